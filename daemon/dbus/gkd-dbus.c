@@ -30,6 +30,7 @@
 #include "daemon/gkd-util.h"
 
 #include "egg/egg-cleanup.h"
+#include "egg/egg-secure-memory.h"
 
 #include <glib.h>
 #include <gio/gio.h>
@@ -112,6 +113,46 @@ handle_get_control_directory (GkdExportedDaemon *skeleton,
 	return TRUE;
 }
 
+static gboolean
+handle_get_secure_memory_stats (GkdExportedDaemon *skeleton,
+				GDBusMethodInvocation *invocation,
+				gpointer user_data)
+{
+	egg_secure_tag_rec *tags;
+	egg_secure_block_rec *blocks;
+	GVariantBuilder tag_builder;
+	GVariantBuilder block_builder;
+	guint count, i;
+
+	g_variant_builder_init (&tag_builder, G_VARIANT_TYPE ("a(stttt)"));
+	tags = egg_secure_tag_records (&count);
+	for (i = 0; tags != NULL && i < count; i++) {
+		g_variant_builder_add (&tag_builder, "(stttt)", tags[i].tag,
+				       (guint64)tags[i].live_length,
+				       (guint64)tags[i].high_water,
+				       (guint64)tags[i].n_allocs,
+				       (guint64)tags[i].n_fallbacks);
+	}
+	free (tags);
+
+	g_variant_builder_init (&block_builder, G_VARIANT_TYPE ("a(tttdb)"));
+	blocks = egg_secure_block_records (&count);
+	for (i = 0; blocks != NULL && i < count; i++) {
+		g_variant_builder_add (&block_builder, "(tttdb)",
+				       (guint64)blocks[i].block_length,
+				       (guint64)blocks[i].used_length,
+				       (guint64)blocks[i].largest_free,
+				       blocks[i].fragmentation,
+				       blocks[i].large ? TRUE : FALSE);
+	}
+	free (blocks);
+
+	gkd_exported_daemon_complete_get_secure_memory_stats (skeleton, invocation,
+							      g_variant_builder_end (&tag_builder),
+							      g_variant_builder_end (&block_builder));
+	return TRUE;
+}
+
 static void
 cleanup_singleton (gpointer user_data)
 {
@@ -148,6 +189,8 @@ gkd_dbus_singleton_acquire (gboolean *acquired)
 				  G_CALLBACK (handle_get_control_directory), NULL);
 		g_signal_connect (skeleton, "handle-get-environment",
 				  G_CALLBACK (handle_get_environment), NULL);
+		g_signal_connect (skeleton, "handle-get-secure-memory-stats",
+				  G_CALLBACK (handle_get_secure_memory_stats), NULL);
 
 		g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (skeleton), dbus_conn,
 						  GNOME_KEYRING_DAEMON_PATH, &error);
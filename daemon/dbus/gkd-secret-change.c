@@ -464,6 +464,8 @@ gkd_secret_change_with_secrets (GckObject *collection,
 	gboolean result = FALSE;
 	GckObject *ocred = NULL;
 	GckObject *mcred = NULL;
+	GckSession *cred_session;
+	GckObject *object;
 
 	g_assert (GCK_IS_OBJECT (collection));
 	g_assert (session == NULL || GCK_IS_SESSION (session));
@@ -495,8 +497,15 @@ gkd_secret_change_with_secrets (GckObject *collection,
 	gck_builder_clear (&builder);
 	gck_builder_add_ulong (&builder, CKA_G_CREDENTIAL, gck_object_get_handle (mcred));
 
-	/* Now set the collection credentials to the first one */
-	result = gck_object_set (collection, gck_builder_end (&builder), NULL, error);
+	/*
+	 * Now set the collection credentials to the first one. That's done in
+	 * the session the credential is in, which is the one the key lives in.
+	 */
+	cred_session = gck_object_get_session (mcred);
+	object = gck_object_from_handle (cred_session, gck_object_get_handle (collection));
+	result = gck_object_set (object, gck_builder_end (&builder), NULL, error);
+	g_object_unref (object);
+	g_object_unref (cred_session);
 
 cleanup:
 	if (ocred) {
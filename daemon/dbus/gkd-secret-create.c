@@ -102,13 +102,17 @@ create_collection_with_secret (GkdSecretCreate *self, GkdSecretSecret *master)
 {
 	GError *error = NULL;
 	GkdSecretService *service;
+	GckSession *session;
 	gchar *identifier;
 
 	g_assert (GKD_SECRET_IS_CREATE (self));
 	g_assert (master);
 	g_assert (!self->result_path);
 
-	self->result_path = gkd_secret_create_with_secret (self->attributes, master, &error);
+	session = gkd_secret_session_get_pkcs11_session (master->session);
+	g_return_val_if_fail (session, FALSE);
+
+	self->result_path = gkd_secret_create_with_secret (session, self->attributes, master, &error);
 
 	if (!self->result_path) {
 		g_warning ("couldn't create new collection: %s", error->message);
@@ -427,7 +431,8 @@ gkd_secret_create_with_credential (GckSession *session, GckAttributes *attrs,
 }
 
 gchar*
-gkd_secret_create_with_secret (GckAttributes *attrs,
+gkd_secret_create_with_secret (GckSession *session,
+			       GckAttributes *attrs,
 			       GkdSecretSecret *master,
 			       GError **error)
 {
@@ -435,7 +440,6 @@ gkd_secret_create_with_secret (GckAttributes *attrs,
 	GckAttributes *atts;
 	GckObject *cred;
 	GckObject *collection;
-	GckSession *session;
 	gpointer identifier;
 	gsize n_identifier;
 	gboolean token;
@@ -448,8 +452,7 @@ gkd_secret_create_with_secret (GckAttributes *attrs,
 	gck_builder_add_boolean (&builder, CKA_GNOME_TRANSIENT, TRUE);
 	gck_builder_add_boolean (&builder, CKA_TOKEN, token);
 
-	session = gkd_secret_session_get_pkcs11_session (master->session);
-	g_return_val_if_fail (session, NULL);
+	g_return_val_if_fail (GCK_IS_SESSION (session), NULL);
 
 	/* Create ourselves some credentials */
 	atts = gck_attributes_ref_sink (gck_builder_end (&builder));
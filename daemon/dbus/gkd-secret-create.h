@@ -53,7 +53,8 @@ GckObject*          gkd_secret_create_with_credential         (GckSession *sessi
                                                                GckObject *cred,
                                                                GError **error);
 
-gchar*              gkd_secret_create_with_secret             (GckAttributes *attrs,
+gchar*              gkd_secret_create_with_secret             (GckSession *session,
+                                                               GckAttributes *attrs,
                                                                GkdSecretSecret *master,
                                                                GError **error);
 
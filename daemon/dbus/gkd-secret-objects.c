@@ -20,6 +20,7 @@
 
 #include "config.h"
 
+#include "gkd-secret-dispatch.h"
 #include "gkd-secret-error.h"
 #include "gkd-secret-objects.h"
 #include "gkd-secret-property.h"
@@ -28,6 +29,7 @@
 #include "gkd-secret-session.h"
 #include "gkd-secret-types.h"
 #include "gkd-secret-util.h"
+#include "gkd-item-generated.h"
 #include "gkd-secrets-generated.h"
 
 #include "egg/egg-error.h"
@@ -41,7 +43,10 @@ struct _GkdSecretObjects {
 	GkdSecretService *service;
 	GckSlot *pkcs11_slot;
 	GHashTable *collections_to_skeletons;
-	GHashTable *items_to_skeletons;
+	GHashTable *paths_to_handles;
+	GHashTable *pending_items;
+	GHashTable *pending_collections;
+	guint pending_idle;
 };
 
 
@@ -52,27 +57,26 @@ struct _GkdSecretObjects {
 typedef struct {
 	GkdExportedCollectionSkeleton parent;
 	GkdSecretObjects *objects;
+	GQueue items;
+	GHashTable *item_links;
+	guint items_idle;
+	GDBusConnection *items_connection;
+	guint items_subtree;
 } GkdSecretCollectionSkeleton;
 typedef struct {
 	GkdExportedCollectionSkeletonClass parent_class;
 } GkdSecretCollectionSkeletonClass;
-typedef struct {
-	GkdExportedItemSkeleton parent;
-	GkdSecretObjects *objects;
-} GkdSecretItemSkeleton;
-typedef struct {
-	GkdExportedItemSkeletonClass parent_class;
-} GkdSecretItemSkeletonClass;
 
 static GckObject * secret_objects_lookup_gck_object_for_path (GkdSecretObjects *self,
 							      const gchar *sender,
 							      const gchar *path,
 							      GError **error);
 
+static void secret_objects_queue_collection_changed (GkdSecretObjects *self,
+						     const gchar *collection_path);
+
 GType gkd_secret_collection_skeleton_get_type (void);
 G_DEFINE_TYPE (GkdSecretCollectionSkeleton, gkd_secret_collection_skeleton, GKD_TYPE_EXPORTED_COLLECTION_SKELETON)
-GType gkd_secret_item_skeleton_get_type (void);
-G_DEFINE_TYPE (GkdSecretItemSkeleton, gkd_secret_item_skeleton, GKD_TYPE_EXPORTED_ITEM_SKELETON)
 
 static void
 on_object_path_append_to_builder (GkdSecretObjects *self,
@@ -229,7 +233,7 @@ gkd_secret_collection_skeleton_set_property_dbus (GDBusConnection *connection,
 						   g_variant_get_string (value, NULL));
 	}
 
-	gkd_secret_service_emit_collection_changed (self->objects->service, object_path);
+	secret_objects_queue_collection_changed (self->objects, object_path);
 	g_object_unref (object);
 
 	return TRUE;
@@ -277,16 +281,94 @@ gkd_secret_collection_skeleton_get_vtable (GDBusInterfaceSkeleton *skeleton)
 	return &vtable;
 }
 
+static void
+gkd_secret_collection_skeleton_finalize (GObject *obj)
+{
+	GkdSecretCollectionSkeleton *self = (GkdSecretCollectionSkeleton *) obj;
+
+	if (self->items_idle)
+		g_source_remove (self->items_idle);
+	g_hash_table_destroy (self->item_links);
+	while (!g_queue_is_empty (&self->items))
+		g_free (g_queue_pop_head (&self->items));
+
+	G_OBJECT_CLASS (gkd_secret_collection_skeleton_parent_class)->finalize (obj);
+}
+
 static void
 gkd_secret_collection_skeleton_class_init (GkdSecretCollectionSkeletonClass *klass)
 {
+	GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
 	GDBusInterfaceSkeletonClass *skclass = G_DBUS_INTERFACE_SKELETON_CLASS (klass);
+	gobject_class->finalize = gkd_secret_collection_skeleton_finalize;
 	skclass->get_vtable = gkd_secret_collection_skeleton_get_vtable;
 }
 
 static void
 gkd_secret_collection_skeleton_init (GkdSecretCollectionSkeleton *self)
 {
+	g_queue_init (&self->items);
+	self->item_links = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+/*
+ * The paths of the items in the collection are kept up to date as they're
+ * created and deleted, rather than listing the collection each time. The
+ * Items property is then published once, after a batch of changes.
+ */
+
+static void
+collection_skeleton_add_item (GkdSecretCollectionSkeleton *self,
+			      const gchar *item_path)
+{
+	if (g_hash_table_lookup (self->item_links, item_path))
+		return;
+
+	g_queue_push_tail (&self->items, g_strdup (item_path));
+	g_hash_table_insert (self->item_links, self->items.tail->data, self->items.tail);
+}
+
+static void
+collection_skeleton_remove_item (GkdSecretCollectionSkeleton *self,
+				 const gchar *item_path)
+{
+	GList *link;
+
+	link = g_hash_table_lookup (self->item_links, item_path);
+	if (link == NULL)
+		return;
+
+	g_hash_table_remove (self->item_links, item_path);
+	g_free (link->data);
+	g_queue_delete_link (&self->items, link);
+}
+
+static gboolean
+on_collection_skeleton_items_idle (gpointer user_data)
+{
+	GkdSecretCollectionSkeleton *self = user_data;
+	const gchar **items;
+	GList *l;
+	guint i;
+
+	self->items_idle = 0;
+
+	items = g_new (const gchar *, self->items.length + 1);
+	for (l = self->items.head, i = 0; l != NULL; l = g_list_next (l), i++)
+		items[i] = l->data;
+	items[i] = NULL;
+
+	gkd_exported_collection_set_items (GKD_EXPORTED_COLLECTION (self), items);
+	g_free (items);
+
+	return FALSE;
+}
+
+static void
+collection_skeleton_items_changed (GkdSecretCollectionSkeleton *self)
+{
+	if (!self->items_idle)
+		self->items_idle = g_idle_add (on_collection_skeleton_items_idle, self);
 }
 
 static GkdExportedCollection *
@@ -297,117 +379,261 @@ gkd_secret_collection_skeleton_new (GkdSecretObjects *objects)
 	return self;
 }
 
-static gboolean
-gkd_secret_item_skeleton_set_property_dbus (GDBusConnection *connection,
-					    const gchar *sender,
-					    const gchar *object_path,
-					    const gchar *interface_name,
-					    const gchar *property_name,
-					    GVariant *value,
-					    GError **error,
-					    gpointer user_data)
-{
-	GkdSecretItemSkeleton *self = (GkdSecretItemSkeleton *) user_data;
-	GckObject *object;
+enum {
+	PROP_0,
+	PROP_PKCS11_SLOT,
+	PROP_SERVICE
+};
 
-	object = secret_objects_lookup_gck_object_for_path (self->objects, sender, object_path, error);
-	if (!object)
-		return FALSE;
+static gchar *    object_path_for_item          (const gchar *base,
+						 GckObject *item);
 
-	if (!object_property_set (self->objects, object, property_name, value, error)) {
-		g_object_unref (object);
-		return FALSE;
-	}
+static gchar *    object_path_for_collection    (GckObject *collection);
 
-	if (g_strcmp0 (property_name, "Attributes") == 0) {
-		gkd_exported_item_set_attributes (GKD_EXPORTED_ITEM (self), value);
-	} else if (g_strcmp0 (property_name, "Label") == 0) {
-		gkd_exported_item_set_label (GKD_EXPORTED_ITEM (self),
-					     g_variant_get_string (value, NULL));
-	}
+static gchar *    collection_path_for_item      (GckObject *item);
 
-	gkd_secret_objects_emit_item_changed (self->objects, object);
-	g_object_unref (object);
+G_DEFINE_TYPE (GkdSecretObjects, gkd_secret_objects, G_TYPE_OBJECT);
 
-	return TRUE;
+/* -----------------------------------------------------------------------------
+ * INTERNAL
+ */
+
+/*
+ * Object handles of exported collections and items, by path. Entries are
+ * added the first time a path is looked up, and removed when the object
+ * is unregistered. An object can also be deleted elsewhere, so a handle is
+ * checked with a single attribute read before it's used. If it's no longer
+ * valid, the entry is dropped and the object is searched for again.
+ */
+
+static void
+secret_objects_remember_handle (GkdSecretObjects *self,
+				const gchar *path,
+				GckObject *object)
+{
+	CK_OBJECT_HANDLE *handle;
+
+	/* Aliases can be pointed at another collection */
+	if (g_str_has_prefix (path, SECRET_ALIAS_PREFIX))
+		return;
+
+	handle = g_new (CK_OBJECT_HANDLE, 1);
+	*handle = gck_object_get_handle (object);
+	g_hash_table_replace (self->paths_to_handles, g_strdup (path), handle);
 }
 
-static GVariant *
-gkd_secret_item_skeleton_get_property_dbus (GDBusConnection *connection,
-					    const gchar *sender,
-					    const gchar *object_path,
-					    const gchar *interface_name,
-					    const gchar *property_name,
-					    GError **error,
-					    gpointer user_data)
-{
-	GkdSecretItemSkeleton *self = (GkdSecretItemSkeleton *) user_data;
+static gboolean
+on_path_under_prefix (gpointer key,
+		      gpointer value,
+		      gpointer user_data)
+{
+	return g_str_has_prefix (key, user_data);
+}
+
+static void
+secret_objects_forget_handles (GkdSecretObjects *self,
+			       const gchar *path)
+{
+	gchar *prefix;
+
+	/* The object itself, and any items within it */
+	g_hash_table_remove (self->paths_to_handles, path);
+	prefix = g_strconcat (path, "/", NULL);
+	g_hash_table_foreach_remove (self->paths_to_handles, on_path_under_prefix, prefix);
+	g_free (prefix);
+}
+
+static GckObject *
+secret_objects_lookup_cached (GkdSecretObjects *self,
+			      GckSession *session,
+			      const gchar *path)
+{
+	CK_OBJECT_HANDLE *handle;
+	GckAttributes *attrs;
 	GckObject *object;
-	GVariant *variant;
+	GError *error = NULL;
 
-	object = secret_objects_lookup_gck_object_for_path (self->objects, sender, object_path, error);
-	if (!object)
+	handle = g_hash_table_lookup (self->paths_to_handles, path);
+	if (handle == NULL)
 		return NULL;
 
-	variant = object_property_get (self->objects, object, property_name, error);
-	g_object_unref (object);
+	object = gck_object_from_handle (session, *handle);
 
-	return variant;
+	/* Usually CKR_OBJECT_HANDLE_INVALID, anything else is seen by the search */
+	attrs = gck_object_get (object, NULL, &error, CKA_CLASS, GCK_INVALID);
+	if (attrs == NULL) {
+		g_clear_error (&error);
+		g_hash_table_remove (self->paths_to_handles, path);
+		g_object_unref (object);
+		return NULL;
+	}
+
+	gck_attributes_unref (attrs);
+	return object;
 }
 
-static GDBusInterfaceVTable *
-gkd_secret_item_skeleton_get_vtable (GDBusInterfaceSkeleton *skeleton)
+/*
+ * Change notifications are queued, and sent once per main loop iteration.
+ * An item changed several times, or a whole collection of items being
+ * locked or unlocked, then results in a single ItemChanged and a single
+ * PropertiesChanged per item, and one CollectionChanged per collection.
+ */
+
+typedef struct {
+	gchar *collection_path;
+	GHashTable *properties;
+} PendingItem;
+
+static void
+pending_item_free (gpointer data)
 {
-	static GDBusInterfaceVTable vtable;
-	GDBusInterfaceVTable *parent_vtable;
+	PendingItem *pending = data;
+	g_free (pending->collection_path);
+	g_hash_table_unref (pending->properties);
+	g_slice_free (PendingItem, pending);
+}
 
-	parent_vtable = G_DBUS_INTERFACE_SKELETON_CLASS (gkd_secret_item_skeleton_parent_class)->get_vtable (skeleton);
+static void
+item_emit_properties_changed (GkdSecretObjects *self,
+			      const gchar *item_path,
+			      GHashTable *properties)
+{
+	GVariantBuilder builder;
+	GHashTableIter iter;
+	GError *error = NULL;
+	gpointer name, value;
 
-	(&vtable)->get_property = gkd_secret_item_skeleton_get_property_dbus;
-	(&vtable)->set_property = gkd_secret_item_skeleton_set_property_dbus;
-	(&vtable)->method_call = parent_vtable->method_call;
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+	g_hash_table_iter_init (&iter, properties);
+	while (g_hash_table_iter_next (&iter, &name, &value))
+		g_variant_builder_add (&builder, "{sv}", name, value);
 
-	return &vtable;
+	g_dbus_connection_emit_signal (gkd_secret_service_get_connection (self->service),
+				       NULL, item_path, "org.freedesktop.DBus.Properties",
+				       "PropertiesChanged",
+				       g_variant_new ("(sa{sv}as)", SECRET_ITEM_INTERFACE,
+						      &builder, NULL),
+				       &error);
+
+	if (error != NULL) {
+		g_warning ("couldn't emit PropertiesChanged for %s: %s", item_path, error->message);
+		g_error_free (error);
+	}
 }
 
-static void
-gkd_secret_item_skeleton_class_init (GkdSecretItemSkeletonClass *klass)
+static gboolean
+on_secret_objects_pending_idle (gpointer user_data)
 {
-	GDBusInterfaceSkeletonClass *skclass = G_DBUS_INTERFACE_SKELETON_CLASS (klass);
-	skclass->get_vtable = gkd_secret_item_skeleton_get_vtable;
+	GkdSecretObjects *self = user_data;
+	GkdExportedCollection *skeleton;
+	PendingItem *pending;
+	GHashTableIter iter;
+	gpointer path;
+
+	self->pending_idle = 0;
+
+	g_hash_table_iter_init (&iter, self->pending_items);
+	while (g_hash_table_iter_next (&iter, &path, (gpointer *)&pending)) {
+		/* The service is a weak pointer, and may have gone away */
+		if (self->service && g_hash_table_size (pending->properties) > 0)
+			item_emit_properties_changed (self, path, pending->properties);
+		skeleton = g_hash_table_lookup (self->collections_to_skeletons,
+						pending->collection_path);
+		if (skeleton != NULL)
+			gkd_exported_collection_emit_item_changed (skeleton, path);
+		g_hash_table_iter_remove (&iter);
+	}
+
+	g_hash_table_iter_init (&iter, self->pending_collections);
+	while (g_hash_table_iter_next (&iter, &path, NULL)) {
+		if (self->service)
+			gkd_secret_service_emit_collection_changed (self->service, path);
+		g_hash_table_iter_remove (&iter);
+	}
+
+	return FALSE;
 }
 
 static void
-gkd_secret_item_skeleton_init (GkdSecretItemSkeleton *self)
+secret_objects_queue_pending (GkdSecretObjects *self)
 {
+	if (!self->pending_idle)
+		self->pending_idle = g_idle_add_full (G_PRIORITY_DEFAULT,
+						      on_secret_objects_pending_idle,
+						      self, NULL);
 }
 
-static GkdExportedItem *
-gkd_secret_item_skeleton_new (GkdSecretObjects *objects)
+/* Consumes a floating reference to the value, if it has one */
+static void
+secret_objects_queue_item_changed (GkdSecretObjects *self,
+				   const gchar *collection_path,
+				   const gchar *item_path,
+				   const gchar *property_name,
+				   GVariant *value)
 {
-	GkdExportedItem *self = g_object_new (gkd_secret_item_skeleton_get_type (), NULL);
-	((GkdSecretItemSkeleton *) self)->objects = objects;
-	return self;
+	PendingItem *pending;
+
+	pending = g_hash_table_lookup (self->pending_items, item_path);
+	if (pending == NULL) {
+		pending = g_slice_new (PendingItem);
+		pending->collection_path = g_strdup (collection_path);
+		pending->properties = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+							     (GDestroyNotify)g_variant_unref);
+		g_hash_table_insert (self->pending_items, g_strdup (item_path), pending);
+	}
+
+	/* A later value of the same property replaces the earlier one */
+	if (property_name != NULL)
+		g_hash_table_replace (pending->properties, g_strdup (property_name),
+				      g_variant_ref_sink (value));
+
+	secret_objects_queue_pending (self);
 }
 
-enum {
-	PROP_0,
-	PROP_PKCS11_SLOT,
-	PROP_SERVICE
-};
+static void
+secret_objects_item_changed (GkdSecretObjects *self,
+			     GckObject *item,
+			     const gchar *property_name,
+			     GVariant *value)
+{
+	gchar *collection_path;
+	gchar *item_path;
 
-static gchar *    object_path_for_item          (const gchar *base,
-						 GckObject *item);
+	collection_path = collection_path_for_item (item);
+	item_path = object_path_for_item (collection_path, item);
+	if (item_path != NULL) {
+		secret_objects_remember_handle (self, item_path, item);
+		secret_objects_queue_item_changed (self, collection_path, item_path,
+						   property_name, value);
+	}
 
-static gchar *    object_path_for_collection    (GckObject *collection);
+	g_free (item_path);
+	g_free (collection_path);
+}
 
-static gchar *    collection_path_for_item      (GckObject *item);
+static void
+secret_objects_queue_collection_changed (GkdSecretObjects *self,
+					 const gchar *collection_path)
+{
+	if (!g_hash_table_contains (self->pending_collections, collection_path))
+		g_hash_table_add (self->pending_collections, g_strdup (collection_path));
 
-G_DEFINE_TYPE (GkdSecretObjects, gkd_secret_objects, G_TYPE_OBJECT);
+	secret_objects_queue_pending (self);
+}
 
-/* -----------------------------------------------------------------------------
- * INTERNAL
- */
+static void
+secret_objects_drop_pending (GkdSecretObjects *self,
+			     const gchar *path)
+{
+	gchar *prefix;
+
+	/* Nothing more to say about an object that's gone, or its items */
+	g_hash_table_remove (self->pending_items, path);
+	g_hash_table_remove (self->pending_collections, path);
+	prefix = g_strconcat (path, "/", NULL);
+	g_hash_table_foreach_remove (self->pending_items, on_path_under_prefix, prefix);
+	g_free (prefix);
+}
 
 static GckObject *
 secret_objects_lookup_gck_object_for_path (GkdSecretObjects *self,
@@ -432,6 +658,13 @@ secret_objects_lookup_gck_object_for_path (GkdSecretObjects *self,
 	session = gkd_secret_service_get_pkcs11_session (self->service, sender);
 	g_return_val_if_fail (session, FALSE);
 
+	object = secret_objects_lookup_cached (self, session, path);
+	if (object) {
+		g_free (c_ident);
+		g_free (i_ident);
+		return object;
+	}
+
 	if (i_ident) {
 		gck_builder_add_ulong (&builder, CKA_CLASS, CKO_SECRET_KEY);
 		gck_builder_add_string (&builder, CKA_G_COLLECTION, c_ident);
@@ -456,6 +689,7 @@ secret_objects_lookup_gck_object_for_path (GkdSecretObjects *self,
 
 	object = g_object_ref (objects->data);
 	gck_list_unref_free (objects);
+	secret_objects_remember_handle (self, path, object);
 
  out:
 	if (!object)
@@ -485,71 +719,215 @@ secret_objects_lookup_gck_object_for_invocation (GkdSecretObjects *self,
 	return object;
 }
 
+/*
+ * The objects handed to a worker are bound to the caller's worker session,
+ * see gkd_secret_service_get_worker_session().
+ */
+static GckObject *
+secret_objects_lookup_for_worker (GkdSecretObjects *self,
+				  GDBusMethodInvocation *invocation)
+{
+	GckObject *object;
+	GckObject *rebound;
+
+	object = secret_objects_lookup_gck_object_for_invocation (self, invocation);
+	if (!object)
+		return NULL;
+
+	rebound = gkd_secret_service_object_for_worker (self->service,
+						       g_dbus_method_invocation_get_sender (invocation),
+						       object);
+	g_object_unref (object);
+
+	if (!rebound)
+		g_dbus_method_invocation_return_error_literal (invocation, G_DBUS_ERROR,
+							       G_DBUS_ERROR_FAILED,
+							       "Couldn't open a session for the call");
+	return rebound;
+}
+
+/*
+ * The PKCS#11 work of the item methods runs in a worker, see
+ * gkd_secret_service_queue_call(). The item is looked up, and the
+ * arguments parsed, before the call is queued. The worker gets the item
+ * in the caller's worker session, which the session keys live in too. It
+ * uses its own reference to the session key, since the session may be
+ * closed while it runs.
+ */
+
 static gboolean
-item_method_delete (GkdExportedItem *skeleton,
-		    GDBusMethodInvocation *invocation,
-		    GkdSecretObjects *self)
+session_is_closed (GkdSecretSession *session)
 {
-	GError *error = NULL;
+	return gkd_secret_dispatch_get_object_path (GKD_SECRET_DISPATCH (session)) == NULL;
+}
+
+typedef struct {
+	GkdSecretObjects *objects;
+	GckObject *item;
+	GkdSecretSession *session;
+	GckObject *key;
+	CK_MECHANISM_TYPE mech_type;
+	GkdSecretSecret *secret;
+	gchar *session_path;
 	gchar *collection_path;
 	gchar *item_path;
-	GckObject *collection;
-	GckObject *object;
 
-	object = secret_objects_lookup_gck_object_for_invocation (self, invocation);
-	if (!object) {
-		return TRUE;
-	}
+	/* For org.gnome.keyring.Item, the secret value goes in a memfd */
+	gboolean use_fd;
+	GUnixFDList *fd_list;
+	GVariant *reply;
+} ItemCall;
+
+static ItemCall *
+item_call_new (GkdSecretObjects *self,
+	       GckObject *item)
+{
+	ItemCall *call = g_slice_new0 (ItemCall);
+	call->objects = g_object_ref (self);
+	call->item = item;
+	return call;
+}
 
-	collection_path = collection_path_for_item (object);
-	item_path = object_path_for_item (NULL, object);
+static void
+item_call_free (gpointer data)
+{
+	ItemCall *call = data;
+
+	g_object_unref (call->objects);
+	g_object_unref (call->item);
+	g_clear_object (&call->session);
+	g_clear_object (&call->key);
+	gkd_secret_secret_free (call->secret);
+	g_free (call->session_path);
+	g_free (call->collection_path);
+	g_free (call->item_path);
+	g_clear_object (&call->fd_list);
+	if (call->reply)
+		g_variant_unref (call->reply);
+	g_slice_free (ItemCall, call);
+}
 
-	if (gck_object_destroy (object, NULL, &error)) {
-		collection = gkd_secret_objects_lookup_collection (self, NULL, collection_path);
+static gboolean
+item_delete_thread (gpointer data,
+		    GError **error)
+{
+	ItemCall *call = data;
+
+	call->collection_path = collection_path_for_item (call->item);
+	call->item_path = object_path_for_item (call->collection_path, call->item);
+
+	return gck_object_destroy (call->item, NULL, error);
+}
+
+static void
+item_delete_done (GkdSecretService *service,
+		  GDBusMethodInvocation *invocation,
+		  gpointer data,
+		  GError *error)
+{
+	ItemCall *call = data;
+	GckObject *collection;
+
+	if (error == NULL) {
+		collection = gkd_secret_objects_lookup_collection (call->objects, NULL,
+								   call->collection_path);
 		if (collection != NULL) {
-			gkd_secret_objects_emit_item_deleted (self, collection, item_path);
+			gkd_secret_objects_emit_item_deleted (call->objects, collection,
+							      call->item_path);
 			g_object_unref (collection);
 		}
 
 		/* No prompt necessary */
-		gkd_exported_item_complete_delete (skeleton, invocation, "/");
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(o)", "/"));
 
+	} else if (g_error_matches (error, GCK_ERROR, CKR_USER_NOT_LOGGED_IN)) {
+		g_dbus_method_invocation_return_error_literal (invocation, GKD_SECRET_ERROR,
+							       GKD_SECRET_ERROR_IS_LOCKED,
+							       "Cannot delete a locked item");
 	} else {
-		if (g_error_matches (error, GCK_ERROR, CKR_USER_NOT_LOGGED_IN))
-			g_dbus_method_invocation_return_error_literal (invocation, GKD_SECRET_ERROR,
-								       GKD_SECRET_ERROR_IS_LOCKED,
-								       "Cannot delete a locked item");
-		else
-			g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
-							       G_DBUS_ERROR_FAILED,
-							       "Couldn't delete collection: %s",
-							       egg_error_message (error));
-
-		g_clear_error (&error);
+		g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+						       G_DBUS_ERROR_FAILED,
+						       "Couldn't delete collection: %s",
+						       egg_error_message (error));
 	}
+}
 
-	g_free (collection_path);
-	g_free (item_path);
-	g_object_unref (object);
+static void
+item_method_delete (GkdSecretObjects *self,
+		    GDBusMethodInvocation *invocation)
+{
+	GckObject *object;
 
-	return TRUE;
+	object = secret_objects_lookup_for_worker (self, invocation);
+	if (!object)
+		return;
+
+	gkd_secret_service_queue_call (self->service, invocation,
+				       item_delete_thread, item_delete_done,
+				       item_call_new (self, object), item_call_free);
 }
 
 static gboolean
-item_method_get_secret (GkdExportedItem *skeleton,
+item_get_secret_thread (gpointer data,
+			GError **error)
+{
+	ItemCall *call = data;
+
+	call->secret = gkd_secret_session_get_item_secret (call->session, call->key, call->mech_type,
+							   call->item, error);
+	if (call->secret == NULL)
+		return FALSE;
+
+	/* Large secrets are written out to shared memory here too */
+	if (call->use_fd) {
+		call->fd_list = g_unix_fd_list_new ();
+		call->reply = gkd_secret_secret_append_fd (call->secret, call->session_path,
+							   call->fd_list, error);
+		if (call->reply == NULL)
+			return FALSE;
+		g_variant_ref_sink (call->reply);
+	}
+
+	return TRUE;
+}
+
+static void
+item_get_secret_done (GkdSecretService *service,
+		      GDBusMethodInvocation *invocation,
+		      gpointer data,
+		      GError *error)
+{
+	ItemCall *call = data;
+
+	if (error != NULL)
+		g_dbus_method_invocation_return_gerror (invocation, error);
+	else if (session_is_closed (call->session))
+		g_dbus_method_invocation_return_error_literal (invocation, GKD_SECRET_ERROR,
+							       GKD_SECRET_ERROR_NO_SESSION,
+							       "The session was closed");
+	else if (call->use_fd)
+		g_dbus_method_invocation_return_value_with_unix_fd_list (invocation,
+									 g_variant_new ("(@(oayhs))", call->reply),
+									 call->fd_list);
+	else
+		g_dbus_method_invocation_return_value (invocation,
+						       g_variant_new ("(@(oayays))",
+								      gkd_secret_secret_append (call->secret)));
+}
+
+static void
+item_method_get_secret (GkdSecretObjects *self,
 			GDBusMethodInvocation *invocation,
-			gchar *path,
-			GkdSecretObjects *self)
+			const gchar *path,
+			gboolean use_fd)
 {
 	GkdSecretSession *session;
-	GkdSecretSecret *secret;
 	GckObject *item;
-	GError *error = NULL;
+	ItemCall *call;
 
-	item = secret_objects_lookup_gck_object_for_invocation (self, invocation);
-	if (!item) {
-		return TRUE;
-	}
+	item = secret_objects_lookup_for_worker (self, invocation);
+	if (!item)
+		return;
 
 	session = gkd_secret_service_lookup_session (self->service, path,
 						     g_dbus_method_invocation_get_sender (invocation));
@@ -557,97 +935,345 @@ item_method_get_secret (GkdExportedItem *skeleton,
 		g_dbus_method_invocation_return_error_literal (invocation, GKD_SECRET_ERROR,
 							       GKD_SECRET_ERROR_NO_SESSION,
 							       "The session does not exist");
-		goto cleanup;
+		g_object_unref (item);
+		return;
 	}
 
-	secret = gkd_secret_session_get_item_secret (session, item, &error);
-	if (secret == NULL) {
-		g_dbus_method_invocation_take_error (invocation, error);
-		goto cleanup;
-	}
+	call = item_call_new (self, item);
+	call->session = g_object_ref (session);
+	call->key = gkd_secret_session_get_key (session, &call->mech_type);
+	call->session_path = g_strdup (path);
+	call->use_fd = use_fd;
+	gkd_secret_service_queue_call (self->service, invocation,
+				       item_get_secret_thread, item_get_secret_done,
+				       call, item_call_free);
+}
 
-	gkd_exported_item_complete_get_secret (skeleton, invocation,
-					       gkd_secret_secret_append (secret));
-	gkd_secret_secret_free (secret);
+static gboolean
+item_set_secret_thread (gpointer data,
+			GError **error)
+{
+	ItemCall *call = data;
 
- cleanup:
-	g_object_unref (item);
-	return TRUE;
+	return gkd_secret_session_set_item_secret (call->secret->session, call->key,
+						   call->mech_type, call->item,
+						   call->secret, error);
 }
 
-static gboolean
-item_method_set_secret (GkdExportedItem *skeleton,
+static void
+item_set_secret_done (GkdSecretService *service,
+		      GDBusMethodInvocation *invocation,
+		      gpointer data,
+		      GError *error)
+{
+	if (error != NULL)
+		g_dbus_method_invocation_return_gerror (invocation, error);
+	else
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
+}
+
+static void
+item_method_set_secret (GkdSecretObjects *self,
 			GDBusMethodInvocation *invocation,
 			GVariant *secret_variant,
-			GkdSecretObjects *self)
+			gboolean use_fd)
 {
 	GkdSecretSecret *secret;
+	GDBusMessage *message;
 	const char *caller;
 	GckObject *item;
 	GError *error = NULL;
+	ItemCall *call;
 
-	item = secret_objects_lookup_gck_object_for_invocation (self, invocation);
-	if (!item) {
-		return TRUE;
-	}
+	item = secret_objects_lookup_for_worker (self, invocation);
+	if (!item)
+		return;
 
 	caller = g_dbus_method_invocation_get_sender (invocation);
-	secret = gkd_secret_secret_parse (self->service, caller, secret_variant, &error);
-	if (error != NULL) {
-		goto cleanup;
+	if (use_fd) {
+		message = g_dbus_method_invocation_get_message (invocation);
+		secret = gkd_secret_secret_parse_fd (self->service, caller, secret_variant,
+						     g_dbus_message_get_unix_fd_list (message),
+						     &error);
+	} else {
+		secret = gkd_secret_secret_parse (self->service, caller, secret_variant, &error);
+	}
+	if (secret == NULL) {
+		g_dbus_method_invocation_take_error (invocation, error);
+		g_object_unref (item);
+		return;
 	}
 
-	gkd_secret_session_set_item_secret (secret->session, item, secret, &error);
-	gkd_secret_secret_free (secret);
+	call = item_call_new (self, item);
+	call->secret = secret;
+	call->key = gkd_secret_session_get_key (secret->session, &call->mech_type);
+	gkd_secret_service_queue_call (self->service, invocation,
+				       item_set_secret_thread, item_set_secret_done,
+				       call, item_call_free);
+}
 
-	if (error != NULL) {
-		goto cleanup;
+/*
+ * Items aren't exported as objects of their own. Each collection registers
+ * a subtree at its path, and calls to the items below it are dispatched
+ * here, with the item looked up by path when needed.
+ */
+
+static void
+item_method_call (GDBusConnection *connection,
+		  const gchar *sender,
+		  const gchar *object_path,
+		  const gchar *interface_name,
+		  const gchar *method_name,
+		  GVariant *parameters,
+		  GDBusMethodInvocation *invocation,
+		  gpointer user_data)
+{
+	GkdSecretObjects *self = user_data;
+	GVariant *secret;
+	const gchar *path;
+
+	if (g_str_equal (method_name, "Delete")) {
+		item_method_delete (self, invocation);
+
+	} else if (g_str_equal (method_name, "GetSecret")) {
+		g_variant_get (parameters, "(&o)", &path);
+		item_method_get_secret (self, invocation, path, FALSE);
+
+	} else if (g_str_equal (method_name, "SetSecret")) {
+		g_variant_get (parameters, "(@(oayays))", &secret);
+		item_method_set_secret (self, invocation, secret, FALSE);
+		g_variant_unref (secret);
+
+	} else {
+		g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+						       G_DBUS_ERROR_UNKNOWN_METHOD,
+						       "Unknown method %s", method_name);
 	}
+}
+
+/* The org.gnome.keyring.Item extension, for secrets too large to copy about */
+static void
+item_fd_method_call (GDBusConnection *connection,
+		     const gchar *sender,
+		     const gchar *object_path,
+		     const gchar *interface_name,
+		     const gchar *method_name,
+		     GVariant *parameters,
+		     GDBusMethodInvocation *invocation,
+		     gpointer user_data)
+{
+	GkdSecretObjects *self = user_data;
+	GVariant *secret;
+	const gchar *path;
+
+	if (g_str_equal (method_name, "GetSecretFd")) {
+		g_variant_get (parameters, "(&o)", &path);
+		item_method_get_secret (self, invocation, path, TRUE);
+
+	} else if (g_str_equal (method_name, "SetSecretFd")) {
+		g_variant_get (parameters, "(@(oayhs))", &secret);
+		item_method_set_secret (self, invocation, secret, TRUE);
+		g_variant_unref (secret);
 
- cleanup:
-	if (error != NULL) {
-		g_dbus_method_invocation_take_error (invocation, error);
 	} else {
-		gkd_exported_item_complete_set_secret (skeleton, invocation);
+		g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+						       G_DBUS_ERROR_UNKNOWN_METHOD,
+						       "Unknown method %s", method_name);
 	}
+}
+
+static gboolean
+item_set_property (GDBusConnection *connection,
+		   const gchar *sender,
+		   const gchar *object_path,
+		   const gchar *interface_name,
+		   const gchar *property_name,
+		   GVariant *value,
+		   GError **error,
+		   gpointer user_data)
+{
+	GkdSecretObjects *self = user_data;
+	GckObject *object;
+
+	object = secret_objects_lookup_gck_object_for_path (self, sender, object_path, error);
+	if (!object)
+		return FALSE;
+
+	if (!object_property_set (self, object, property_name, value, error)) {
+		g_object_unref (object);
+		return FALSE;
+	}
+
+	if (g_strcmp0 (property_name, "Attributes") == 0 ||
+	    g_strcmp0 (property_name, "Label") == 0)
+		secret_objects_item_changed (self, object, property_name, value);
+	else
+		secret_objects_item_changed (self, object, NULL, NULL);
+	g_object_unref (object);
 
-	g_object_unref (item);
 	return TRUE;
 }
 
-static void
-item_cleanup_search_results (GckSession *session, GList *items,
-			     GList **locked, GList **unlocked)
+static GVariant *
+item_get_property (GDBusConnection *connection,
+		   const gchar *sender,
+		   const gchar *object_path,
+		   const gchar *interface_name,
+		   const gchar *property_name,
+		   GError **error,
+		   gpointer user_data)
 {
-	GError *error = NULL;
-	gpointer value;
-	gsize n_value;
+	GkdSecretObjects *self = user_data;
+	GckObject *object;
+	GVariant *variant;
+
+	object = secret_objects_lookup_gck_object_for_path (self, sender, object_path, error);
+	if (!object)
+		return NULL;
+
+	variant = object_property_get (self, object, property_name, error);
+	g_object_unref (object);
+
+	return variant;
+}
+
+static const GDBusInterfaceVTable item_vtable = {
+	item_method_call,
+	item_get_property,
+	item_set_property,
+};
+
+static const GDBusInterfaceVTable item_fd_vtable = {
+	item_fd_method_call,
+	NULL,
+	NULL,
+};
+
+static gchar **
+on_items_subtree_enumerate (GDBusConnection *connection,
+			    const gchar *sender,
+			    const gchar *object_path,
+			    gpointer user_data)
+{
+	GkdSecretCollectionSkeleton *skeleton = user_data;
+	gsize prefix = strlen (object_path) + 1;
+	gchar **nodes;
 	GList *l;
+	guint i;
 
-	*locked = NULL;
-	*unlocked = NULL;
+	nodes = g_new (gchar *, skeleton->items.length + 1);
+	for (l = skeleton->items.head, i = 0; l != NULL; l = g_list_next (l), i++)
+		nodes[i] = g_strdup ((gchar *)l->data + prefix);
+	nodes[i] = NULL;
 
-	for (l = items; l; l = g_list_next (l)) {
-		value = gck_object_get_data (l->data, CKA_G_LOCKED, NULL, &n_value, &error);
-		if (value == NULL) {
-			if (!g_error_matches (error, GCK_ERROR, CKR_OBJECT_HANDLE_INVALID))
-				g_warning ("couldn't check if item is locked: %s", egg_error_message (error));
-			g_clear_error (&error);
+	return nodes;
+}
 
-		/* Is not locked */
-		} if (n_value == 1 && *((CK_BBOOL*)value) == CK_FALSE) {
-			*unlocked = g_list_prepend (*unlocked, l->data);
+static GDBusInterfaceInfo **
+on_items_subtree_introspect (GDBusConnection *connection,
+			     const gchar *sender,
+			     const gchar *object_path,
+			     const gchar *node,
+			     gpointer user_data)
+{
+	GkdSecretCollectionSkeleton *skeleton = user_data;
+	GDBusInterfaceInfo **infos;
+	gchar *item_path;
+	gboolean exists;
 
-		/* Is locked */
-		} else {
-			*locked = g_list_prepend (*locked, l->data);
-		}
+	/* The collection itself is exported separately */
+	if (node == NULL)
+		return NULL;
 
-		g_free (value);
+	/* Calls for items not in the collection are not dispatched */
+	item_path = g_strconcat (object_path, "/", node, NULL);
+	exists = g_hash_table_lookup (skeleton->item_links, item_path) != NULL;
+	g_free (item_path);
+
+	if (!exists)
+		return NULL;
+
+	infos = g_new0 (GDBusInterfaceInfo *, 3);
+	infos[0] = g_dbus_interface_info_ref (gkd_exported_item_interface_info ());
+	infos[1] = g_dbus_interface_info_ref (gkd_exported_keyring_item_interface_info ());
+	return infos;
+}
+
+static const GDBusInterfaceVTable *
+on_items_subtree_dispatch (GDBusConnection *connection,
+			   const gchar *sender,
+			   const gchar *object_path,
+			   const gchar *interface_name,
+			   const gchar *node,
+			   gpointer *out_user_data,
+			   gpointer user_data)
+{
+	GkdSecretCollectionSkeleton *skeleton = user_data;
+
+	if (node == NULL)
+		return NULL;
+
+	*out_user_data = skeleton->objects;
+	if (g_strcmp0 (interface_name, SECRET_ITEM_INTERFACE) == 0)
+		return &item_vtable;
+	if (g_strcmp0 (interface_name, KEYRING_ITEM_INTERFACE) == 0)
+		return &item_fd_vtable;
+	return NULL;
+}
+
+static const GDBusSubtreeVTable items_subtree_vtable = {
+	on_items_subtree_enumerate,
+	on_items_subtree_introspect,
+	on_items_subtree_dispatch,
+};
+
+/*
+ * Creates a search object, reads back the matched items and destroys it.
+ * When locked is set, the module splits the matches into those unlocked
+ * (returned) and locked (in locked) to the session, in a single get.
+ */
+static GList *
+objects_search_items (GckSession *session,
+		      GckAttributes *attrs,
+		      GList **locked,
+		      GError **error)
+{
+	const GckAttribute *attr;
+	GckAttributes *matched;
+	GckObject *search;
+	GList *items = NULL;
+
+	search = gck_session_create_object (session, attrs, NULL, error);
+	if (search == NULL)
+		return NULL;
+
+	if (locked)
+		matched = gck_object_get (search, NULL, error, CKA_G_MATCHED_UNLOCKED,
+					  CKA_G_MATCHED_LOCKED, GCK_INVALID);
+	else
+		matched = gck_object_get (search, NULL, error, CKA_G_MATCHED, GCK_INVALID);
+
+	gck_object_destroy (search, NULL, NULL);
+	g_object_unref (search);
+
+	if (matched == NULL)
+		return NULL;
+
+	attr = gck_attributes_find (matched, locked ? CKA_G_MATCHED_UNLOCKED : CKA_G_MATCHED);
+	if (attr && !gck_attribute_is_invalid (attr))
+		items = gck_objects_from_handle_array (session, (CK_OBJECT_HANDLE_PTR)attr->value,
+						       attr->length / sizeof (CK_OBJECT_HANDLE));
+
+	if (locked) {
+		*locked = NULL;
+		attr = gck_attributes_find (matched, CKA_G_MATCHED_LOCKED);
+		if (attr && !gck_attribute_is_invalid (attr))
+			*locked = gck_objects_from_handle_array (session, (CK_OBJECT_HANDLE_PTR)attr->value,
+								 attr->length / sizeof (CK_OBJECT_HANDLE));
 	}
 
-	*locked = g_list_reverse (*locked);
-	*unlocked = g_list_reverse (*unlocked);
+	gck_attributes_unref (matched);
+	return items;
 }
 
 static gboolean
@@ -767,8 +1393,124 @@ object_path_for_collection (GckObject *collection)
 		path = gkd_secret_util_build_path (SECRET_COLLECTION_PREFIX, identifier, n_identifier);
 		g_free (identifier);
 	}
-
-	return path;
+
+	return path;
+}
+
+typedef struct {
+	GkdSecretObjects *objects;
+	GckObject *collection;
+	GckSession *session;
+	GkdSecretSecret *secret;
+	GckObject *key;
+	CK_MECHANISM_TYPE mech_type;
+	GckAttributes *attrs;
+	gchar *identifier;
+	gchar *base;
+	gboolean replace;
+	gchar *path;
+} CollectionCall;
+
+static CollectionCall *
+collection_call_new (GkdSecretObjects *self,
+		     GckObject *collection)
+{
+	CollectionCall *call = g_slice_new0 (CollectionCall);
+	call->objects = g_object_ref (self);
+	call->collection = collection;
+	return call;
+}
+
+static void
+collection_call_free (gpointer data)
+{
+	CollectionCall *call = data;
+
+	g_object_unref (call->objects);
+	g_object_unref (call->collection);
+	g_clear_object (&call->session);
+	gkd_secret_secret_free (call->secret);
+	g_clear_object (&call->key);
+	if (call->attrs)
+		gck_attributes_unref (call->attrs);
+	g_free (call->identifier);
+	g_free (call->base);
+	g_free (call->path);
+	g_slice_free (CollectionCall, call);
+}
+
+static gboolean
+collection_create_item_thread (gpointer data,
+			       GError **error)
+{
+	CollectionCall *call = data;
+	GckBuilder builder = GCK_BUILDER_INIT;
+	const GckAttribute *fields;
+	gboolean created = FALSE;
+	GckObject *item = NULL;
+
+	if (call->replace) {
+		fields = gck_attributes_find (call->attrs, CKA_G_FIELDS);
+		if (fields)
+			item = collection_find_matching_item (call->objects, call->session,
+							      call->identifier, fields);
+	}
+
+	/* Replace the item */
+	if (item) {
+		if (!gck_object_set (item, call->attrs, NULL, error)) {
+			g_object_unref (item);
+			return FALSE;
+		}
+
+	/* Create a new item */
+	} else {
+		gck_builder_add_all (&builder, call->attrs);
+		gck_builder_add_string (&builder, CKA_G_COLLECTION, call->identifier);
+		gck_builder_add_ulong (&builder, CKA_CLASS, CKO_SECRET_KEY);
+		item = gck_session_create_object (call->session, gck_builder_end (&builder), NULL, error);
+		if (item == NULL)
+			return FALSE;
+		created = TRUE;
+	}
+
+	/* Set the secret */
+	if (!gkd_secret_session_set_item_secret (call->secret->session, call->key,
+						 call->mech_type, item, call->secret, error)) {
+		if (created) /* If we created, then try to destroy on failure */
+			gck_object_destroy (item, NULL, NULL);
+		g_object_unref (item);
+		return FALSE;
+	}
+
+	call->path = object_path_for_item (call->base, item);
+	g_object_unref (item);
+	return TRUE;
+}
+
+static void
+collection_create_item_done (GkdSecretService *service,
+			     GDBusMethodInvocation *invocation,
+			     gpointer data,
+			     GError *error)
+{
+	CollectionCall *call = data;
+
+	if (error == NULL) {
+		gkd_secret_objects_emit_item_created (call->objects, call->collection, call->path);
+		g_dbus_method_invocation_return_value (invocation,
+						       g_variant_new ("(oo)", call->path, "/"));
+
+	} else if (g_error_matches (error, GCK_ERROR, CKR_USER_NOT_LOGGED_IN)) {
+		g_dbus_method_invocation_return_error_literal (invocation, GKD_SECRET_ERROR,
+							       GKD_SECRET_ERROR_IS_LOCKED,
+							       "Cannot create an item in a locked collection");
+	} else {
+		g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+						       G_DBUS_ERROR_FAILED,
+						       "Couldn't create item: %s",
+						       egg_error_message (error));
+	}
 }
 
 static gboolean
@@ -780,19 +1522,14 @@ collection_method_create_item (GkdExportedCollection *skeleton,
 			       GkdSecretObjects *self)
 {
 	GckBuilder builder = GCK_BUILDER_INIT;
-	GckSession *pkcs11_session = NULL;
 	GkdSecretSecret *secret = NULL;
-	GckAttributes *attrs = NULL;
-	const GckAttribute *fields;
-	GckObject *item = NULL;
+	CollectionCall *call;
 	const gchar *base;
 	GError *error = NULL;
-	gchar *path = NULL;
 	gchar *identifier;
-	gboolean created = FALSE;
 	GckObject *object;
 
-	object = secret_objects_lookup_gck_object_for_invocation (self, invocation);
+	object = secret_objects_lookup_for_worker (self, invocation);
 	if (!object) {
 		return TRUE;
 	}
@@ -801,7 +1538,9 @@ collection_method_create_item (GkdExportedCollection *skeleton,
 		g_dbus_method_invocation_return_error_literal (invocation, G_DBUS_ERROR,
 							       G_DBUS_ERROR_INVALID_ARGS,
 							       "Invalid properties argument");
-		goto cleanup;
+		gck_builder_clear (&builder);
+		g_object_unref (object);
+		return TRUE;
 	}
 
 	base = g_dbus_method_invocation_get_object_path (invocation);
@@ -810,77 +1549,67 @@ collection_method_create_item (GkdExportedCollection *skeleton,
 
 	if (secret == NULL) {
 		g_dbus_method_invocation_take_error (invocation, error);
-		error = NULL;
-		goto cleanup;
+		gck_builder_clear (&builder);
+		g_object_unref (object);
+		return TRUE;
 	}
 
 	if (!gkd_secret_util_parse_path (base, &identifier, NULL))
 		g_return_val_if_reached (FALSE);
 	g_return_val_if_fail (identifier, FALSE);
 
-	pkcs11_session = gck_object_get_session (object);
-	g_return_val_if_fail (pkcs11_session, FALSE);
-
-	attrs = gck_attributes_ref_sink (gck_builder_end (&builder));
+	call = collection_call_new (self, object);
+	call->session = gck_object_get_session (object);
+	call->secret = secret;
+	call->key = gkd_secret_session_get_key (secret->session, &call->mech_type);
+	call->attrs = gck_attributes_ref_sink (gck_builder_end (&builder));
+	call->identifier = identifier;
+	call->base = g_strdup (base);
+	call->replace = replace;
 
-	if (replace) {
-		fields = gck_attributes_find (attrs, CKA_G_FIELDS);
-		if (fields)
-			item = collection_find_matching_item (self, pkcs11_session, identifier, fields);
-	}
+	gkd_secret_service_queue_call (self->service, invocation,
+				       collection_create_item_thread, collection_create_item_done,
+				       call, collection_call_free);
 
-	/* Replace the item */
-	if (item) {
-		if (!gck_object_set (item, attrs, NULL, &error))
-			goto cleanup;
+	return TRUE;
+}
 
-	/* Create a new item */
-	} else {
-		gck_builder_add_all (&builder, attrs);
-		gck_builder_add_string (&builder, CKA_G_COLLECTION, identifier);
-		gck_builder_add_ulong (&builder, CKA_CLASS, CKO_SECRET_KEY);
-		item = gck_session_create_object (pkcs11_session, gck_builder_end (&builder), NULL, &error);
-		if (item == NULL)
-			goto cleanup;
-		created = TRUE;
-	}
+static gboolean
+collection_delete_thread (gpointer data,
+			  GError **error)
+{
+	CollectionCall *call = data;
 
-	/* Set the secret */
-	if (!gkd_secret_session_set_item_secret (secret->session, item, secret, &error)) {
-		if (created) /* If we created, then try to destroy on failure */
-			gck_object_destroy (item, NULL, NULL);
-		goto cleanup;
+	call->path = object_path_for_collection (call->collection);
+	if (call->path == NULL) {
+		g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+				     "Couldn't lookup the collection");
+		return FALSE;
 	}
 
-	path = object_path_for_item (base, item);
-	gkd_secret_objects_emit_item_created (self, object, path);
+	return gck_object_destroy (call->collection, NULL, error);
+}
 
-	gkd_exported_collection_complete_create_item (skeleton, invocation, path, "/");
+static void
+collection_delete_done (GkdSecretService *service,
+			GDBusMethodInvocation *invocation,
+			gpointer data,
+			GError *error)
+{
+	CollectionCall *call = data;
 
-cleanup:
-	if (error) {
-		if (g_error_matches (error, GCK_ERROR, CKR_USER_NOT_LOGGED_IN))
-			g_dbus_method_invocation_return_error_literal (invocation, GKD_SECRET_ERROR,
-								       GKD_SECRET_ERROR_IS_LOCKED,
-								       "Cannot create an item in a locked collection");
-		else
-			g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
-							       G_DBUS_ERROR_FAILED,
-							       "Couldn't create item: %s",
-							       egg_error_message (error));
-		g_clear_error (&error);
+	if (error != NULL) {
+		g_dbus_method_invocation_return_error (invocation,
+						       G_DBUS_ERROR,
+						       G_DBUS_ERROR_FAILED,
+						       "Couldn't delete collection: %s",
+						       egg_error_message (error));
+		return;
 	}
 
-	gkd_secret_secret_free (secret);
-	gck_attributes_unref (attrs);
-	if (item)
-		g_object_unref (item);
-	if (pkcs11_session)
-		g_object_unref (pkcs11_session);
-	g_free (path);
-	g_object_unref (object);
-
-	return TRUE;
+	/* Notify the callers that a collection was deleted */
+	gkd_secret_service_emit_collection_deleted (service, call->path);
+	g_dbus_method_invocation_return_value (invocation, g_variant_new ("(o)", "/"));
 }
 
 static gboolean
@@ -888,35 +1617,16 @@ collection_method_delete (GkdExportedCollection *skeleton,
 			  GDBusMethodInvocation *invocation,
 			  GkdSecretObjects *self)
 {
-	GError *error = NULL;
-	gchar *path;
 	GckObject *object;
 
-	object = secret_objects_lookup_gck_object_for_invocation (self, invocation);
+	object = secret_objects_lookup_for_worker (self, invocation);
 	if (!object) {
 		return TRUE;
 	}
 
-	path = object_path_for_collection (object);
-	g_return_val_if_fail (path != NULL, FALSE);
-
-	if (!gck_object_destroy (object, NULL, &error)) {
-		g_dbus_method_invocation_return_error (invocation,
-						       G_DBUS_ERROR,
-						       G_DBUS_ERROR_FAILED,
-						       "Couldn't delete collection: %s",
-						       egg_error_message (error));
-		g_clear_error (&error);
-		goto cleanup;
-	}
-
-	/* Notify the callers that a collection was deleted */
-	gkd_secret_service_emit_collection_deleted (self->service, path);
-	gkd_exported_collection_complete_delete (skeleton, invocation, "/");
-
- cleanup:
-	g_free (path);
-	g_object_unref (object);
+	gkd_secret_service_queue_call (self->service, invocation,
+				       collection_delete_thread, collection_delete_done,
+				       collection_call_new (self, object), collection_call_free);
 
 	return TRUE;
 }
@@ -928,7 +1638,14 @@ collection_method_delete (GkdExportedCollection *skeleton,
 static void
 skeleton_destroy_func (gpointer user_data)
 {
+	GkdSecretCollectionSkeleton *collection = user_data;
 	GDBusInterfaceSkeleton *skeleton = user_data;
+
+	if (collection->items_subtree)
+		g_dbus_connection_unregister_subtree (collection->items_connection,
+						      collection->items_subtree);
+	g_clear_object (&collection->items_connection);
+
 	g_dbus_interface_skeleton_unexport (skeleton);
 	g_object_unref (skeleton);
 }
@@ -938,8 +1655,12 @@ gkd_secret_objects_init (GkdSecretObjects *self)
 {
 	self->collections_to_skeletons = g_hash_table_new_full (g_str_hash, g_str_equal,
 								g_free, skeleton_destroy_func);
-	self->items_to_skeletons = g_hash_table_new_full (g_str_hash, g_str_equal,
-							  g_free, skeleton_destroy_func);
+	self->paths_to_handles = g_hash_table_new_full (g_str_hash, g_str_equal,
+							g_free, g_free);
+	self->pending_items = g_hash_table_new_full (g_str_hash, g_str_equal,
+						     g_free, pending_item_free);
+	self->pending_collections = g_hash_table_new_full (g_str_hash, g_str_equal,
+							   g_free, NULL);
 }
 
 static void
@@ -947,6 +1668,11 @@ gkd_secret_objects_dispose (GObject *obj)
 {
 	GkdSecretObjects *self = GKD_SECRET_OBJECTS (obj);
 
+	if (self->pending_idle) {
+		g_source_remove (self->pending_idle);
+		self->pending_idle = 0;
+	}
+
 	if (self->pkcs11_slot) {
 		g_object_unref (self->pkcs11_slot);
 		self->pkcs11_slot = NULL;
@@ -959,7 +1685,9 @@ gkd_secret_objects_dispose (GObject *obj)
 	}
 
 	g_clear_pointer (&self->collections_to_skeletons, g_hash_table_unref);
-	g_clear_pointer (&self->items_to_skeletons, g_hash_table_unref);
+	g_clear_pointer (&self->paths_to_handles, g_hash_table_unref);
+	g_clear_pointer (&self->pending_items, g_hash_table_unref);
+	g_clear_pointer (&self->pending_collections, g_hash_table_unref);
 
 	G_OBJECT_CLASS (gkd_secret_objects_parent_class)->dispose (obj);
 }
@@ -1109,6 +1837,13 @@ gkd_secret_objects_lookup_item (GkdSecretObjects *self, const gchar *caller,
 	session = gkd_secret_service_get_pkcs11_session (self->service, caller);
 	g_return_val_if_fail (session, NULL);
 
+	object = secret_objects_lookup_cached (self, session, path);
+	if (object) {
+		g_free (identifier);
+		g_free (collection);
+		return object;
+	}
+
 	gck_builder_add_ulong (&builder, CKA_CLASS, CKO_SECRET_KEY);
 	gck_builder_add_string (&builder, CKA_ID, identifier);
 	gck_builder_add_string (&builder, CKA_G_COLLECTION, collection);
@@ -1123,8 +1858,10 @@ gkd_secret_objects_lookup_item (GkdSecretObjects *self, const gchar *caller,
 		g_clear_error (&error);
 	}
 
-	if (objects)
+	if (objects) {
 		object = g_object_ref (objects->data);
+		secret_objects_remember_handle (self, path, object);
+	}
 
 	gck_list_unref_free (objects);
 	return object;
@@ -1257,6 +1994,89 @@ gkd_secret_objects_append_collection_paths (GkdSecretObjects *self,
 	return g_variant_builder_end (&builder);
 }
 
+typedef struct {
+	GkdSecretObjects *objects;
+	GckSession *session;
+	GckAttributes *attrs;
+	gboolean separate_locked;
+	GVariant *result;
+} SearchCall;
+
+static void
+search_call_free (gpointer data)
+{
+	SearchCall *call = data;
+
+	g_object_unref (call->objects);
+	g_object_unref (call->session);
+	gck_attributes_unref (call->attrs);
+	if (call->result)
+		g_variant_unref (call->result);
+	g_slice_free (SearchCall, call);
+}
+
+static gboolean
+search_items_thread (gpointer data,
+		     GError **error)
+{
+	SearchCall *call = data;
+	GVariant *unlocked_variant, *locked_variant;
+	GVariantBuilder result;
+	GList *locked = NULL;
+	GError *err = NULL;
+	GList *items;
+
+	/* Search, with the locked items split out if necessary */
+	items = objects_search_items (call->session, call->attrs,
+				      call->separate_locked ? &locked : NULL, &err);
+
+	if (err != NULL) {
+		g_propagate_error (error, err);
+		return FALSE;
+	}
+
+	if (call->separate_locked) {
+		g_variant_builder_init (&result, G_VARIANT_TYPE ("ao"));
+		objects_foreach_item (call->objects, items, NULL, on_object_path_append_to_builder, &result);
+		unlocked_variant = g_variant_builder_end (&result);
+
+		g_variant_builder_init (&result, G_VARIANT_TYPE ("ao"));
+		objects_foreach_item (call->objects, locked, NULL, on_object_path_append_to_builder, &result);
+		locked_variant = g_variant_builder_end (&result);
+
+		gck_list_unref_free (locked);
+
+		call->result = g_variant_new ("(@ao@ao)", unlocked_variant, locked_variant);
+	} else {
+		g_variant_builder_init (&result, G_VARIANT_TYPE ("ao"));
+		objects_foreach_item (call->objects, items, NULL, on_object_path_append_to_builder, &result);
+
+		call->result = g_variant_new ("(@ao)", g_variant_builder_end (&result));
+	}
+
+	g_variant_ref_sink (call->result);
+	gck_list_unref_free (items);
+	return TRUE;
+}
+
+static void
+search_items_done (GkdSecretService *service,
+		   GDBusMethodInvocation *invocation,
+		   gpointer data,
+		   GError *error)
+{
+	SearchCall *call = data;
+
+	if (error != NULL)
+		g_dbus_method_invocation_return_error (invocation,
+						       G_DBUS_ERROR,
+						       G_DBUS_ERROR_FAILED,
+						       "Couldn't search for items: %s",
+						       egg_error_message (error));
+	else
+		g_dbus_method_invocation_return_value (invocation, call->result);
+}
+
 gboolean
 gkd_secret_objects_handle_search_items (GkdSecretObjects *self,
 					GDBusMethodInvocation *invocation,
@@ -1265,15 +2085,9 @@ gkd_secret_objects_handle_search_items (GkdSecretObjects *self,
 					gboolean separate_locked)
 {
 	GckBuilder builder = GCK_BUILDER_INIT;
-	GckObject *search;
 	GckSession *session;
-	GError *error = NULL;
+	SearchCall *call;
 	gchar *identifier;
-	gpointer data;
-	gsize n_data;
-	GList *locked, *unlocked;
-	GList *items;
-	GVariantBuilder result;
 
 	if (!gkd_secret_property_parse_fields (attributes, &builder)) {
 		gck_builder_clear (&builder);
@@ -1294,74 +2108,96 @@ gkd_secret_objects_handle_search_items (GkdSecretObjects *self,
 	gck_builder_add_ulong (&builder, CKA_CLASS, CKO_G_SEARCH);
 	gck_builder_add_boolean (&builder, CKA_TOKEN, FALSE);
 
-	/* The session we're using to access the object */
-	session = gkd_secret_service_get_pkcs11_session (self->service, g_dbus_method_invocation_get_sender (invocation));
+	/* The search object is made in the worker, in a session of its own */
+	session = gkd_secret_service_get_worker_session (self->service, g_dbus_method_invocation_get_sender (invocation));
 	g_return_val_if_fail (session, FALSE);
 
-	/* Create the search object */
-	search = gck_session_create_object (session, gck_builder_end (&builder), NULL, &error);
+	call = g_slice_new0 (SearchCall);
+	call->objects = g_object_ref (self);
+	call->session = g_object_ref (session);
+	call->attrs = gck_attributes_ref_sink (gck_builder_end (&builder));
+	call->separate_locked = separate_locked;
 
-	if (error != NULL) {
-		g_dbus_method_invocation_return_error (invocation,
-						       G_DBUS_ERROR,
-						       G_DBUS_ERROR_FAILED,
-						       "Couldn't search for items: %s",
-						       egg_error_message (error));
-		g_clear_error (&error);
-		return TRUE;
-	}
+	gkd_secret_service_queue_call (self->service, invocation,
+				       search_items_thread, search_items_done,
+				       call, search_call_free);
 
-	/* Get the matched item handles, and delete the search object */
-	data = gck_object_get_data (search, CKA_G_MATCHED, NULL, &n_data, &error);
-	gck_object_destroy (search, NULL, NULL);
-	g_object_unref (search);
+	return TRUE;
+}
 
-	if (error != NULL) {
-		g_dbus_method_invocation_return_error (invocation,
-						       G_DBUS_ERROR,
-						       G_DBUS_ERROR_FAILED,
-						       "Couldn't retrieve matched items: %s",
-						       egg_error_message (error));
-		g_clear_error (&error);
-		return TRUE;
-	}
+typedef struct {
+	GkdSecretSession *session;
+	GckObject *key;
+	CK_MECHANISM_TYPE mech_type;
+	GList *items;
+	GList *paths;
+	GPtrArray *secrets;
+} SecretsCall;
 
-	/* Build a list of object handles */
-	items = gck_objects_from_handle_array (session, data, n_data / sizeof (CK_OBJECT_HANDLE));
-	g_free (data);
+static void
+secrets_call_free (gpointer data)
+{
+	SecretsCall *call = data;
+
+	g_object_unref (call->session);
+	g_clear_object (&call->key);
+	gck_list_unref_free (call->items);
+	g_list_free_full (call->paths, g_free);
+	if (call->secrets)
+		g_ptr_array_unref (call->secrets);
+	g_slice_free (SecretsCall, call);
+}
 
-	/* Filter out the locked items */
-	if (separate_locked) {
-		GVariant *unlocked_variant, *locked_variant;
+static gboolean
+get_secrets_thread (gpointer data,
+		    GError **error)
+{
+	SecretsCall *call = data;
 
-		item_cleanup_search_results (session, items, &locked, &unlocked);
+	/* All the secrets are wrapped at once */
+	call->secrets = gkd_secret_session_get_item_secrets (call->session, call->key, call->mech_type,
+							     call->items, error);
+	return call->secrets != NULL;
+}
 
-		g_variant_builder_init (&result, G_VARIANT_TYPE ("ao"));
-		objects_foreach_item (self, unlocked, NULL, on_object_path_append_to_builder, &result);
-		unlocked_variant = g_variant_builder_end (&result);
+static void
+get_secrets_done (GkdSecretService *service,
+		  GDBusMethodInvocation *invocation,
+		  gpointer data,
+		  GError *error)
+{
+	SecretsCall *call = data;
+	GkdSecretSecret *secret;
+	GVariantBuilder builder;
+	GList *p;
+	guint i;
 
-		g_variant_builder_init (&result, G_VARIANT_TYPE ("ao"));
-		objects_foreach_item (self, locked, NULL, on_object_path_append_to_builder, &result);
-		locked_variant = g_variant_builder_end (&result);
+	if (error != NULL) {
+		g_dbus_method_invocation_return_gerror (invocation, error);
+		return;
+	}
 
-		g_list_free (locked);
-		g_list_free (unlocked);
+	if (session_is_closed (call->session)) {
+		g_dbus_method_invocation_return_error_literal (invocation, GKD_SECRET_ERROR,
+							       GKD_SECRET_ERROR_NO_SESSION,
+							       "The session was closed");
+		return;
+	}
 
-		g_dbus_method_invocation_return_value (invocation,
-						       g_variant_new ("(@ao@ao)",
-								      unlocked_variant,
-								      locked_variant));
-	} else {
-		g_variant_builder_init (&result, G_VARIANT_TYPE ("ao"));
-		objects_foreach_item (self, items, NULL, on_object_path_append_to_builder, &result);
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{o(oayays)}"));
 
-		g_dbus_method_invocation_return_value (invocation,
-						       g_variant_new ("(@ao)", g_variant_builder_end (&result)));
-	}
+	for (p = call->paths, i = 0; p != NULL; p = g_list_next (p), i++) {
+		secret = g_ptr_array_index (call->secrets, i);
 
-	gck_list_unref_free (items);
+		/* We ignore is locked, and just leave out from response */
+		if (secret == NULL)
+			continue;
 
-	return TRUE;
+		g_variant_builder_add (&builder, "{o@(oayays)}", p->data, gkd_secret_secret_append (secret));
+	}
+
+	g_dbus_method_invocation_return_value (invocation,
+					       g_variant_new ("(@a{o(oayays)})", g_variant_builder_end (&builder)));
 }
 
 gboolean
@@ -1371,12 +2207,11 @@ gkd_secret_objects_handle_get_secrets (GkdSecretObjects *self,
 				       const gchar *session_path)
 {
 	GkdSecretSession *session;
-	GkdSecretSecret *secret;
+	SecretsCall *call;
+	GckObject *found;
 	GckObject *item;
 	const char *caller;
 	int i;
-	GVariantBuilder builder;
-	GError *error = NULL;
 
 	caller = g_dbus_method_invocation_get_sender (invocation);
 	session = gkd_secret_service_lookup_session (self->service, session_path, caller);
@@ -1387,37 +2222,34 @@ gkd_secret_objects_handle_get_secrets (GkdSecretObjects *self,
 		return TRUE;
 	}
 
-	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{o(oayays)}"));
+	call = g_slice_new0 (SecretsCall);
+	call->session = g_object_ref (session);
+	call->key = gkd_secret_session_get_key (session, &call->mech_type);
 
 	for (i = 0; paths[i] != NULL; ++i) {
 
 		/* Try to find the item, if it doesn't exist, just ignore */
-		item = gkd_secret_objects_lookup_item (self, caller, paths[i]);
+		found = gkd_secret_objects_lookup_item (self, caller, paths[i]);
+		if (!found)
+			continue;
+
+		/* Wrapped in the worker session, where the key is */
+		item = gkd_secret_service_object_for_worker (self->service, caller, found);
+		g_object_unref (found);
 		if (!item)
 			continue;
 
-		secret = gkd_secret_session_get_item_secret (session, item, &error);
-		g_object_unref (item);
+		call->items = g_list_prepend (call->items, item);
+		call->paths = g_list_prepend (call->paths, g_strdup (paths[i]));
+	}
 
-		if (secret == NULL) {
-			/* We ignore is locked, and just leave out from response */
-			if (g_error_matches (error, GKD_SECRET_ERROR, GKD_SECRET_ERROR_IS_LOCKED)) {
-				g_clear_error (&error);
-				continue;
-
-			/* All other errors stop the operation */
-			} else {
-				g_dbus_method_invocation_take_error (invocation, error);
-				return TRUE;
-			}
-		}
+	call->items = g_list_reverse (call->items);
+	call->paths = g_list_reverse (call->paths);
 
-		g_variant_builder_add (&builder, "{o@(oayays)}", paths[i], gkd_secret_secret_append (secret));
-		gkd_secret_secret_free (secret);
-	}
+	gkd_secret_service_queue_call (self->service, invocation,
+				       get_secrets_thread, get_secrets_done,
+				       call, secrets_call_free);
 
-	g_dbus_method_invocation_return_value (invocation,
-					       g_variant_new ("(@a{o(oayays)})", g_variant_builder_end (&builder)));
 	return TRUE;
 }
 
@@ -1427,15 +2259,12 @@ on_each_item_emit_locked (GkdSecretObjects *self,
 			  GckObject *object,
 			  gpointer user_data)
 {
-	GkdExportedItem *skeleton;
+	const gchar *collection_path = user_data;
 	GVariant *value;
 	GError *error = NULL;
 
-	skeleton = g_hash_table_lookup (self->items_to_skeletons, path);
-	if (skeleton == NULL) {
-		g_warning ("setting locked state on item %s, but no skeleton found", path);
+	if (path == NULL)
 		return;
-	}
 
 	value = object_property_get (self, object, "Locked", &error);
 	if (!value) {
@@ -1445,10 +2274,8 @@ on_each_item_emit_locked (GkdSecretObjects *self,
 		return;
 	}
 
-	gkd_exported_item_set_locked (skeleton, g_variant_get_boolean (value));
-	g_variant_unref (value);
-
-	gkd_secret_objects_emit_item_changed (self, object);
+	secret_objects_remember_handle (self, path, object);
+	secret_objects_queue_item_changed (self, collection_path, path, "Locked", value);
 }
 
 void
@@ -1462,7 +2289,7 @@ gkd_secret_objects_emit_collection_locked (GkdSecretObjects *self,
 
 	collection_path = object_path_for_collection (collection);
 	gkd_secret_objects_foreach_item (self, NULL, collection_path,
-					 on_each_item_emit_locked, NULL);
+					 on_each_item_emit_locked, collection_path);
 
 	skeleton = g_hash_table_lookup (self->collections_to_skeletons, collection_path);
 	if (skeleton == NULL) {
@@ -1481,52 +2308,10 @@ gkd_secret_objects_emit_collection_locked (GkdSecretObjects *self,
 	gkd_exported_collection_set_locked (skeleton, g_variant_get_boolean (value));
 	g_variant_unref (value);
 
-	gkd_secret_service_emit_collection_changed (self->service, collection_path);
+	secret_objects_queue_collection_changed (self, collection_path);
 	g_free (collection_path);
 }
 
-static void
-gkd_secret_objects_register_item (GkdSecretObjects *self,
-				  const gchar *item_path)
-{
-	GkdExportedItem *skeleton;
-	GError *error = NULL;
-
-	skeleton = g_hash_table_lookup (self->items_to_skeletons, item_path);
-	if (skeleton != NULL) {
-		g_warning ("asked to register item %s, but it's already registered", item_path);
-		return;
-	}
-
-	skeleton = gkd_secret_item_skeleton_new (self);
-	g_hash_table_insert (self->items_to_skeletons, g_strdup (item_path), skeleton);
-
-	g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (skeleton),
-					  gkd_secret_service_get_connection (self->service),
-					  item_path, &error);
-	if (error != NULL) {
-		g_warning ("could not register secret item on session bus: %s", error->message);
-		g_error_free (error);
-	}
-
-	g_signal_connect (skeleton, "handle-delete",
-			  G_CALLBACK (item_method_delete), self);
-	g_signal_connect (skeleton, "handle-get-secret",
-			  G_CALLBACK (item_method_get_secret), self);
-	g_signal_connect (skeleton, "handle-set-secret",
-			  G_CALLBACK (item_method_set_secret), self);
-}
-
-static void
-gkd_secret_objects_unregister_item (GkdSecretObjects *self,
-				    const gchar *item_path)
-{
-	if (!g_hash_table_remove (self->items_to_skeletons, item_path)) {
-		g_warning ("asked to unregister item %s, but it wasn't found", item_path);
-		return;
-	}
-}
-
 void
 gkd_secret_objects_emit_item_created (GkdSecretObjects *self,
 				      GckObject *collection,
@@ -1534,7 +2319,6 @@ gkd_secret_objects_emit_item_created (GkdSecretObjects *self,
 {
 	GkdExportedCollection *skeleton;
 	gchar *collection_path;
-	gchar **items;
 
 	g_return_if_fail (GKD_SECRET_IS_OBJECTS (self));
 	g_return_if_fail (GCK_OBJECT (collection));
@@ -1544,36 +2328,22 @@ gkd_secret_objects_emit_item_created (GkdSecretObjects *self,
 	skeleton = g_hash_table_lookup (self->collections_to_skeletons, collection_path);
 	g_return_if_fail (skeleton != NULL);
 
-	gkd_secret_objects_register_item (self, item_path);
 	gkd_exported_collection_emit_item_created (skeleton, item_path);
 
-	items = gkd_secret_objects_get_collection_items (self, collection_path);
-	gkd_exported_collection_set_items (skeleton, (const gchar **) items);
+	collection_skeleton_add_item ((GkdSecretCollectionSkeleton *) skeleton, item_path);
+	collection_skeleton_items_changed ((GkdSecretCollectionSkeleton *) skeleton);
 
 	g_free (collection_path);
-	g_strfreev (items);
 }
 
 void
 gkd_secret_objects_emit_item_changed (GkdSecretObjects *self,
 				      GckObject *item)
 {
-	GkdExportedCollection *skeleton;
-	gchar *collection_path;
-	gchar *item_path;
-
 	g_return_if_fail (GKD_SECRET_IS_OBJECTS (self));
 	g_return_if_fail (GCK_OBJECT (item));
 
-	collection_path = collection_path_for_item (item);
-	skeleton = g_hash_table_lookup (self->collections_to_skeletons, collection_path);
-	g_return_if_fail (skeleton != NULL);
-
-	item_path = object_path_for_item (collection_path, item);
-	gkd_exported_collection_emit_item_changed (skeleton, item_path);
-
-	g_free (item_path);
-	g_free (collection_path);
+	secret_objects_item_changed (self, item, NULL, NULL);
 }
 
 void
@@ -1583,7 +2353,6 @@ gkd_secret_objects_emit_item_deleted (GkdSecretObjects *self,
 {
 	GkdExportedCollection *skeleton;
 	gchar *collection_path;
-	gchar **items;
 
 	g_return_if_fail (GKD_SECRET_IS_OBJECTS (self));
 	g_return_if_fail (GCK_OBJECT (collection));
@@ -1593,18 +2362,19 @@ gkd_secret_objects_emit_item_deleted (GkdSecretObjects *self,
 	skeleton = g_hash_table_lookup (self->collections_to_skeletons, collection_path);
 	g_return_if_fail (skeleton != NULL);
 
-	gkd_secret_objects_unregister_item (self, item_path);
+	secret_objects_forget_handles (self, item_path);
+	secret_objects_drop_pending (self, item_path);
 	gkd_exported_collection_emit_item_deleted (skeleton, item_path);
 
-	items = gkd_secret_objects_get_collection_items (self, collection_path);
-	gkd_exported_collection_set_items (skeleton, (const gchar **) items);
+	collection_skeleton_remove_item ((GkdSecretCollectionSkeleton *) skeleton, item_path);
+	collection_skeleton_items_changed ((GkdSecretCollectionSkeleton *) skeleton);
 
-	g_strfreev (items);
 	g_free (collection_path);
 }
 
 static void
 gkd_secret_objects_init_collection_items (GkdSecretObjects *self,
+					  GkdExportedCollection *skeleton,
 					  const gchar *collection_path)
 {
 	gchar **items;
@@ -1612,7 +2382,7 @@ gkd_secret_objects_init_collection_items (GkdSecretObjects *self,
 
 	items = gkd_secret_objects_get_collection_items (self, collection_path);
 	for (idx = 0; items[idx] != NULL; idx++)
-		gkd_secret_objects_register_item (self, items[idx]);
+		collection_skeleton_add_item ((GkdSecretCollectionSkeleton *) skeleton, items[idx]);
 
 	g_strfreev (items);
 }
@@ -1621,6 +2391,7 @@ void
 gkd_secret_objects_register_collection (GkdSecretObjects *self,
 					const gchar *collection_path)
 {
+	GkdSecretCollectionSkeleton *collection;
 	GkdExportedCollection *skeleton;
 	GError *error = NULL;
 
@@ -1648,13 +2419,29 @@ gkd_secret_objects_register_collection (GkdSecretObjects *self,
 	g_signal_connect (skeleton, "handle-search-items",
 			  G_CALLBACK (collection_method_search_items), self);
 
-	gkd_secret_objects_init_collection_items (self, collection_path);
+	gkd_secret_objects_init_collection_items (self, skeleton, collection_path);
+
+	/* The items are dispatched from a subtree at the collection path */
+	collection = (GkdSecretCollectionSkeleton *) skeleton;
+	collection->items_connection = g_object_ref (gkd_secret_service_get_connection (self->service));
+	collection->items_subtree = g_dbus_connection_register_subtree (collection->items_connection,
+									collection_path,
+									&items_subtree_vtable,
+									G_DBUS_SUBTREE_FLAGS_DISPATCH_TO_UNENUMERATED_NODES,
+									collection, NULL, &error);
+	if (error != NULL) {
+		g_warning ("could not register secret items on session bus: %s", error->message);
+		g_error_free (error);
+	}
 }
 
 void
 gkd_secret_objects_unregister_collection (GkdSecretObjects *self,
 					  const gchar *collection_path)
 {
+	secret_objects_forget_handles (self, collection_path);
+	secret_objects_drop_pending (self, collection_path);
+
 	if (!g_hash_table_remove (self->collections_to_skeletons, collection_path)) {
 		g_warning ("asked to unregister collection %s, but it wasn't found", collection_path);
 		return;
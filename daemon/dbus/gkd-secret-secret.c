@@ -30,7 +30,16 @@
 
 #include <glib-object.h>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
 
 GkdSecretSecret *
 gkd_secret_secret_new (GkdSecretSession *session,
@@ -145,6 +154,186 @@ gkd_secret_secret_append (GkdSecretSecret *secret)
 	return g_variant_new ("(o@ay@ays)", path, parameter, value, content_type);
 }
 
+/*
+ * Large secrets can have their value passed in a sealed memfd, which is
+ * mapped rather than copied around. The seals make sure the sender can't
+ * change it after the fact.
+ */
+
+#ifdef HAVE_MEMFD_CREATE
+
+#define SECRET_MEMORY_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+/* The largest secret value accepted in a memfd */
+#define SECRET_MEMORY_MAX (64 * 1024 * 1024)
+
+static void
+destroy_with_mapped_memory (gpointer data)
+{
+	GkdSecretSecret *secret = data;
+	g_free (secret->parameter);
+	if (secret->value)
+		munmap (secret->value, secret->n_value);
+}
+
+#endif /* HAVE_MEMFD_CREATE */
+
+GkdSecretSecret*
+gkd_secret_secret_parse_fd (GkdSecretService *service,
+			    const char *sender,
+			    GVariant *variant,
+			    GUnixFDList *fd_list,
+			    GError **error)
+{
+#ifdef HAVE_MEMFD_CREATE
+	GkdSecretSecret *secret = NULL;
+	GkdSecretSession *session;
+	const char *parameter, *path, *content_type;
+	GVariant *parameter_variant;
+	gsize n_parameter;
+	struct stat sb;
+	gpointer map = NULL;
+	gint32 handle;
+	int seals;
+	int fd;
+
+	g_return_val_if_fail (GKD_SECRET_IS_SERVICE (service), NULL);
+	g_return_val_if_fail (variant, NULL);
+	g_return_val_if_fail (sender, NULL);
+
+	g_variant_get (variant, "(&o^&ayh&s)", &path, NULL, &handle, &content_type);
+
+	if (fd_list == NULL || handle < 0 || handle >= g_unix_fd_list_get_length (fd_list)) {
+		g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+				     "The secret value was not passed with the message");
+		return NULL;
+	}
+
+	/* Try to lookup the session */
+	session = gkd_secret_service_lookup_session (service, path, sender);
+	if (session == NULL) {
+		g_set_error_literal (error, GKD_SECRET_ERROR,
+				     GKD_SECRET_ERROR_NO_SESSION,
+				     "The session wrapping the secret does not exist");
+		return NULL;
+	}
+
+	fd = g_unix_fd_list_get (fd_list, handle, error);
+	if (fd < 0)
+		return NULL;
+
+	seals = fcntl (fd, F_GET_SEALS);
+	if (seals < 0 || (seals & SECRET_MEMORY_SEALS) != SECRET_MEMORY_SEALS ||
+	    fstat (fd, &sb) < 0 || sb.st_size < 0 || sb.st_size > SECRET_MEMORY_MAX) {
+		g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+				     "The secret value was not sealed, or was too large");
+		close (fd);
+		return NULL;
+	}
+
+	/* A private mapping, clearing it when done doesn't touch the sender's */
+	if (sb.st_size > 0) {
+		map = mmap (NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+				     "Couldn't map the secret value: %s", g_strerror (errno));
+			close (fd);
+			return NULL;
+		}
+	}
+
+	close (fd);
+
+	parameter_variant = g_variant_get_child_value (variant, 1);
+	parameter = g_variant_get_fixed_array (parameter_variant, &n_parameter, sizeof (guchar));
+
+	secret = g_slice_new0 (GkdSecretSecret);
+	secret->session = g_object_ref (session);
+	secret->parameter = g_memdup (parameter, n_parameter);
+	secret->n_parameter = n_parameter;
+	secret->value = map;
+	secret->n_value = sb.st_size;
+
+	secret->destroy_func = destroy_with_mapped_memory;
+	secret->destroy_data = secret;
+
+	g_variant_unref (parameter_variant);
+
+	return secret;
+#else
+	g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+			     "Passing secrets in shared memory is not supported");
+	return NULL;
+#endif
+}
+
+/*
+ * This may be called from a worker, so the caller passes in the path of
+ * the secret's session, looked up beforehand on the main loop.
+ */
+GVariant *
+gkd_secret_secret_append_fd (GkdSecretSecret *secret,
+			     const gchar *path,
+			     GUnixFDList *fd_list,
+			     GError **error)
+{
+#ifdef HAVE_MEMFD_CREATE
+	const gchar *content_type = "text/plain";
+	GVariant *parameter;
+	gint handle;
+	gsize len;
+	gssize r;
+	int fd;
+
+	g_return_val_if_fail (path != NULL, NULL);
+	g_return_val_if_fail (G_IS_UNIX_FD_LIST (fd_list), NULL);
+
+	fd = memfd_create ("gkd-secret", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+			     "Couldn't create shared memory: %s", g_strerror (errno));
+		return NULL;
+	}
+
+	for (len = 0; len < secret->n_value; ) {
+		r = write (fd, (guchar *)secret->value + len, secret->n_value - len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+				     "Couldn't write the secret to shared memory: %s",
+				     r < 0 ? g_strerror (errno) : "short write");
+			close (fd);
+			return NULL;
+		}
+		len += r;
+	}
+
+	if (fcntl (fd, F_ADD_SEALS, SECRET_MEMORY_SEALS) < 0) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+			     "Couldn't seal shared memory: %s", g_strerror (errno));
+		close (fd);
+		return NULL;
+	}
+
+	/* The list has its own copy of the descriptor */
+	handle = g_unix_fd_list_append (fd_list, fd, error);
+	close (fd);
+	if (handle < 0)
+		return NULL;
+
+	parameter = g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+					       secret->parameter, secret->n_parameter,
+					       sizeof (guchar));
+
+	return g_variant_new ("(o@ayhs)", path, parameter, handle, content_type);
+#else
+	g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+			     "Passing secrets in shared memory is not supported");
+	return NULL;
+#endif
+}
+
 void
 gkd_secret_secret_free (gpointer data)
 {
@@ -23,7 +23,7 @@
 
 #include "gkd-secret-types.h"
 
-#include <glib.h>
+#include <gio/gunixfdlist.h>
 
 struct _GkdSecretSecret {
 	GkdSecretSession *session;
@@ -56,6 +56,17 @@ GkdSecretSecret*       gkd_secret_secret_parse                    (GkdSecretServ
 
 GVariant *             gkd_secret_secret_append                   (GkdSecretSecret *secret);
 
+GkdSecretSecret*       gkd_secret_secret_parse_fd                 (GkdSecretService *service,
+                                                                   const char *sender,
+                                                                   GVariant *variant,
+                                                                   GUnixFDList *fd_list,
+                                                                   GError **error);
+
+GVariant *             gkd_secret_secret_append_fd                (GkdSecretSecret *secret,
+                                                                   const gchar *path,
+                                                                   GUnixFDList *fd_list,
+                                                                   GError **error);
+
 void                   gkd_secret_secret_free                     (gpointer data);
 
 #endif /* __GKD_SECRET_PROPERTY_H__ */
@@ -140,9 +140,21 @@ typedef struct _ServiceClient {
 	gchar *caller_peer;
 	CK_G_APPLICATION app;
 	GckSession *pkcs11_session;
+	GckSession *worker_session;
 	GHashTable *dispatch;
+	GQueue calls;
 } ServiceClient;
 
+typedef struct {
+	GkdSecretService *service;
+	gchar *caller;
+	GDBusMethodInvocation *invocation;
+	GkdSecretServiceCallFunc func;
+	GkdSecretServiceDoneFunc done;
+	gpointer data;
+	GDestroyNotify destroy;
+} ServiceCall;
+
 G_DEFINE_TYPE (GkdSecretService, gkd_secret_service, G_TYPE_OBJECT);
 
 /* -----------------------------------------------------------------------------
@@ -241,14 +253,39 @@ dispose_and_unref (gpointer object)
 	g_object_unref (object);
 }
 
+static void
+service_call_free (ServiceCall *call)
+{
+	if (call->destroy)
+		(call->destroy) (call->data);
+	g_object_unref (call->invocation);
+	g_object_unref (call->service);
+	g_free (call->caller);
+	g_slice_free (ServiceCall, call);
+}
+
 static void
 free_client (gpointer data)
 {
 	ServiceClient *client = data;
+	ServiceCall *call;
 
 	if (!client)
 		return;
 
+	/*
+	 * The call at the head is running, and is freed when it completes.
+	 * The others were never started, and nobody is left to answer.
+	 */
+	while (client->calls.length > 1) {
+		call = g_queue_pop_tail (&client->calls);
+		g_dbus_method_invocation_return_error_literal (call->invocation, G_DBUS_ERROR,
+							       G_DBUS_ERROR_FAILED,
+							       "The caller went away");
+		service_call_free (call);
+	}
+	g_queue_clear (&client->calls);
+
 	/* Info about our client */
 	g_free (client->caller_peer);
 
@@ -259,6 +296,7 @@ free_client (gpointer data)
 #endif
 		g_object_unref (client->pkcs11_session);
 	}
+	g_clear_object (&client->worker_session);
 
 	/* The sessions and prompts the client has open */
 	g_hash_table_destroy (client->dispatch);
@@ -280,6 +318,7 @@ initialize_service_client (GkdSecretService *self,
 	client->caller_peer = g_strdup (caller);
 	client->app.applicationData = client;
 	client->dispatch = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, dispose_and_unref);
+	g_queue_init (&client->calls);
 
 	g_hash_table_replace (self->clients, client->caller_peer, client);
 
@@ -299,6 +338,79 @@ gkd_secret_service_ensure_client (GkdSecretService *self,
 	}
 }
 
+/*
+ * Calls that do slow PKCS#11 work, such as writing out a keyring, run that
+ * work in a worker thread. Each caller has at most one call running at a
+ * time, and the rest wait their turn, so that a caller sees its calls
+ * complete in the order they were made, while other callers carry on.
+ * Calls which change state on the main loop wait their turn in the same
+ * way, so that they don't overtake a call running in a worker.
+ */
+
+static void service_call_start (ServiceCall *call);
+
+static void
+service_call_thread (GTask *task,
+		     gpointer source_object,
+		     gpointer task_data,
+		     GCancellable *cancellable)
+{
+	ServiceCall *call = task_data;
+	GError *error = NULL;
+
+	if ((call->func) (call->data, &error))
+		g_task_return_boolean (task, TRUE);
+	else
+		g_task_return_error (task, error);
+}
+
+static void
+on_service_call_complete (GObject *source,
+			  GAsyncResult *result,
+			  gpointer user_data)
+{
+	GkdSecretService *self = GKD_SECRET_SERVICE (source);
+	ServiceCall *call = user_data;
+	ServiceClient *client;
+	GError *error = NULL;
+
+	g_task_propagate_boolean (G_TASK (result), &error);
+	client = g_hash_table_lookup (self->clients, call->caller);
+
+	/* Nothing has been done on the main loop yet, and nobody to do it for */
+	if (call->func == NULL && client == NULL)
+		g_dbus_method_invocation_return_error_literal (call->invocation, G_DBUS_ERROR,
+							       G_DBUS_ERROR_FAILED,
+							       "The caller went away");
+	else
+		(call->done) (self, call->invocation, call->data, error);
+	g_clear_error (&error);
+
+	/* The next call from the same caller can go ahead */
+	client = g_hash_table_lookup (self->clients, call->caller);
+	if (client != NULL && g_queue_peek_head (&client->calls) == call) {
+		g_queue_pop_head (&client->calls);
+		if (!g_queue_is_empty (&client->calls))
+			service_call_start (g_queue_peek_head (&client->calls));
+	}
+
+	service_call_free (call);
+}
+
+static void
+service_call_start (ServiceCall *call)
+{
+	GTask *task;
+
+	task = g_task_new (call->service, NULL, on_service_call_complete, call);
+	g_task_set_task_data (task, call, NULL);
+	if (call->func)
+		g_task_run_in_thread (task, service_call_thread);
+	else
+		g_task_return_boolean (task, TRUE);
+	g_object_unref (task);
+}
+
 typedef struct {
 	GkdSecretService *service;
 	GDBusMessage *message;
@@ -406,25 +518,33 @@ service_message_filter (GDBusConnection *connection,
  * DBUS
  */
 
-static gboolean
-service_method_open_session (GkdExportedService *skeleton,
-			     GDBusMethodInvocation *invocation,
-			     gchar *algorithm,
-			     GVariant *input,
-			     GkdSecretService *self)
+/*
+ * The methods below change what the caller has open, or the state of
+ * the collections, so they're run in turn with the caller's other calls.
+ * See gkd_secret_service_queue_call(). Their arguments are read from the
+ * invocation once they do run.
+ */
+
+static void
+open_session_done (GkdSecretService *self,
+		   GDBusMethodInvocation *invocation,
+		   gpointer data,
+		   GError *unused)
 {
 	GkdSecretSession *session;
 	GVariant *output = NULL;
 	gchar *result = NULL;
 	GError *error = NULL;
 	const gchar *caller;
+	const gchar *algorithm;
 	GVariant *input_payload;
 
 	caller = g_dbus_method_invocation_get_sender (invocation);
+	g_variant_get (g_dbus_method_invocation_get_parameters (invocation),
+		       "(&sv)", &algorithm, &input_payload);
 
 	/* Now we can create a session with this information */
 	session = gkd_secret_session_new (self, caller);
-	input_payload = g_variant_get_variant (input);
 	gkd_secret_session_handle_open (session, algorithm, input_payload,
 					&output, &result,
 					&error);
@@ -435,11 +555,21 @@ service_method_open_session (GkdExportedService *skeleton,
 	} else {
 		gkd_secret_service_publish_dispatch (self, caller,
 						     GKD_SECRET_DISPATCH (session));
-		gkd_exported_service_complete_open_session (skeleton, invocation, output, result);
+		gkd_exported_service_complete_open_session (self->skeleton, invocation, output, result);
 		g_free (result);
 	}
 
 	g_object_unref (session);
+}
+
+static gboolean
+service_method_open_session (GkdExportedService *skeleton,
+			     GDBusMethodInvocation *invocation,
+			     gchar *algorithm,
+			     GVariant *input,
+			     GkdSecretService *self)
+{
+	gkd_secret_service_queue_call (self, invocation, NULL, open_session_done, NULL, NULL);
 	return TRUE;
 }
 
@@ -464,27 +594,34 @@ service_method_get_secrets (GkdExportedService *skeleton,
 						      (const gchar **) items, session);
 }
 
-static gboolean
-service_method_create_collection (GkdExportedService *skeleton,
-				  GDBusMethodInvocation *invocation,
-				  GVariant *properties,
-				  gchar *alias,
-				  GkdSecretService *self)
+static void
+create_collection_done (GkdSecretService *self,
+			GDBusMethodInvocation *invocation,
+			gpointer data,
+			GError *unused)
 {
 	GckBuilder builder = GCK_BUILDER_INIT;
 	GckAttributes *attrs;
 	GkdSecretCreate *create;
+	GVariant *properties;
+	const gchar *alias;
 	const gchar *path;
 	const char *caller;
 
+	g_variant_get (g_dbus_method_invocation_get_parameters (invocation),
+		       "(@a{sv}&s)", &properties, &alias);
+
 	if (!gkd_secret_property_parse_all (properties, SECRET_COLLECTION_INTERFACE, &builder)) {
 		gck_builder_clear (&builder);
+		g_variant_unref (properties);
 		g_dbus_method_invocation_return_error_literal (invocation, G_DBUS_ERROR,
 							       G_DBUS_ERROR_INVALID_ARGS,
 							       "Invalid properties");
-		return TRUE;
+		return;
 	}
 
+	g_variant_unref (properties);
+
 	/* Empty alias is no alias */
 	if (alias) {
 		if (!alias[0]) {
@@ -494,7 +631,7 @@ service_method_create_collection (GkdExportedService *skeleton,
 			g_dbus_method_invocation_return_error_literal (invocation, G_DBUS_ERROR,
 								       G_DBUS_ERROR_NOT_SUPPORTED,
 								       "Only the 'default' alias is supported");
-			return TRUE;
+			return;
 		}
 	}
 
@@ -510,15 +647,26 @@ service_method_create_collection (GkdExportedService *skeleton,
 	gkd_secret_service_publish_dispatch (self, caller,
 					     GKD_SECRET_DISPATCH (create));
 
-	gkd_exported_service_complete_create_collection (skeleton, invocation,
+	gkd_exported_service_complete_create_collection (self->skeleton, invocation,
 							 "/", path);
-	return TRUE;
 }
 
 static gboolean
-service_method_lock_service (GkdExportedService *skeleton,
-			     GDBusMethodInvocation *invocation,
-			     GkdSecretService *self)
+service_method_create_collection (GkdExportedService *skeleton,
+				  GDBusMethodInvocation *invocation,
+				  GVariant *properties,
+				  gchar *alias,
+				  GkdSecretService *self)
+{
+	gkd_secret_service_queue_call (self, invocation, NULL, create_collection_done, NULL, NULL);
+	return TRUE;
+}
+
+static void
+lock_service_done (GkdSecretService *self,
+		   GDBusMethodInvocation *invocation,
+		   gpointer data,
+		   GError *unused)
 {
 	GError *error = NULL;
 	GckSession *session;
@@ -526,32 +674,49 @@ service_method_lock_service (GkdExportedService *skeleton,
 
 	caller = g_dbus_method_invocation_get_sender (invocation);
 	session = gkd_secret_service_get_pkcs11_session (self, caller);
-	g_return_val_if_fail (session != NULL, FALSE);
+	if (session == NULL) {
+		g_dbus_method_invocation_return_error_literal (invocation, G_DBUS_ERROR,
+							       G_DBUS_ERROR_FAILED,
+							       "Couldn't lock service");
+		return;
+	}
 
 	if (!gkd_secret_lock_all (session, &error))
 		g_dbus_method_invocation_take_error (invocation, error);
 	else
-		gkd_exported_service_complete_lock_service (skeleton, invocation);
+		gkd_exported_service_complete_lock_service (self->skeleton, invocation);
+}
 
+static gboolean
+service_method_lock_service (GkdExportedService *skeleton,
+			     GDBusMethodInvocation *invocation,
+			     GkdSecretService *self)
+{
+	gkd_secret_service_queue_call (self, invocation, NULL, lock_service_done, NULL, NULL);
 	return TRUE;
 }
 
-static gboolean
-service_method_unlock (GkdExportedService *skeleton,
-		       GDBusMethodInvocation *invocation,
-		       gchar **objpaths,
-		       GkdSecretService *self)
+static void
+unlock_done (GkdSecretService *self,
+	     GDBusMethodInvocation *invocation,
+	     gpointer data,
+	     GError *unused)
 {
 	GkdSecretUnlock *unlock;
 	const char *caller;
 	const gchar *path;
 	int i, n_unlocked;
+	const gchar **objpaths;
 	gchar **unlocked;
 
 	caller = g_dbus_method_invocation_get_sender (invocation);
+	g_variant_get (g_dbus_method_invocation_get_parameters (invocation),
+		       "(^a&o)", &objpaths);
+
 	unlock = gkd_secret_unlock_new (self, caller, NULL);
 	for (i = 0; objpaths[i] != NULL; ++i)
 		gkd_secret_unlock_queue (unlock, objpaths[i]);
+	g_free (objpaths);
 
 	/* So do we need to prompt? */
 	if (gkd_secret_unlock_have_queued (unlock)) {
@@ -565,34 +730,46 @@ service_method_unlock (GkdExportedService *skeleton,
 	}
 
 	unlocked = gkd_secret_unlock_get_results (unlock, &n_unlocked);
-	gkd_exported_service_complete_unlock (skeleton, invocation,
+	gkd_exported_service_complete_unlock (self->skeleton, invocation,
 					      (const gchar **) unlocked, path);
 
 	gkd_secret_unlock_reset_results (unlock);
 	g_object_unref (unlock);
+}
 
+static gboolean
+service_method_unlock (GkdExportedService *skeleton,
+		       GDBusMethodInvocation *invocation,
+		       gchar **objpaths,
+		       GkdSecretService *self)
+{
+	gkd_secret_service_queue_call (self, invocation, NULL, unlock_done, NULL, NULL);
 	return TRUE;
 }
 
-static gboolean
-service_method_lock (GkdExportedService *skeleton,
-		     GDBusMethodInvocation *invocation,
-		     gchar **objpaths,
-		     GkdSecretService *self)
+static void
+lock_done (GkdSecretService *self,
+	   GDBusMethodInvocation *invocation,
+	   gpointer data,
+	   GError *unused)
 {
 	const char *caller;
 	GckObject *collection;
 	int i;
+	const gchar **objpaths;
 	char **locked;
 	GPtrArray *array;
 
 	caller = g_dbus_method_invocation_get_sender (invocation);
+	g_variant_get (g_dbus_method_invocation_get_parameters (invocation),
+		       "(^a&o)", &objpaths);
+
 	array = g_ptr_array_new ();
 	for (i = 0; objpaths[i] != NULL; ++i) {
 		collection = gkd_secret_objects_lookup_collection (self->objects, caller, objpaths[i]);
 		if (collection != NULL) {
 			if (gkd_secret_lock (collection, NULL)) {
-				g_ptr_array_add (array, objpaths[i]);
+				g_ptr_array_add (array, (gpointer) objpaths[i]);
 				gkd_secret_objects_emit_collection_locked (self->objects,
 									   collection);
 			}
@@ -603,9 +780,20 @@ service_method_lock (GkdExportedService *skeleton,
 	g_ptr_array_add (array, NULL);
 
 	locked = (gchar **) g_ptr_array_free (array, FALSE);
-	gkd_exported_service_complete_lock (skeleton, invocation,
+	gkd_exported_service_complete_lock (self->skeleton, invocation,
 					    (const gchar **) locked, "/");
 
+	g_free (locked);
+	g_free (objpaths);
+}
+
+static gboolean
+service_method_lock (GkdExportedService *skeleton,
+		     GDBusMethodInvocation *invocation,
+		     gchar **objpaths,
+		     GkdSecretService *self)
+{
+	gkd_secret_service_queue_call (self, invocation, NULL, lock_done, NULL, NULL);
 	return TRUE;
 }
 
@@ -696,21 +884,25 @@ service_method_read_alias (GkdExportedService *skeleton,
 	return TRUE;
 }
 
-static gboolean
-service_method_set_alias (GkdExportedService *skeleton,
-			  GDBusMethodInvocation *invocation,
-			  gchar *alias,
-			  gchar *path,
-			  GkdSecretService *self)
+static void
+set_alias_done (GkdSecretService *self,
+		GDBusMethodInvocation *invocation,
+		gpointer data,
+		GError *unused)
 {
 	GckObject *collection;
+	const gchar *alias;
+	const gchar *path;
 	gchar *identifier;
 
+	g_variant_get (g_dbus_method_invocation_get_parameters (invocation),
+		       "(&s&o)", &alias, &path);
+
 	if (!g_str_equal (alias, "default")) {
 		g_dbus_method_invocation_return_error_literal (invocation, G_DBUS_ERROR,
 							       G_DBUS_ERROR_NOT_SUPPORTED,
 							       "Only the 'default' alias is supported");
-		return TRUE;
+		return;
 	}
 
 	/* No default collection */
@@ -724,7 +916,7 @@ service_method_set_alias (GkdExportedService *skeleton,
 			g_dbus_method_invocation_return_error_literal (invocation, G_DBUS_ERROR,
 								       G_DBUS_ERROR_INVALID_ARGS,
 								       "Invalid collection object path");
-			return TRUE;
+			return;
 		}
 
 		collection = gkd_secret_objects_lookup_collection (self->objects,
@@ -735,7 +927,7 @@ service_method_set_alias (GkdExportedService *skeleton,
 			g_dbus_method_invocation_return_error_literal (invocation, GKD_SECRET_ERROR,
 								       GKD_SECRET_ERROR_NO_SUCH_OBJECT,
 								       "The collection does not exist");
-			return TRUE;
+			return;
 		}
 
 		g_object_unref (collection);
@@ -744,11 +936,81 @@ service_method_set_alias (GkdExportedService *skeleton,
 	gkd_secret_service_set_alias (self, alias, identifier);
 	g_free (identifier);
 
-	gkd_exported_service_complete_set_alias (skeleton, invocation);
+	gkd_exported_service_complete_set_alias (self->skeleton, invocation);
+}
 
+static gboolean
+service_method_set_alias (GkdExportedService *skeleton,
+			  GDBusMethodInvocation *invocation,
+			  gchar *alias,
+			  gchar *path,
+			  GkdSecretService *self)
+{
+	gkd_secret_service_queue_call (self, invocation, NULL, set_alias_done, NULL, NULL);
 	return TRUE;
 }
 
+/*
+ * The internal master password methods derive keys, and write out the
+ * keyring, so that work runs in a worker. See gkd_secret_service_queue_call().
+ */
+
+typedef struct {
+	GckSession *session;
+	GckObject *collection;
+	GckAttributes *attrs;
+	GkdSecretSecret *original;
+	GkdSecretSecret *master;
+	gchar *path;
+} MasterCall;
+
+static void
+master_call_free (gpointer data)
+{
+	MasterCall *call = data;
+
+	g_clear_object (&call->session);
+	g_clear_object (&call->collection);
+	if (call->attrs)
+		gck_attributes_unref (call->attrs);
+	gkd_secret_secret_free (call->original);
+	gkd_secret_secret_free (call->master);
+	g_free (call->path);
+	g_slice_free (MasterCall, call);
+}
+
+static gboolean
+create_with_master_password_thread (gpointer data,
+				    GError **error)
+{
+	MasterCall *call = data;
+
+	call->path = gkd_secret_create_with_secret (call->session, call->attrs,
+						    call->master, error);
+	return call->path != NULL;
+}
+
+static void
+create_with_master_password_done (GkdSecretService *self,
+				  GDBusMethodInvocation *invocation,
+				  gpointer data,
+				  GError *error)
+{
+	MasterCall *call = data;
+
+	if (error != NULL) {
+		gkd_secret_propagate_error (invocation, "Couldn't create collection",
+					    g_error_copy (error));
+		return;
+	}
+
+	/* Notify the callers that a collection was created */
+	gkd_secret_service_emit_collection_created (self, call->path);
+
+	gkd_exported_internal_complete_create_with_master_password
+		(self->internal_skeleton, invocation, call->path);
+}
+
 static gboolean
 service_method_create_with_master_password (GkdExportedInternal *skeleton,
 					    GDBusMethodInvocation *invocation,
@@ -758,10 +1020,10 @@ service_method_create_with_master_password (GkdExportedInternal *skeleton,
 {
 	GckBuilder builder = GCK_BUILDER_INIT;
 	GkdSecretSecret *secret = NULL;
-	GckAttributes *attrs = NULL;
+	GckSession *session;
 	GError *error = NULL;
-	gchar *path;
 	const gchar *caller;
+	MasterCall *call;
 
 	if (!gkd_secret_property_parse_all (attributes, SECRET_COLLECTION_INTERFACE, &builder)) {
 		gck_builder_clear (&builder);
@@ -781,28 +1043,56 @@ service_method_create_with_master_password (GkdExportedInternal *skeleton,
 		return TRUE;
 	}
 
-	gck_builder_add_boolean (&builder, CKA_TOKEN, TRUE);
-	attrs = gck_attributes_ref_sink (gck_builder_end (&builder));
-	path = gkd_secret_create_with_secret (attrs, secret, &error);
-	gck_attributes_unref (attrs);
-	gkd_secret_secret_free (secret);
-
-	if (path == NULL) {
-		gkd_secret_propagate_error (invocation, "Couldn't create collection", error);
+	/* The worker uses a session of its own, where the key is */
+	session = gkd_secret_service_get_worker_session (self, caller);
+	if (session == NULL) {
+		gck_builder_clear (&builder);
+		gkd_secret_secret_free (secret);
+		g_dbus_method_invocation_return_error_literal (invocation, G_DBUS_ERROR,
+							       G_DBUS_ERROR_FAILED,
+							       "Couldn't create collection");
 		return TRUE;
 	}
 
-	/* Notify the callers that a collection was created */
-        g_message ("emit collection_Created");
-	gkd_secret_service_emit_collection_created (self, path);
+	gck_builder_add_boolean (&builder, CKA_TOKEN, TRUE);
 
-	gkd_exported_internal_complete_create_with_master_password
-		(skeleton, invocation, path);
-	g_free (path);
+	call = g_slice_new0 (MasterCall);
+	call->session = g_object_ref (session);
+	call->attrs = gck_attributes_ref_sink (gck_builder_end (&builder));
+	call->master = secret;
+
+	gkd_secret_service_queue_call (self, invocation,
+				       create_with_master_password_thread,
+				       create_with_master_password_done,
+				       call, master_call_free);
 
 	return TRUE;
 }
 
+static gboolean
+change_with_master_password_thread (gpointer data,
+				    GError **error)
+{
+	MasterCall *call = data;
+
+	return gkd_secret_change_with_secrets (call->collection, call->session,
+					       call->original, call->master, error);
+}
+
+static void
+change_with_master_password_done (GkdSecretService *self,
+				  GDBusMethodInvocation *invocation,
+				  gpointer data,
+				  GError *error)
+{
+	if (error == NULL)
+		gkd_exported_internal_complete_change_with_master_password
+			(self->internal_skeleton, invocation);
+	else
+		gkd_secret_propagate_error (invocation, "Couldn't change collection password",
+					    g_error_copy (error));
+}
+
 static gboolean
 service_method_change_with_master_password (GkdExportedInternal *skeleton,
 					    GDBusMethodInvocation *invocation,
@@ -815,6 +1105,7 @@ service_method_change_with_master_password (GkdExportedInternal *skeleton,
 	GckObject *collection;
 	GError *error = NULL;
 	const gchar *sender;
+	MasterCall *call;
 
 	sender = g_dbus_method_invocation_get_sender (invocation);
 
@@ -829,6 +1120,7 @@ service_method_change_with_master_password (GkdExportedInternal *skeleton,
 	master = gkd_secret_secret_parse (self, sender,
 					  master_variant, &error);
 	if (master == NULL) {
+		gkd_secret_secret_free (original);
 		g_dbus_method_invocation_take_error (invocation, error);
 		return TRUE;
 	}
@@ -839,29 +1131,66 @@ service_method_change_with_master_password (GkdExportedInternal *skeleton,
 
 	/* No such collection */
 	if (collection == NULL) {
-	  g_dbus_method_invocation_return_error_literal (invocation, GKD_SECRET_ERROR,
-							 GKD_SECRET_ERROR_NO_SUCH_OBJECT,
-							 "The collection does not exist");
+		g_dbus_method_invocation_return_error_literal (invocation, GKD_SECRET_ERROR,
+							       GKD_SECRET_ERROR_NO_SUCH_OBJECT,
+							       "The collection does not exist");
+		gkd_secret_secret_free (original);
+		gkd_secret_secret_free (master);
+		return TRUE;
 	}
 
-	/* Success */
-	else if (gkd_secret_change_with_secrets (collection, NULL, original, master, &error))
-		gkd_exported_internal_complete_change_with_master_password
-			(skeleton, invocation);
+	/* The worker uses a session of its own, where the keys are */
+	call = g_slice_new0 (MasterCall);
+	call->collection = gkd_secret_service_object_for_worker (self, sender, collection);
+	call->original = original;
+	call->master = master;
+	g_object_unref (collection);
 
-	/* Failure */
-	else
-		gkd_secret_propagate_error (invocation, "Couldn't change collection password", error);
+	if (call->collection == NULL) {
+		g_dbus_method_invocation_return_error_literal (invocation, G_DBUS_ERROR,
+							       G_DBUS_ERROR_FAILED,
+							       "Couldn't change collection password");
+		master_call_free (call);
+		return TRUE;
+	}
 
-	gkd_secret_secret_free (original);
-	gkd_secret_secret_free (master);
+	call->session = gck_object_get_session (call->collection);
 
-	if (collection)
-		g_object_unref (collection);
+	gkd_secret_service_queue_call (self, invocation,
+				       change_with_master_password_thread,
+				       change_with_master_password_done,
+				       call, master_call_free);
 
 	return TRUE;
 }
 
+static gboolean
+unlock_with_master_password_thread (gpointer data,
+				    GError **error)
+{
+	MasterCall *call = data;
+
+	return gkd_secret_unlock_with_secret (call->collection, call->master, error);
+}
+
+static void
+unlock_with_master_password_done (GkdSecretService *self,
+				  GDBusMethodInvocation *invocation,
+				  gpointer data,
+				  GError *error)
+{
+	MasterCall *call = data;
+
+	if (error == NULL) {
+		gkd_secret_objects_emit_collection_locked (self->objects, call->collection);
+		gkd_exported_internal_complete_unlock_with_master_password
+			(self->internal_skeleton, invocation);
+	} else {
+		gkd_secret_propagate_error (invocation, "Couldn't unlock collection",
+					    g_error_copy (error));
+	}
+}
+
 static gboolean
 service_method_unlock_with_master_password (GkdExportedInternal *skeleton,
 					    GDBusMethodInvocation *invocation,
@@ -873,6 +1202,7 @@ service_method_unlock_with_master_password (GkdExportedInternal *skeleton,
 	GError *error = NULL;
 	GckObject *collection;
 	const gchar *sender;
+	MasterCall *call;
 
 	sender = g_dbus_method_invocation_get_sender (invocation);
 
@@ -891,22 +1221,28 @@ service_method_unlock_with_master_password (GkdExportedInternal *skeleton,
 		g_dbus_method_invocation_return_error_literal (invocation, GKD_SECRET_ERROR,
 							       GKD_SECRET_ERROR_NO_SUCH_OBJECT,
 							       "The collection does not exist");
+		gkd_secret_secret_free (master);
+		return TRUE;
+	}
 
-	/* Success */
-	} else if (gkd_secret_unlock_with_secret (collection, master, &error)) {
-		gkd_secret_objects_emit_collection_locked (self->objects, collection);
-		gkd_exported_internal_complete_unlock_with_master_password
-			(skeleton, invocation);
+	/* The worker uses a session of its own, where the key is */
+	call = g_slice_new0 (MasterCall);
+	call->collection = gkd_secret_service_object_for_worker (self, sender, collection);
+	call->master = master;
+	g_object_unref (collection);
 
-	/* Failure */
-	} else {
-		gkd_secret_propagate_error (invocation, "Couldn't unlock collection", error);
+	if (call->collection == NULL) {
+		g_dbus_method_invocation_return_error_literal (invocation, G_DBUS_ERROR,
+							       G_DBUS_ERROR_FAILED,
+							       "Couldn't unlock collection");
+		master_call_free (call);
+		return TRUE;
 	}
 
-	gkd_secret_secret_free (master);
-
-	if (collection)
-		g_object_unref (collection);
+	gkd_secret_service_queue_call (self, invocation,
+				       unlock_with_master_password_thread,
+				       unlock_with_master_password_done,
+				       call, master_call_free);
 
 	return TRUE;
 }
@@ -1227,12 +1563,40 @@ log_into_pkcs11_session (GckSession *session, GError **error)
 	return TRUE;
 }
 
+static GckSession *
+open_client_session (GkdSecretService *self,
+		     ServiceClient *client)
+{
+	GckSession *session;
+	GError *error = NULL;
+	GckSlot *slot;
+
+	slot = gkd_secret_service_get_pkcs11_slot (self);
+	session = gck_slot_open_session_full (slot, GCK_SESSION_READ_WRITE,
+					      CKF_G_APPLICATION_SESSION, &client->app,
+					      NULL, NULL, &error);
+	if (!session) {
+		g_warning ("couldn't open pkcs11 session for secret service: %s",
+			   egg_error_message (error));
+		g_clear_error (&error);
+		return NULL;
+	}
+
+	if (!log_into_pkcs11_session (session, &error)) {
+		g_warning ("couldn't log in to pkcs11 session for secret service: %s",
+			   egg_error_message (error));
+		g_clear_error (&error);
+		g_object_unref (session);
+		return NULL;
+	}
+
+	return session;
+}
+
 GckSession*
 gkd_secret_service_get_pkcs11_session (GkdSecretService *self, const gchar *caller)
 {
 	ServiceClient *client;
-	GError *error = NULL;
-	GckSlot *slot;
 
 	g_return_val_if_fail (GKD_SECRET_IS_SERVICE (self), NULL);
 	g_return_val_if_fail (caller, NULL);
@@ -1241,31 +1605,52 @@ gkd_secret_service_get_pkcs11_session (GkdSecretService *self, const gchar *call
 	g_return_val_if_fail (client, NULL);
 
 	/* Open a new session if necessary */
-	if (!client->pkcs11_session) {
-		slot = gkd_secret_service_get_pkcs11_slot (self);
-		client->pkcs11_session = gck_slot_open_session_full (slot, GCK_SESSION_READ_WRITE,
-								     CKF_G_APPLICATION_SESSION, &client->app,
-								     NULL, NULL, &error);
-		if (!client->pkcs11_session) {
-			g_warning ("couldn't open pkcs11 session for secret service: %s",
-				   egg_error_message (error));
-			g_clear_error (&error);
-			return NULL;
-		}
-
-		if (!log_into_pkcs11_session (client->pkcs11_session, &error)) {
-			g_warning ("couldn't log in to pkcs11 session for secret service: %s",
-				   egg_error_message (error));
-			g_clear_error (&error);
-			g_object_unref (client->pkcs11_session);
-			client->pkcs11_session = NULL;
-			return NULL;
-		}
-	}
+	if (!client->pkcs11_session)
+		client->pkcs11_session = open_client_session (self, client);
 
 	return client->pkcs11_session;
 }
 
+/*
+ * The objects are looked up on the main loop with finds in the caller's
+ * session, which would clash with a find in a worker on the same session.
+ * So the calls run in workers use a second session of the caller's, and
+ * the session keys live there too, since the secrets are wrapped and
+ * unwrapped in the workers. Nothing does a find in this session.
+ */
+GckSession*
+gkd_secret_service_get_worker_session (GkdSecretService *self, const gchar *caller)
+{
+	ServiceClient *client;
+
+	g_return_val_if_fail (GKD_SECRET_IS_SERVICE (self), NULL);
+	g_return_val_if_fail (caller, NULL);
+
+	client = g_hash_table_lookup (self->clients, caller);
+	g_return_val_if_fail (client, NULL);
+
+	if (!client->worker_session)
+		client->worker_session = open_client_session (self, client);
+
+	return client->worker_session;
+}
+
+GckObject*
+gkd_secret_service_object_for_worker (GkdSecretService *self, const gchar *caller,
+				      GckObject *object)
+{
+	GckSession *session;
+
+	g_return_val_if_fail (GKD_SECRET_IS_SERVICE (self), NULL);
+	g_return_val_if_fail (GCK_IS_OBJECT (object), NULL);
+
+	session = gkd_secret_service_get_worker_session (self, caller);
+	if (session == NULL)
+		return NULL;
+
+	return gck_object_from_handle (session, gck_object_get_handle (object));
+}
+
 GckSession*
 gkd_secret_service_internal_pkcs11_session (GkdSecretService *self)
 {
@@ -1320,6 +1705,44 @@ gkd_secret_service_lookup_session (GkdSecretService *self, const gchar *path,
 	return GKD_SECRET_SESSION (object);
 }
 
+/*
+ * Runs func in a worker thread, and then done on the main loop, which is
+ * expected to answer the invocation. The data is freed with destroy on the
+ * main loop, so func should only make PKCS#11 calls with it, on objects
+ * from the caller's worker session, see gkd_secret_service_get_worker_session().
+ * Without a func, done is run once the caller's earlier calls have completed.
+ */
+void
+gkd_secret_service_queue_call (GkdSecretService *self,
+			       GDBusMethodInvocation *invocation,
+			       GkdSecretServiceCallFunc func,
+			       GkdSecretServiceDoneFunc done,
+			       gpointer data,
+			       GDestroyNotify destroy)
+{
+	ServiceClient *client;
+	ServiceCall *call;
+
+	g_return_if_fail (GKD_SECRET_IS_SERVICE (self));
+	g_return_if_fail (G_IS_DBUS_METHOD_INVOCATION (invocation));
+	g_return_if_fail (done != NULL);
+
+	call = g_slice_new0 (ServiceCall);
+	call->service = g_object_ref (self);
+	call->caller = g_strdup (g_dbus_method_invocation_get_sender (invocation));
+	call->invocation = g_object_ref (invocation);
+	call->func = func;
+	call->done = done;
+	call->data = data;
+	call->destroy = destroy;
+
+	gkd_secret_service_ensure_client (self, call->caller);
+	client = g_hash_table_lookup (self->clients, call->caller);
+	g_queue_push_tail (&client->calls, call);
+	if (client->calls.length == 1)
+		service_call_start (call);
+}
+
 void
 gkd_secret_service_close_session (GkdSecretService *self, GkdSecretSession *session)
 {
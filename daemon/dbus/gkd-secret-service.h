@@ -36,6 +36,14 @@
 
 typedef struct _GkdSecretServiceClass GkdSecretServiceClass;
 
+typedef gboolean        (* GkdSecretServiceCallFunc)               (gpointer call_data,
+                                                                    GError **error);
+
+typedef void            (* GkdSecretServiceDoneFunc)               (GkdSecretService *self,
+                                                                    GDBusMethodInvocation *invocation,
+                                                                    gpointer call_data,
+                                                                    GError *error);
+
 struct _GkdSecretServiceClass {
 	GObjectClass parent_class;
 };
@@ -49,6 +57,13 @@ GckSlot*                gkd_secret_service_get_pkcs11_slot         (GkdSecretSer
 GckSession*             gkd_secret_service_get_pkcs11_session      (GkdSecretService *self,
                                                                     const gchar *caller);
 
+GckSession*             gkd_secret_service_get_worker_session      (GkdSecretService *self,
+                                                                    const gchar *caller);
+
+GckObject*              gkd_secret_service_object_for_worker       (GkdSecretService *self,
+                                                                    const gchar *caller,
+                                                                    GckObject *object);
+
 GckSession*             gkd_secret_service_internal_pkcs11_session (GkdSecretService *self);
 
 GkdSecretObjects*       gkd_secret_service_get_objects             (GkdSecretService *self);
@@ -62,6 +77,13 @@ GkdSecretSession*       gkd_secret_service_lookup_session          (GkdSecretSer
 void                    gkd_secret_service_close_session           (GkdSecretService *self,
                                                                     GkdSecretSession *sess);
 
+void                    gkd_secret_service_queue_call              (GkdSecretService *self,
+                                                                    GDBusMethodInvocation *invocation,
+                                                                    GkdSecretServiceCallFunc func,
+                                                                    GkdSecretServiceDoneFunc done,
+                                                                    gpointer call_data,
+                                                                    GDestroyNotify destroy);
+
 const gchar*            gkd_secret_service_get_alias               (GkdSecretService *self,
                                                                     const gchar *alias);
 
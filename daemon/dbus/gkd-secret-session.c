@@ -30,6 +30,7 @@
 #include "gkd-secret-util.h"
 #include "gkd-secrets-generated.h"
 
+#include "egg/egg-buffer.h"
 #include "egg/egg-dh.h"
 #include "egg/egg-error.h"
 
@@ -79,6 +80,7 @@ take_session_key (GkdSecretSession *self, GckObject *key, CK_MECHANISM_TYPE mech
 	self->mech_type = mech;
 }
 
+/* A NULL group means X25519, which has no parameters to send */
 static gboolean
 aes_create_dh_keys (GckSession *session, const gchar *group,
 		    GckObject **pub_key, GckObject **priv_key)
@@ -88,19 +90,27 @@ aes_create_dh_keys (GckSession *session, const gchar *group,
 	gconstpointer prime, base;
 	gsize n_prime, n_base;
 	GError *error = NULL;
+	gulong mech_type;
 	gboolean ret;
 
-	if (!egg_dh_default_params_raw (group, &prime, &n_prime, &base, &n_base)) {
-		g_warning ("couldn't load dh parameter group: %s", group);
-		return FALSE;
+	if (group == NULL) {
+		mech_type = CKM_G_X25519_KEY_PAIR_GEN;
+
+	} else {
+		if (!egg_dh_default_params_raw (group, &prime, &n_prime, &base, &n_base)) {
+			g_warning ("couldn't load dh parameter group: %s", group);
+			return FALSE;
+		}
+
+		gck_builder_add_data (&builder, CKA_PRIME, prime, n_prime);
+		gck_builder_add_data (&builder, CKA_BASE, base, n_base);
+		mech_type = CKM_DH_PKCS_KEY_PAIR_GEN;
 	}
 
-	gck_builder_add_data (&builder, CKA_PRIME, prime, n_prime);
-	gck_builder_add_data (&builder, CKA_BASE, base, n_base);
 	attrs = gck_attributes_ref_sink (gck_builder_end (&builder));
 
 	/* Perform the DH key generation */
-	ret = gck_session_generate_key_pair (session, CKM_DH_PKCS_KEY_PAIR_GEN, attrs, attrs,
+	ret = gck_session_generate_key_pair (session, mech_type, attrs, attrs,
 					     pub_key, priv_key, NULL, &error);
 
 	gck_attributes_unref (attrs);
@@ -115,7 +125,7 @@ aes_create_dh_keys (GckSession *session, const gchar *group,
 }
 
 static gboolean
-aes_derive_key (GckSession *session, GckObject *priv_key,
+aes_derive_key (GckSession *session, GckObject *priv_key, gulong derive_type,
 		gconstpointer input, gsize n_input, GckObject **aes_key)
 {
 	GckBuilder builder = GCK_BUILDER_INIT;
@@ -125,10 +135,11 @@ aes_derive_key (GckSession *session, GckObject *priv_key,
 
 	/*
 	 * First we have to generate a secret key from the DH key. The
-	 * length of this key depends on the size of our DH prime
+	 * length of this key depends on the size of our DH prime, or is
+	 * 32 bytes for X25519.
 	 */
 
-	mech.type = CKM_DH_PKCS_DERIVE;
+	mech.type = derive_type;
 	mech.parameter = input;
 	mech.n_parameter = n_input;
 
@@ -168,6 +179,7 @@ aes_derive_key (GckSession *session, GckObject *priv_key,
 
 static gboolean
 aes_negotiate (GkdSecretSession *self,
+	       const gchar *group,
 	       GVariant *input_variant,
 	       GVariant **output_variant,
 	       gchar **result,
@@ -182,10 +194,10 @@ aes_negotiate (GkdSecretSession *self,
 	gsize n_input;
 	gboolean ret;
 
-	session = gkd_secret_service_get_pkcs11_session (self->service, self->caller);
+	session = gkd_secret_service_get_worker_session (self->service, self->caller);
 	g_return_val_if_fail (session, FALSE);
 
-	if (!aes_create_dh_keys (session, "ietf-ike-grp-modp-1024", &pub, &priv)) {
+	if (!aes_create_dh_keys (session, group, &pub, &priv)) {
 		g_set_error_literal (error_out, G_DBUS_ERROR,
 				     G_DBUS_ERROR_FAILED,
 				     "Failed to create necessary crypto keys.");
@@ -208,7 +220,9 @@ aes_negotiate (GkdSecretSession *self,
 	}
 
 	input = g_variant_get_fixed_array (input_variant, &n_input, sizeof (guchar));
-	ret = aes_derive_key (session, priv, input, n_input, &key);
+	ret = aes_derive_key (session, priv,
+			      group ? CKM_DH_PKCS_DERIVE : CKM_G_X25519_DERIVE,
+			      input, n_input, &key);
 
 	gck_object_destroy (priv, NULL, NULL);
 	g_object_unref (priv);
@@ -249,7 +263,7 @@ plain_negotiate (GkdSecretSession *self,
 	GckObject *key;
 	GckSession *session;
 
-	session = gkd_secret_service_get_pkcs11_session (self->service, self->caller);
+	session = gkd_secret_service_get_worker_session (self->service, self->caller);
 	g_return_val_if_fail (session, FALSE);
 
 	gck_builder_add_ulong (&builder, CKA_CLASS, CKO_SECRET_KEY);
@@ -282,6 +296,20 @@ plain_negotiate (GkdSecretSession *self,
 /* -----------------------------------------------------------------------------
  * DBUS
  */
+static void
+session_close_done (GkdSecretService *service,
+		    GDBusMethodInvocation *invocation,
+		    gpointer data,
+		    GError *error)
+{
+	GkdSecretSession *self = data;
+
+	/* Already closed if the caller went away meanwhile */
+	if (self->object_path != NULL)
+		gkd_secret_service_close_session (service, self);
+	g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
+}
+
 static gboolean
 session_method_close (GkdExportedSession *skeleton,
 		      GDBusMethodInvocation *invocation,
@@ -290,8 +318,9 @@ session_method_close (GkdExportedSession *skeleton,
 	if (!gkd_dbus_invocation_matches_caller (invocation, self->caller))
 		return FALSE;
 
-	gkd_secret_service_close_session (self->service, self);
-	gkd_exported_session_complete_close (skeleton, invocation);
+	/* After the caller's calls which may be using the session */
+	gkd_secret_service_queue_call (self->service, invocation, NULL, session_close_done,
+				       g_object_ref (self), g_object_unref);
 
 	return TRUE;
 }
@@ -550,7 +579,22 @@ gkd_secret_session_handle_open (GkdSecretSession *self,
 			return FALSE;
 		}
 
-		return aes_negotiate (self, input, output, result, error);
+		return aes_negotiate (self, "ietf-ike-grp-modp-1024", input, output, result, error);
+
+#ifdef EGG_DH_HAVE_X25519
+	/* The same, with much cheaper key agreement on Curve25519 */
+	} else if (g_str_equal (algorithm, "dh-x25519-sha256-aes128-cbc-pkcs7")) {
+		if (!g_variant_type_equal (variant_type, G_VARIANT_TYPE_BYTESTRING) ||
+		    g_variant_n_children (input) != EGG_DH_X25519_SIZE) {
+			g_set_error (error, G_DBUS_ERROR,
+				     G_DBUS_ERROR_INVALID_ARGS,
+				     "The session algorithm input argument (%s) was invalid",
+				     algorithm);
+			return FALSE;
+		}
+
+		return aes_negotiate (self, NULL, input, output, result, error);
+#endif
 
 	} else {
 		g_set_error (error, G_DBUS_ERROR,
@@ -570,15 +614,36 @@ gkd_secret_session_get_caller (GkdSecretSession *self)
 	return self->caller;
 }
 
+/* The session the key lives in, see gkd_secret_service_get_worker_session() */
 GckSession*
 gkd_secret_session_get_pkcs11_session (GkdSecretSession *self)
 {
 	g_return_val_if_fail (GKD_SECRET_IS_SESSION (self), NULL);
-	return gkd_secret_service_get_pkcs11_session (self->service, self->caller);
+	return gkd_secret_service_get_worker_session (self->service, self->caller);
+}
+
+/*
+ * The key is only valid while the session is open. Calls which use it in
+ * a worker take their own reference here, on the main loop, so that the
+ * session can be closed while they run.
+ */
+GckObject*
+gkd_secret_session_get_key (GkdSecretSession *self,
+			    CK_MECHANISM_TYPE *mech_type)
+{
+	g_return_val_if_fail (GKD_SECRET_IS_SESSION (self), NULL);
+	g_return_val_if_fail (mech_type != NULL, NULL);
+
+	if (self->key == NULL)
+		return NULL;
+
+	*mech_type = self->mech_type;
+	return g_object_ref (self->key);
 }
 
 GkdSecretSecret*
-gkd_secret_session_get_item_secret (GkdSecretSession *self, GckObject *item,
+gkd_secret_session_get_item_secret (GkdSecretSession *self, GckObject *key,
+				    CK_MECHANISM_TYPE mech_type, GckObject *item,
 				    GError **error_out)
 {
 	GckMechanism mech = { 0UL, NULL, 0 };
@@ -587,12 +652,12 @@ gkd_secret_session_get_item_secret (GkdSecretSession *self, GckObject *item,
 	gsize n_value, n_iv;
 	GError *error = NULL;
 
-	g_assert (GCK_IS_OBJECT (self->key));
+	g_assert (GCK_IS_OBJECT (key));
 
 	session = gck_object_get_session (item);
 	g_return_val_if_fail (session, NULL);
 
-	if (self->mech_type == CKM_AES_CBC_PAD) {
+	if (mech_type == CKM_AES_CBC_PAD) {
 		n_iv = 16;
 		iv = g_malloc (n_iv);
 		gcry_create_nonce (iv, n_iv);
@@ -601,12 +666,13 @@ gkd_secret_session_get_item_secret (GkdSecretSession *self, GckObject *item,
 		iv = NULL;
 	}
 
-	mech.type = self->mech_type;
+	mech.type = mech_type;
 	mech.parameter = iv;
 	mech.n_parameter = n_iv;
 
-	value = gck_session_wrap_key_full (session, self->key, &mech, item, &n_value,
+	value = gck_session_wrap_key_full (session, key, &mech, item, &n_value,
 					   NULL, &error);
+	g_object_unref (session);
 
 	if (error != NULL) {
 		if (g_error_matches (error, GCK_ERROR, CKR_USER_NOT_LOGGED_IN)) {
@@ -627,8 +693,113 @@ gkd_secret_session_get_item_secret (GkdSecretSession *self, GckObject *item,
 	return gkd_secret_secret_new_take_memory (self, iv, n_iv, value, n_value);
 }
 
+GPtrArray *
+gkd_secret_session_get_item_secrets (GkdSecretSession *self, GckObject *key,
+				     CK_MECHANISM_TYPE mech_type, GList *items,
+				     GError **error_out)
+{
+	GckMechanism mech = { CKM_G_WRAP_MULTIPLE, NULL, 0 };
+	CK_ULONG_PTR params;
+	GckSession *session;
+	GPtrArray *secrets;
+	GError *error = NULL;
+	EggBuffer buffer;
+	const guchar *iv, *value;
+	gsize n_iv, n_value;
+	gpointer data;
+	gsize n_data;
+	gsize offset;
+	guint32 rv;
+	guint n_items, i;
+	GList *l;
+
+	g_assert (GCK_IS_OBJECT (key));
+
+	secrets = g_ptr_array_new_with_free_func (gkd_secret_secret_free);
+	if (items == NULL)
+		return secrets;
+
+	/* The mechanism to wrap with, and then the items */
+	n_items = g_list_length (items);
+	params = g_new (CK_ULONG, n_items + 1);
+	params[0] = mech_type;
+	for (l = items, i = 1; l != NULL; l = g_list_next (l), i++)
+		params[i] = gck_object_get_handle (l->data);
+
+	mech.parameter = params;
+	mech.n_parameter = (n_items + 1) * sizeof (CK_ULONG);
+
+	/* All the secrets are wrapped in one go, each with its own IV */
+	session = gck_object_get_session (items->data);
+	g_return_val_if_fail (session, NULL);
+
+	data = gck_session_wrap_key_full (session, key, &mech, items->data, &n_data,
+					  NULL, &error);
+
+	/* An item was unlocked after the length was worked out */
+	if (g_error_matches (error, GCK_ERROR, CKR_BUFFER_TOO_SMALL)) {
+		g_clear_error (&error);
+		data = gck_session_wrap_key_full (session, key, &mech, items->data, &n_data,
+						  NULL, &error);
+	}
+
+	g_object_unref (session);
+	g_free (params);
+
+	if (error != NULL) {
+		g_message ("couldn't wrap item secrets: %s", egg_error_message (error));
+		g_set_error_literal (error_out, G_DBUS_ERROR,
+				     G_DBUS_ERROR_FAILED,
+				     "Couldn't get item secret");
+		g_clear_error (&error);
+		g_ptr_array_unref (secrets);
+		return NULL;
+	}
+
+	egg_buffer_init_static (&buffer, data, n_data);
+	offset = 0;
+
+	for (i = 0; i < n_items; i++) {
+		if (!egg_buffer_get_uint32 (&buffer, offset, &offset, &rv))
+			break;
+
+		/* Locked items are left out */
+		if (rv == CKR_USER_NOT_LOGGED_IN) {
+			g_ptr_array_add (secrets, NULL);
+			continue;
+
+		} else if (rv != CKR_OK) {
+			g_message ("couldn't wrap item secret: %s", gck_message_from_rv (rv));
+			break;
+		}
+
+		if (!egg_buffer_get_byte_array (&buffer, offset, &offset, &iv, &n_iv) ||
+		    !egg_buffer_get_byte_array (&buffer, offset, &offset, &value, &n_value))
+			break;
+
+		g_ptr_array_add (secrets, gkd_secret_secret_new_take_memory (self,
+									      g_memdup (iv, n_iv), n_iv,
+									      g_memdup (value, n_value), n_value));
+	}
+
+	/* When wrapped with CKM_G_NULL these are the actual secrets */
+	memset (data, 0, n_data);
+	g_free (data);
+
+	if (secrets->len != n_items) {
+		g_set_error_literal (error_out, G_DBUS_ERROR,
+				     G_DBUS_ERROR_FAILED,
+				     "Couldn't get item secret");
+		g_ptr_array_unref (secrets);
+		return NULL;
+	}
+
+	return secrets;
+}
+
 gboolean
-gkd_secret_session_set_item_secret (GkdSecretSession *self, GckObject *item,
+gkd_secret_session_set_item_secret (GkdSecretSession *self, GckObject *key,
+				    CK_MECHANISM_TYPE mech_type, GckObject *item,
 				    GkdSecretSecret *secret, GError **error_out)
 {
 	GckBuilder builder = GCK_BUILDER_INIT;
@@ -642,7 +813,7 @@ gkd_secret_session_set_item_secret (GkdSecretSession *self, GckObject *item,
 	g_return_val_if_fail (GCK_IS_OBJECT (item), FALSE);
 	g_return_val_if_fail (secret, FALSE);
 
-	g_assert (GCK_IS_OBJECT (self->key));
+	g_assert (GCK_IS_OBJECT (key));
 
 	/*
 	 * By getting these attributes, and then using them in the unwrap,
@@ -661,15 +832,17 @@ gkd_secret_session_set_item_secret (GkdSecretSession *self, GckObject *item,
 	gck_attributes_unref (attrs);
 	gck_builder_add_ulong (&builder, CKA_CLASS, CKO_SECRET_KEY);
 
-	session = gkd_secret_service_get_pkcs11_session (self->service, self->caller);
+	/* The key's session, which the item was rebound to */
+	session = gck_object_get_session (item);
 	g_return_val_if_fail (session, FALSE);
 
-	mech.type = self->mech_type;
+	mech.type = mech_type;
 	mech.parameter = secret->parameter;
 	mech.n_parameter = secret->n_parameter;
 
-	object = gck_session_unwrap_key_full (session, self->key, &mech, secret->value,
+	object = gck_session_unwrap_key_full (session, key, &mech, secret->value,
 					      secret->n_value, gck_builder_end (&builder), NULL, &error);
+	g_object_unref (session);
 
 	if (object == NULL) {
 		if (g_error_matches (error, GCK_ERROR, CKR_USER_NOT_LOGGED_IN)) {
@@ -721,7 +894,7 @@ gkd_secret_session_create_credential (GkdSecretSession *self,
 	g_assert (attrs != NULL);
 
 	if (session == NULL)
-		session = gkd_secret_service_get_pkcs11_session (self->service, self->caller);
+		session = gkd_secret_service_get_worker_session (self->service, self->caller);
 	g_return_val_if_fail (session, NULL);
 
 	if (attrs == NULL) {
@@ -55,11 +55,24 @@ const gchar*        gkd_secret_session_get_caller              (GkdSecretSession
 
 GckSession*         gkd_secret_session_get_pkcs11_session      (GkdSecretSession *self);
 
+GckObject*          gkd_secret_session_get_key                 (GkdSecretSession *self,
+                                                                CK_MECHANISM_TYPE *mech_type);
+
 GkdSecretSecret*    gkd_secret_session_get_item_secret         (GkdSecretSession *self,
+                                                                GckObject *key,
+                                                                CK_MECHANISM_TYPE mech_type,
                                                                 GckObject *item,
                                                                 GError **error);
 
+GPtrArray*          gkd_secret_session_get_item_secrets        (GkdSecretSession *self,
+                                                                GckObject *key,
+                                                                CK_MECHANISM_TYPE mech_type,
+                                                                GList *items,
+                                                                GError **error);
+
 gboolean            gkd_secret_session_set_item_secret         (GkdSecretSession *self,
+                                                                GckObject *key,
+                                                                CK_MECHANISM_TYPE mech_type,
                                                                 GckObject *item,
                                                                 GkdSecretSecret *secret,
                                                                 GError **error);
@@ -22,6 +22,7 @@
 #define __GKD_SECRET_TYPES_H__
 
 #define INTERNAL_SERVICE_INTERFACE     "org.gnome.keyring.InternalUnsupportedGuiltRiddenInterface"
+#define KEYRING_ITEM_INTERFACE         "org.gnome.keyring.Item"
 
 #define SECRET_COLLECTION_INTERFACE    "org.freedesktop.Secret.Collection"
 #define SECRET_ITEM_INTERFACE          "org.freedesktop.Secret.Item"
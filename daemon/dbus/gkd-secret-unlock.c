@@ -37,6 +37,8 @@
 
 #include "daemon/login/gkd-login.h"
 
+#include "pkcs11/wrap-layer/gkm-wrap-layer.h"
+
 #include "pkcs11/pkcs11i.h"
 
 #include <glib/gi18n.h>
@@ -50,6 +52,11 @@
  * multiple times for the same thing. There are two queues:
  *  - self->queued: A queue of object paths per unlock requests.
  *  - unlock_prompt_queue: A queue of unlock requests ready to prompt.
+ *
+ * Before prompting, the collections whose passwords are stored in the login
+ * keyring are all unlocked at once, each in a worker. The store derives each
+ * keyring's key without its module lock, so these overlap. Only the ones
+ * that are still locked afterwards are prompted for.
  */
 
 enum {
@@ -68,6 +75,7 @@ struct _GkdSecretUnlock {
 	gchar *window_id;
 	GQueue *queued;
 	gchar *current;
+	guint stored_pending;
 	GArray *results;
 	gboolean prompted;
 	gboolean completed;
@@ -301,6 +309,172 @@ perform_next_unlock (GkdSecretUnlock *self)
 	}
 }
 
+typedef struct {
+	GckObject *collection;
+	gchar *path;
+	gchar *password;
+} StoredUnlock;
+
+static void
+stored_unlock_free (gpointer data)
+{
+	StoredUnlock *unlock = data;
+	g_clear_object (&unlock->collection);
+	g_free (unlock->path);
+	egg_secure_strfree (unlock->password);
+	g_slice_free (StoredUnlock, unlock);
+}
+
+static gchar *
+lookup_stored_password (GckObject *collection)
+{
+	GckAttributes *attrs;
+	GError *error = NULL;
+	gboolean is_login;
+	gchar *identifier;
+	gchar *location;
+	gchar *password;
+
+	attrs = gck_object_get (collection, NULL, &error,
+				CKA_ID, CKA_G_LOGIN_COLLECTION, GCK_INVALID);
+	if (attrs == NULL) {
+		if (!g_error_matches (error, GCK_ERROR, CKR_OBJECT_HANDLE_INVALID))
+			g_message ("couldn't lookup collection identifier: %s",
+				   egg_error_message (error));
+		g_clear_error (&error);
+		return NULL;
+	}
+
+	/* The login keyring's password is never stored in itself */
+	if ((gck_attributes_find_boolean (attrs, CKA_G_LOGIN_COLLECTION, &is_login) && is_login) ||
+	    !gck_attributes_find_string (attrs, CKA_ID, &identifier)) {
+		gck_attributes_unref (attrs);
+		return NULL;
+	}
+
+	/* Where the wrap layer stores it, when it unlocks the collection */
+	location = gkm_wrap_layer_auto_unlock_location (identifier);
+	password = gkd_login_lookup_password (NULL, "keyring", location, NULL);
+
+	g_free (location);
+	g_free (identifier);
+	gck_attributes_unref (attrs);
+	return password;
+}
+
+static void
+stored_unlock_thread (GTask *task,
+		      gpointer source_object,
+		      gpointer task_data,
+		      GCancellable *cancellable)
+{
+	StoredUnlock *unlock = task_data;
+	gboolean unlocked = FALSE;
+
+	if (!g_cancellable_is_cancelled (cancellable))
+		unlocked = gkd_secret_unlock_with_password (unlock->collection,
+							    (const guchar *)unlock->password,
+							    strlen (unlock->password), NULL);
+
+	g_task_return_boolean (task, unlocked);
+}
+
+static void
+on_stored_unlock_complete (GObject *source,
+			   GAsyncResult *result,
+			   gpointer user_data)
+{
+	GkdSecretUnlock *self = GKD_SECRET_UNLOCK (source);
+	StoredUnlock *unlock = g_task_get_task_data (G_TASK (result));
+	gchar *path;
+
+	g_assert (self->stored_pending > 0);
+	self->stored_pending--;
+
+	/* Dismissed while unlocking, the prompt has already completed */
+	if (self->completed)
+		return;
+
+	path = g_strdup (unlock->path);
+	if (g_task_propagate_boolean (G_TASK (result), NULL)) {
+		emit_collection_unlocked (self, path);
+		g_array_append_val (self->results, path);
+	} else {
+		g_queue_push_tail (self->queued, path);
+	}
+
+	/* Prompt for the ones that are left once all the others are done */
+	if (self->stored_pending == 0)
+		perform_next_unlock (self);
+}
+
+/*
+ * The passwords are looked up here on the main loop, and only the unlocks
+ * themselves run in the workers, on the caller's worker session.
+ */
+static gboolean
+perform_stored_unlocks (GkdSecretUnlock *self)
+{
+	GckObject *collection;
+	StoredUnlock *unlock;
+	GQueue remaining = G_QUEUE_INIT;
+	gboolean locked;
+	gchar *password;
+	gchar *objpath;
+	GTask *task;
+
+	g_assert (self->stored_pending == 0);
+
+	/* Nothing is stored while the login keyring is locked */
+	if (g_queue_is_empty (self->queued) || !gkd_login_available (NULL))
+		return FALSE;
+
+	while ((objpath = g_queue_pop_head (self->queued)) != NULL) {
+		collection = lookup_collection (self, objpath);
+		if (collection == NULL) {
+			g_free (objpath);
+			continue;
+		}
+
+		if (!check_locked_collection (collection, &locked)) {
+			g_free (objpath);
+
+		} else if (!locked) {
+			g_array_append_val (self->results, objpath);
+
+		} else if ((password = lookup_stored_password (collection)) == NULL) {
+			g_queue_push_tail (&remaining, objpath);
+
+		} else {
+			unlock = g_slice_new0 (StoredUnlock);
+			unlock->collection = gkd_secret_service_object_for_worker (self->service,
+										   self->caller,
+										   collection);
+			unlock->path = objpath;
+			unlock->password = password;
+
+			if (unlock->collection == NULL) {
+				g_queue_push_tail (&remaining, g_strdup (objpath));
+				stored_unlock_free (unlock);
+			} else {
+				task = g_task_new (self, self->cancellable, on_stored_unlock_complete, NULL);
+				g_task_set_task_data (task, unlock, stored_unlock_free);
+				g_task_run_in_thread (task, stored_unlock_thread);
+				g_object_unref (task);
+				self->stored_pending++;
+			}
+		}
+
+		g_object_unref (collection);
+	}
+
+	/* The rest are prompted for, in the order they were asked for */
+	while ((objpath = g_queue_pop_head (&remaining)) != NULL)
+		g_queue_push_tail (self->queued, objpath);
+
+	return self->stored_pending > 0;
+}
+
 /* -----------------------------------------------------------------------------
  * DBUS
  */
@@ -585,7 +759,8 @@ gboolean
 gkd_secret_unlock_have_queued (GkdSecretUnlock *self)
 {
 	g_return_val_if_fail (GKD_SECRET_IS_UNLOCK (self), FALSE);
-	return !g_queue_is_empty (self->queued) || self->current;
+	return !g_queue_is_empty (self->queued) || self->current ||
+	       self->stored_pending > 0;
 }
 
 gchar**
@@ -619,7 +794,10 @@ gkd_secret_unlock_call_prompt (GkdSecretUnlock *self, const gchar *window_id)
 	self->window_id = g_strdup (window_id);
 
 	self->prompted = TRUE;
-	perform_next_unlock (self);
+
+	/* Otherwise perform_next_unlock() is called when they're done */
+	if (!perform_stored_unlocks (self))
+		perform_next_unlock (self);
 }
 
 gboolean
@@ -629,6 +807,7 @@ gkd_secret_unlock_with_secret (GckObject *collection,
 {
 	GckBuilder builder = GCK_BUILDER_INIT;
 	GckAttributes *attrs;
+	GckSession *session;
 	GckObject *cred;
 	gboolean locked;
 
@@ -644,8 +823,11 @@ gkd_secret_unlock_with_secret (GckObject *collection,
 	gck_builder_add_boolean (&builder, CKA_TOKEN, TRUE);
 	attrs = gck_attributes_ref_sink (gck_builder_end (&builder));
 
-	cred = gkd_secret_session_create_credential (master->session, NULL,
+	/* The key's session, which the collection was rebound to */
+	session = gck_object_get_session (collection);
+	cred = gkd_secret_session_create_credential (master->session, session,
 						     attrs, master, error);
+	g_object_unref (session);
 
 	gck_attributes_unref (attrs);
 
@@ -32,7 +32,17 @@
 #include <glib/gstdio.h>
 #include <gio/gio.h>
 
+#include <gio/gunixfdlist.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+
+#include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 typedef struct {
 	TestService service;
@@ -185,6 +195,163 @@ test_created_modified_properties (Test *test,
 	g_free (item);
 }
 
+#ifdef HAVE_MEMFD_CREATE
+
+static int
+create_secret_memfd (gconstpointer data,
+                     gsize n_data,
+                     gboolean seal)
+{
+	gssize res;
+	gsize len;
+	int fd;
+
+	fd = memfd_create ("test-secret", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	g_assert_cmpint (fd, >=, 0);
+
+	for (len = 0; len < n_data; len += res) {
+		res = write (fd, (const guchar *)data + len, n_data - len);
+		if (res < 0 && errno == EINTR)
+			res = 0;
+		g_assert_cmpint (res, >=, 0);
+	}
+
+	if (seal)
+		g_assert_cmpint (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+		                        F_SEAL_WRITE | F_SEAL_SEAL), ==, 0);
+
+	return fd;
+}
+
+static void
+set_secret_fd (Test *test,
+               const gchar *item,
+               int fd,
+               GError **error)
+{
+	GUnixFDList *fd_list;
+	GVariant *retval;
+	gint handle;
+
+	fd_list = g_unix_fd_list_new ();
+	handle = g_unix_fd_list_append (fd_list, fd, NULL);
+	g_assert_cmpint (handle, >=, 0);
+
+	retval = g_dbus_connection_call_with_unix_fd_list_sync (test->service.connection,
+	                                                        test->service.bus_name,
+	                                                        item, KEYRING_ITEM_INTERFACE,
+	                                                        "SetSecretFd",
+	                                                        g_variant_new ("((o@ayhs))",
+	                                                                       test->service.session,
+	                                                                       g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, "", 0, 1),
+	                                                                       handle, "text/plain"),
+	                                                        G_VARIANT_TYPE ("()"),
+	                                                        G_DBUS_CALL_FLAGS_NO_AUTO_START,
+	                                                        -1, fd_list, NULL, NULL, error);
+	if (retval)
+		g_variant_unref (retval);
+	g_object_unref (fd_list);
+}
+
+static void
+test_secret_fd (Test *test,
+                gconstpointer unused)
+{
+	GVariantBuilder builder;
+	GUnixFDList *fd_list = NULL;
+	GError *error = NULL;
+	GVariant *retval;
+	GVariant *value;
+	const guchar *data;
+	guchar *secret;
+	gsize n_secret = 1024 * 1024;
+	gsize n_data;
+	gchar *item;
+	gchar *prompt;
+	struct stat sb;
+	gpointer map;
+	gint handle;
+	gsize i;
+	int fd;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+	g_variant_builder_add (&builder, "{sv}", SECRET_ITEM_INTERFACE ".Label", g_variant_new_string ("Large"));
+
+	retval = g_dbus_connection_call_sync (test->service.connection,
+	                                      test->service.bus_name,
+	                                      "/org/freedesktop/secrets/collection/test",
+	                                      SECRET_COLLECTION_INTERFACE,
+	                                      "CreateItem",
+	                                      g_variant_new ("(@a{sv}@(oayays)b)", g_variant_builder_end (&builder),
+	                                                     test_service_build_secret (&test->service, "small"), TRUE),
+	                                      G_VARIANT_TYPE ("(oo)"),
+	                                      G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, NULL, &error);
+	g_assert_no_error (error);
+	g_variant_get (retval, "(oo)", &item, &prompt);
+	g_variant_unref (retval);
+	g_free (prompt);
+
+	secret = g_malloc (n_secret);
+	for (i = 0; i < n_secret; i++)
+		secret[i] = i % 251;
+
+	/* Memory that the caller can still change is refused */
+	fd = create_secret_memfd (secret, n_secret, FALSE);
+	set_secret_fd (test, item, fd, &error);
+	g_assert_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS);
+	g_clear_error (&error);
+	close (fd);
+
+	fd = create_secret_memfd (secret, n_secret, TRUE);
+	set_secret_fd (test, item, fd, &error);
+	g_assert_no_error (error);
+	close (fd);
+
+	/* The standard API sees the same secret */
+	retval = g_dbus_connection_call_sync (test->service.connection,
+	                                      test->service.bus_name,
+	                                      item, SECRET_ITEM_INTERFACE, "GetSecret",
+	                                      g_variant_new ("(o)", test->service.session),
+	                                      G_VARIANT_TYPE ("((oayays))"),
+	                                      G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, NULL, &error);
+	g_assert_no_error (error);
+	g_variant_get (retval, "((&o@ay@ay&s))", NULL, NULL, &value, NULL);
+	data = g_variant_get_fixed_array (value, &n_data, 1);
+	egg_assert_cmpmem (data, n_data, ==, secret, n_secret);
+	g_variant_unref (value);
+	g_variant_unref (retval);
+
+	/* And it comes back in sealed memory */
+	retval = g_dbus_connection_call_with_unix_fd_list_sync (test->service.connection,
+	                                                        test->service.bus_name,
+	                                                        item, KEYRING_ITEM_INTERFACE,
+	                                                        "GetSecretFd",
+	                                                        g_variant_new ("(o)", test->service.session),
+	                                                        G_VARIANT_TYPE ("((oayhs))"),
+	                                                        G_DBUS_CALL_FLAGS_NO_AUTO_START,
+	                                                        -1, NULL, &fd_list, NULL, &error);
+	g_assert_no_error (error);
+	g_variant_get (retval, "((&o@ayh&s))", NULL, NULL, &handle, NULL);
+	fd = g_unix_fd_list_get (fd_list, handle, &error);
+	g_assert_no_error (error);
+
+	g_assert_cmpint (fcntl (fd, F_GET_SEALS) & F_SEAL_WRITE, ==, F_SEAL_WRITE);
+	g_assert_cmpint (fstat (fd, &sb), ==, 0);
+	g_assert_cmpint (sb.st_size, ==, n_secret);
+	map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	g_assert (map != MAP_FAILED);
+	egg_assert_cmpmem (map, sb.st_size, ==, secret, n_secret);
+
+	munmap (map, sb.st_size);
+	close (fd);
+	g_object_unref (fd_list);
+	g_variant_unref (retval);
+	g_free (secret);
+	g_free (item);
+}
+
+#endif /* HAVE_MEMFD_CREATE */
+
 int
 main (int argc, char **argv)
 {
@@ -195,6 +362,10 @@ main (int argc, char **argv)
 
 	g_test_add ("/secret-item/created-modified-properties", Test, NULL,
 	            setup, test_created_modified_properties, teardown);
+#ifdef HAVE_MEMFD_CREATE
+	g_test_add ("/secret-item/secret-fd", Test, NULL,
+	            setup, test_secret_fd, teardown);
+#endif
 
 	return egg_tests_run_with_loop ();
 }
@@ -47,7 +47,7 @@ typedef struct {
 	TestService service;
 	guint signal_id;
 	GList *received_signals;
-	gboolean expecting_properties;
+	gboolean expecting_signals;
 } Test;
 
 static void
@@ -74,11 +74,8 @@ on_signal_received (GDBusConnection *connection,
 	sig->parameters = g_variant_ref (parameters);
 	test->received_signals = g_list_prepend (test->received_signals, sig);
 
-	if (test->expecting_properties &&
-	    g_str_equal ("org.freedesktop.DBus.Properties", interface_name) &&
-	    g_str_equal ("PropertiesChanged", signal_name)) {
+	if (test->expecting_signals)
 		egg_test_wait_stop ();
-	}
 }
 
 static void
@@ -99,8 +96,8 @@ received_signals_flush (Test *test)
 	test->received_signals = NULL;
 }
 
-static void
-expect_signal_with_path (Test *test,
+static guint
+count_signals_with_path (Test *test,
                          const gchar *signal_path,
                          const gchar *signal_iface,
                          const gchar *signal_name,
@@ -108,6 +105,7 @@ expect_signal_with_path (Test *test,
 {
 	ReceivedSignal *sig;
 	const gchar *path;
+	guint count = 0;
 	GList *l;
 
 	g_assert (signal_path != NULL);
@@ -129,12 +127,37 @@ expect_signal_with_path (Test *test,
 				            sig->name, sig->iface, sig->path, param_path, path);
 			}
 
-			return;
+			count++;
 		}
 	}
 
-	g_critical ("didn't receive signal %s on interface %s at object %s",
-	            signal_name, signal_iface, signal_path);
+	return count;
+}
+
+static void
+expect_signal_with_path (Test *test,
+                         const gchar *signal_path,
+                         const gchar *signal_iface,
+                         const gchar *signal_name,
+                         const gchar *param_path)
+{
+	/* Change notifications are sent once the daemon's main loop
+	 * comes around, which may be after the method call has returned.
+	 */
+	while (count_signals_with_path (test, signal_path, signal_iface,
+	                                signal_name, param_path) == 0) {
+		test->expecting_signals = TRUE;
+		if (!egg_test_wait_until (2000)) {
+			test->expecting_signals = FALSE;
+			break;
+		}
+		test->expecting_signals = FALSE;
+	}
+
+	if (count_signals_with_path (test, signal_path, signal_iface,
+	                             signal_name, param_path) == 0)
+		g_critical ("didn't receive signal %s on interface %s at object %s",
+		            signal_name, signal_iface, signal_path);
 }
 
 static gboolean
@@ -196,9 +219,9 @@ expect_property_changed (Test *test,
 	 * we're going to fail.
 	 */
 	while (!has_property_changed (test, signal_path, property_iface, property_name)) {
-		test->expecting_properties = TRUE;
+		test->expecting_signals = TRUE;
 		egg_test_wait_until (2000);
-		test->expecting_properties = FALSE;
+		test->expecting_signals = FALSE;
 	}
 
 	if (!has_property_changed (test, signal_path, property_iface, property_name))
@@ -607,6 +630,55 @@ test_collection_lock (Test *test,
 	g_variant_unref (retval);
 }
 
+static void
+test_collection_lock_coalesced (Test *test,
+                                gconstpointer unused)
+{
+	GError *error = NULL;
+	const gchar *prompt;
+	GVariant *elements[2];
+	GVariant *locked;
+	GVariant *retval;
+
+	/* Locking the same collection twice in one call */
+	elements[0] = g_variant_new_object_path ("/org/freedesktop/secrets/collection/test");
+	elements[1] = g_variant_new_object_path ("/org/freedesktop/secrets/collection/test");
+	retval = dbus_call_perform (test,
+	                            SECRET_SERVICE_PATH,
+	                            SECRET_SERVICE_INTERFACE,
+	                            "Lock",
+	                            g_variant_new ("(@ao)",
+	                                           g_variant_new_array (G_VARIANT_TYPE ("o"), elements, 2)),
+	                            G_VARIANT_TYPE ("(aoo)"),
+	                            &error);
+	g_assert_no_error (error);
+
+	g_variant_get (retval, "(@ao&o)", &locked, &prompt);
+	g_assert_cmpstr (prompt, ==, "/");
+	g_variant_unref (locked);
+
+	expect_signal_with_path (test, SECRET_SERVICE_PATH,
+	                         SECRET_SERVICE_INTERFACE, "CollectionChanged",
+	                         "/org/freedesktop/secrets/collection/test");
+	expect_signal_with_path (test, "/org/freedesktop/secrets/collection/test",
+	                         SECRET_COLLECTION_INTERFACE, "ItemChanged",
+	                         "/org/freedesktop/secrets/collection/test/1");
+	expect_property_changed (test, "/org/freedesktop/secrets/collection/test/1",
+	                         SECRET_ITEM_INTERFACE, "Locked");
+
+	/* Give any duplicates a chance to arrive */
+	egg_test_wait_until (200);
+
+	g_assert_cmpuint (count_signals_with_path (test, SECRET_SERVICE_PATH,
+	                                           SECRET_SERVICE_INTERFACE, "CollectionChanged",
+	                                           "/org/freedesktop/secrets/collection/test"), ==, 1);
+	g_assert_cmpuint (count_signals_with_path (test, "/org/freedesktop/secrets/collection/test",
+	                                           SECRET_COLLECTION_INTERFACE, "ItemChanged",
+	                                           "/org/freedesktop/secrets/collection/test/1"), ==, 1);
+
+	g_variant_unref (retval);
+}
+
 static void
 test_collection_unlock (Test *test,
                         gconstpointer unused)
@@ -799,6 +871,8 @@ main (int argc, char **argv)
 	            setup, test_collection_deleted, teardown);
 	g_test_add ("/secret-signals/collection-lock", Test, NULL,
 	            setup, test_collection_lock, teardown);
+	g_test_add ("/secret-signals/collection-lock-coalesced", Test, NULL,
+	            setup, test_collection_lock_coalesced, teardown);
 	g_test_add ("/secret-signals/collection-unlock", Test, NULL,
 	            setup_locked, test_collection_unlock, teardown);
 	g_test_add ("/secret-signals/collection-unlock-no-prompt", Test, NULL,
@@ -1040,6 +1040,9 @@ main (int argc, char *argv[])
 
 	egg_libgcrypt_initialize ();
 
+	/* Threads in the daemon cache their freed secure memory */
+	egg_secure_enable_thread_caches ();
+
 	/* Send all warning or error messages to syslog */
 	prepare_logging ();
 
@@ -25,6 +25,7 @@
 
 #include "egg/egg-cleanup.h"
 
+#include "pkcs11/gkm/gkm-manager.h"
 #include "pkcs11/wrap-layer/gkm-wrap-layer.h"
 #include "pkcs11/rpc-layer/gkm-rpc-layer.h"
 #include "pkcs11/secret-store/gkm-secret-store.h"
@@ -67,6 +68,7 @@ gkd_pkcs11_initialize (void)
 	CK_FUNCTION_LIST_PTR gnome2_store;
 	CK_FUNCTION_LIST_PTR xdg_store;
 	CK_C_INITIALIZE_ARGS init_args;
+	gchar *directory;
 	gboolean ret;
 	CK_RV rv;
 
@@ -102,6 +104,9 @@ gkd_pkcs11_initialize (void)
 	}
 #endif
 
+	/* The ssh agent caches the keys it lists, until they change */
+	gkm_manager_set_token_notify (gkd_ssh_agent_identities_changed);
+
 	/* Initialize the whole caboodle */
 	rv = (pkcs11_roof->C_Initialize) (&init_args);
 	g_free (init_args.pReserved);
@@ -113,6 +118,10 @@ gkd_pkcs11_initialize (void)
 
 	egg_cleanup_register (pkcs11_daemon_cleanup, NULL);
 
+	directory = gkm_ssh_store_get_directory ();
+	gkd_ssh_agent_watch_directory (directory);
+	g_free (directory);
+
 	ret = gkd_ssh_agent_initialize (pkcs11_roof) &&
 	      gkm_rpc_layer_initialize (pkcs11_roof);
 
@@ -0,0 +1,278 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* gkd-ssh-agent-bench.c - measures signatures per second from parallel clients
+
+   Gnome keyring is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   Gnome keyring is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "config.h"
+
+#include "gkd-ssh-agent-private.h"
+
+#include "egg/egg-buffer.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+/*
+ * Each client connects to the agent at SSH_AUTH_SOCK, and has the first
+ * identity sign requests over and over again, until the time is up. The
+ * agent should already have a key loaded and unlocked.
+ */
+
+typedef struct _Client {
+	GThread *thread;
+	guint completed;
+	guint failed;
+} Client;
+
+static const gchar *socket_path = NULL;
+static gint64 bench_until = 0;
+static guchar *key_blob = NULL;
+static gsize n_key_blob = 0;
+
+static void
+usage (void)
+{
+	fprintf (stderr, "usage: gkd-ssh-agent-bench [-c clients] [-t seconds]\n");
+	exit (2);
+}
+
+static int
+connect_agent (void)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	sock = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		g_warning ("couldn't create socket: %s", g_strerror (errno));
+		return -1;
+	}
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strncpy (addr.sun_path, socket_path, sizeof (addr.sun_path) - 1);
+	if (connect (sock, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+		g_warning ("couldn't connect to agent: %s: %s", socket_path, g_strerror (errno));
+		close (sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+static gboolean
+transfer_all (int sock, guchar *buf, gsize len, gboolean out)
+{
+	int res;
+
+	while (len > 0) {
+		if (out)
+			res = write (sock, buf, len);
+		else
+			res = read (sock, buf, len);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return FALSE;
+		buf += res;
+		len -= res;
+	}
+
+	return TRUE;
+}
+
+/* Sends the request, and reads the response into the same buffer */
+static gboolean
+agent_call (int sock, EggBuffer *buffer)
+{
+	guint32 length;
+
+	egg_buffer_set_uint32 (buffer, 0, buffer->len - 4);
+	if (!transfer_all (sock, buffer->buf, buffer->len, TRUE))
+		return FALSE;
+
+	egg_buffer_reset (buffer);
+	egg_buffer_add_empty (buffer, 4);
+	if (!transfer_all (sock, buffer->buf, 4, FALSE))
+		return FALSE;
+
+	length = egg_buffer_decode_uint32 (buffer->buf);
+	if (length < 1 || length > 256 * 1024)
+		return FALSE;
+
+	egg_buffer_add_empty (buffer, length);
+	return !egg_buffer_has_error (buffer) &&
+	       transfer_all (sock, buffer->buf + 4, length, FALSE);
+}
+
+/* Takes the blob of the first identity the agent has */
+static gboolean
+load_key_blob (void)
+{
+	EggBuffer buffer;
+	const guchar *blob;
+	gsize n_blob;
+	guint32 count;
+	guchar op;
+	gboolean ret = FALSE;
+	int sock;
+
+	sock = connect_agent ();
+	if (sock < 0)
+		return FALSE;
+
+	egg_buffer_init_full (&buffer, 1024, (EggBufferAllocator)g_realloc);
+	egg_buffer_add_uint32 (&buffer, 0);
+	egg_buffer_add_byte (&buffer, GKD_SSH_OP_REQUEST_IDENTITIES);
+
+	if (agent_call (sock, &buffer) &&
+	    egg_buffer_get_byte (&buffer, 4, NULL, &op) &&
+	    op == GKD_SSH_RES_IDENTITIES_ANSWER &&
+	    egg_buffer_get_uint32 (&buffer, 5, NULL, &count)) {
+		if (count == 0) {
+			g_message ("the agent has no identities to sign with");
+		} else if (egg_buffer_get_byte_array (&buffer, 9, NULL, &blob, &n_blob)) {
+			key_blob = g_memdup (blob, n_blob);
+			n_key_blob = n_blob;
+			ret = TRUE;
+		}
+	} else {
+		g_message ("couldn't list the agent identities");
+	}
+
+	egg_buffer_uninit (&buffer);
+	close (sock);
+	return ret;
+}
+
+static gpointer
+run_client (gpointer data)
+{
+	Client *client = data;
+	EggBuffer buffer;
+	guchar challenge[32];
+	guchar op;
+	guint i;
+	int sock;
+
+	sock = connect_agent ();
+	if (sock < 0) {
+		client->failed++;
+		return NULL;
+	}
+
+	egg_buffer_init_full (&buffer, 1024, (EggBufferAllocator)g_realloc);
+
+	while (g_get_monotonic_time () < bench_until) {
+		for (i = 0; i < sizeof (challenge); i++)
+			challenge[i] = g_random_int_range (0, 256);
+
+		egg_buffer_reset (&buffer);
+		egg_buffer_add_uint32 (&buffer, 0);
+		egg_buffer_add_byte (&buffer, GKD_SSH_OP_SIGN_REQUEST);
+		egg_buffer_add_byte_array (&buffer, key_blob, n_key_blob);
+		egg_buffer_add_byte_array (&buffer, challenge, sizeof (challenge));
+		egg_buffer_add_uint32 (&buffer, 0);
+
+		if (!agent_call (sock, &buffer)) {
+			client->failed++;
+			break;
+		}
+
+		if (egg_buffer_get_byte (&buffer, 4, NULL, &op) &&
+		    op == GKD_SSH_RES_SIGN_RESPONSE)
+			client->completed++;
+		else
+			client->failed++;
+	}
+
+	egg_buffer_uninit (&buffer);
+	close (sock);
+	return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+	Client *clients;
+	guint n_clients = 1;
+	guint seconds = 5;
+	guint completed = 0;
+	guint failed = 0;
+	gint64 started, elapsed;
+	guint i;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "c:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			n_clients = atoi (optarg);
+			if (n_clients < 1)
+				usage ();
+			break;
+		case 't':
+			seconds = atoi (optarg);
+			if (seconds < 1)
+				usage ();
+			break;
+		default:
+			usage ();
+		}
+	}
+
+	if (optind != argc)
+		usage ();
+
+	socket_path = g_getenv ("SSH_AUTH_SOCK");
+	if (!socket_path || !socket_path[0]) {
+		g_message ("SSH_AUTH_SOCK is not set");
+		return 1;
+	}
+
+	if (!load_key_blob ())
+		return 1;
+
+	clients = g_new0 (Client, n_clients);
+	started = g_get_monotonic_time ();
+	bench_until = started + (gint64)seconds * G_USEC_PER_SEC;
+
+	for (i = 0; i < n_clients; i++)
+		clients[i].thread = g_thread_new ("client", run_client, &clients[i]);
+	for (i = 0; i < n_clients; i++) {
+		g_thread_join (clients[i].thread);
+		completed += clients[i].completed;
+		failed += clients[i].failed;
+	}
+
+	elapsed = g_get_monotonic_time () - started;
+
+	printf ("%u clients: %u signatures, %u failed, %.1f signatures/sec\n",
+	        n_clients, completed, failed,
+	        (double)completed * G_USEC_PER_SEC / (double)elapsed);
+
+	g_free (clients);
+	g_free (key_blob);
+	return failed ? 1 : 0;
+}
@@ -22,6 +22,7 @@
 
 #include "config.h"
 
+#include "gkd-ssh-agent.h"
 #include "gkd-ssh-agent-private.h"
 
 #include <gck/gck.h>
@@ -30,6 +31,7 @@
 #include "pkcs11/pkcs11i.h"
 
 #include "egg/egg-error.h"
+#include "egg/egg-file-tracker.h"
 #include "egg/egg-secure-memory.h"
 
 #include <glib.h>
@@ -606,6 +608,311 @@ load_contraints (EggBuffer *buffer,
 	return TRUE;
 }
 
+/* -----------------------------------------------------------------------------
+ * IDENTITY CACHE
+ *
+ * ssh clients list the identities at the start of every connection, so
+ * the encoded answer is kept around. It's thrown away when keys are added
+ * or removed through the agent, when a key added with a lifetime expires,
+ * when the slot is logged in or out, and when the daemon tells us that
+ * token objects changed in any of the modules. The ssh store only notices
+ * new files in its directory when searched, so *.pub files there are
+ * watched here too, once the daemon tells us where that is.
+ *
+ * Along with it, the handles of the private keys found for sign requests
+ * are kept, by their public key blobs. These are forgotten whenever the
+ * identities change.
+ */
+
+static GMutex identities_mutex;
+static gchar *identities_directory = NULL;
+static EggFileTracker *identities_tracker = NULL;
+static gint identities_generation = 0;
+
+/* The cached answer, protected by identities_mutex */
+static guchar *identities_answer = NULL;
+static gsize n_identities_answer = 0;
+static gint identities_answer_generation = 0;
+static gulong identities_answer_state = 0;
+static gint64 identities_expire = G_MAXINT64;
+
+/* Private key handles in the agent's slot, protected by identities_mutex */
+static GHashTable *private_keys = NULL;
+static gint private_keys_generation = 0;
+
+static void
+identities_changed (void)
+{
+	g_atomic_int_inc (&identities_generation);
+}
+
+static void
+identities_expire_after (gulong lifetime)
+{
+	gint64 when;
+
+	when = g_get_monotonic_time () + (gint64)lifetime * G_USEC_PER_SEC;
+
+	g_mutex_lock (&identities_mutex);
+	identities_expire = MIN (identities_expire, when);
+	g_mutex_unlock (&identities_mutex);
+}
+
+static void
+on_identity_file (EggFileTracker *tracker,
+                  const gchar *path,
+                  gpointer unused)
+{
+	identities_changed ();
+}
+
+static gulong
+identities_login_state (void)
+{
+	GckSession *session;
+	gulong state = 0;
+
+	session = gkd_ssh_agent_checkout_session ();
+	if (session) {
+		state = gck_session_get_state (session);
+		gkd_ssh_agent_checkin_session (session);
+	}
+
+	return state;
+}
+
+/* Called with identities_mutex held */
+static gint
+identities_check (void)
+{
+	if (!identities_tracker && identities_directory) {
+		identities_tracker = egg_file_tracker_new (identities_directory, "*.pub", NULL);
+		g_signal_connect (identities_tracker, "file-added", G_CALLBACK (on_identity_file), NULL);
+		g_signal_connect (identities_tracker, "file-changed", G_CALLBACK (on_identity_file), NULL);
+		g_signal_connect (identities_tracker, "file-removed", G_CALLBACK (on_identity_file), NULL);
+	}
+
+	/* Just a few stats, when nothing has changed */
+	if (identities_tracker)
+		egg_file_tracker_refresh (identities_tracker, FALSE);
+
+	if (g_get_monotonic_time () >= identities_expire) {
+		identities_expire = G_MAXINT64;
+		identities_changed ();
+	}
+
+	return g_atomic_int_get (&identities_generation);
+}
+
+/*
+ * Adds the cached answer to the response if it's still valid. Otherwise
+ * returns the generation to store a newly built answer with.
+ */
+static gboolean
+identities_lookup (EggBuffer *resp,
+                   gulong state,
+                   gint *generation)
+{
+	gboolean ret = FALSE;
+
+	g_mutex_lock (&identities_mutex);
+
+		*generation = identities_check ();
+
+		if (identities_answer &&
+		    identities_answer_generation == *generation &&
+		    identities_answer_state == state) {
+			egg_buffer_append (resp, identities_answer, n_identities_answer);
+			ret = TRUE;
+		}
+
+	g_mutex_unlock (&identities_mutex);
+
+	return ret;
+}
+
+static void
+identities_store (const guchar *answer,
+                  gsize n_answer,
+                  gulong state,
+                  gint generation)
+{
+	g_mutex_lock (&identities_mutex);
+
+		/* Don't store an answer that was out of date before it was done */
+		if (g_atomic_int_get (&identities_generation) == generation) {
+			g_free (identities_answer);
+			identities_answer = g_memdup (answer, n_answer);
+			n_identities_answer = n_answer;
+			identities_answer_generation = generation;
+			identities_answer_state = state;
+		}
+
+	g_mutex_unlock (&identities_mutex);
+}
+
+/*
+ * Finds the handle of the private key for a public key blob, if it's still
+ * valid. Otherwise returns the generation to store the handle with.
+ */
+static gboolean
+private_keys_lookup (const guchar *blob,
+                     gsize n_blob,
+                     CK_OBJECT_HANDLE *handle,
+                     gint *generation)
+{
+	gboolean ret = FALSE;
+	GBytes *bytes;
+	gulong *value;
+
+	g_mutex_lock (&identities_mutex);
+
+		*generation = identities_check ();
+
+		if (private_keys && private_keys_generation != *generation)
+			g_hash_table_remove_all (private_keys);
+		private_keys_generation = *generation;
+
+		if (private_keys) {
+			bytes = g_bytes_new_static (blob, n_blob);
+			value = g_hash_table_lookup (private_keys, bytes);
+			g_bytes_unref (bytes);
+
+			if (value) {
+				*handle = *value;
+				ret = TRUE;
+			}
+		}
+
+	g_mutex_unlock (&identities_mutex);
+
+	return ret;
+}
+
+static void
+private_keys_store (const guchar *blob,
+                    gsize n_blob,
+                    CK_OBJECT_HANDLE handle,
+                    gint generation)
+{
+	gulong *value;
+
+	g_mutex_lock (&identities_mutex);
+
+		if (!private_keys)
+			private_keys = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+			                                      (GDestroyNotify)g_bytes_unref, g_free);
+
+		/* Only if the identities haven't changed since the key was found */
+		if (g_atomic_int_get (&identities_generation) == generation &&
+		    private_keys_generation == generation) {
+			value = g_new (gulong, 1);
+			*value = handle;
+			g_hash_table_replace (private_keys, g_bytes_new (blob, n_blob), value);
+		}
+
+	g_mutex_unlock (&identities_mutex);
+}
+
+static void
+private_keys_forget (const guchar *blob,
+                     gsize n_blob)
+{
+	GBytes *bytes;
+
+	g_mutex_lock (&identities_mutex);
+
+		if (private_keys) {
+			bytes = g_bytes_new_static (blob, n_blob);
+			g_hash_table_remove (private_keys, bytes);
+			g_bytes_unref (bytes);
+		}
+
+	g_mutex_unlock (&identities_mutex);
+}
+
+/*
+ * Looks up the private key matching the public key. Most keys are found
+ * through one of the agent's own sessions, which is returned and must be
+ * checked back in once done with the key. When the public key blob is
+ * given, keys found there are remembered, and found again without any
+ * searching. Otherwise all the slots are searched, and NULL is returned.
+ */
+static GckSession*
+lookup_private_key (GkdSshAgentCall *call, const guchar *blob, gsize n_blob,
+                    GckAttributes *attrs, GckObject **key)
+{
+	CK_OBJECT_HANDLE handle;
+	GckSession *pooled;
+	gint generation = 0;
+
+	g_assert (key != NULL && *key == NULL);
+
+	pooled = gkd_ssh_agent_checkout_session ();
+	if (pooled) {
+		if (blob && private_keys_lookup (blob, n_blob, &handle, &generation) &&
+		    login_session (pooled)) {
+			*key = gck_object_from_handle (pooled, handle);
+			return pooled;
+		}
+
+		search_keys_like_attributes (NULL, pooled, attrs, CKO_PUBLIC_KEY, return_private_matching, key);
+		if (*key) {
+			if (blob)
+				private_keys_store (blob, n_blob, gck_object_get_handle (*key), generation);
+			return pooled;
+		}
+
+		gkd_ssh_agent_checkin_session (pooled);
+	}
+
+	search_keys_like_attributes (call->modules, NULL, attrs, CKO_PUBLIC_KEY, return_private_matching, key);
+	return NULL;
+}
+
+void
+gkd_ssh_agent_identities_changed (void)
+{
+	identities_changed ();
+}
+
+void
+gkd_ssh_agent_watch_directory (const gchar *directory)
+{
+	g_mutex_lock (&identities_mutex);
+
+		g_free (identities_directory);
+		identities_directory = g_strdup (directory);
+		if (identities_tracker)
+			g_object_unref (identities_tracker);
+		identities_tracker = NULL;
+
+	g_mutex_unlock (&identities_mutex);
+
+	identities_changed ();
+}
+
+void
+gkd_ssh_agent_clear_identities (void)
+{
+	g_mutex_lock (&identities_mutex);
+
+		g_free (identities_answer);
+		identities_answer = NULL;
+		n_identities_answer = 0;
+		identities_expire = G_MAXINT64;
+		if (private_keys)
+			g_hash_table_destroy (private_keys);
+		private_keys = NULL;
+		if (identities_tracker)
+			g_object_unref (identities_tracker);
+		identities_tracker = NULL;
+
+	g_mutex_unlock (&identities_mutex);
+
+	identities_changed ();
+}
+
 /* -----------------------------------------------------------------------------
  * OPERATIONS
  */
@@ -619,6 +926,7 @@ op_add_identity (GkdSshAgentCall *call)
 	gchar *stype = NULL;
 	gchar *comment = NULL;
 	gboolean ret;
+	gulong lifetime;
 	gulong algo;
 	gsize offset;
 
@@ -685,6 +993,11 @@ op_add_identity (GkdSshAgentCall *call)
 
 	gkd_ssh_agent_checkin_main_session (session);
 
+	/* The identities have changed, and will again when the key expires */
+	identities_changed ();
+	if (ret && gck_builder_find_ulong (&pub, CKA_G_DESTRUCT_AFTER, &lifetime))
+		identities_expire_after (lifetime);
+
 	gck_builder_clear (&priv);
 	gck_builder_clear (&pub);
 
@@ -762,8 +1075,15 @@ op_request_identities (GkdSshAgentCall *call)
 	GError *error = NULL;
 	GList *all_attrs, *l;
 	GckAttributes *attrs;
-	gsize blobpos;
+	gsize blobpos, answer;
 	gchar *comment;
+	gint generation;
+	gulong state;
+
+	/* Usually nothing has changed since last time */
+	state = identities_login_state ();
+	if (identities_lookup (call->resp, state, &generation))
+		return TRUE;
 
 	/* TODO: Check SSH purpose */
 	gck_builder_add_ulong (&builder, CKA_CLASS, CKO_PUBLIC_KEY);
@@ -788,6 +1108,7 @@ op_request_identities (GkdSshAgentCall *call)
 		return TRUE;
 	}
 
+	answer = call->resp->len;
 	egg_buffer_add_byte (call->resp, GKD_SSH_RES_IDENTITIES_ANSWER);
 	egg_buffer_add_uint32 (call->resp, g_list_length (all_attrs));
 
@@ -818,6 +1139,10 @@ op_request_identities (GkdSshAgentCall *call)
 
 	g_list_free (all_attrs);
 
+	if (!egg_buffer_has_error (call->resp))
+		identities_store (call->resp->buf + answer, call->resp->len - answer,
+		                  state, generation);
+
 	return TRUE;
 }
 
@@ -1001,10 +1326,17 @@ op_sign_request (GkdSshAgentCall *call)
 	guint8 *hash;
 	gulong algo, mech;
 	GChecksumType halgo;
+	GckSession *pooled;
+	const guchar *blob;
+	gsize n_blob;
 	gsize n_hash = 0;
 
 	offset = 5;
 
+	/* The key blob, which private keys are remembered by */
+	if (!egg_buffer_get_byte_array (call->req, offset, NULL, &blob, &n_blob))
+		return FALSE;
+
 	/* The key packet size */
 	if (!egg_buffer_get_uint32 (call->req, offset, &offset, &sz))
 		return FALSE;
@@ -1032,7 +1364,7 @@ op_sign_request (GkdSshAgentCall *call)
 	}
 
 	/* Lookup the key */
-	search_keys_like_attributes (call->modules, NULL, attrs, CKO_PUBLIC_KEY, return_private_matching, &key);
+	pooled = lookup_private_key (call, blob, n_blob, attrs, &key);
 	gck_attributes_unref (attrs);
 
 	if (!key) {
@@ -1061,10 +1393,19 @@ op_sign_request (GkdSshAgentCall *call)
 	g_object_unref (key);
 	g_free (hash);
 
+	if (pooled)
+		gkd_ssh_agent_checkin_session (pooled);
+
 	if (error) {
 		if (!g_error_matches (error, GCK_ERROR, CKR_FUNCTION_CANCELED) &&
 		    !g_error_matches (error, GCK_ERROR, CKR_PIN_INCORRECT))
 			g_message ("signing of the data failed: %s", egg_error_message (error));
+
+		/* A remembered key may have gone away behind our back */
+		if (g_error_matches (error, GCK_ERROR, CKR_OBJECT_HANDLE_INVALID) ||
+		    g_error_matches (error, GCK_ERROR, CKR_KEY_HANDLE_INVALID))
+			identities_changed ();
+
 		g_clear_error (&error);
 		egg_buffer_add_byte (call->resp, GKD_SSH_RES_FAILURE);
 		return TRUE;
@@ -1116,6 +1457,7 @@ op_v1_challenge (GkdSshAgentCall *call)
 	GChecksum *checksum;
 	GckObject *key = NULL;
 	guint32 resp_type;
+	GckSession *pooled;
 	GError *error = NULL;
 	guint i;
 	guchar b;
@@ -1162,7 +1504,7 @@ op_v1_challenge (GkdSshAgentCall *call)
 	}
 
 	/* Lookup the key */
-	search_keys_like_attributes (call->modules, NULL, attrs, CKO_PUBLIC_KEY, return_private_matching, &key);
+	pooled = lookup_private_key (call, NULL, 0, attrs, &key);
 	gck_attributes_unref (attrs);
 
 	/* Didn't find a key? */
@@ -1179,6 +1521,9 @@ op_v1_challenge (GkdSshAgentCall *call)
 	g_object_unref (session);
 	g_object_unref (key);
 
+	if (pooled)
+		gkd_ssh_agent_checkin_session (pooled);
+
 	if (error) {
 		if (!g_error_matches (error, GCK_ERROR, CKR_FUNCTION_CANCELED))
 			g_message ("decryption of the data failed: %s", egg_error_message (error));
@@ -1208,11 +1553,17 @@ op_remove_identity (GkdSshAgentCall *call)
 	GckAttributes *attrs;
 	GckSession *session;
 	GckObject *key = NULL;
+	const guchar *blob;
+	gsize n_blob;
 	gsize offset;
 	guint sz;
 
 	offset = 5;
 
+	/* The key blob, which private keys are remembered by */
+	if (!egg_buffer_get_byte_array (call->req, offset, NULL, &blob, &n_blob))
+		return FALSE;
+
 	/* The key packet size */
 	if (!egg_buffer_get_uint32 (call->req, offset, &offset, &sz))
 		return FALSE;
@@ -1243,6 +1594,9 @@ op_remove_identity (GkdSshAgentCall *call)
 
 	gkd_ssh_agent_checkin_main_session (session);
 
+	private_keys_forget (blob, n_blob);
+	identities_changed ();
+
 	egg_buffer_add_byte (call->resp, GKD_SSH_RES_SUCCESS);
 
 	return TRUE;
@@ -1323,6 +1677,7 @@ op_remove_all_identities (GkdSshAgentCall *call)
 	}
 
 	gkd_ssh_agent_checkin_main_session (session);
+	identities_changed ();
 
 	egg_buffer_add_byte (call->resp, GKD_SSH_RES_SUCCESS);
 	return TRUE;
@@ -87,6 +87,8 @@ typedef struct _GkdSshAgentCall {
 typedef gboolean (*GkdSshAgentOperation) (GkdSshAgentCall *call);
 extern const GkdSshAgentOperation gkd_ssh_agent_operations[GKD_SSH_OP_MAX];
 
+void                  gkd_ssh_agent_clear_identities                (void);
+
 /* -----------------------------------------------------------------------------
  * gkd-ssh-agent.c
  */
@@ -97,6 +99,10 @@ GckSession*           gkd_ssh_agent_checkout_main_session           (void);
 
 void                  gkd_ssh_agent_checkin_main_session            (GckSession* session);
 
+GckSession*           gkd_ssh_agent_checkout_session                (void);
+
+void                  gkd_ssh_agent_checkin_session                 (GckSession* session);
+
 /* -----------------------------------------------------------------------------
  * gkd-ssh-agent-proto.c
  */
@@ -28,6 +28,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -49,144 +50,424 @@ static GList *pkcs11_modules = NULL;
 
 EGG_SECURE_DECLARE (ssh_agent);
 
-static gboolean
-read_all (int fd, guchar *buf, int len)
+/* --------------------------------------------------------------------------------------
+ * CONNECTIONS
+ *
+ * A single loop thread polls all client connections, and reads and
+ * writes their packets without blocking. Each complete request is
+ * handed to a small pool of worker threads, which run the operation.
+ *
+ * The agent protocol has at most one request in flight on a connection,
+ * so a connection is not polled while a worker has it. An idle connection
+ * only holds its socket and this structure, the request is read into
+ * secure memory once its size is known, and freed once it is handled.
+ */
+
+typedef struct _Conn {
+	struct _Conn *next;
+	int sock;
+
+	/* Owned by the loop thread, unless busy */
+	guchar header[4];
+	gsize n_read;
+	guint32 length;
+	EggBuffer req;
+	EggBuffer resp;
+	gsize n_written;
+
+	/* Protected by conns_mutex */
+	gboolean busy;
+	gboolean writing;
+	gboolean closed;
+} Conn;
+
+/* The maximum number of operations running at once */
+#define MAX_WORKERS 8
+
+/* The largest request accepted from a client */
+#define MAX_PACKET_SIZE (256 * 1024)
+
+/* All connections, additions and removals protected by conns_mutex */
+static Conn *socket_conns = NULL;
+static GMutex conns_mutex;
+
+/* The loop thread, and the pipe used to wake it up */
+static GThread *loop_thread = NULL;
+static int loop_wakeup[2] = { -1, -1 };
+static gboolean loop_quit = FALSE;
+
+/* The workers which run the operations */
+static GThreadPool *loop_workers = NULL;
+
+static void
+loop_wake (void)
 {
-	int all = len;
+	guchar ch = 0;
 	int res;
 
-	while (len > 0) {
+	g_assert (loop_wakeup[1] != -1);
 
-		res = read (fd, buf, len);
+	/* If the pipe is full, the loop is going to wake up anyway */
+	do {
+		res = write (loop_wakeup[1], &ch, 1);
+	} while (res < 0 && errno == EINTR);
+}
 
-		if (res < 0) {
-			if (errno == EAGAIN || errno == EINTR)
+static void
+conn_release (Conn *conn)
+{
+	egg_buffer_uninit (&conn->req);
+	egg_buffer_uninit (&conn->resp);
+	close (conn->sock);
+	g_slice_free (Conn, conn);
+}
+
+/*
+ * Reads as much of a request as is available without blocking. Returns
+ * 1 when a complete request has been read, 0 when more is needed and -1
+ * when the connection should be closed.
+ */
+static int
+conn_read (Conn *conn)
+{
+	guchar *data;
+	gsize want;
+	int res;
+
+	for (;;) {
+
+		/* Read the packet size ... */
+		if (conn->n_read < 4) {
+			data = conn->header + conn->n_read;
+			want = 4 - conn->n_read;
+
+		/* ... and then the packet itself */
+		} else {
+			data = conn->req.buf + conn->n_read;
+			want = conn->length - conn->n_read;
+		}
+
+		res = read (conn->sock, data, want);
+		if (res == 0) {
+			return -1;
+		} else if (res < 0) {
+			if (errno == EINTR)
 				continue;
-			g_warning ("couldn't read %u bytes from client: %s", all,
-			           g_strerror (errno));
-			return FALSE;
-		} else if (res == 0) {
-			return FALSE;
-		} else  {
-			len -= res;
-			buf += res;
+			if (errno == EAGAIN)
+				return 0;
+			g_warning ("couldn't read from client: %s", g_strerror (errno));
+			return -1;
 		}
-	}
 
-	return TRUE;
+		conn->n_read += res;
+
+		/* Allocate memory for the packet, along with its size */
+		if (conn->n_read == 4) {
+			conn->length = egg_buffer_decode_uint32 (conn->header);
+			if (conn->length < 1 || conn->length > MAX_PACKET_SIZE) {
+				g_warning ("invalid packet size from client");
+				return -1;
+			}
+
+			conn->length += 4;
+			if (!egg_buffer_init_full (&conn->req, conn->length, egg_secure_realloc) ||
+			    !egg_buffer_add_empty (&conn->req, conn->length)) {
+				g_warning ("couldn't allocate memory for request");
+				return -1;
+			}
+			memcpy (conn->req.buf, conn->header, 4);
+
+		/* A complete packet */
+		} else if (conn->n_read == conn->length) {
+			conn->n_read = 0;
+			conn->length = 0;
+			return 1;
+		}
+	}
 }
 
-static gboolean
-write_all (int fd, const guchar *buf, int len)
+/*
+ * Writes as much of the response as possible without blocking. Returns
+ * 1 when it has all been written, 0 when the socket is full and -1 when
+ * the connection should be closed.
+ */
+static int
+conn_write (Conn *conn)
 {
-	int all = len;
 	int res;
 
-	while (len > 0) {
-
-		res = write (fd, buf, len);
+	while (conn->n_written < conn->resp.len) {
+		res = write (conn->sock, conn->resp.buf + conn->n_written,
+		             conn->resp.len - conn->n_written);
 		if (res < 0) {
-			if (errno == EAGAIN || errno == EINTR)
+			if (errno == EINTR)
 				continue;
+			if (errno == EAGAIN)
+				return 0;
 			if (errno != EPIPE)
-				g_warning ("couldn't write %u bytes to client: %s", all,
-				           g_strerror (errno));
-			return FALSE;
+				g_warning ("couldn't write %u bytes to client: %s",
+				           (guint)conn->resp.len, g_strerror (errno));
+			return -1;
 		} else if (res == 0) {
-			g_warning ("couldn't write %u bytes to client", all);
-			return FALSE;
-		} else  {
-			len -= res;
-			buf += res;
+			g_warning ("couldn't write %u bytes to client", (guint)conn->resp.len);
+			return -1;
 		}
+
+		conn->n_written += res;
 	}
 
-	return TRUE;
+	egg_buffer_uninit (&conn->resp);
+	conn->n_written = 0;
+	return 1;
 }
 
 static gboolean
-read_packet_with_size (GkdSshAgentCall *call)
+conn_process (Conn *conn)
 {
-	int fd;
-	guint32 packet_size;
-
-	fd = call->sock;
+	GkdSshAgentCall call;
+	gboolean ret;
+	guchar op;
 
-	egg_buffer_resize (call->req, 4);
-	if (!read_all (fd, call->req->buf, 4))
+	/* Decode the operation */
+	if (!egg_buffer_get_byte (&conn->req, 4, NULL, &op))
 		return FALSE;
-
-	if (!egg_buffer_get_uint32 (call->req, 0, NULL, &packet_size) ||
-	    packet_size < 1) {
-		g_warning ("invalid packet size from client");
+	if (op >= GKD_SSH_OP_MAX)
 		return FALSE;
-	}
+	g_assert (gkd_ssh_agent_operations[op]);
 
-	egg_buffer_resize (call->req, packet_size + 4);
-	if (!read_all (fd, call->req->buf + 4, packet_size))
-		return FALSE;
+	egg_buffer_init_full (&conn->resp, 128, (EggBufferAllocator)g_realloc);
+	egg_buffer_add_uint32 (&conn->resp, 0);
 
-	return TRUE;
+	memset (&call, 0, sizeof (call));
+	call.sock = conn->sock;
+	call.req = &conn->req;
+	call.resp = &conn->resp;
+	call.modules = gck_list_ref_copy (pkcs11_modules);
+
+	/* Execute the right operation */
+	ret = (gkd_ssh_agent_operations[op]) (&call) &&
+	      egg_buffer_set_uint32 (&conn->resp, 0, conn->resp.len - 4);
+
+	gck_list_unref_free (call.modules);
+	return ret;
 }
 
-static gpointer
-run_client_thread (gpointer data)
+static void
+run_agent_worker (gpointer data,
+                  gpointer unused)
 {
-	gint *socket = data;
-	GkdSshAgentCall call;
-	EggBuffer req;
-	EggBuffer resp;
-	guchar op;
+	Conn *conn = data;
+	int res = -1;
 
-	memset (&call, 0, sizeof (call));
-	call.sock = g_atomic_int_get (socket);
-	g_assert (call.sock != -1);
+	/* Usually the whole response fits in the socket right away */
+	if (conn_process (conn))
+		res = conn_write (conn);
 
-	egg_buffer_init_full (&req, 128, egg_secure_realloc);
-	egg_buffer_init_full (&resp, 128, (EggBufferAllocator)g_realloc);
-	call.req = &req;
-	call.resp = &resp;
-	call.modules = gck_list_ref_copy (pkcs11_modules);
+	/* The request is no longer needed */
+	egg_buffer_uninit (&conn->req);
+
+	g_mutex_lock (&conns_mutex);
+	conn->busy = FALSE;
+	conn->writing = (res == 0);
+	conn->closed = (res < 0);
+	g_mutex_unlock (&conns_mutex);
+
+	/* Hand the connection back to the loop thread */
+	loop_wake ();
+}
+
+static gpointer
+run_agent_loop (gpointer unused)
+{
+	GError *error = NULL;
+	struct pollfd *pfds;
+	Conn **conns;
+	Conn *conn, *done, **here;
+	guchar buf[64];
+	guint n_alloc = 64;
+	guint n_pfds, i;
+	int res;
+
+	pfds = g_new (struct pollfd, n_alloc);
+	conns = g_new (Conn *, n_alloc);
 
 	for (;;) {
+		done = NULL;
 
-		egg_buffer_reset (call.req);
+		g_mutex_lock (&conns_mutex);
 
-		/* 1. Read in the request */
-		if (!read_packet_with_size (&call))
+		if (loop_quit) {
+			g_mutex_unlock (&conns_mutex);
 			break;
+		}
 
-		/* 2. Now decode the operation */
-		if (!egg_buffer_get_byte (call.req, 4, NULL, &op))
-			break;
-		if (op >= GKD_SSH_OP_MAX)
-			break;
-		g_assert (gkd_ssh_agent_operations[op]);
+		/* Pull out connections that are finished with */
+		for (here = &socket_conns, conn = *here; conn != NULL; conn = *here) {
+			if (conn->closed && !conn->busy) {
+				*here = conn->next;
+				conn->next = done;
+				done = conn;
+			} else {
+				here = &conn->next;
+			}
+		}
 
-		/* 3. Execute the right operation */
-		egg_buffer_reset (call.resp);
-		egg_buffer_add_uint32 (call.resp, 0);
-		if (!(gkd_ssh_agent_operations[op]) (&call))
-			break;
-		if (!egg_buffer_set_uint32 (call.resp, 0, call.resp->len - 4))
-			break;
+		/* Watch the wakeup pipe, and every connection not with a worker */
+		for (n_pfds = 1, conn = socket_conns; conn != NULL; conn = conn->next) {
+			if (conn->closed || conn->busy)
+				continue;
+			if (n_pfds == n_alloc) {
+				n_alloc *= 2;
+				pfds = g_renew (struct pollfd, pfds, n_alloc);
+				conns = g_renew (Conn *, conns, n_alloc);
+			}
+			pfds[n_pfds].fd = conn->sock;
+			pfds[n_pfds].events = conn->writing ? POLLOUT : POLLIN;
+			pfds[n_pfds].revents = 0;
+			conns[n_pfds] = conn;
+			n_pfds++;
+		}
 
-		/* 4. Write the reply back out */
-		if (!write_all (call.sock, call.resp->buf, call.resp->len))
-			break;
-	}
+		g_mutex_unlock (&conns_mutex);
 
-	egg_buffer_uninit (&req);
-	egg_buffer_uninit (&resp);
-	gck_list_unref_free (call.modules);
-	call.modules = NULL;
+		for (conn = done; conn != NULL; conn = done) {
+			done = conn->next;
+			conn_release (conn);
+		}
+
+		pfds[0].fd = loop_wakeup[0];
+		pfds[0].events = POLLIN;
+		pfds[0].revents = 0;
 
-	close (call.sock);
-	g_atomic_int_set (socket, -1);
+		if (poll (pfds, n_pfds, -1) < 0) {
+			if (errno != EINTR && errno != EAGAIN) {
+				g_warning ("couldn't wait on ssh agent connections: %s", g_strerror (errno));
+				break;
+			}
+			continue;
+		}
+
+		/* Drain the wakeup pipe */
+		if (pfds[0].revents) {
+			while (read (loop_wakeup[0], buf, sizeof (buf)) > 0);
+		}
+
+		/* Only this thread marks connections busy, so these are still ours */
+		for (i = 1; i < n_pfds; i++) {
+			if (!pfds[i].revents)
+				continue;
+			conn = conns[i];
+
+			/* Finish writing out a response, or read the next request */
+			if (conn->writing) {
+				res = conn_write (conn);
+				if (res > 0) {
+					g_mutex_lock (&conns_mutex);
+					conn->writing = FALSE;
+					g_mutex_unlock (&conns_mutex);
+				}
+			} else {
+				res = conn_read (conn);
+				if (res > 0) {
+					g_mutex_lock (&conns_mutex);
+					conn->busy = TRUE;
+					g_mutex_unlock (&conns_mutex);
+
+					if (!g_thread_pool_push (loop_workers, conn, &error)) {
+						g_warning ("couldn't run ssh agent operation: %s",
+						           egg_error_message (error));
+						g_clear_error (&error);
+						g_mutex_lock (&conns_mutex);
+						conn->busy = FALSE;
+						g_mutex_unlock (&conns_mutex);
+						res = -1;
+					}
+				}
+			}
+
+			if (res < 0) {
+				g_mutex_lock (&conns_mutex);
+				conn->closed = TRUE;
+				g_mutex_unlock (&conns_mutex);
+			}
+		}
+	}
 
+	g_free (pfds);
+	g_free (conns);
 	return NULL;
 }
 
+static gboolean
+start_agent_loop (void)
+{
+	GError *error = NULL;
+	int i;
+
+	g_assert (loop_thread == NULL);
+
+	if (pipe (loop_wakeup) < 0) {
+		g_warning ("couldn't create wakeup pipe: %s", g_strerror (errno));
+		return FALSE;
+	}
+
+	for (i = 0; i < 2; i++) {
+		fcntl (loop_wakeup[i], F_SETFL, fcntl (loop_wakeup[i], F_GETFL) | O_NONBLOCK);
+		fcntl (loop_wakeup[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	loop_workers = g_thread_pool_new (run_agent_worker, NULL, MAX_WORKERS, FALSE, &error);
+	if (!loop_workers) {
+		g_warning ("couldn't create ssh agent worker threads: %s", egg_error_message (error));
+		g_clear_error (&error);
+		return FALSE;
+	}
+
+	loop_quit = FALSE;
+	loop_thread = g_thread_new ("ssh-agent", run_agent_loop, NULL);
+	return TRUE;
+}
+
+static void
+stop_agent_loop (void)
+{
+	Conn *conn;
+	int i;
+
+	/* Stop the loop thread, so no more operations are sent to workers */
+	if (loop_thread) {
+		g_mutex_lock (&conns_mutex);
+		loop_quit = TRUE;
+		g_mutex_unlock (&conns_mutex);
+		loop_wake ();
+		g_thread_join (loop_thread);
+		loop_thread = NULL;
+	}
+
+	/* Forcibly shutdown the connections, and wait for the workers */
+	if (loop_workers) {
+		g_mutex_lock (&conns_mutex);
+		for (conn = socket_conns; conn != NULL; conn = conn->next)
+			shutdown (conn->sock, SHUT_RDWR);
+		g_mutex_unlock (&conns_mutex);
+
+		g_thread_pool_free (loop_workers, TRUE, TRUE);
+		loop_workers = NULL;
+	}
+
+	while (socket_conns) {
+		conn = socket_conns;
+		socket_conns = conn->next;
+		conn_release (conn);
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (loop_wakeup[i] != -1)
+			close (loop_wakeup[i]);
+		loop_wakeup[i] = -1;
+	}
+}
+
 /* --------------------------------------------------------------------------------------
  * SESSION MANAGEMENT
  */
@@ -232,17 +513,72 @@ gkd_ssh_agent_checkin_main_session (GckSession *session)
 	g_mutex_unlock (pkcs11_main_mutex);
 }
 
-/* --------------------------------------------------------------------------------------
- * MAIN THREAD
+/*
+ * Further logged in sessions on the same slot, for operations that only
+ * use keys, such as signing. Objects belong to the slot rather than any
+ * one session, so the keys are visible in all of them. There is no point
+ * in more sessions than there are workers to use them.
  */
+static GckSlot *pkcs11_slot = NULL;
+static GList *pkcs11_pool = NULL;
+static guint pkcs11_pool_opened = 0;
+static GCond *pkcs11_pool_cond = NULL;
 
-typedef struct _Client {
-	GThread *thread;
-	gint sock;
-} Client;
+GckSession*
+gkd_ssh_agent_checkout_session (void)
+{
+	GckSession *result = NULL;
+	GError *error = NULL;
 
-/* Each client thread in this list */
-static GList *socket_clients = NULL;
+	g_mutex_lock (pkcs11_main_mutex);
+
+		g_assert (GCK_IS_SLOT (pkcs11_slot));
+		while (!pkcs11_pool && pkcs11_pool_opened >= MAX_WORKERS)
+			g_cond_wait (pkcs11_pool_cond, pkcs11_main_mutex);
+		if (pkcs11_pool) {
+			result = pkcs11_pool->data;
+			pkcs11_pool = g_list_delete_link (pkcs11_pool, pkcs11_pool);
+		} else {
+			pkcs11_pool_opened++;
+		}
+
+	g_mutex_unlock (pkcs11_main_mutex);
+
+	if (result)
+		return result;
+
+	/* Open another session, without holding the lock */
+	result = gck_slot_open_session (pkcs11_slot, GCK_SESSION_AUTHENTICATE, NULL, &error);
+	if (!result) {
+		g_warning ("couldn't create pkcs#11 session: %s", egg_error_message (error));
+		g_clear_error (&error);
+
+		g_mutex_lock (pkcs11_main_mutex);
+		pkcs11_pool_opened--;
+		g_cond_signal (pkcs11_pool_cond);
+		g_mutex_unlock (pkcs11_main_mutex);
+	}
+
+	return result;
+}
+
+void
+gkd_ssh_agent_checkin_session (GckSession *session)
+{
+	g_assert (GCK_IS_SESSION (session));
+
+	g_mutex_lock (pkcs11_main_mutex);
+
+		g_assert (session != pkcs11_main_session);
+		pkcs11_pool = g_list_prepend (pkcs11_pool, session);
+		g_cond_signal (pkcs11_pool_cond);
+
+	g_mutex_unlock (pkcs11_main_mutex);
+}
+
+/* --------------------------------------------------------------------------------------
+ * MAIN THREAD
+ */
 
 /* The main socket we listen on */
 static int socket_fd = -1;
@@ -253,76 +589,50 @@ static char socket_path[1024] = { 0, };
 void
 gkd_ssh_agent_accept (void)
 {
-	Client *client;
 	struct sockaddr_un addr;
 	socklen_t addrlen;
-	GError *error = NULL;
-	GList *l;
+	Conn *conn;
 	int new_fd;
 
 	g_return_if_fail (socket_fd != -1);
-
-	/* Cleanup any completed dispatch threads */
-	for (l = socket_clients; l; l = g_list_next (l)) {
-		client = l->data;
-		if (g_atomic_int_get (&client->sock) == -1) {
-			g_thread_join (client->thread);
-			g_slice_free (Client, client);
-			l->data = NULL;
-		}
-	}
-	socket_clients = g_list_remove_all (socket_clients, NULL);
+	g_return_if_fail (loop_thread != NULL);
 
 	addrlen = sizeof (addr);
 	new_fd = accept (socket_fd, (struct sockaddr*) &addr, &addrlen);
-	if (socket_fd < 0) {
+	if (new_fd < 0) {
 		g_warning ("cannot accept SSH agent connection: %s", strerror (errno));
 		return;
 	}
 
-	client = g_slice_new0 (Client);
-	client->sock = new_fd;
-
-	/* And create a new thread/process */
-	client->thread = g_thread_new ("ssh-agent", run_client_thread, &client->sock);
-	if (!client->thread) {
-		g_warning ("couldn't create thread SSH agent connection: %s",
-		           egg_error_message (error));
-		g_slice_free (Client, client);
+	if (fcntl (new_fd, F_SETFL, fcntl (new_fd, F_GETFL) | O_NONBLOCK) < 0) {
+		g_warning ("couldn't set SSH agent connection to non-blocking: %s", strerror (errno));
+		close (new_fd);
 		return;
 	}
 
-	socket_clients = g_list_append (socket_clients, client);
+	conn = g_slice_new0 (Conn);
+	conn->sock = new_fd;
+
+	g_mutex_lock (&conns_mutex);
+	conn->next = socket_conns;
+	socket_conns = conn;
+	g_mutex_unlock (&conns_mutex);
+
+	loop_wake ();
 }
 
 void
 gkd_ssh_agent_shutdown (void)
 {
-	Client *client;
-	GList *l;
-
 	if (socket_fd != -1)
 		close (socket_fd);
+	socket_fd = -1;
 
 	if (*socket_path)
 		unlink (socket_path);
 
-	/* Stop all of the dispatch threads */
-	for (l = socket_clients; l; l = g_list_next (l)) {
-		client = l->data;
-
-		/* Forcibly shutdown the connection */
-		if (client->sock != -1)
-			shutdown (client->sock, SHUT_RDWR);
-		g_thread_join (client->thread);
-
-		/* This is always closed by client thread */
-		g_assert (client->sock == -1);
-		g_slice_free (Client, client);
-	}
-
-	g_list_free (socket_clients);
-	socket_clients = NULL;
+	/* Stop the loop and workers, and close all the connections */
+	stop_agent_loop ();
 }
 
 void
@@ -339,11 +649,22 @@ gkd_ssh_agent_uninitialize (void)
 		g_object_unref (pkcs11_main_session);
 		pkcs11_main_session = NULL;
 
+		g_assert (g_list_length (pkcs11_pool) == pkcs11_pool_opened);
+		gck_list_unref_free (pkcs11_pool);
+		pkcs11_pool = NULL;
+		pkcs11_pool_opened = 0;
+		g_object_unref (pkcs11_slot);
+		pkcs11_slot = NULL;
+
 	g_mutex_unlock (pkcs11_main_mutex);
 	g_mutex_clear (pkcs11_main_mutex);
 	g_free (pkcs11_main_mutex);
 	g_cond_clear (pkcs11_main_cond);
 	g_free (pkcs11_main_cond);
+	g_cond_clear (pkcs11_pool_cond);
+	g_free (pkcs11_pool_cond);
+
+	gkd_ssh_agent_clear_identities ();
 
 	gck_list_unref_free (pkcs11_modules);
 	pkcs11_modules = NULL;
@@ -409,6 +730,10 @@ gkd_ssh_agent_initialize_with_module (GckModule *module)
 	pkcs11_main_checked = FALSE;
 	pkcs11_main_session = session;
 
+	pkcs11_pool_cond = g_new0 (GCond, 1);
+	g_cond_init (pkcs11_pool_cond);
+	pkcs11_slot = gck_session_get_slot (session);
+
 	return TRUE;
 }
 
@@ -444,6 +769,13 @@ gkd_ssh_agent_startup (const gchar *prefix)
 		return -1;
 	}
 
+	if (!start_agent_loop ()) {
+		stop_agent_loop ();
+		close (sock);
+		unlink (socket_path);
+		return -1;
+	}
+
 	g_setenv ("SSH_AUTH_SOCK", socket_path, TRUE);
 
 	socket_fd = sock;
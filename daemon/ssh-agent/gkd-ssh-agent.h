@@ -37,4 +37,8 @@ gboolean          gkd_ssh_agent_initialize              (CK_FUNCTION_LIST_PTR fu
 
 void              gkd_ssh_agent_uninitialize            (void);
 
+void              gkd_ssh_agent_identities_changed      (void);
+
+void              gkd_ssh_agent_watch_directory         (const gchar *directory);
+
 #endif /* GKDSSHAGENT_H_ */
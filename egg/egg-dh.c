@@ -357,3 +357,69 @@ egg_dh_gen_secret (gcry_mpi_t peer, gcry_mpi_t priv,
 
 	return value;
 }
+
+/*
+ * The X25519 functions below work on the 32 byte little endian strings
+ * of RFC 7748, rather than on numbers. The private key is expected to be
+ * in secure memory.
+ */
+
+gboolean
+egg_dh_x25519_gen_pair (guchar *pub, guchar *priv)
+{
+#ifdef EGG_DH_HAVE_X25519
+	static const guchar basepoint[EGG_DH_X25519_SIZE] = { 9, };
+	gcry_error_t gcry;
+
+	g_return_val_if_fail (pub, FALSE);
+	g_return_val_if_fail (priv, FALSE);
+
+	/* Clamp the random scalar the way RFC 7748 describes */
+	gcry_randomize (priv, EGG_DH_X25519_SIZE, GCRY_STRONG_RANDOM);
+	priv[0] &= 248;
+	priv[31] &= 127;
+	priv[31] |= 64;
+
+	gcry = gcry_ecc_mul_point (GCRY_ECC_CURVE25519, pub, priv, basepoint);
+	g_return_val_if_fail (gcry == 0, FALSE);
+
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+gpointer
+egg_dh_x25519_gen_secret (const guchar *peer, const guchar *priv, gsize *bytes)
+{
+#ifdef EGG_DH_HAVE_X25519
+	gcry_error_t gcry;
+	guchar *value;
+	guchar check = 0;
+	gsize i;
+
+	g_return_val_if_fail (peer, NULL);
+	g_return_val_if_fail (priv, NULL);
+	g_return_val_if_fail (bytes, NULL);
+
+	value = egg_secure_alloc (EGG_DH_X25519_SIZE);
+	gcry = gcry_ecc_mul_point (GCRY_ECC_CURVE25519, value, priv, peer);
+	if (gcry != 0) {
+		egg_secure_free (value);
+		return NULL;
+	}
+
+	/* A peer value of small order gives all zeros, which is no secret */
+	for (i = 0; i < EGG_DH_X25519_SIZE; i++)
+		check |= value[i];
+	if (check == 0) {
+		egg_secure_free (value);
+		return NULL;
+	}
+
+	*bytes = EGG_DH_X25519_SIZE;
+	return value;
+#else
+	return NULL;
+#endif
+}
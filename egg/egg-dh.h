@@ -25,6 +25,13 @@
 
 #include <gcrypt.h>
 
+/* Curve25519 needs gcry_ecc_mul_point () */
+#if GCRYPT_VERSION_NUMBER >= 0x010900
+#define EGG_DH_HAVE_X25519 1
+#endif
+
+#define EGG_DH_X25519_SIZE 32
+
 gboolean   egg_dh_default_params                              (const gchar *name,
                                                                gcry_mpi_t *prime,
                                                                gcry_mpi_t *base);
@@ -46,4 +53,11 @@ gpointer   egg_dh_gen_secret                                  (gcry_mpi_t peer,
                                                                gcry_mpi_t prime,
                                                                gsize *bytes);
 
+gboolean   egg_dh_x25519_gen_pair                             (guchar *pub,
+                                                               guchar *priv);
+
+gpointer   egg_dh_x25519_gen_secret                           (const guchar *peer,
+                                                               const guchar *priv,
+                                                               gsize *bytes);
+
 #endif /* EGG_DH_H_ */
@@ -40,6 +40,10 @@
 #include <unistd.h>
 #include <assert.h>
 
+#ifdef HAVE_PTHREAD_KEY_CREATE
+#include <pthread.h>
+#endif
+
 #ifdef WITH_VALGRIND
 #include <valgrind/valgrind.h>
 #include <valgrind/memcheck.h>
@@ -55,6 +59,9 @@
 
 #define DEFAULT_BLOCK_SIZE 16384
 
+/* Allocations this size or larger get a guarded mapping of their own */
+#define LARGE_ALLOC_SIZE 4096
+
 /* Use our own assert to guarantee no glib allocations */
 #ifndef ASSERT
 #ifdef G_DISABLE_ASSERT
@@ -92,22 +99,47 @@ typedef struct _Cell {
 	size_t n_words;         /* Amount of secure memory in words */
 	size_t requested;       /* Amount actually requested by app, in bytes, 0 if unused */
 	const char *tag;        /* Tag which describes the allocation */
+	struct _Block *block;   /* Block this cell is carved from */
 	struct _Cell *next;     /* Next in memory ring */
 	struct _Cell *prev;     /* Previous in memory ring */
+	int cached;             /* Belongs to the thread caches, in no ring */
 } Cell;
 
 /*
  * A block of secure memory. This structure is the header in that block.
+ * Unused cells are not tracked per block, but in the size class bins
+ * below, which are shared between all blocks.
  */
 typedef struct _Block {
 	word_t *words;              /* Actual memory hangs off here */
 	size_t n_words;             /* Number of words in block */
 	size_t n_used;              /* Number of used allocations */
 	struct _Cell* used_cells;   /* Ring of used allocations */
-	struct _Cell* unused_cells; /* Ring of unused allocations */
+	size_t n_cached;            /* Words in cells belonging to the thread caches */
 	struct _Block *next;        /* Next block in list */
+	int large;                  /* Holds one large allocation, has guard pages */
 } Block;
 
+/*
+ * Unused cells are segregated by size into bins. The small bins each
+ * cover two words of payload, and small allocations are rounded up to
+ * the top of their bin, so that freed small cells are reused exactly
+ * (slab style) without having to be split. The remaining bins each
+ * cover a power of two range of payload words, the last one is open
+ * ended.
+ */
+#define SMALL_BINS      8
+#define SMALL_BIN_WORDS 2
+#define N_BINS          16
+
+static Cell *unused_bins[N_BINS] = { NULL, };
+
+#ifdef HAVE_PTHREAD_KEY_CREATE
+static int cache_enabled = 0;
+#else
+#define cache_enabled 0
+#endif
+
 /* -----------------------------------------------------------------------------
  * UNUSED STACK
  */
@@ -290,6 +322,74 @@ pool_valid (void* item)
 
 #endif /* G_DISABLE_ASSERT */
 
+/* -----------------------------------------------------------------------------
+ * TAG STATISTICS
+ *
+ * Always on counters for each allocation tag, only changed while holding
+ * the lock. The thread caches keep their own counts, and add them in the
+ * next time they take the lock. The table is keyed on the tag pointer,
+ * several entries with the same tag string are merged when reporting.
+ * Once the table is full further tags are counted together in the last
+ * slot.
+ */
+
+#define N_TAG_STATS 128
+
+typedef struct {
+	const char *tag;
+	size_t live;
+	size_t high_water;
+	size_t n_allocs;
+	size_t n_fallbacks;
+} TagStats;
+
+static TagStats tag_stats[N_TAG_STATS];
+
+static TagStats *
+stats_for_tag (const char *tag)
+{
+	unsigned int i, n;
+
+	i = ((size_t)tag >> 3) % (N_TAG_STATS - 1);
+	for (n = 0; n < N_TAG_STATS - 1; ++n, i = (i + 1) % (N_TAG_STATS - 1)) {
+		if (tag_stats[i].tag == tag)
+			return &tag_stats[i];
+		if (tag_stats[i].tag == NULL) {
+			tag_stats[i].tag = tag;
+			return &tag_stats[i];
+		}
+	}
+
+	return &tag_stats[N_TAG_STATS - 1];
+}
+
+static void
+stats_add (const char *tag,
+           size_t length,
+           size_t n_allocs)
+{
+	TagStats *stats;
+
+	stats = stats_for_tag (tag);
+	stats->n_allocs += n_allocs;
+	stats->live += length;
+	if (stats->live > stats->high_water)
+		stats->high_water = stats->live;
+}
+
+static void
+stats_remove (const char *tag,
+              size_t length)
+{
+	stats_for_tag (tag)->live -= length;
+}
+
+static void
+stats_fallback (const char *tag)
+{
+	stats_for_tag (tag)->n_fallbacks++;
+}
+
 /* -----------------------------------------------------------------------------
  * SEC ALLOCATION
  *
@@ -304,6 +404,60 @@ sec_size_to_words (size_t length)
 	return (length % sizeof (void*) ? 1 : 0) + (length / sizeof (void*));
 }
 
+static inline size_t
+sec_size_to_cell_words (size_t length)
+{
+	size_t n_words;
+
+	n_words = sec_size_to_words (length);
+
+	/* Small allocations are rounded up to the top of their bin */
+	if (n_words <= SMALL_BINS * SMALL_BIN_WORDS)
+		n_words = ((n_words + SMALL_BIN_WORDS - 1) / SMALL_BIN_WORDS) * SMALL_BIN_WORDS;
+
+	/* Two extra words for the guards */
+	return n_words + 2;
+}
+
+static inline unsigned int
+sec_bin_for_words (size_t n_words)
+{
+	unsigned int bin;
+	size_t payload;
+
+	ASSERT (n_words > 2);
+	payload = n_words - 2;
+
+	if (payload <= SMALL_BINS * SMALL_BIN_WORDS)
+		return (payload - 1) / SMALL_BIN_WORDS;
+
+	/* Power of two ranges above the small bins */
+	payload = (payload - 1) / (SMALL_BINS * SMALL_BIN_WORDS);
+	for (bin = SMALL_BINS; payload > 1 && bin < N_BINS - 1; payload >>= 1)
+		++bin;
+
+	return bin;
+}
+
+/* Whether a cell is exactly the size of a small bin */
+static inline int
+sec_is_small_cell (Cell *cell)
+{
+	size_t payload = cell->n_words - 2;
+	return payload <= SMALL_BINS * SMALL_BIN_WORDS &&
+	       payload % SMALL_BIN_WORDS == 0;
+}
+
+/*
+ * Cells of the thread caches are never unused, and their tag and length
+ * are only touched by the thread using them, so check the flag first.
+ */
+static inline int
+sec_is_unused_cell (Cell *cell)
+{
+	return !cell->cached && cell->requested == 0;
+}
+
 static inline void
 sec_write_guards (Cell *cell)
 {
@@ -394,6 +548,27 @@ sec_remove_cell_ring (Cell **ring, Cell *cell)
 	ASSERT (*ring != cell);
 }
 
+static void
+sec_unused_insert (Cell *cell)
+{
+	ASSERT (cell);
+	ASSERT (cell->block);
+	ASSERT (cell->requested == 0);
+	ASSERT (cell->tag == NULL);
+
+	sec_insert_cell_ring (&unused_bins[sec_bin_for_words (cell->n_words)], cell);
+}
+
+static void
+sec_unused_remove (Cell *cell)
+{
+	ASSERT (cell);
+	ASSERT (cell->requested == 0);
+
+	/* Must be called before cell->n_words changes */
+	sec_remove_cell_ring (&unused_bins[sec_bin_for_words (cell->n_words)], cell);
+}
+
 static inline void*
 sec_cell_to_memory (Cell *cell)
 {
@@ -488,21 +663,18 @@ sec_neighbor_after (Block *block, Cell *cell)
 }
 
 static void*
-sec_alloc (Block *block,
-           const char *tag,
+sec_alloc (const char *tag,
            size_t length)
 {
 	Cell *cell, *other;
+	Block *block;
+	unsigned int bin;
 	size_t n_words;
 	void *memory;
 
-	ASSERT (block);
 	ASSERT (length);
 	ASSERT (tag);
 
-	if (!block->unused_cells)
-		return NULL;
-
 	/*
 	 * Each memory allocation is aligned to a pointer size, and
 	 * then, sandwidched between two pointers to its meta data.
@@ -511,18 +683,25 @@ sec_alloc (Block *block,
 	 * We allocate memory in units of sizeof (void*)
 	 */
 
-	n_words = sec_size_to_words (length) + 2;
+	n_words = sec_size_to_cell_words (length);
+	bin = sec_bin_for_words (n_words);
 
-	/* Look for a cell of at least our required size */
-	cell = block->unused_cells;
-	while (cell->n_words < n_words) {
-		cell = cell->next;
-		if (cell == block->unused_cells) {
-			cell = NULL;
-			break;
+	/* Look for a cell of at least our required size in our own bin */
+	cell = unused_bins[bin];
+	if (cell) {
+		while (cell->n_words < n_words) {
+			cell = cell->next;
+			if (cell == unused_bins[bin]) {
+				cell = NULL;
+				break;
+			}
 		}
 	}
 
+	/* Any cell in a larger bin is big enough, use the smallest one */
+	while (!cell && ++bin < N_BINS)
+		cell = unused_bins[bin];
+
 	if (!cell)
 		return NULL;
 
@@ -530,31 +709,47 @@ sec_alloc (Block *block,
 	ASSERT (cell->requested == 0);
 	ASSERT (cell->prev);
 	ASSERT (cell->words);
+	ASSERT (cell->block);
 	sec_check_guards (cell);
 
+	block = cell->block;
+
 	/* Steal from the cell if it's too long */
 	if (cell->n_words > n_words + WASTE) {
 		other = pool_alloc ();
 		if (!other)
 			return NULL;
+
+		sec_unused_remove (cell);
 		other->n_words = n_words;
 		other->words = cell->words;
+		other->block = block;
 		cell->n_words -= n_words;
 		cell->words += n_words;
 
 		sec_write_guards (other);
 		sec_write_guards (cell);
+		sec_unused_insert (cell);
 
 		cell = other;
 	}
 
 	if (cell->next)
-		sec_remove_cell_ring (&block->unused_cells, cell);
+		sec_unused_remove (cell);
 
 	++block->n_used;
 	cell->tag = tag;
 	cell->requested = length;
-	sec_insert_cell_ring (&block->used_cells, cell);
+	stats_add (tag, length, 1);
+
+	/* Small cells can be kept by a thread cache once freed */
+	if (cache_enabled && sec_is_small_cell (cell)) {
+		cell->cached = 1;
+		block->n_cached += cell->n_words;
+	} else {
+		sec_insert_cell_ring (&block->used_cells, cell);
+	}
+
 	memory = sec_cell_to_memory (cell);
 
 #ifdef WITH_VALGRIND
@@ -595,15 +790,26 @@ sec_free (Block *block, void *memory)
 	sec_check_guards (cell);
 	ASSERT (cell->requested > 0);
 	ASSERT (cell->tag != NULL);
+	ASSERT (cell->block == block);
 
 	/* Remove from the used cell ring */
-	sec_remove_cell_ring (&block->used_cells, cell);
+	if (cell->cached) {
+		ASSERT (block->n_cached >= cell->n_words);
+		block->n_cached -= cell->n_words;
+		cell->cached = 0;
+	} else {
+		sec_remove_cell_ring (&block->used_cells, cell);
+	}
+	stats_remove (cell->tag, cell->requested);
+	cell->tag = NULL;
+	cell->requested = 0;
 
 	/* Find previous unallocated neighbor, and merge if possible */
 	other = sec_neighbor_before (block, cell);
-	if (other && other->requested == 0) {
+	if (other && sec_is_unused_cell (other)) {
 		ASSERT (other->tag == NULL);
 		ASSERT (other->next && other->prev);
+		sec_unused_remove (other);
 		other->n_words += cell->n_words;
 		sec_write_guards (other);
 		pool_free (cell);
@@ -612,24 +818,20 @@ sec_free (Block *block, void *memory)
 
 	/* Find next unallocated neighbor, and merge if possible */
 	other = sec_neighbor_after (block, cell);
-	if (other && other->requested == 0) {
+	if (other && sec_is_unused_cell (other)) {
 		ASSERT (other->tag == NULL);
 		ASSERT (other->next && other->prev);
+		sec_unused_remove (other);
 		other->n_words += cell->n_words;
 		other->words = cell->words;
-		if (cell->next)
-			sec_remove_cell_ring (&block->unused_cells, cell);
 		sec_write_guards (other);
 		pool_free (cell);
 		cell = other;
 	}
 
-	/* Add to the unused list if not already there */
-	if (!cell->next)
-		sec_insert_cell_ring (&block->unused_cells, cell);
+	/* Add to the bin for its (possibly merged) size */
+	sec_unused_insert (cell);
 
-	cell->tag = NULL;
-	cell->requested = 0;
 	--block->n_used;
 	return NULL;
 }
@@ -700,12 +902,14 @@ sec_realloc (Block *block,
 	valid = cell->requested;
 
 	/* How many words we actually want */
-	n_words = sec_size_to_words (length) + 2;
+	n_words = sec_size_to_cell_words (length);
 
 	/* Less memory is required than is in the cell */
 	if (n_words <= cell->n_words) {
 
 		/* TODO: No shrinking behavior yet */
+		stats_remove (cell->tag, valid);
+		stats_add (cell->tag, length, 0);
 		cell->requested = length;
 		alloc = sec_cell_to_memory (cell);
 
@@ -720,19 +924,28 @@ sec_realloc (Block *block,
 		return alloc;
 	}
 
+	/*
+	 * Large allocations only ever live in blocks of their own, so don't
+	 * grow into them here. Cells of the thread caches keep their size.
+	 * The caller allocates anew and copies.
+	 */
+	if (block->large || cell->cached || length >= LARGE_ALLOC_SIZE)
+		return NULL;
+
 	/* Need braaaaaiiiiiinsss... */
 	while (cell->n_words < n_words) {
 
 		/* See if we have a neighbor who can give us some memory */
 		other = sec_neighbor_after (block, cell);
-		if (!other || other->requested != 0)
+		if (!other || !sec_is_unused_cell (other))
 			break;
 
+		sec_unused_remove (other);
+
 		/* Eat the whole neighbor if not too big */
 		if (n_words - cell->n_words + WASTE >= other->n_words) {
 			cell->n_words += other->n_words;
 			sec_write_guards (cell);
-			sec_remove_cell_ring (&block->unused_cells, other);
 			pool_free (other);
 
 		/* Steal from the neighbor */
@@ -740,12 +953,15 @@ sec_realloc (Block *block,
 			other->words += n_words - cell->n_words;
 			other->n_words -= n_words - cell->n_words;
 			sec_write_guards (other);
+			sec_unused_insert (other);
 			cell->n_words = n_words;
 			sec_write_guards (cell);
 		}
 	}
 
 	if (cell->n_words >= n_words) {
+		stats_remove (cell->tag, valid);
+		stats_add (tag, length, 0);
 		cell->requested = length;
 		cell->tag = tag;
 		alloc = sec_cell_to_memory (cell);
@@ -754,7 +970,7 @@ sec_realloc (Block *block,
 	}
 
 	/* That didn't work, try alloc/free */
-	alloc = sec_alloc (block, tag, length);
+	alloc = sec_alloc (tag, length);
 	if (alloc) {
 		memcpy_with_vbits (alloc, memory, valid);
 		sec_free (block, memory);
@@ -801,6 +1017,8 @@ sec_validate (Block *block)
 {
 	Cell *cell;
 	word_t *word, *last;
+	size_t n_cached = 0;
+	int prev_unused = 0;
 
 #ifdef WITH_VALGRIND
 	if (RUNNING_ON_VALGRIND)
@@ -820,8 +1038,15 @@ sec_validate (Block *block)
 		/* Validate that it's actually for real */
 		sec_check_guards (cell);
 
+		/* Belongs to the thread caches, tag and length may be changing */
+		if (cell->cached) {
+			ASSERT (cell->next == NULL);
+			ASSERT (cell->prev == NULL);
+			ASSERT (sec_is_small_cell (cell));
+			n_cached += cell->n_words;
+
 		/* Is it an allocated block? */
-		if (cell->requested > 0) {
+		} else if (cell->requested > 0) {
 			ASSERT (cell->tag != NULL);
 			ASSERT (cell->next != NULL);
 			ASSERT (cell->prev != NULL);
@@ -836,12 +1061,40 @@ sec_validate (Block *block)
 			ASSERT (cell->prev != NULL);
 			ASSERT (cell->next->prev == cell);
 			ASSERT (cell->prev->next == cell);
+
+			/* Unused neighbors are always merged */
+			ASSERT (!prev_unused);
 		}
 
+		ASSERT (cell->block == block);
+		prev_unused = sec_is_unused_cell (cell);
+
 		word += cell->n_words;
 		if (word == last)
 			break;
 	}
+
+	ASSERT (n_cached == block->n_cached);
+}
+
+static void
+sec_validate_unused (void)
+{
+	unsigned int bin;
+	Cell *cell;
+
+	for (bin = 0; bin < N_BINS; ++bin) {
+		cell = unused_bins[bin];
+		if (cell == NULL)
+			continue;
+		do {
+			ASSERT (cell->requested == 0);
+			ASSERT (cell->tag == NULL);
+			ASSERT (cell->block != NULL);
+			ASSERT (sec_bin_for_words (cell->n_words) == bin);
+			cell = cell->next;
+		} while (cell != unused_bins[bin]);
+	}
 }
 
 /* -----------------------------------------------------------------------------
@@ -850,10 +1103,12 @@ sec_validate (Block *block)
 
 static void*
 sec_acquire_pages (size_t *sz,
+                   int guarded,
                    const char *during_tag)
 {
 	void *pages;
 	unsigned long pgsize;
+	size_t mapped;
 
 	ASSERT (sz);
 	ASSERT (*sz);
@@ -864,7 +1119,10 @@ sec_acquire_pages (size_t *sz,
 	*sz = (*sz + pgsize -1) & ~(pgsize - 1);
 
 #if defined(HAVE_MLOCK)
-	pages = mmap (0, *sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	/* Guarded pages have an inaccessible page on either side */
+	mapped = guarded ? *sz + 2 * pgsize : *sz;
+
+	pages = mmap (0, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
 	if (pages == MAP_FAILED) {
 		if (show_warning && egg_secure_warnings)
 			fprintf (stderr, "couldn't map %lu bytes of memory (%s): %s\n",
@@ -873,13 +1131,26 @@ sec_acquire_pages (size_t *sz,
 		return NULL;
 	}
 
+	if (guarded) {
+		if (mprotect (pages, pgsize, PROT_NONE) < 0 ||
+		    mprotect ((char *)pages + pgsize + *sz, pgsize, PROT_NONE) < 0) {
+			if (show_warning && egg_secure_warnings)
+				fprintf (stderr, "couldn't protect guard pages (%s): %s\n",
+				         during_tag, strerror (errno));
+			show_warning = 0;
+			munmap (pages, mapped);
+			return NULL;
+		}
+		pages = (char *)pages + pgsize;
+	}
+
 	if (mlock (pages, *sz) < 0) {
 		if (show_warning && egg_secure_warnings && errno != EPERM) {
 			fprintf (stderr, "couldn't lock %lu bytes of memory (%s): %s\n",
 			         (unsigned long)*sz, during_tag, strerror (errno));
 			show_warning = 0;
 		}
-		munmap (pages, *sz);
+		munmap (guarded ? (char *)pages - pgsize : pages, mapped);
 		return NULL;
 	}
 
@@ -898,7 +1169,7 @@ sec_acquire_pages (size_t *sz,
 }
 
 static void
-sec_release_pages (void *pages, size_t sz)
+sec_release_pages (void *pages, size_t sz, int guarded)
 {
 	ASSERT (pages);
 	ASSERT (sz % getpagesize () == 0);
@@ -907,6 +1178,12 @@ sec_release_pages (void *pages, size_t sz)
 	if (munlock (pages, sz) < 0 && egg_secure_warnings)
 		fprintf (stderr, "couldn't unlock private memory: %s\n", strerror (errno));
 
+	/* Also unmap the guard pages on either side */
+	if (guarded) {
+		pages = (char *)pages - getpagesize ();
+		sz += 2 * getpagesize ();
+	}
+
 	if (munmap (pages, sz) < 0 && egg_secure_warnings)
 		fprintf (stderr, "couldn't unmap private anonymous memory: %s\n", strerror (errno));
 
@@ -917,6 +1194,112 @@ sec_release_pages (void *pages, size_t sz)
 #endif
 }
 
+#ifdef HAVE_PTHREAD_KEY_CREATE
+
+/* -----------------------------------------------------------------------------
+ * BLOCK RANGES
+ *
+ * The address ranges of the small blocks, so that the thread caches can
+ * tell secure memory from fallback memory without taking any lock. Only
+ * changed while holding the lock. Slots are appended to the table, and
+ * then published by raising the count, which never goes down. Slots of
+ * destroyed blocks are reused, so each has a sequence number which is
+ * odd while it's being changed. A reader which sees a slot change under
+ * it just takes the locked path. Blocks which don't fit in the table
+ * always go through the locked path too.
+ */
+
+#define N_RANGES 64
+
+typedef struct {
+	unsigned int seq;
+	word_t *words;
+	word_t *end;
+} Range;
+
+static Range block_ranges[N_RANGES];
+static unsigned int n_block_ranges = 0;
+
+static void
+sec_range_set (Range *range,
+               word_t *words,
+               word_t *end)
+{
+	unsigned int seq = range->seq;
+
+	__atomic_store_n (&range->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	__atomic_store_n (&range->words, words, __ATOMIC_RELAXED);
+	__atomic_store_n (&range->end, end, __ATOMIC_RELAXED);
+	__atomic_store_n (&range->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Called while holding the lock */
+static void
+sec_range_add (Block *block)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_block_ranges; ++i) {
+		if (block_ranges[i].words == NULL)
+			break;
+	}
+
+	if (i == N_RANGES)
+		return;
+
+	sec_range_set (&block_ranges[i], block->words, block->words + block->n_words);
+	if (i == n_block_ranges)
+		__atomic_store_n (&n_block_ranges, i + 1, __ATOMIC_RELEASE);
+}
+
+/* Called while holding the lock */
+static void
+sec_range_remove (Block *block)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_block_ranges; ++i) {
+		if (block_ranges[i].words == block->words) {
+			sec_range_set (&block_ranges[i], NULL, NULL);
+			break;
+		}
+	}
+}
+
+static int
+sec_range_contains (const void *memory)
+{
+	unsigned int i, n, seq;
+	word_t *words, *end;
+
+	n = __atomic_load_n (&n_block_ranges, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; ++i) {
+		seq = __atomic_load_n (&block_ranges[i].seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			return 0;
+
+		words = __atomic_load_n (&block_ranges[i].words, __ATOMIC_RELAXED);
+		end = __atomic_load_n (&block_ranges[i].end, __ATOMIC_RELAXED);
+
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		if (__atomic_load_n (&block_ranges[i].seq, __ATOMIC_RELAXED) != seq)
+			return 0;
+
+		if (words != NULL && (word_t*)memory >= words && (word_t*)memory < end)
+			return 1;
+	}
+
+	return 0;
+}
+
+#else /* !HAVE_PTHREAD_KEY_CREATE */
+
+#define sec_range_add(block)
+#define sec_range_remove(block)
+
+#endif /* !HAVE_PTHREAD_KEY_CREATE */
+
 /* -----------------------------------------------------------------------------
  * MANAGE DIFFERENT BLOCKS
  */
@@ -950,7 +1333,7 @@ sec_block_create (size_t size,
 	if (size < DEFAULT_BLOCK_SIZE)
 		size = DEFAULT_BLOCK_SIZE;
 
-	block->words = sec_acquire_pages (&size, during_tag);
+	block->words = sec_acquire_pages (&size, 0, during_tag);
 	block->n_words = size / sizeof (word_t);
 	if (!block->words) {
 		pool_free (block);
@@ -966,11 +1349,13 @@ sec_block_create (size_t size,
 	cell->words = block->words;
 	cell->n_words = block->n_words;
 	cell->requested = 0;
+	cell->block = block;
 	sec_write_guards (cell);
-	sec_insert_cell_ring (&block->unused_cells, cell);
+	sec_unused_insert (cell);
 
 	block->next = all_blocks;
 	all_blocks = block;
+	sec_range_add (block);
 
 	return block;
 }
@@ -979,6 +1364,7 @@ static void
 sec_block_destroy (Block *block)
 {
 	Block *bl, **at;
+	word_t *word;
 	Cell *cell;
 
 	ASSERT (block);
@@ -996,20 +1382,387 @@ sec_block_destroy (Block *block)
 	/* Must have been found */
 	ASSERT (bl == block);
 	ASSERT (block->used_cells == NULL);
+	ASSERT (block->n_cached == 0);
 
-	/* Release all the meta data cells */
-	while (block->unused_cells) {
-		cell = block->unused_cells;
-		sec_remove_cell_ring (&block->unused_cells, cell);
-		pool_free (cell);
-	}
+	/* All memory in the block has been merged into one unused cell */
+	word = block->words;
+
+#ifdef WITH_VALGRIND
+	VALGRIND_MAKE_MEM_DEFINED (word, sizeof (word_t));
+#endif
+
+	ASSERT (pool_valid (*word));
+	cell = *word;
+	sec_check_guards (cell);
+
+	ASSERT (cell->block == block);
+	ASSERT (cell->n_words == block->n_words);
+	sec_unused_remove (cell);
+	pool_free (cell);
 
 	/* Release all pages of secure memory */
-	sec_release_pages (block->words, block->n_words * sizeof (word_t));
+	sec_range_remove (block);
+	sec_release_pages (block->words, block->n_words * sizeof (word_t), block->large);
 
 	pool_free (block);
 }
 
+/*
+ * A large allocation gets a block of its own, mapped with guard pages on
+ * either side. Nothing else is ever carved from it, and the mapping is
+ * returned to the OS as soon as it is freed, so the small blocks stay
+ * compact.
+ */
+static void*
+sec_alloc_large (const char *tag,
+                 size_t length)
+{
+	Block *block;
+	Cell *cell;
+	size_t size;
+	void *memory;
+
+	ASSERT (tag);
+	ASSERT (length >= LARGE_ALLOC_SIZE);
+
+	/* We can force all all memory to be malloced */
+	if (getenv ("SECMEM_FORCE_FALLBACK"))
+		return NULL;
+
+	block = pool_alloc ();
+	if (!block)
+		return NULL;
+
+	cell = pool_alloc ();
+	if (!cell) {
+		pool_free (block);
+		return NULL;
+	}
+
+	size = (sec_size_to_words (length) + 2) * sizeof (word_t);
+	block->words = sec_acquire_pages (&size, 1, tag);
+	block->n_words = size / sizeof (word_t);
+	block->large = 1;
+	if (!block->words) {
+		pool_free (block);
+		pool_free (cell);
+		return NULL;
+	}
+
+#ifdef WITH_VALGRIND
+	VALGRIND_MAKE_MEM_DEFINED (block->words, size);
+#endif
+
+	/* The one cell spans the whole block */
+	cell->words = block->words;
+	cell->n_words = block->n_words;
+	cell->block = block;
+	cell->tag = tag;
+	cell->requested = length;
+	sec_write_guards (cell);
+	sec_insert_cell_ring (&block->used_cells, cell);
+	block->n_used = 1;
+	stats_add (tag, length, 1);
+
+	block->next = all_blocks;
+	all_blocks = block;
+
+	memory = sec_cell_to_memory (cell);
+
+#ifdef WITH_VALGRIND
+	VALGRIND_MAKE_MEM_UNDEFINED (memory, length);
+#endif
+
+	return memset (memory, 0, length);
+}
+
+#ifdef HAVE_PTHREAD_KEY_CREATE
+
+/* -----------------------------------------------------------------------------
+ * THREAD CACHES
+ *
+ * Each thread keeps a cache of recently freed cells for the small bins.
+ * Once thread caches are enabled, small cells are marked as belonging to
+ * the caches when they're allocated, and are kept off the used ring of
+ * their block. They stay allocated as far as their blocks are concerned,
+ * so that neighbors never merge with them. Their tag and length are only
+ * touched by the thread which holds them, or while holding the lock by
+ * the thread they were handed out to. When a bin in the cache fills up,
+ * part of it is freed back to the blocks while holding the lock once.
+ *
+ * The changes to the tag statistics made by cached allocations are kept
+ * in the cache, and added to the table whenever the lock is taken.
+ */
+
+#define CACHE_DEPTH 16
+#define CACHE_FLUSH 8
+#define CACHE_TAGS  8
+
+typedef struct {
+	const char *tag;
+	ssize_t live;           /* Change in live bytes */
+	ssize_t peak;           /* Highest that change has been */
+	size_t n_allocs;
+} CacheStats;
+
+typedef struct {
+	unsigned int n_cells[SMALL_BINS];
+	Cell *cells[SMALL_BINS][CACHE_DEPTH];
+	unsigned int n_stats;
+	CacheStats stats[CACHE_TAGS];
+} Cache;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+/* Called while holding the lock */
+static void
+cache_apply_stats (Cache *cache)
+{
+	CacheStats *stats;
+	unsigned int i;
+
+	for (i = 0; i < cache->n_stats; ++i) {
+		stats = &cache->stats[i];
+		stats_add (stats->tag, stats->peak, stats->n_allocs);
+		stats_remove (stats->tag, stats->peak - stats->live);
+	}
+
+	cache->n_stats = 0;
+}
+
+static CacheStats *
+cache_stats_for_tag (Cache *cache,
+                     const char *tag)
+{
+	CacheStats *stats;
+	unsigned int i;
+
+	for (i = 0; i < cache->n_stats; ++i) {
+		if (cache->stats[i].tag == tag)
+			return &cache->stats[i];
+	}
+
+	if (cache->n_stats == CACHE_TAGS)
+		return NULL;
+
+	stats = &cache->stats[cache->n_stats++];
+	memset (stats, 0, sizeof (CacheStats));
+	stats->tag = tag;
+	return stats;
+}
+
+static void
+cache_flush (Cache *cache,
+             unsigned int bin,
+             unsigned int count)
+{
+	Block *block;
+	Cell *cell;
+
+	ASSERT (count <= cache->n_cells[bin]);
+
+	DO_LOCK ();
+
+		cache_apply_stats (cache);
+
+		while (count-- > 0) {
+			cell = cache->cells[bin][--cache->n_cells[bin]];
+			block = cell->block;
+			sec_free (block, sec_cell_to_memory (cell));
+			if (block->n_used == 0)
+				sec_block_destroy (block);
+		}
+
+	DO_UNLOCK ();
+}
+
+static void
+cache_destroy (void *data)
+{
+	Cache *cache = data;
+	unsigned int bin;
+
+	for (bin = 0; bin < SMALL_BINS; ++bin) {
+		if (cache->n_cells[bin] > 0)
+			cache_flush (cache, bin, cache->n_cells[bin]);
+	}
+
+	if (cache->n_stats > 0) {
+		DO_LOCK ();
+		cache_apply_stats (cache);
+		DO_UNLOCK ();
+	}
+
+	free (cache);
+}
+
+static void
+cache_key_create (void)
+{
+	if (pthread_key_create (&cache_key, cache_destroy) == 0)
+		cache_enabled = 1;
+}
+
+static Cache *
+cache_get (void)
+{
+	Cache *cache;
+
+	if (!cache_enabled)
+		return NULL;
+
+	cache = pthread_getspecific (cache_key);
+	if (cache == NULL) {
+		cache = calloc (1, sizeof (Cache));
+		if (cache == NULL)
+			return NULL;
+		if (pthread_setspecific (cache_key, cache) != 0) {
+			free (cache);
+			return NULL;
+		}
+	}
+
+	return cache;
+}
+
+static void*
+cache_alloc (const char *tag,
+             size_t length)
+{
+	CacheStats *added, *removed;
+	Cache *cache;
+	Cell *cell;
+	size_t n_words;
+	unsigned int bin;
+	void *memory;
+
+	n_words = sec_size_to_cell_words (length);
+	if (n_words > SMALL_BINS * SMALL_BIN_WORDS + 2)
+		return NULL;
+
+	cache = cache_get ();
+	if (cache == NULL)
+		return NULL;
+
+	bin = sec_bin_for_words (n_words);
+	if (cache->n_cells[bin] == 0)
+		return NULL;
+
+	cell = cache->cells[bin][cache->n_cells[bin] - 1];
+	ASSERT (cell->n_words == n_words);
+	sec_check_guards (cell);
+
+	/* Cached cells are counted as live under their previous tag */
+	removed = cache_stats_for_tag (cache, cell->tag);
+	added = cache_stats_for_tag (cache, tag);
+	if (removed == NULL || added == NULL) {
+		DO_LOCK ();
+		cache_apply_stats (cache);
+		DO_UNLOCK ();
+		removed = cache_stats_for_tag (cache, cell->tag);
+		added = cache_stats_for_tag (cache, tag);
+	}
+
+	removed->live -= cell->requested;
+	added->live += length;
+	if (added->live > added->peak)
+		added->peak = added->live;
+	added->n_allocs++;
+	cache->n_cells[bin]--;
+
+	cell->tag = tag;
+	cell->requested = length;
+	memory = sec_cell_to_memory (cell);
+
+#ifdef WITH_VALGRIND
+	VALGRIND_MAKE_MEM_UNDEFINED (memory, length);
+	VALGRIND_MALLOCLIKE_BLOCK (memory, length, sizeof (void*), 1);
+#endif
+
+	return memset (memory, 0, length);
+}
+
+static int
+cache_free (void *memory)
+{
+	Cache *cache;
+	Cell *cell;
+	word_t *word;
+	unsigned int bin;
+
+	cache = cache_get ();
+	if (cache == NULL)
+		return 0;
+
+	if (!sec_range_contains (memory))
+		return 0;
+
+	word = memory;
+	--word;
+
+#ifdef WITH_VALGRIND
+	VALGRIND_MAKE_MEM_DEFINED (word, sizeof (word_t));
+#endif
+
+	/* Only cells which belong to the thread caches */
+	cell = *word;
+	sec_check_guards (cell);
+	ASSERT (cell->requested > 0);
+	ASSERT (cell->tag != NULL);
+
+	if (!cell->cached)
+		return 0;
+	ASSERT (sec_is_small_cell (cell));
+	bin = sec_bin_for_words (cell->n_words);
+
+#ifdef WITH_VALGRIND
+	VALGRIND_FREELIKE_BLOCK (memory, sizeof (word_t));
+	VALGRIND_MAKE_MEM_DEFINED (memory, cell->requested);
+#endif
+
+	sec_clear_noaccess (memory, 0, cell->requested);
+
+	if (cache->n_cells[bin] == CACHE_DEPTH)
+		cache_flush (cache, bin, CACHE_FLUSH);
+	cache->cells[bin][cache->n_cells[bin]++] = cell;
+
+	return 1;
+}
+
+/* Called while holding the lock */
+static void
+cache_apply_current (void)
+{
+	Cache *cache;
+
+	if (cache_enabled) {
+		cache = pthread_getspecific (cache_key);
+		if (cache != NULL)
+			cache_apply_stats (cache);
+	}
+}
+
+void
+egg_secure_enable_thread_caches (void)
+{
+	pthread_once (&cache_once, cache_key_create);
+}
+
+#else /* !HAVE_PTHREAD_KEY_CREATE */
+
+#define cache_alloc(tag, length) NULL
+#define cache_free(memory) 0
+#define cache_apply_current()
+
+void
+egg_secure_enable_thread_caches (void)
+{
+	/* Not supported on this platform */
+}
+
+#endif /* !HAVE_PTHREAD_KEY_CREATE */
+
 /* ------------------------------------------------------------------------
  * PUBLIC FUNCTIONALITY
  */
@@ -1036,19 +1789,27 @@ egg_secure_alloc_full (const char *tag,
 	if (length == 0)
 		return NULL;
 
+	/* A recently freed cell of this thread */
+	memory = cache_alloc (tag, length);
+	if (memory != NULL)
+		return memory;
+
 	DO_LOCK ();
 
-		for (block = all_blocks; block; block = block->next) {
-			memory = sec_alloc (block, tag, length);
-			if (memory)
-				break;
-		}
+		cache_apply_current ();
 
-		/* None of the current blocks have space, allocate new */
-		if (!memory) {
-			block = sec_block_create (length, tag);
-			if (block)
-				memory = sec_alloc (block, tag, length);
+		if (length >= LARGE_ALLOC_SIZE) {
+			memory = sec_alloc_large (tag, length);
+
+		} else {
+			memory = sec_alloc (tag, length);
+
+			/* None of the current blocks have space, allocate new */
+			if (!memory) {
+				block = sec_block_create (length, tag);
+				if (block)
+					memory = sec_alloc (tag, length);
+			}
 		}
 
 #ifdef WITH_VALGRIND
@@ -1062,6 +1823,9 @@ egg_secure_alloc_full (const char *tag,
 		memory = EGG_SECURE_GLOBALS.fallback (NULL, length);
 		if (memory) /* Our returned memory is always zeroed */
 			memset (memory, 0, length);
+		DO_LOCK ();
+		stats_fallback (tag);
+		DO_UNLOCK ();
 	}
 
 	if (!memory)
@@ -1100,6 +1864,9 @@ egg_secure_realloc_full (const char *tag,
 
 	DO_LOCK ();
 
+		/* The cell may have come from this thread's cache */
+		cache_apply_current ();
+
 		/* Find out where it belongs to */
 		for (block = all_blocks; block; block = block->next) {
 			if (sec_is_valid_word (block, memory)) {
@@ -1175,8 +1942,14 @@ egg_secure_free_full (void *memory, int flags)
 	if (memory == NULL)
 		return;
 
+	/* Keep small cells around for this thread to reuse */
+	if (cache_free (memory))
+		return;
+
 	DO_LOCK ();
 
+		cache_apply_current ();
+
 		/* Find out where it belongs to */
 		for (block = all_blocks; block; block = block->next) {
 			if (sec_is_valid_word (block, memory))
@@ -1236,6 +2009,7 @@ egg_secure_validate (void)
 
 		for (block = all_blocks; block; block = block->next)
 			sec_validate (block);
+		sec_validate_unused ();
 
 	DO_UNLOCK ();
 }
@@ -1243,6 +2017,7 @@ egg_secure_validate (void)
 
 static egg_secure_rec *
 records_for_ring (Cell *cell_ring,
+                  Block *block,
                   egg_secure_rec *records,
                   unsigned int *count,
                   unsigned int *total)
@@ -1266,11 +2041,13 @@ records_for_ring (Cell *cell_ring,
 		}
 
 		if (cell != NULL) {
-			records[*count].request_length = cell->requested;
-			records[*count].block_length = cell->n_words * sizeof (word_t);
-			records[*count].tag = cell->tag;
-			(*count)++;
-			(*total) += cell->n_words;
+			if (cell->block == block) {
+				records[*count].request_length = cell->requested;
+				records[*count].block_length = cell->n_words * sizeof (word_t);
+				records[*count].tag = cell->tag;
+				(*count)++;
+				(*total) += cell->n_words;
+			}
 			cell = cell->next;
 		}
 	} while (cell != NULL && cell != cell_ring);
@@ -1278,12 +2055,39 @@ records_for_ring (Cell *cell_ring,
 	return records;
 }
 
+static egg_secure_rec *
+records_for_cached (Block *block,
+                    egg_secure_rec *records,
+                    unsigned int *count,
+                    unsigned int *total)
+{
+	egg_secure_rec *new_rec;
+
+	/* Only the thread using them may look at these cells */
+	new_rec = realloc (records, sizeof (egg_secure_rec) * (*count + 1));
+	if (new_rec == NULL) {
+		*count = 0;
+		free (records);
+		return NULL;
+	}
+
+	records = new_rec;
+	records[*count].request_length = 0;
+	records[*count].block_length = block->n_cached * sizeof (word_t);
+	records[*count].tag = "thread-caches";
+	(*count)++;
+	(*total) += block->n_cached;
+
+	return records;
+}
+
 egg_secure_rec *
 egg_secure_records (unsigned int *count)
 {
 	egg_secure_rec *records = NULL;
 	Block *block = NULL;
 	unsigned int total;
+	unsigned int bin;
 
 	*count = 0;
 
@@ -1292,10 +2096,13 @@ egg_secure_records (unsigned int *count)
 		for (block = all_blocks; block != NULL; block = block->next) {
 			total = 0;
 
-			records = records_for_ring (block->unused_cells, records, count, &total);
-			if (records == NULL)
-				break;
-			records = records_for_ring (block->used_cells, records, count, &total);
+			records = records_for_ring (block->used_cells, block, records, count, &total);
+			if (records != NULL && block->n_cached > 0)
+				records = records_for_cached (block, records, count, &total);
+			for (bin = 0; records != NULL && bin < N_BINS; ++bin) {
+				if (unused_bins[bin] != NULL)
+					records = records_for_ring (unused_bins[bin], block, records, count, &total);
+			}
 			if (records == NULL)
 				break;
 
@@ -1308,6 +2115,103 @@ egg_secure_records (unsigned int *count)
 	return records;
 }
 
+egg_secure_tag_rec *
+egg_secure_tag_records (unsigned int *count)
+{
+	egg_secure_tag_rec *records;
+	const char *tag;
+	unsigned int i, j;
+
+	*count = 0;
+	records = calloc (N_TAG_STATS, sizeof (egg_secure_tag_rec));
+	if (records == NULL)
+		return NULL;
+
+	DO_LOCK ();
+
+		cache_apply_current ();
+
+		for (i = 0; i < N_TAG_STATS; ++i) {
+			tag = tag_stats[i].tag;
+			if (tag == NULL && i != N_TAG_STATS - 1)
+				continue;
+			if (tag == NULL)
+				tag = "(other)";
+
+			/* Merge entries for the same tag in different places */
+			for (j = 0; j < *count; ++j) {
+				if (strcmp (records[j].tag, tag) == 0)
+					break;
+			}
+
+			if (j == *count) {
+				records[j].tag = tag;
+				(*count)++;
+			}
+
+			records[j].live_length += tag_stats[i].live;
+			records[j].high_water += tag_stats[i].high_water;
+			records[j].n_allocs += tag_stats[i].n_allocs;
+			records[j].n_fallbacks += tag_stats[i].n_fallbacks;
+		}
+
+	DO_UNLOCK ();
+
+	return records;
+}
+
+egg_secure_block_rec *
+egg_secure_block_records (unsigned int *count)
+{
+	egg_secure_block_rec *records = NULL;
+	egg_secure_block_rec *rec;
+	unsigned int bin, allocated = 0;
+	size_t n_free, n_largest;
+	Block *block;
+	Cell *cell;
+
+	*count = 0;
+
+	DO_LOCK ();
+
+		for (block = all_blocks; block != NULL; block = block->next)
+			allocated++;
+
+		if (allocated > 0)
+			records = calloc (allocated, sizeof (egg_secure_block_rec));
+
+		for (block = all_blocks; records != NULL && block != NULL; block = block->next) {
+			n_free = n_largest = 0;
+			for (bin = 0; bin < N_BINS; ++bin) {
+				cell = unused_bins[bin];
+				if (cell == NULL)
+					continue;
+				do {
+					if (cell->block == block) {
+						n_free += cell->n_words;
+						if (cell->n_words > n_largest)
+							n_largest = cell->n_words;
+					}
+					cell = cell->next;
+				} while (cell != unused_bins[bin]);
+			}
+
+			rec = &records[(*count)++];
+			rec->block_length = block->n_words * sizeof (word_t);
+			rec->used_length = (block->n_words - n_free) * sizeof (word_t);
+			rec->largest_free = n_largest * sizeof (word_t);
+			rec->n_used = block->n_used;
+			rec->large = block->large;
+
+			/* How much of the free memory can't be used for one allocation */
+			rec->fragmentation = n_free ? 1.0 - (double)n_largest / (double)n_free : 0.0;
+		}
+
+	DO_UNLOCK ();
+
+	return records;
+}
+
 char*
 egg_secure_strdup_full (const char *tag,
                         const char *str,
@@ -48,8 +48,8 @@ typedef struct {
 	const char *  pool_version;
 } egg_secure_glob;
 
-#define EGG_SECURE_POOL_VER_STR             "1.0"
-#define EGG_SECURE_GLOBALS SECMEM_pool_data_v1_0
+#define EGG_SECURE_POOL_VER_STR             "1.1"
+#define EGG_SECURE_GLOBALS SECMEM_pool_data_v1_1
 
 #define EGG_SECURE_DEFINE_GLOBALS(lock, unlock, fallback) \
 	egg_secure_glob EGG_SECURE_GLOBALS = { \
@@ -101,6 +101,13 @@ int    egg_secure_check        (const void* p);
 
 void   egg_secure_validate     (void);
 
+/*
+ * Keep per thread caches of freed small allocations. Only for use in
+ * programs, not in modules that may be unloaded, since each thread's
+ * cache is released by a thread specific data destructor.
+ */
+void   egg_secure_enable_thread_caches (void);
+
 char*  egg_secure_strdup_full  (const char *tag, const char *str, int options);
 
 char*  egg_secure_strndup_full (const char *tag, const char *str, size_t length, int options);
@@ -109,6 +116,10 @@ void   egg_secure_strclear     (char *str);
 
 void   egg_secure_strfree      (char *str);
 
+/*
+ * Cells belonging to the thread caches are listed together, one record
+ * per block with the "thread-caches" tag, whether in use or not.
+ */
 typedef struct {
 	const char *tag;
 	size_t request_length;
@@ -117,4 +128,33 @@ typedef struct {
 
 egg_secure_rec *   egg_secure_records    (unsigned int *count);
 
+/*
+ * Usage statistics, always kept. Returned arrays are freed with free().
+ * Memory held in thread caches counts as live for the tag that last
+ * used it. Allocations a thread makes from its cache are counted once
+ * that thread next takes the lock, so with thread caches the figures for
+ * other threads can lag behind, and the high water mark is approximate.
+ */
+
+typedef struct {
+	const char *tag;
+	size_t live_length;     /* Bytes currently allocated */
+	size_t high_water;      /* Most bytes ever allocated at once */
+	size_t n_allocs;        /* Number of allocations made */
+	size_t n_fallbacks;     /* Allocations that fell back to pageable memory */
+} egg_secure_tag_rec;
+
+egg_secure_tag_rec *     egg_secure_tag_records    (unsigned int *count);
+
+typedef struct {
+	size_t block_length;
+	size_t used_length;     /* Bytes in used cells, including guards */
+	size_t largest_free;    /* Largest unused cell */
+	size_t n_used;          /* Number of allocations */
+	double fragmentation;   /* 1 - largest_free / unused bytes */
+	int large;              /* Dedicated to one large allocation */
+} egg_secure_block_rec;
+
+egg_secure_block_rec *   egg_secure_block_records  (unsigned int *count);
+
 #endif /* EGG_SECURE_MEMORY_H */
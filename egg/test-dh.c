@@ -185,6 +185,109 @@ test_default_bad (void)
 	g_assert (!ret);
 }
 
+#ifdef EGG_DH_HAVE_X25519
+
+/* The test vectors from RFC 7748, section 6.1 */
+
+static const guchar x25519_alice_priv[] = {
+	0x77, 0x07, 0x6d, 0x0a, 0x73, 0x18, 0xa5, 0x7d,
+	0x3c, 0x16, 0xc1, 0x72, 0x51, 0xb2, 0x66, 0x45,
+	0xdf, 0x4c, 0x2f, 0x87, 0xeb, 0xc0, 0x99, 0x2a,
+	0xb1, 0x77, 0xfb, 0xa5, 0x1d, 0xb9, 0x2c, 0x2a,
+};
+
+static const guchar x25519_alice_pub[] = {
+	0x85, 0x20, 0xf0, 0x09, 0x89, 0x30, 0xa7, 0x54,
+	0x74, 0x8b, 0x7d, 0xdc, 0xb4, 0x3e, 0xf7, 0x5a,
+	0x0d, 0xbf, 0x3a, 0x0d, 0x26, 0x38, 0x1a, 0xf4,
+	0xeb, 0xa4, 0xa9, 0x8e, 0xaa, 0x9b, 0x4e, 0x6a,
+};
+
+static const guchar x25519_bob_priv[] = {
+	0x5d, 0xab, 0x08, 0x7e, 0x62, 0x4a, 0x8a, 0x4b,
+	0x79, 0xe1, 0x7f, 0x8b, 0x83, 0x80, 0x0e, 0xe6,
+	0x6f, 0x3b, 0xb1, 0x29, 0x26, 0x18, 0xb6, 0xfd,
+	0x1c, 0x2f, 0x8b, 0x27, 0xff, 0x88, 0xe0, 0xeb,
+};
+
+static const guchar x25519_bob_pub[] = {
+	0xde, 0x9e, 0xdb, 0x7d, 0x7b, 0x7d, 0xc1, 0xb4,
+	0xd3, 0x5b, 0x61, 0xc2, 0xec, 0xe4, 0x35, 0x37,
+	0x3f, 0x83, 0x43, 0xc8, 0x5b, 0x78, 0x67, 0x4d,
+	0xad, 0xfc, 0x7e, 0x14, 0x6f, 0x88, 0x2b, 0x4f,
+};
+
+static const guchar x25519_shared[] = {
+	0x4a, 0x5d, 0x9d, 0x5b, 0xa4, 0xce, 0x2d, 0xe1,
+	0x72, 0x8e, 0x3b, 0xf4, 0x80, 0x35, 0x0f, 0x25,
+	0xe0, 0x7e, 0x21, 0xc9, 0x47, 0xd1, 0x9e, 0x33,
+	0x76, 0xf0, 0x9b, 0x3c, 0x1e, 0x16, 0x17, 0x42,
+};
+
+static void
+test_x25519_vectors (void)
+{
+	static const guchar basepoint[EGG_DH_X25519_SIZE] = { 9, };
+	gpointer k;
+	gsize n_k;
+
+	k = egg_dh_x25519_gen_secret (basepoint, x25519_alice_priv, &n_k);
+	g_assert (k);
+	egg_assert_cmpmem (k, n_k, ==, x25519_alice_pub, sizeof (x25519_alice_pub));
+	egg_secure_free (k);
+
+	k = egg_dh_x25519_gen_secret (x25519_bob_pub, x25519_alice_priv, &n_k);
+	g_assert (k);
+	egg_assert_cmpmem (k, n_k, ==, x25519_shared, sizeof (x25519_shared));
+	egg_secure_free (k);
+
+	k = egg_dh_x25519_gen_secret (x25519_alice_pub, x25519_bob_priv, &n_k);
+	g_assert (k);
+	egg_assert_cmpmem (k, n_k, ==, x25519_shared, sizeof (x25519_shared));
+	egg_secure_free (k);
+}
+
+static void
+test_x25519_perform (void)
+{
+	guchar pub1[EGG_DH_X25519_SIZE];
+	guchar pub2[EGG_DH_X25519_SIZE];
+	guchar *priv1, *priv2;
+	gpointer k1, k2;
+	gsize n1, n2;
+
+	priv1 = egg_secure_alloc (EGG_DH_X25519_SIZE);
+	priv2 = egg_secure_alloc (EGG_DH_X25519_SIZE);
+
+	g_assert (egg_dh_x25519_gen_pair (pub1, priv1));
+	g_assert (egg_dh_x25519_gen_pair (pub2, priv2));
+
+	k1 = egg_dh_x25519_gen_secret (pub2, priv1, &n1);
+	g_assert (k1);
+	k2 = egg_dh_x25519_gen_secret (pub1, priv2, &n2);
+	g_assert (k2);
+
+	egg_assert_cmpmem (k1, n1, ==, k2, n2);
+
+	egg_secure_free (priv1);
+	egg_secure_free (priv2);
+	egg_secure_free (k1);
+	egg_secure_free (k2);
+}
+
+static void
+test_x25519_small_order (void)
+{
+	static const guchar zero[EGG_DH_X25519_SIZE] = { 0, };
+	gpointer k;
+	gsize n_k;
+
+	k = egg_dh_x25519_gen_secret (zero, x25519_alice_priv, &n_k);
+	g_assert (k == NULL);
+}
+
+#endif /* EGG_DH_HAVE_X25519 */
+
 int
 main (int argc, char **argv)
 {
@@ -204,5 +307,11 @@ main (int argc, char **argv)
 	g_test_add_func ("/dh/default_8192", test_default_8192);
 	g_test_add_func ("/dh/default_bad", test_default_bad);
 
+#ifdef EGG_DH_HAVE_X25519
+	g_test_add_func ("/dh/x25519_vectors", test_x25519_vectors);
+	g_test_add_func ("/dh/x25519_perform", test_x25519_perform);
+	g_test_add_func ("/dh/x25519_small_order", test_x25519_small_order);
+#endif
+
 	return g_test_run ();
 }
@@ -125,6 +125,121 @@ test_alloc_two (void)
 	egg_secure_free_full (p, 0);
 }
 
+static void
+test_reuse_small (void)
+{
+	gpointer p, p2, p3, p4;
+
+	p = egg_secure_alloc_full ("tests", 20, 0);
+	p2 = egg_secure_alloc_full ("tests", 20, 0);
+	p3 = egg_secure_alloc_full ("tests", 20, 0);
+	g_assert (p != NULL && p2 != NULL && p3 != NULL);
+
+	memset (p2, 0x67, 20);
+	egg_secure_free_full (p2, 0);
+
+	/* Same size class, should exactly reuse the freed cell */
+	p4 = egg_secure_alloc_full ("tests", 24, 0);
+	g_assert (p4 == p2);
+	g_assert_cmpint (G_MAXSIZE, ==, find_non_zero (p4, 24));
+
+	egg_secure_validate ();
+
+	egg_secure_free_full (p, 0);
+	egg_secure_free_full (p3, 0);
+	egg_secure_free_full (p4, 0);
+}
+
+static void
+test_alloc_large (void)
+{
+	egg_secure_rec *records;
+	gpointer p, p2;
+	guint count;
+
+	p = egg_secure_alloc_full ("tests", 64, 0);
+	g_assert (p != NULL);
+
+	p2 = egg_secure_alloc_full ("tests", 10000, 0);
+	g_assert (p2 != NULL);
+	g_assert (egg_secure_check (p2));
+	g_assert_cmpint (G_MAXSIZE, ==, find_non_zero (p2, 10000));
+	memset (p2, 0x67, 10000);
+
+	/* The large allocation has a block of its own */
+	egg_secure_free_full (p, 0);
+	records = egg_secure_records (&count);
+	g_assert_cmpuint (count, ==, 1);
+	g_assert_cmpuint (records[0].request_length, ==, 10000);
+	free (records);
+
+	/* Which goes away when freed */
+	egg_secure_free_full (p2, 0);
+	records = egg_secure_records (&count);
+	g_assert_cmpuint (count, ==, 0);
+	free (records);
+}
+
+static egg_secure_tag_rec *
+find_tag_record (egg_secure_tag_rec *records,
+                 guint count,
+                 const gchar *tag)
+{
+	guint i;
+
+	for (i = 0; i < count; i++) {
+		if (g_str_equal (records[i].tag, tag))
+			return records + i;
+	}
+
+	return NULL;
+}
+
+static void
+test_tag_records (void)
+{
+	egg_secure_tag_rec *records, *rec;
+	egg_secure_block_rec *blocks;
+	gpointer p, p2;
+	guint count, i;
+	gsize used;
+
+	/*
+	 * Too large for the thread caches, and a tag of its own, so that
+	 * the counts don't depend on what the other tests left behind.
+	 */
+	p = egg_secure_alloc_full ("tag-records", 1000, 0);
+	p2 = egg_secure_alloc_full ("tag-records", 2000, 0);
+	g_assert (p != NULL && p2 != NULL);
+	egg_secure_free_full (p, 0);
+
+	records = egg_secure_tag_records (&count);
+	rec = find_tag_record (records, count, "tag-records");
+	g_assert (rec != NULL);
+	g_assert_cmpuint (rec->live_length, ==, 2000);
+	g_assert_cmpuint (rec->high_water, ==, 3000);
+	g_assert_cmpuint (rec->n_allocs, ==, 2);
+	g_assert_cmpuint (rec->n_fallbacks, ==, 0);
+	free (records);
+
+	blocks = egg_secure_block_records (&count);
+	g_assert_cmpuint (count, >=, 1);
+	for (i = 0, used = 0; i < count; i++) {
+		g_assert (blocks[i].fragmentation >= 0.0 && blocks[i].fragmentation <= 1.0);
+		used += blocks[i].used_length;
+	}
+	g_assert_cmpuint (used, >=, 2000);
+	free (blocks);
+
+	egg_secure_free_full (p2, 0);
+
+	records = egg_secure_tag_records (&count);
+	rec = find_tag_record (records, count, "tag-records");
+	g_assert_cmpuint (rec->live_length, ==, 0);
+	g_assert_cmpuint (rec->n_allocs, ==, 2);
+	free (records);
+}
+
 static void
 test_realloc (void)
 {
@@ -252,6 +367,88 @@ test_strclear (void)
 	egg_secure_free_full (str, 0);
 }
 
+static gpointer
+thread_cache_worker (gpointer user_data)
+{
+	gpointer p, p2;
+
+	p = egg_secure_alloc_full ("tests", 32, 0);
+	g_assert (p != NULL);
+	memset (p, 0x67, 32);
+	egg_secure_free_full (p, 0);
+
+	/* Comes straight back out of this thread's cache */
+	p2 = egg_secure_alloc_full ("tests", 32, 0);
+	g_assert (p2 == p);
+	g_assert_cmpint (G_MAXSIZE, ==, find_non_zero (p2, 32));
+	egg_secure_free_full (p2, 0);
+
+	return NULL;
+}
+
+static void
+test_thread_cache (void)
+{
+	egg_secure_rec *records;
+	GThread *thread;
+	guint count;
+
+	egg_secure_enable_thread_caches ();
+
+	thread = g_thread_new ("cache", thread_cache_worker, NULL);
+	g_thread_join (thread);
+
+	/* The cache is flushed back when the thread exits */
+	records = egg_secure_records (&count);
+	g_assert_cmpuint (count, ==, 0);
+	free (records);
+}
+
+static gpointer
+cache_stats_worker (gpointer user_data)
+{
+	gpointer p;
+
+	p = egg_secure_alloc_full ("cache-stats-old", 32, 0);
+	g_assert (p != NULL);
+	egg_secure_free_full (p, 0);
+
+	/* Out of this thread's cache, its stats not yet applied */
+	p = egg_secure_alloc_full ("cache-stats", 24, 0);
+	g_assert (p != NULL);
+
+	p = egg_secure_realloc_full ("cache-stats", p, 8, 0);
+	g_assert (p != NULL);
+	egg_secure_free_full (p, 0);
+
+	return NULL;
+}
+
+static void
+test_thread_cache_stats (void)
+{
+	egg_secure_tag_rec *records, *rec;
+	GThread *thread;
+	guint count;
+
+	egg_secure_enable_thread_caches ();
+
+	thread = g_thread_new ("cache-stats", cache_stats_worker, NULL);
+	g_thread_join (thread);
+
+	records = egg_secure_tag_records (&count);
+	rec = find_tag_record (records, count, "cache-stats");
+	g_assert (rec != NULL);
+	g_assert_cmpuint (rec->live_length, ==, 0);
+	g_assert_cmpuint (rec->high_water, ==, 24);
+	g_assert_cmpuint (rec->n_allocs, ==, 1);
+	rec = find_tag_record (records, count, "cache-stats-old");
+	g_assert (rec != NULL);
+	g_assert_cmpuint (rec->live_length, ==, 0);
+	g_assert_cmpuint (rec->high_water, ==, 32);
+	free (records);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -260,10 +457,15 @@ main (int argc, char **argv)
 	g_test_add_func ("/secmem/alloc_free", test_alloc_free);
 	g_test_add_func ("/secmem/realloc_across", test_realloc_across);
 	g_test_add_func ("/secmem/alloc_two", test_alloc_two);
+	g_test_add_func ("/secmem/alloc_large", test_alloc_large);
+	g_test_add_func ("/secmem/tag_records", test_tag_records);
+	g_test_add_func ("/secmem/reuse_small", test_reuse_small);
 	g_test_add_func ("/secmem/realloc", test_realloc);
 	g_test_add_func ("/secmem/multialloc", test_multialloc);
 	g_test_add_func ("/secmem/clear", test_clear);
 	g_test_add_func ("/secmem/strclear", test_strclear);
+	g_test_add_func ("/secmem/thread_cache", test_thread_cache);
+	g_test_add_func ("/secmem/thread_cache_stats", test_thread_cache_stats);
 
 	return g_test_run ();
 }
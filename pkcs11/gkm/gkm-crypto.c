@@ -31,9 +31,12 @@
 #include "gkm-sexp.h"
 #include "gkm-sexp-key.h"
 
+#include "egg/egg-buffer.h"
 #include "egg/egg-libgcrypt.h"
 #include "egg/egg-secure-memory.h"
 
+EGG_SECURE_DECLARE (crypto);
+
 /* ----------------------------------------------------------------------------
  * PUBLIC
  */
@@ -407,6 +410,10 @@ gkm_crypto_generate_key_pair (GkmSession *session, CK_MECHANISM_TYPE mech,
 		return gkm_dh_mechanism_generate (session, pub_atts, n_pub_atts,
 		                                  priv_atts, n_priv_atts,
 		                                  pub_key, priv_key);
+	case CKM_G_X25519_KEY_PAIR_GEN:
+		return gkm_dh_mechanism_generate_x25519 (session, pub_atts, n_pub_atts,
+		                                         priv_atts, n_priv_atts,
+		                                         pub_key, priv_key);
 	default:
 		return CKR_MECHANISM_INVALID;
 	}
@@ -430,6 +437,9 @@ gkm_crypto_derive_key (GkmSession *session, CK_MECHANISM_PTR mech, GkmObject *ba
 	case CKM_DH_PKCS_DERIVE:
 		return gkm_dh_mechanism_derive (session, mech, base, attrs,
 		                                n_attrs, derived);
+	case CKM_G_X25519_DERIVE:
+		return gkm_dh_mechanism_derive_x25519 (session, mech, base, attrs,
+		                                       n_attrs, derived);
 	case CKM_G_HKDF_SHA256_DERIVE:
 		return gkm_hkdf_mechanism_derive (session, "sha256", mech, base,
 		                                  attrs, n_attrs, derived);
@@ -438,6 +448,116 @@ gkm_crypto_derive_key (GkmSession *session, CK_MECHANISM_PTR mech, GkmObject *ba
 	}
 }
 
+/* The parameter can come straight out of an RPC message, and be unaligned */
+static CK_ULONG
+wrap_multiple_param (CK_MECHANISM_PTR mech, CK_ULONG index)
+{
+	CK_ULONG value;
+
+	memcpy (&value, (guchar *)mech->pParameter + index * sizeof (CK_ULONG), sizeof (value));
+	return value;
+}
+
+static CK_RV
+wrap_multiple (GkmSession *session, CK_MECHANISM_PTR mech, GkmObject *wrapper,
+               GkmObject *wrapped, CK_BYTE_PTR output, CK_ULONG_PTR n_output)
+{
+	CK_ULONG n_objects;
+	CK_MECHANISM inner;
+	GkmObject *object;
+	EggBuffer buffer;
+	guchar iv[16];
+	guchar *at;
+	CK_ULONG n_wrapped;
+	CK_ULONG length = 0;
+	CK_ULONG i;
+	CK_RV rv;
+
+	/* The inner mechanism, and then at least the wrapped object */
+	if (!mech->pParameter || mech->ulParameterLen % sizeof (CK_ULONG) != 0 ||
+	    mech->ulParameterLen < 2 * sizeof (CK_ULONG))
+		return CKR_MECHANISM_PARAM_INVALID;
+
+	n_objects = mech->ulParameterLen / sizeof (CK_ULONG) - 1;
+	if (wrap_multiple_param (mech, 1) != gkm_object_get_handle (wrapped))
+		return CKR_MECHANISM_PARAM_INVALID;
+
+	inner.mechanism = wrap_multiple_param (mech, 0);
+	switch (inner.mechanism) {
+	case CKM_AES_CBC_PAD:
+		inner.pParameter = iv;
+		inner.ulParameterLen = sizeof (iv);
+		break;
+	case CKM_G_NULL:
+		inner.pParameter = NULL;
+		inner.ulParameterLen = 0;
+		break;
+	default:
+		return CKR_MECHANISM_PARAM_INVALID;
+	}
+
+	/* The values may be in the clear, when wrapped with CKM_G_NULL */
+	if (output)
+		egg_buffer_init_full (&buffer, 256, egg_secure_realloc);
+
+	for (i = 0; i < n_objects; i++) {
+		rv = gkm_session_lookup_readable_object (session, wrap_multiple_param (mech, i + 1), &object);
+		if (rv == CKR_OK)
+			rv = gkm_crypto_wrap_key (session, &inner, wrapper, object, NULL, &n_wrapped);
+
+		/* They just want the length */
+		if (!output) {
+			length += 4;
+			if (rv == CKR_OK)
+				length += 4 + inner.ulParameterLen + 4 + n_wrapped;
+			continue;
+		}
+
+		if (rv == CKR_OK) {
+			if (inner.pParameter)
+				gcry_create_nonce (inner.pParameter, inner.ulParameterLen);
+			egg_buffer_add_uint32 (&buffer, CKR_OK);
+			egg_buffer_add_byte_array (&buffer, inner.pParameter, inner.ulParameterLen);
+			at = egg_buffer_add_byte_array_empty (&buffer, n_wrapped);
+			if (at == NULL) {
+				rv = CKR_HOST_MEMORY;
+				break;
+			}
+
+			rv = gkm_crypto_wrap_key (session, &inner, wrapper, object, at, &n_wrapped);
+			if (rv != CKR_OK)
+				break;
+			g_assert (at + n_wrapped <= buffer.buf + buffer.len);
+
+			/* Padding can come out shorter than the length asked for */
+			egg_buffer_set_uint32 (&buffer, (at - buffer.buf) - 4, n_wrapped);
+			buffer.len = (at - buffer.buf) + n_wrapped;
+		} else {
+			egg_buffer_add_uint32 (&buffer, rv);
+			rv = CKR_OK;
+		}
+	}
+
+	if (!output) {
+		*n_output = length;
+		return CKR_OK;
+	}
+
+	if (rv == CKR_OK && egg_buffer_has_error (&buffer))
+		rv = CKR_HOST_MEMORY;
+
+	if (rv == CKR_OK) {
+		if (*n_output < buffer.len)
+			rv = CKR_BUFFER_TOO_SMALL;
+		else
+			memcpy (output, buffer.buf, buffer.len);
+		*n_output = buffer.len;
+	}
+
+	egg_buffer_uninit (&buffer);
+	return rv;
+}
+
 CK_RV
 gkm_crypto_wrap_key (GkmSession *session, CK_MECHANISM_PTR mech, GkmObject *wrapper,
                      GkmObject *wrapped, CK_BYTE_PTR output, CK_ULONG_PTR n_output)
@@ -448,6 +568,10 @@ gkm_crypto_wrap_key (GkmSession *session, CK_MECHANISM_PTR mech, GkmObject *wrap
 	g_return_val_if_fail (mech, CKR_GENERAL_ERROR);
 	g_return_val_if_fail (n_output, CKR_GENERAL_ERROR);
 
+	/* Each of the objects is checked against the mechanism it's wrapped with */
+	if (mech->mechanism == CKM_G_WRAP_MULTIPLE)
+		return wrap_multiple (session, mech, wrapper, wrapped, output, n_output);
+
 	if (!gkm_object_has_attribute_ulong (wrapper, session, CKA_ALLOWED_MECHANISMS, mech->mechanism))
 		return CKR_KEY_TYPE_INCONSISTENT;
 
@@ -26,6 +26,9 @@
 #include "gkm-dh-private-key.h"
 #include "gkm-session.h"
 #include "gkm-transaction.h"
+#include "gkm-x25519-key.h"
+
+#include "pkcs11/pkcs11i.h"
 
 #include "egg/egg-dh.h"
 #include "egg/egg-libgcrypt.h"
@@ -33,12 +36,13 @@
 
 EGG_SECURE_DECLARE (dh_mechanism);
 
+/* The prime and base are NULL for X25519 keys, which have no parameters */
 static GkmObject*
 create_dh_object (GkmSession *session, GkmTransaction *transaction, CK_OBJECT_CLASS klass,
-                  CK_ATTRIBUTE_PTR value, CK_ATTRIBUTE_PTR prime, CK_ATTRIBUTE_PTR base,
-                  CK_ATTRIBUTE_PTR id, CK_ATTRIBUTE_PTR attrs, CK_ULONG n_attrs)
+                  CK_KEY_TYPE type, CK_ATTRIBUTE_PTR value, CK_ATTRIBUTE_PTR prime,
+                  CK_ATTRIBUTE_PTR base, CK_ATTRIBUTE_PTR id, CK_ATTRIBUTE_PTR attrs,
+                  CK_ULONG n_attrs)
 {
-	CK_KEY_TYPE type = CKK_DH;
 	CK_ATTRIBUTE attr;
 	GkmObject *object;
 	GArray *array;
@@ -49,8 +53,10 @@ create_dh_object (GkmSession *session, GkmTransaction *transaction, CK_OBJECT_CL
 	g_array_append_val (array, *value);
 
 	/* Add in the DH params */
-	g_array_append_val (array, *prime);
-	g_array_append_val (array, *base);
+	if (prime)
+		g_array_append_val (array, *prime);
+	if (base)
+		g_array_append_val (array, *base);
 
 	/* Setup the class */
 	attr.type = CKA_CLASS;
@@ -78,6 +84,56 @@ create_dh_object (GkmSession *session, GkmTransaction *transaction, CK_OBJECT_CL
 	return object;
 }
 
+/* Creates the derived key from a secure shared secret, which is freed */
+static CK_RV
+create_derived_object (GkmSession *session, guchar *value, gsize n_actual,
+                       CK_ULONG n_value, CK_ATTRIBUTE_PTR attrs, CK_ULONG n_attrs,
+                       GkmObject **derived)
+{
+	CK_ATTRIBUTE attr;
+	GArray *array;
+	GkmTransaction *transaction;
+
+	/* Now setup the attributes with our new value */
+	array = g_array_new (FALSE, FALSE, sizeof (CK_ATTRIBUTE));
+
+	/* Prepend the value */
+	attr.type = CKA_VALUE;
+	attr.ulValueLen = n_value;
+
+	/* Is it too long, move to the front and truncate */
+	if (n_actual > n_value) {
+		attr.pValue = value + (n_actual - n_value);
+
+	/* If it's too short, expand with zeros */
+	} else if (n_actual < n_value) {
+		value = egg_secure_realloc (value, n_value);
+		memmove (value + (n_value - n_actual), value, n_actual);
+		memset (value, 0, (n_value - n_actual));
+		attr.pValue = value;
+
+	/* It's just right */
+	} else {
+		attr.pValue = value;
+	}
+
+	g_array_append_val (array, attr);
+
+	/* Add the remainder of the attributes */
+	g_array_append_vals (array, attrs, n_attrs);
+
+	transaction = gkm_transaction_new ();
+
+	/* Now create an object with these attributes */
+	*derived = gkm_session_create_object_for_attributes (session, transaction,
+	                                                     (CK_ATTRIBUTE_PTR)array->data, array->len);
+
+	egg_secure_free (value);
+	g_array_free (array, TRUE);
+
+	return gkm_transaction_complete_and_unref (transaction);
+}
+
 CK_RV
 gkm_dh_mechanism_generate (GkmSession *session, CK_ATTRIBUTE_PTR pub_atts,
                            CK_ULONG n_pub_atts, CK_ATTRIBUTE_PTR priv_atts,
@@ -160,8 +216,8 @@ gkm_dh_mechanism_generate (GkmSession *session, CK_ATTRIBUTE_PTR pub_atts,
 
 	transaction = gkm_transaction_new ();
 
-	*pub_key = create_dh_object (session, transaction, CKO_PUBLIC_KEY, &value,
-	                            aprime, abase, &id, pub_atts, n_pub_atts);
+	*pub_key = create_dh_object (session, transaction, CKO_PUBLIC_KEY, CKK_DH,
+	                             &value, aprime, abase, &id, pub_atts, n_pub_atts);
 	g_free (value.pValue);
 
 	if (!gkm_transaction_get_failed (transaction)) {
@@ -175,8 +231,8 @@ gkm_dh_mechanism_generate (GkmSession *session, CK_ATTRIBUTE_PTR pub_atts,
 		g_return_val_if_fail (gcry == 0, CKR_GENERAL_ERROR);
 		value.ulValueLen = length;
 
-		*priv_key = create_dh_object (session, transaction, CKO_PRIVATE_KEY, &value,
-		                              aprime, abase, &id, priv_atts, n_priv_atts);
+		*priv_key = create_dh_object (session, transaction, CKO_PRIVATE_KEY, CKK_DH,
+		                              &value, aprime, abase, &id, priv_atts, n_priv_atts);
 		egg_secure_clear (value.pValue, value.ulValueLen);
 		egg_secure_free (value.pValue);
 	}
@@ -208,12 +264,9 @@ gkm_dh_mechanism_derive (GkmSession *session, CK_MECHANISM_PTR mech, GkmObject *
 	gcry_mpi_t prime;
 	gcry_mpi_t priv;
 	gcry_error_t gcry;
-	CK_ATTRIBUTE attr;
-	GArray *array;
 	gsize n_actual = 0;
 	CK_ULONG n_value = 0;
 	guchar *value;
-	GkmTransaction *transaction;
 	CK_KEY_TYPE type;
 
 	g_return_val_if_fail (GKM_IS_DH_PRIVATE_KEY (base), CKR_GENERAL_ERROR);
@@ -247,42 +300,104 @@ gkm_dh_mechanism_derive (GkmSession *session, CK_MECHANISM_PTR mech, GkmObject *
 	if (value == NULL)
 		return CKR_FUNCTION_FAILED;
 
-	/* Now setup the attributes with our new value */
-	array = g_array_new (FALSE, FALSE, sizeof (CK_ATTRIBUTE));
+	return create_derived_object (session, value, n_actual, n_value,
+	                              attrs, n_attrs, derived);
+}
 
-	/* Prepend the value */
-	attr.type = CKA_VALUE;
-	attr.ulValueLen = n_value;
+CK_RV
+gkm_dh_mechanism_generate_x25519 (GkmSession *session, CK_ATTRIBUTE_PTR pub_atts,
+                                  CK_ULONG n_pub_atts, CK_ATTRIBUTE_PTR priv_atts,
+                                  CK_ULONG n_priv_atts, GkmObject **pub_key,
+                                  GkmObject **priv_key)
+{
+	guchar pub[EGG_DH_X25519_SIZE];
+	CK_ATTRIBUTE value, id;
+	GkmTransaction *transaction;
+	guchar *priv;
+	CK_RV rv;
 
-	/* Is it too long, move to the front and truncate */
-	if (n_actual > n_value) {
-		attr.pValue = value + (n_actual - n_value);
+	g_return_val_if_fail (GKM_IS_SESSION (session), CKR_GENERAL_ERROR);
+	g_return_val_if_fail (pub_key, CKR_GENERAL_ERROR);
+	g_return_val_if_fail (priv_key, CKR_GENERAL_ERROR);
 
-	/* If it's too short, expand with zeros */
-	} else if (n_actual < n_value) {
-		value = egg_secure_realloc (value, n_value);
-		memmove (value + (n_value - n_actual), value, n_actual);
-		memset (value, 0, (n_value - n_actual));
-		attr.pValue = value;
+	*priv_key = NULL;
+	*pub_key = NULL;
 
-	/* It's just right */
-	} else {
-		attr.pValue = value;
+	priv = egg_secure_alloc (EGG_DH_X25519_SIZE);
+	if (!egg_dh_x25519_gen_pair (pub, priv)) {
+		egg_secure_free (priv);
+		return CKR_FUNCTION_FAILED;
 	}
 
-	g_array_append_val (array, attr);
-
-	/* Add the remainder of the attributes */
-	g_array_append_vals (array, attrs, n_attrs);
+	/* The identifier is the tail of the public value, as for DH */
+	id.type = CKA_ID;
+	id.ulValueLen = 16;
+	id.pValue = pub + (EGG_DH_X25519_SIZE - 16);
 
 	transaction = gkm_transaction_new ();
 
-	/* Now create an object with these attributes */
-	*derived = gkm_session_create_object_for_attributes (session, transaction,
-	                                                     (CK_ATTRIBUTE_PTR)array->data, array->len);
+	value.type = CKA_VALUE;
+	value.pValue = pub;
+	value.ulValueLen = EGG_DH_X25519_SIZE;
+	*pub_key = create_dh_object (session, transaction, CKO_PUBLIC_KEY, CKK_G_X25519,
+	                             &value, NULL, NULL, &id, pub_atts, n_pub_atts);
 
-	egg_secure_free (value);
-	g_array_free (array, TRUE);
+	if (!gkm_transaction_get_failed (transaction)) {
+		value.pValue = priv;
+		*priv_key = create_dh_object (session, transaction, CKO_PRIVATE_KEY, CKK_G_X25519,
+		                              &value, NULL, NULL, &id, priv_atts, n_priv_atts);
+	}
 
-	return gkm_transaction_complete_and_unref (transaction);
+	egg_secure_clear (priv, EGG_DH_X25519_SIZE);
+	egg_secure_free (priv);
+
+	gkm_transaction_complete (transaction);
+	if (gkm_transaction_get_failed (transaction)) {
+		if (*pub_key)
+			g_object_unref (*pub_key);
+		if (*priv_key)
+			g_object_unref (*priv_key);
+		*priv_key = *pub_key = NULL;
+	}
+
+	rv = gkm_transaction_get_result (transaction);
+	g_object_unref (transaction);
+
+	return rv;
+}
+
+CK_RV
+gkm_dh_mechanism_derive_x25519 (GkmSession *session, CK_MECHANISM_PTR mech, GkmObject *base,
+                                CK_ATTRIBUTE_PTR attrs, CK_ULONG n_attrs, GkmObject **derived)
+{
+	gsize n_actual = 0;
+	CK_ULONG n_value = 0;
+	guchar *value;
+	CK_KEY_TYPE type;
+
+	g_return_val_if_fail (GKM_IS_X25519_KEY (base), CKR_GENERAL_ERROR);
+	g_return_val_if_fail (gkm_x25519_key_get_class (GKM_X25519_KEY (base)) == CKO_PRIVATE_KEY,
+	                      CKR_GENERAL_ERROR);
+
+	if (!mech->pParameter || mech->ulParameterLen != EGG_DH_X25519_SIZE)
+		return CKR_MECHANISM_PARAM_INVALID;
+
+	/* What length should we truncate to? */
+	if (!gkm_attributes_find_ulong (attrs, n_attrs, CKA_VALUE_LEN, &n_value)) {
+		if (gkm_attributes_find_ulong (attrs, n_attrs, CKA_KEY_TYPE, &type))
+			n_value = gkm_crypto_secret_key_length (type);
+	}
+
+	/* Default to the full shared secret */
+	if (n_value == 0)
+		n_value = EGG_DH_X25519_SIZE;
+
+	value = egg_dh_x25519_gen_secret (mech->pParameter,
+	                                  gkm_x25519_key_get_value (GKM_X25519_KEY (base)),
+	                                  &n_actual);
+	if (value == NULL)
+		return CKR_FUNCTION_FAILED;
+
+	return create_derived_object (session, value, n_actual, n_value,
+	                              attrs, n_attrs, derived);
 }
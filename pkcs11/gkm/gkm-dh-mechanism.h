@@ -24,6 +24,7 @@
 #include "gkm-types.h"
 
 #include "pkcs11/pkcs11.h"
+#include "pkcs11/pkcs11i.h"
 
 #include <glib.h>
 
@@ -33,6 +34,10 @@ static const CK_MECHANISM_TYPE GKM_DH_MECHANISMS[] = {
 	CKM_DH_PKCS_DERIVE
 };
 
+static const CK_MECHANISM_TYPE GKM_X25519_MECHANISMS[] = {
+	CKM_G_X25519_DERIVE
+};
+
 CK_RV                    gkm_dh_mechanism_generate                     (GkmSession *session,
                                                                         CK_ATTRIBUTE_PTR pub_atts,
                                                                         CK_ULONG n_pub_atts,
@@ -48,4 +53,19 @@ CK_RV                    gkm_dh_mechanism_derive                       (GkmSessi
                                                                         CK_ULONG n_attrs,
                                                                         GkmObject **derived);
 
+CK_RV                    gkm_dh_mechanism_generate_x25519              (GkmSession *session,
+                                                                        CK_ATTRIBUTE_PTR pub_atts,
+                                                                        CK_ULONG n_pub_atts,
+                                                                        CK_ATTRIBUTE_PTR priv_atts,
+                                                                        CK_ULONG n_priv_atts,
+                                                                        GkmObject **pub_key,
+                                                                        GkmObject **priv_key);
+
+CK_RV                    gkm_dh_mechanism_derive_x25519                (GkmSession *session,
+                                                                        CK_MECHANISM_PTR mech,
+                                                                        GkmObject *base,
+                                                                        CK_ATTRIBUTE_PTR attrs,
+                                                                        CK_ULONG n_attrs,
+                                                                        GkmObject **derived);
+
 #endif /* GKM_DH_MECHANISM_H_ */
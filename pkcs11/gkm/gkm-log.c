@@ -271,6 +271,8 @@ gkm_log_attr_type (CK_ATTRIBUTE_TYPE type)
 	X (CKA_G_MATCHED)
 	X (CKA_G_SCHEMA)
 	X (CKA_G_LOGIN_COLLECTION)
+	X (CKA_G_MATCHED_UNLOCKED)
+	X (CKA_G_MATCHED_LOCKED)
 	X (CKA_G_DESTRUCT_IDLE)
 	X (CKA_G_DESTRUCT_AFTER)
 	X (CKA_G_DESTRUCT_USES)
@@ -72,6 +72,9 @@ typedef struct _Finder {
 
 G_DEFINE_TYPE(GkmManager, gkm_manager, G_TYPE_OBJECT);
 
+/* Told when token objects in any manager change */
+static GkmManagerNotify token_notify = NULL;
+
 /* Friend functions for GkmObject */
 void  _gkm_manager_register_object    (GkmManager *self, GkmObject *object);
 void  _gkm_manager_unregister_object  (GkmManager *self, GkmObject *object);
@@ -379,6 +382,13 @@ index_remove_each (gpointer key, gpointer value, gpointer user_data)
 	index_remove (value, user_data);
 }
 
+static void
+token_changed (GkmManager *self)
+{
+	if (self->pv->for_token && token_notify)
+		(token_notify) ();
+}
+
 static void
 notify_attribute (GkmObject *object, CK_ATTRIBUTE_TYPE attr_type, GkmManager *self)
 {
@@ -394,6 +404,7 @@ notify_attribute (GkmObject *object, CK_ATTRIBUTE_TYPE attr_type, GkmManager *se
 
 	/* Tell everyone that this attribute changed on this object */
 	g_signal_emit (self, signals[ATTRIBUTE_CHANGED], 0, object, attr_type);
+	token_changed (self);
 }
 
 static void
@@ -442,6 +453,7 @@ add_object (GkmManager *self, GkmObject *object)
 
 	/* Tell everyone we added this object */
 	g_signal_emit (self, signals[OBJECT_ADDED], 0, object);
+	token_changed (self);
 }
 
 static void
@@ -467,6 +479,7 @@ remove_object (GkmManager *self, GkmObject *object)
 
 	/* Tell everyone this object is gone */
 	g_signal_emit (self, signals[OBJECT_REMOVED], 0, object);
+	token_changed (self);
 }
 
 static void
@@ -763,6 +776,12 @@ gkm_manager_get_for_token (GkmManager *self)
 	return self->pv->for_token;
 }
 
+void
+gkm_manager_set_token_notify (GkmManagerNotify notify)
+{
+	token_notify = notify;
+}
+
 void
 gkm_manager_add_attribute_index (GkmManager *self, CK_ATTRIBUTE_TYPE attr, gboolean unique)
 {
@@ -88,6 +88,11 @@ GkmManager*             gkm_manager_for_template                (CK_ATTRIBUTE_PT
 
 gboolean                gkm_manager_get_for_token               (GkmManager *self);
 
+/* Called whenever token objects are added, removed or changed in any module */
+typedef void            (*GkmManagerNotify)                     (void);
+
+void                    gkm_manager_set_token_notify            (GkmManagerNotify notify);
+
 void                    gkm_manager_add_attribute_index         (GkmManager *self,
                                                                  CK_ATTRIBUTE_TYPE attr,
                                                                  gboolean unique);
@@ -461,8 +461,24 @@ gkm_C_CreateObject (CK_SESSION_HANDLE handle, CK_ATTRIBUTE_PTR template,
                     CK_ULONG count, CK_OBJECT_HANDLE_PTR new_object)
 {
 	CK_RV rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+	GkmPrepared *prepared = NULL;
 	GkmSession *session;
 
+	g_mutex_lock (&pkcs11_module_mutex);
+
+		if (pkcs11_module != NULL) {
+			session = gkm_module_lookup_session (pkcs11_module, handle);
+			if (session != NULL)
+				prepared = gkm_session_prepare_create_object (session,
+				                                              template, count);
+		}
+
+	g_mutex_unlock (&pkcs11_module_mutex);
+
+	/* Such as deriving a key to unlock with, which other threads needn't wait for */
+	if (prepared != NULL)
+		gkm_prepared_run (prepared);
+
 	g_mutex_lock (&pkcs11_module_mutex);
 
 		if (pkcs11_module != NULL) {
@@ -476,6 +492,8 @@ gkm_C_CreateObject (CK_SESSION_HANDLE handle, CK_ATTRIBUTE_PTR template,
 
 	g_mutex_unlock (&pkcs11_module_mutex);
 
+	gkm_prepared_free (prepared);
+
 	return rv;
 }
 
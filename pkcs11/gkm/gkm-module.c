@@ -44,6 +44,9 @@
 #include "gkm-timer.h"
 #include "gkm-transaction.h"
 #include "gkm-util.h"
+#include "gkm-x25519-key.h"
+
+#include "egg/egg-dh.h"
 
 enum {
 	PROP_0,
@@ -161,6 +164,20 @@ static const MechanismAndInfo mechanism_list[] = {
 	 */
 	{ CKM_DH_PKCS_DERIVE, { 1, 255, CKF_DERIVE } },
 
+#ifdef EGG_DH_HAVE_X25519
+	/*
+	 * CKM_G_X25519_KEY_PAIR_GEN
+	 * For X25519 the min and max are the size of the curve in bits.
+	 */
+	{ CKM_G_X25519_KEY_PAIR_GEN, { 255, 255, CKF_GENERATE_KEY_PAIR } },
+
+	/*
+	 * CKM_G_X25519_DERIVE
+	 * For X25519 derivation the min and max are sizes of output key in bytes.
+	 */
+	{ CKM_G_X25519_DERIVE, { 1, 32, CKF_DERIVE } },
+#endif
+
 	/*
 	 * CKM_G_HKDF_DERIVE
 	 * For HKDF derivation the min and max are sizes of prime in bits.
@@ -178,6 +195,12 @@ static const MechanismAndInfo mechanism_list[] = {
 	 * For NULL min and max are zero
 	 */
 	{ CKM_G_NULL, { GKM_NULL_MECHANISM_MIN_LENGTH, GKM_NULL_MECHANISM_MAX_LENGTH, CKF_WRAP | CKF_UNWRAP } },
+
+	/*
+	 * CKM_G_WRAP_MULTIPLE
+	 * Key sizes are those of the mechanism in the parameters
+	 */
+	{ CKM_G_WRAP_MULTIPLE, { 0, 0, CKF_WRAP } },
 };
 
 /* Hidden function that you should not use */
@@ -621,6 +644,8 @@ gkm_module_init (GkmModule *self)
 	gkm_module_register_factory (self, GKM_FACTORY_PRIVATE_XSA_KEY);
 	gkm_module_register_factory (self, GKM_FACTORY_DH_PUBLIC_KEY);
 	gkm_module_register_factory (self, GKM_FACTORY_PUBLIC_XSA_KEY);
+	gkm_module_register_factory (self, GKM_FACTORY_X25519_PRIVATE_KEY);
+	gkm_module_register_factory (self, GKM_FACTORY_X25519_PUBLIC_KEY);
 }
 
 static void
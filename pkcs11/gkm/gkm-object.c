@@ -771,6 +771,29 @@ gkm_object_unlock (GkmObject *self, GkmCredential *cred)
 	return GKM_OBJECT_GET_CLASS (self)->unlock (self, cred);
 }
 
+GkmPrepared*
+gkm_object_prepare_unlock (GkmObject *self, CK_UTF8CHAR_PTR pin, CK_ULONG n_pin)
+{
+	g_return_val_if_fail (GKM_IS_OBJECT (self), NULL);
+	if (!GKM_OBJECT_GET_CLASS (self)->prepare_unlock)
+		return NULL;
+	return GKM_OBJECT_GET_CLASS (self)->prepare_unlock (self, pin, n_pin);
+}
+
+void
+gkm_prepared_run (GkmPrepared *prepared)
+{
+	g_return_if_fail (prepared != NULL);
+	(prepared->run) (prepared);
+}
+
+void
+gkm_prepared_free (GkmPrepared *prepared)
+{
+	if (prepared != NULL)
+		(prepared->free) (prepared);
+}
+
 
 gboolean
 gkm_object_get_attribute_boolean (GkmObject *self, GkmSession *session,
@@ -37,6 +37,16 @@
 typedef struct _GkmObjectClass GkmObjectClass;
 typedef struct _GkmObjectPrivate GkmObjectPrivate;
 
+/*
+ * Slow work that's done before an object is unlocked, without holding the
+ * module lock, such as deriving a key from the password. It's run on the
+ * thread which then does the unlock. Implementations embed this first.
+ */
+struct _GkmPrepared {
+	void (*run) (GkmPrepared *prepared);
+	void (*free) (GkmPrepared *prepared);
+};
+
 struct _GkmObject {
 	GObject parent;
 	GkmObjectPrivate *pv;
@@ -63,6 +73,8 @@ struct _GkmObjectClass {
 	                           GkmTransaction *transaction, CK_ATTRIBUTE *attrs, CK_ULONG n_attrs);
 
 	CK_RV (*unlock) (GkmObject *self, GkmCredential *cred);
+
+	GkmPrepared* (*prepare_unlock) (GkmObject *self, CK_UTF8CHAR_PTR pin, CK_ULONG n_pin);
 };
 
 GType                  gkm_object_get_type               (void);
@@ -87,6 +99,14 @@ void                   gkm_object_mark_used              (GkmObject *self);
 CK_RV                  gkm_object_unlock                 (GkmObject *self,
                                                           GkmCredential *cred);
 
+GkmPrepared*           gkm_object_prepare_unlock         (GkmObject *self,
+                                                          CK_UTF8CHAR_PTR pin,
+                                                          CK_ULONG n_pin);
+
+void                   gkm_prepared_run                  (GkmPrepared *prepared);
+
+void                   gkm_prepared_free                 (GkmPrepared *prepared);
+
 void                   gkm_object_destroy                (GkmObject *self,
                                                           GkmTransaction *transaction);
 
@@ -933,6 +933,37 @@ gkm_session_C_SetOperationState (GkmSession* self, CK_BYTE_PTR operation_state,
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
+/*
+ * Called with the module lock held before gkm_session_C_CreateObject(). A
+ * credential that unlocks an object may have slow work to do first, which
+ * is returned to be run without the lock.
+ */
+GkmPrepared*
+gkm_session_prepare_create_object (GkmSession *self, CK_ATTRIBUTE_PTR template,
+                                   CK_ULONG count)
+{
+	CK_OBJECT_HANDLE handle;
+	CK_OBJECT_CLASS klass;
+	CK_ATTRIBUTE_PTR value;
+	GkmObject *object;
+
+	g_return_val_if_fail (GKM_IS_SESSION (self), NULL);
+
+	if (!count || !template)
+		return NULL;
+	if (!gkm_attributes_find_ulong (template, count, CKA_CLASS, &klass) ||
+	    klass != CKO_G_CREDENTIAL)
+		return NULL;
+	if (!gkm_attributes_find_ulong (template, count, CKA_G_OBJECT, &handle))
+		return NULL;
+	if (gkm_session_lookup_readable_object (self, handle, &object) != CKR_OK)
+		return NULL;
+
+	value = gkm_attributes_find (template, count, CKA_VALUE);
+	return gkm_object_prepare_unlock (object, value ? value->pValue : NULL,
+	                                  value ? value->ulValueLen : 0);
+}
+
 CK_RV
 gkm_session_C_CreateObject (GkmSession* self, CK_ATTRIBUTE_PTR template,
                             CK_ULONG count, CK_OBJECT_HANDLE_PTR new_object)
@@ -139,6 +139,10 @@ CK_RV                    gkm_session_C_SetOperationState                (GkmSess
                                                                          CK_OBJECT_HANDLE encryption_key,
                                                                          CK_OBJECT_HANDLE authentication_key);
 
+GkmPrepared*             gkm_session_prepare_create_object              (GkmSession *self,
+                                                                         CK_ATTRIBUTE_PTR template,
+                                                                         CK_ULONG count);
+
 CK_RV                    gkm_session_C_CreateObject                     (GkmSession* self,
                                                                          CK_ATTRIBUTE_PTR template,
                                                                          CK_ULONG count,
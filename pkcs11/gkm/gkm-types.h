@@ -35,6 +35,7 @@ typedef struct _GkmManager GkmManager;
 typedef struct _GkmModule GkmModule;
 typedef struct _GkmNullKey GkmNullKey;
 typedef struct _GkmObject GkmObject;
+typedef struct _GkmPrepared GkmPrepared;
 typedef struct _GkmPrivateXsaKey GkmPrivateXsaKey;
 typedef struct _GkmPublicXsaKey GkmPublicXsaKey;
 typedef struct _GkmSecret GkmSecret;
@@ -48,5 +49,6 @@ typedef struct _GkmStore GkmStore;
 typedef struct _GkmTimer GkmTimer;
 typedef struct _GkmTransaction GkmTransaction;
 typedef struct _GkmTrust GkmTrust;
+typedef struct _GkmX25519Key GkmX25519Key;
 
 #endif /* __GKM_TYPES_H__ */
@@ -0,0 +1,293 @@
+/*
+ * gnome-keyring
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "pkcs11/pkcs11.h"
+#include "pkcs11/pkcs11i.h"
+
+#include "gkm-attributes.h"
+#include "gkm-dh-mechanism.h"
+#define DEBUG_FLAG GKM_DEBUG_OBJECT
+#include "gkm-debug.h"
+#include "gkm-factory.h"
+#include "gkm-session.h"
+#include "gkm-transaction.h"
+#include "gkm-x25519-key.h"
+
+#include "egg/egg-dh.h"
+#include "egg/egg-secure-memory.h"
+
+#include <string.h>
+
+/*
+ * Both halves of an X25519 key pair are this one class, since neither
+ * has anything more to it than its 32 byte value.
+ */
+
+struct _GkmX25519Key {
+	GkmObject parent;
+	CK_OBJECT_CLASS klass;
+	guchar *value;
+	gpointer id;
+	gsize n_id;
+};
+
+G_DEFINE_TYPE (GkmX25519Key, gkm_x25519_key, GKM_TYPE_OBJECT);
+
+EGG_SECURE_DECLARE (x25519_key);
+
+/* -----------------------------------------------------------------------------
+ * INTERNAL
+ */
+
+static GkmObject*
+factory_create_x25519_key (GkmSession *session, GkmTransaction *transaction,
+                           CK_OBJECT_CLASS klass, CK_ATTRIBUTE_PTR attrs, CK_ULONG n_attrs)
+{
+	GkmManager *manager;
+	CK_ATTRIBUTE_PTR value;
+	CK_ATTRIBUTE_PTR idattr;
+	GkmObject *object;
+
+	value = gkm_attributes_find (attrs, n_attrs, CKA_VALUE);
+	if (value == NULL) {
+		gkm_transaction_fail (transaction, CKR_TEMPLATE_INCOMPLETE);
+		return NULL;
+	}
+
+	if (value->ulValueLen != EGG_DH_X25519_SIZE) {
+		gkm_transaction_fail (transaction, CKR_ATTRIBUTE_VALUE_INVALID);
+		return NULL;
+	}
+
+	manager = gkm_manager_for_template (attrs, n_attrs, session);
+	idattr = gkm_attributes_find (attrs, n_attrs, CKA_ID);
+
+	object = GKM_OBJECT (gkm_x25519_key_new (gkm_session_get_module (session),
+	                                         manager, klass, value->pValue,
+	                                         idattr ? g_memdup (idattr->pValue, idattr->ulValueLen) : NULL,
+	                                         idattr ? idattr->ulValueLen : 0));
+	gkm_attributes_consume (attrs, n_attrs, CKA_VALUE, G_MAXULONG);
+
+	gkm_session_complete_object_creation (session, transaction, object,
+	                                      TRUE, attrs, n_attrs);
+	return object;
+}
+
+static GkmObject*
+factory_create_x25519_private_key (GkmSession *session, GkmTransaction *transaction,
+                                   CK_ATTRIBUTE_PTR attrs, CK_ULONG n_attrs)
+{
+	return factory_create_x25519_key (session, transaction, CKO_PRIVATE_KEY, attrs, n_attrs);
+}
+
+static GkmObject*
+factory_create_x25519_public_key (GkmSession *session, GkmTransaction *transaction,
+                                  CK_ATTRIBUTE_PTR attrs, CK_ULONG n_attrs)
+{
+	return factory_create_x25519_key (session, transaction, CKO_PUBLIC_KEY, attrs, n_attrs);
+}
+
+/* -----------------------------------------------------------------------------
+ * OBJECT
+ */
+
+static CK_RV
+gkm_x25519_key_real_get_attribute (GkmObject *base, GkmSession *session, CK_ATTRIBUTE* attr)
+{
+	GkmX25519Key *self = GKM_X25519_KEY (base);
+	gboolean priv = (self->klass == CKO_PRIVATE_KEY);
+
+	switch (attr->type)
+	{
+
+	case CKA_CLASS:
+		return gkm_attribute_set_ulong (attr, self->klass);
+
+	case CKA_KEY_TYPE:
+		return gkm_attribute_set_ulong (attr, CKK_G_X25519);
+
+	case CKA_START_DATE:
+	case CKA_END_DATE:
+	case CKA_SUBJECT:
+		return gkm_attribute_set_empty (attr);
+
+	case CKA_LOCAL:
+		return gkm_attribute_set_bool (attr, FALSE);
+
+	case CKA_KEY_GEN_MECHANISM:
+		return gkm_attribute_set_ulong (attr, CK_UNAVAILABLE_INFORMATION);
+
+	case CKA_ALLOWED_MECHANISMS:
+		return gkm_attribute_set_data (attr, (CK_VOID_PTR)GKM_X25519_MECHANISMS,
+		                               sizeof (GKM_X25519_MECHANISMS));
+
+	case CKA_ID:
+		return gkm_attribute_set_data (attr, self->id, self->n_id);
+
+	case CKA_DERIVE:
+		return gkm_attribute_set_bool (attr, priv);
+
+	case CKA_PRIVATE:
+		return gkm_attribute_set_bool (attr, priv);
+
+	case CKA_EXTRACTABLE:
+		return gkm_attribute_set_bool (attr, TRUE);
+
+	case CKA_SENSITIVE:
+	case CKA_ALWAYS_SENSITIVE:
+	case CKA_NEVER_EXTRACTABLE:
+	case CKA_ALWAYS_AUTHENTICATE:
+	case CKA_WRAP_WITH_TRUSTED:
+	case CKA_TRUSTED:
+	case CKA_ENCRYPT:
+	case CKA_DECRYPT:
+	case CKA_SIGN:
+	case CKA_SIGN_RECOVER:
+	case CKA_VERIFY:
+	case CKA_VERIFY_RECOVER:
+	case CKA_WRAP:
+	case CKA_UNWRAP:
+		return gkm_attribute_set_bool (attr, FALSE);
+
+	case CKA_WRAP_TEMPLATE:
+	case CKA_UNWRAP_TEMPLATE:
+		gkm_debug ("CKR_ATTRIBUTE_TYPE_INVALID: no wrap template attributes");
+		return CKR_ATTRIBUTE_TYPE_INVALID;
+
+	case CKA_VALUE:
+		return gkm_attribute_set_data (attr, self->value, EGG_DH_X25519_SIZE);
+	};
+
+	return GKM_OBJECT_CLASS (gkm_x25519_key_parent_class)->get_attribute (base, session, attr);
+}
+
+static void
+gkm_x25519_key_init (GkmX25519Key *self)
+{
+
+}
+
+static void
+gkm_x25519_key_finalize (GObject *obj)
+{
+	GkmX25519Key *self = GKM_X25519_KEY (obj);
+
+	egg_secure_free (self->value);
+	self->value = NULL;
+
+	g_free (self->id);
+	self->id = NULL;
+	self->n_id = 0;
+
+	G_OBJECT_CLASS (gkm_x25519_key_parent_class)->finalize (obj);
+}
+
+static void
+gkm_x25519_key_class_init (GkmX25519KeyClass *klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+	GkmObjectClass *gkm_class = GKM_OBJECT_CLASS (klass);
+
+	gkm_x25519_key_parent_class = g_type_class_peek_parent (klass);
+
+	gobject_class->finalize = gkm_x25519_key_finalize;
+
+	gkm_class->get_attribute = gkm_x25519_key_real_get_attribute;
+}
+
+/* -----------------------------------------------------------------------------
+ * PUBLIC
+ */
+
+GkmFactory*
+gkm_x25519_key_get_private_factory (void)
+{
+	static CK_OBJECT_CLASS klass = CKO_PRIVATE_KEY;
+	static CK_KEY_TYPE type = CKK_G_X25519;
+
+	static CK_ATTRIBUTE attributes[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_KEY_TYPE, &type, sizeof (type) }
+	};
+
+	static GkmFactory factory = {
+		attributes,
+		G_N_ELEMENTS (attributes),
+		factory_create_x25519_private_key
+	};
+
+	return &factory;
+}
+
+GkmFactory*
+gkm_x25519_key_get_public_factory (void)
+{
+	static CK_OBJECT_CLASS klass = CKO_PUBLIC_KEY;
+	static CK_KEY_TYPE type = CKK_G_X25519;
+
+	static CK_ATTRIBUTE attributes[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_KEY_TYPE, &type, sizeof (type) }
+	};
+
+	static GkmFactory factory = {
+		attributes,
+		G_N_ELEMENTS (attributes),
+		factory_create_x25519_public_key
+	};
+
+	return &factory;
+}
+
+GkmX25519Key*
+gkm_x25519_key_new (GkmModule *module, GkmManager *manager, CK_OBJECT_CLASS klass,
+                    gconstpointer value, gpointer id, gsize n_id)
+{
+	GkmX25519Key *key;
+
+	g_return_val_if_fail (klass == CKO_PRIVATE_KEY || klass == CKO_PUBLIC_KEY, NULL);
+	g_return_val_if_fail (value, NULL);
+
+	key = g_object_new (GKM_TYPE_X25519_KEY,
+	                    "manager", manager,
+	                    "module", module,
+	                    NULL);
+
+	key->klass = klass;
+	key->value = egg_secure_alloc (EGG_DH_X25519_SIZE);
+	memcpy (key->value, value, EGG_DH_X25519_SIZE);
+	key->id = id;
+	key->n_id = n_id;
+	return key;
+}
+
+CK_OBJECT_CLASS
+gkm_x25519_key_get_class (GkmX25519Key *self)
+{
+	g_return_val_if_fail (GKM_IS_X25519_KEY (self), CKO_PUBLIC_KEY);
+	return self->klass;
+}
+
+const guchar*
+gkm_x25519_key_get_value (GkmX25519Key *self)
+{
+	g_return_val_if_fail (GKM_IS_X25519_KEY (self), NULL);
+	return self->value;
+}
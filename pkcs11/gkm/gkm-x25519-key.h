@@ -0,0 +1,63 @@
+/*
+ * gnome-keyring
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GKM_X25519_KEY_H__
+#define __GKM_X25519_KEY_H__
+
+#include <glib-object.h>
+
+#include "gkm-object.h"
+#include "gkm-types.h"
+
+#include "pkcs11/pkcs11.h"
+
+#define GKM_FACTORY_X25519_PRIVATE_KEY            (gkm_x25519_key_get_private_factory ())
+
+#define GKM_FACTORY_X25519_PUBLIC_KEY             (gkm_x25519_key_get_public_factory ())
+
+#define GKM_TYPE_X25519_KEY               (gkm_x25519_key_get_type ())
+#define GKM_X25519_KEY(obj)               (G_TYPE_CHECK_INSTANCE_CAST ((obj), GKM_TYPE_X25519_KEY, GkmX25519Key))
+#define GKM_X25519_KEY_CLASS(klass)       (G_TYPE_CHECK_CLASS_CAST ((klass), GKM_TYPE_X25519_KEY, GkmX25519KeyClass))
+#define GKM_IS_X25519_KEY(obj)            (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GKM_TYPE_X25519_KEY))
+#define GKM_IS_X25519_KEY_CLASS(klass)    (G_TYPE_CHECK_CLASS_TYPE ((klass), GKM_TYPE_X25519_KEY))
+#define GKM_X25519_KEY_GET_CLASS(obj)     (G_TYPE_INSTANCE_GET_CLASS ((obj), GKM_TYPE_X25519_KEY, GkmX25519KeyClass))
+
+typedef struct _GkmX25519KeyClass GkmX25519KeyClass;
+
+struct _GkmX25519KeyClass {
+	GkmObjectClass parent_class;
+};
+
+GType                     gkm_x25519_key_get_type              (void);
+
+GkmFactory*               gkm_x25519_key_get_private_factory   (void);
+
+GkmFactory*               gkm_x25519_key_get_public_factory    (void);
+
+GkmX25519Key*             gkm_x25519_key_new                   (GkmModule *module,
+                                                                GkmManager *manager,
+                                                                CK_OBJECT_CLASS klass,
+                                                                gconstpointer value,
+                                                                gpointer id,
+                                                                gsize n_id);
+
+CK_OBJECT_CLASS           gkm_x25519_key_get_class             (GkmX25519Key *self);
+
+const guchar*             gkm_x25519_key_get_value             (GkmX25519Key *self);
+
+#endif /* __GKM_X25519_KEY_H__ */
@@ -104,6 +104,10 @@ typedef CK_G_APPLICATION* CK_G_APPLICATION_PTR;
 
 #define CKA_G_LOGIN_COLLECTION               (CKA_GNOME + 218)
 
+#define CKA_G_MATCHED_UNLOCKED               (CKA_GNOME + 219)
+
+#define CKA_G_MATCHED_LOCKED                 (CKA_GNOME + 220)
+
 /* -------------------------------------------------------------------
  * MECHANISMS
  */
@@ -113,8 +117,35 @@ typedef CK_G_APPLICATION* CK_G_APPLICATION_PTR;
 
 #define CKM_G_HKDF_SHA256_DERIVE             (CKM_GNOME + 101)
 
+/* Wraps the values of several objects in one call */
+#define CKM_G_WRAP_MULTIPLE                  (CKM_GNOME + 102)
+
+/*
+ * The parameter for CKM_G_WRAP_MULTIPLE is an array of CK_ULONG, with no
+ * pointers in it so that it can be passed as is. The first is the mechanism
+ * each object is wrapped with, which must be allowed for the wrapping key.
+ * The rest are the handles of the objects, of which the first must be the
+ * key passed to C_WrapKey. ulParameterLen is the size of the array in bytes.
+ *
+ * For each object in turn, the output has a 32-bit result code. When that
+ * is CKR_OK it's followed by the IV the module chose, and then the wrapped
+ * value. Numbers are big endian, the IV and value are each preceded by a
+ * 32-bit length. Whether each object can be wrapped is checked again when
+ * the output is filled in, so an object unlocked in between can make a
+ * call fail with CKR_BUFFER_TOO_SMALL after the length was asked for.
+ */
+
+/* Key agreement on Curve25519, as in RFC 7748 */
+#define CKM_G_X25519_KEY_PAIR_GEN            (CKM_GNOME + 103)
+
+/* The parameter is the 32 byte public value of the peer */
+#define CKM_G_X25519_DERIVE                  (CKM_GNOME + 104)
+
 #define CKK_G_NULL                           (CKK_GNOME + 100)
 
+/* CKA_VALUE of both keys is 32 bytes, little endian as in RFC 7748 */
+#define CKK_G_X25519                         (CKK_GNOME + 102)
+
 /* -------------------------------------------------------------------
  * AUTO DESTRUCT
  */
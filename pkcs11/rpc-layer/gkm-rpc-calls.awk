@@ -0,0 +1,84 @@
+# gkm-rpc-calls.awk - generates gkm-rpc-calls.h from gkm-rpc-private.h
+#
+# Each call signature in the gkm_rpc_calls table is split into its parts
+# here, so that messages can be checked against them without any string
+# handling. A signature with an unknown part fails the build.
+
+function emit(var, sig,    out, part)
+{
+	out = ""
+	while (length(sig) > 0) {
+		part = substr(sig, 1, 1)
+		if (part == "a" || part == "f")
+			part = substr(sig, 1, 2)
+		if (!(part in parts)) {
+			printf("gkm-rpc-calls.awk: unknown part '%s' in signature of %s\n", part, var) > "/dev/stderr"
+			failed = 1
+			exit 1
+		}
+		out = out parts[part] ", "
+		sig = substr(sig, length(part) + 1)
+	}
+	printf("static const unsigned char gkm_rpc_parts_%s[] = { %sGKM_RPC_PART_END };\n", var, out)
+}
+
+BEGIN {
+	parts["y"] = "GKM_RPC_PART_BYTE"
+	parts["u"] = "GKM_RPC_PART_ULONG"
+	parts["v"] = "GKM_RPC_PART_VERSION"
+	parts["s"] = "GKM_RPC_PART_SPACE_STRING"
+	parts["z"] = "GKM_RPC_PART_ZERO_STRING"
+	parts["M"] = "GKM_RPC_PART_MECHANISM"
+	parts["ay"] = "GKM_RPC_PART_BYTE_ARRAY"
+	parts["au"] = "GKM_RPC_PART_ULONG_ARRAY"
+	parts["aA"] = "GKM_RPC_PART_ATTRIBUTE_ARRAY"
+	parts["fy"] = "GKM_RPC_PART_BYTE_BUFFER"
+	parts["fu"] = "GKM_RPC_PART_ULONG_BUFFER"
+	parts["fA"] = "GKM_RPC_PART_ATTRIBUTE_BUFFER"
+
+	print "/* Generated from gkm-rpc-private.h by gkm-rpc-calls.awk, do not edit */"
+	print ""
+	n = 0
+}
+
+/^[ \t]*\{ GKM_RPC_CALL_/ {
+	line = $0
+	gsub(/[{},]/, " ", line)
+	split(line, field, " ")
+
+	if (field[1] == "GKM_RPC_CALL_ERROR")
+		next
+
+	name = field[1]
+	sub(/^GKM_RPC_CALL_/, "", name)
+	request = field[3]
+	response = field[4]
+	gsub(/"/, "", request)
+	gsub(/"/, "", response)
+
+	emit(name "_request", request)
+	emit(name "_response", response)
+
+	ids[n] = field[1]
+	names[n] = name
+	request_lens[n] = length(request)
+	response_lens[n] = length(response)
+	n++
+}
+
+END {
+	if (failed)
+		exit 1
+	if (n == 0) {
+		print "gkm-rpc-calls.awk: no calls found" > "/dev/stderr"
+		exit 1
+	}
+
+	print ""
+	print "static const GkmRpcCallParts gkm_rpc_call_parts[GKM_RPC_CALL_MAX] = {"
+	for (i = 0; i < n; i++) {
+		printf("\t[%s] = { gkm_rpc_parts_%s_request, gkm_rpc_parts_%s_response, %d, %d },\n",
+		       ids[i], names[i], names[i], request_lens[i], response_lens[i])
+	}
+	print "};"
+}
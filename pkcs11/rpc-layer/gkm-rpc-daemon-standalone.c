@@ -52,7 +52,7 @@ static int is_running = 1;
 static int
 usage (void)
 {
-	fprintf (stderr, "usage: gkm-rpc-daemon pkcs11-module\n");
+	fprintf (stderr, "usage: gkm-rpc-daemon [-t trace-file] pkcs11-module\n");
 	exit (2);
 }
 
@@ -61,26 +61,40 @@ main (int argc, char *argv[])
 {
 	CK_C_GetFunctionList func_get_list;
 	CK_FUNCTION_LIST_PTR funcs;
+	const char *trace = NULL;
+	const char *path;
 	void *module;
 	fd_set read_fds;
-	int sock, ret;
+	int sock, ret, opt;
 	CK_RV rv;
 
+	/* Optionally record a trace of the calls, for gkm-rpc-replay */
+	while ((opt = getopt (argc, argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			trace = optarg;
+			break;
+		default:
+			usage ();
+		}
+	}
+
 	/* The module to load is the argument */
-	if (argc != 2)
+	if (optind != argc - 1)
 		usage();
+	path = argv[optind];
 
 	/* Load the library */
-	module = dlopen(argv[1], RTLD_NOW);
+	module = dlopen(path, RTLD_NOW);
 	if(!module) {
-		fprintf (stderr, "couldn't open library: %s: %s\n", argv[1], dlerror());
+		fprintf (stderr, "couldn't open library: %s: %s\n", path, dlerror());
 		exit (1);
 	}
 
 	/* Lookup the appropriate function in library */
 	func_get_list = (CK_C_GetFunctionList)dlsym (module, "C_GetFunctionList");
 	if (!func_get_list) {
-		fprintf (stderr, "couldn't find C_GetFunctionList in library: %s: %s\n", argv[1], dlerror());
+		fprintf (stderr, "couldn't find C_GetFunctionList in library: %s: %s\n", path, dlerror());
 		exit (1);
 	}
 
@@ -88,18 +102,21 @@ main (int argc, char *argv[])
 	rv = (func_get_list) (&funcs);
 	if (rv != CKR_OK || !funcs) {
 		fprintf (stderr, "couldn't get function list from C_GetFunctionList in libary: %s: 0x%08x\n",
-		         argv[1], (int)rv);
+		         path, (int)rv);
 		exit (1);
 	}
 
 	/* RPC layer expects initialized module */
 	rv = (funcs->C_Initialize) (&p11_init_args);
 	if (rv != CKR_OK) {
-		fprintf (stderr, "couldn't initialize module: %s: 0x%08x\n", argv[1], (int)rv);
+		fprintf (stderr, "couldn't initialize module: %s: 0x%08x\n", path, (int)rv);
 		exit (1);
 	}
 
 	gkm_rpc_layer_initialize (funcs);
+	if (trace && !gkm_rpc_layer_trace (trace))
+		exit (1);
+
 	sock = gkm_rpc_layer_startup (SOCKET_PATH);
 	if (sock == -1)
 		exit (1);
@@ -125,7 +142,7 @@ main (int argc, char *argv[])
 
 	rv = (funcs->C_Finalize) (NULL);
 	if (rv != CKR_OK)
-		fprintf (stderr, "couldn't finalize module: %s: 0x%08x\n", argv[1], (int)rv);
+		fprintf (stderr, "couldn't finalize module: %s: 0x%08x\n", path, (int)rv);
 
 	dlclose(module);
 
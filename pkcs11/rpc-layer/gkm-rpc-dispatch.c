@@ -36,6 +36,8 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -90,6 +92,8 @@ typedef struct _CallState {
 	GkmRpcMessage *resp;
 	void *allocated;
 	ClientInstance *client;
+	int multiplex;
+	int batched;
 } CallState;
 
 static ClientInstance *clients = NULL;
@@ -139,6 +143,7 @@ call_init (CallState *cs, uid_t uid, pid_t pid)
 
 	cs->client = cl;
 	cs->allocated = NULL;
+	cs->multiplex = 0;
 	return 1;
 }
 
@@ -217,7 +222,7 @@ proto_read_byte_buffer (CallState *cs, CK_BYTE_PTR* buffer, CK_ULONG* n_buffer)
 	msg = cs->req;
 
 	/* Check that we're supposed to be reading this at this point */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "fy"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_BYTE_BUFFER));
 
 	/* The number of ulongs there's room for on the other end */
 	if (!egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &length))
@@ -243,6 +248,7 @@ proto_read_byte_array (CallState *cs, CK_BYTE_PTR* array, CK_ULONG* n_array)
 	GkmRpcMessage *msg;
 	const unsigned char *data;
 	unsigned char valid;
+	uint32_t length;
 	size_t n_data;
 
 	assert (cs);
@@ -250,7 +256,7 @@ proto_read_byte_array (CallState *cs, CK_BYTE_PTR* array, CK_ULONG* n_array)
 	msg = cs->req;
 
 	/* Check that we're supposed to have this at this point */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "ay"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_BYTE_ARRAY));
 
 	/* Read out the byte which says whether data is present or not */
 	if (!egg_buffer_get_byte (&msg->buffer, msg->parsed, &msg->parsed, &valid))
@@ -262,10 +268,16 @@ proto_read_byte_array (CallState *cs, CK_BYTE_PTR* array, CK_ULONG* n_array)
 		return CKR_OK;
 	}
 
-	/* Point our arguments into the buffer */
-	if (!egg_buffer_get_byte_array (&msg->buffer, msg->parsed, &msg->parsed,
-	                                &data, &n_data))
+	/* Point our arguments into the buffer, or the shared memory */
+	if (valid == 2) {
+		if (!egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &length) ||
+		    !gkm_rpc_message_read_shared (msg, length, &data))
+			return PARSE_ERROR;
+		n_data = length;
+	} else if (!egg_buffer_get_byte_array (&msg->buffer, msg->parsed, &msg->parsed,
+	                                       &data, &n_data)) {
 		return PARSE_ERROR;
+	}
 
 	*array = (CK_BYTE_PTR)data;
 	*n_array = n_data;
@@ -313,7 +325,7 @@ proto_read_ulong_buffer (CallState *cs, CK_ULONG_PTR* buffer, CK_ULONG* n_buffer
 	msg = cs->req;
 
 	/* Check that we're supposed to be reading this at this point */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "fu"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_ULONG_BUFFER));
 
 	/* The number of ulongs there's room for on the other end */
 	if (!egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &length))
@@ -376,7 +388,7 @@ proto_read_attribute_buffer (CallState *cs, CK_ATTRIBUTE_PTR* result, CK_ULONG*
 	msg = cs->req;
 
 	/* Make sure this is in the rigth order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "fA"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_ATTRIBUTE_BUFFER));
 
 	/* Read the number of attributes */
 	if (!egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &n_attrs))
@@ -434,7 +446,7 @@ proto_read_attribute_array (CallState *cs, CK_ATTRIBUTE_PTR* result, CK_ULONG* n
 	msg = cs->req;
 
 	/* Make sure this is in the rigth order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "aA"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_ATTRIBUTE_ARRAY));
 
 	/* Read the number of attributes */
 	if (!egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &n_attrs))
@@ -461,8 +473,15 @@ proto_read_attribute_array (CallState *cs, CK_ATTRIBUTE_PTR* result, CK_ULONG* n
 		if (valid) {
 			if (!egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &value))
 				return PARSE_ERROR;
-			if (!egg_buffer_get_byte_array (&msg->buffer, msg->parsed, &msg->parsed, &data, &n_data))
+
+			/* Large values may be in shared memory */
+			if (valid == 2) {
+				if (!gkm_rpc_message_read_shared (msg, value, &data))
+					return PARSE_ERROR;
+				n_data = value;
+			} else if (!egg_buffer_get_byte_array (&msg->buffer, msg->parsed, &msg->parsed, &data, &n_data)) {
 				return PARSE_ERROR;
+			}
 
 			if (data != NULL && n_data != value) {
 				g_warning ("attribute length and data do not match");
@@ -525,7 +544,7 @@ proto_read_null_string (CallState *cs, CK_UTF8CHAR_PTR* val)
 	msg = cs->req;
 
 	/* Check that we're supposed to have this at this point */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "z"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_ZERO_STRING));
 
 	if (!egg_buffer_get_byte_array (&msg->buffer, msg->parsed, &msg->parsed, &data, &n_data))
 		return PARSE_ERROR;
@@ -555,7 +574,7 @@ proto_read_mechanism (CallState *cs, CK_MECHANISM_PTR mech)
 	msg = cs->req;
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "M"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_MECHANISM));
 
 	/* The mechanism type */
 	if (!egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &value))
@@ -685,6 +704,10 @@ proto_write_session_info (CallState *cs, CK_SESSION_INFO_PTR info)
  * CALL MACROS
  */
 
+/* Typed request stubs, generated from the call signatures */
+#define GKM_RPC_STUBS_DISPATCH
+#include "gkm-rpc-stubs.h"
+
 #define BEGIN_CALL(call_id) \
 	debug ((#call_id ": enter")); \
 	assert (cs); \
@@ -704,6 +727,10 @@ proto_write_session_info (CallState *cs, CK_SESSION_INFO_PTR info)
 		return _ret; \
 	}
 
+#define IN_CALL(stub) \
+	_ret = stub; \
+	if (_ret != CKR_OK) goto _cleanup;
+
 #define IN_BYTE(val) \
 	if (!gkm_rpc_message_read_byte (cs->req, &val)) \
 		{ _ret = PARSE_ERROR; goto _cleanup; }
@@ -796,9 +823,14 @@ rpc_C_Initialize (CallState *cs)
 	ret = proto_read_byte_array (cs, &handshake, &n_handshake);
 	if (ret == CKR_OK) {
 
+		/* The client wants to multiplex calls on this connection */
+		if (n_handshake == GKM_RPC_HANDSHAKE_MULTIPLEX_LEN &&
+		    memcmp (handshake, GKM_RPC_HANDSHAKE_MULTIPLEX, n_handshake) == 0) {
+			cs->multiplex = 1;
+
 		/* Check to make sure the header matches */
-		if (n_handshake != GKM_RPC_HANDSHAKE_LEN ||
-		    memcmp (handshake, GKM_RPC_HANDSHAKE, n_handshake) != 0) {
+		} else if (n_handshake != GKM_RPC_HANDSHAKE_LEN ||
+		           memcmp (handshake, GKM_RPC_HANDSHAKE, n_handshake) != 0) {
 			gkm_rpc_warn ("invalid handshake received from connecting module");
 			ret = CKR_GENERAL_ERROR;
 		}
@@ -874,8 +906,7 @@ rpc_C_GetSlotList (CallState *cs)
 	CK_ULONG count;
 
 	BEGIN_CALL (C_GetSlotList);
-		IN_BYTE (token_present);
-		IN_ULONG_BUFFER (slot_list, count);
+		IN_CALL (gkm_rpc_stub_read_C_GetSlotList (cs, &token_present, &slot_list, &count));
 	PROCESS_CALL ((token_present, slot_list, &count));
 		OUT_ULONG_ARRAY (slot_list, count);
 	END_CALL;
@@ -890,7 +921,7 @@ rpc_C_GetSlotInfo (CallState *cs)
 	/* Slot id becomes appartment so lower layers can tell clients apart. */
 
 	BEGIN_CALL (C_GetSlotInfo);
-		IN_ULONG (slot_id);
+		IN_CALL (gkm_rpc_stub_read_C_GetSlotInfo (cs, &slot_id));
 	PROCESS_CALL ((slot_id, &info));
 		OUT_SLOT_INFO (info);
 	END_CALL;
@@ -905,7 +936,7 @@ rpc_C_GetTokenInfo (CallState *cs)
 	/* Slot id becomes appartment so lower layers can tell clients apart. */
 
 	BEGIN_CALL (C_GetTokenInfo);
-		IN_ULONG (slot_id);
+		IN_CALL (gkm_rpc_stub_read_C_GetTokenInfo (cs, &slot_id));
 	PROCESS_CALL ((slot_id, &info));
 		OUT_TOKEN_INFO (info);
 	END_CALL;
@@ -921,8 +952,8 @@ rpc_C_GetMechanismList (CallState *cs)
 	/* Slot id becomes appartment so lower layers can tell clients apart. */
 
 	BEGIN_CALL (C_GetMechanismList);
-		IN_ULONG (slot_id);
-		IN_ULONG_BUFFER (mechanism_list, count);
+		IN_CALL (gkm_rpc_stub_read_C_GetMechanismList (cs, &slot_id, &mechanism_list,
+		                                               &count));
 	PROCESS_CALL ((slot_id, mechanism_list, &count));
 		OUT_ULONG_ARRAY (mechanism_list, count);
 	END_CALL;
@@ -938,8 +969,7 @@ rpc_C_GetMechanismInfo (CallState *cs)
 	/* Slot id becomes appartment so lower layers can tell clients apart. */
 
 	BEGIN_CALL (C_GetMechanismInfo);
-		IN_ULONG (slot_id);
-		IN_ULONG (type);
+		IN_CALL (gkm_rpc_stub_read_C_GetMechanismInfo (cs, &slot_id, &type));
 	PROCESS_CALL ((slot_id, type, &info));
 		OUT_MECHANISM_INFO (info);
 	END_CALL;
@@ -956,9 +986,7 @@ rpc_C_InitToken (CallState *cs)
 	/* Slot id becomes appartment so lower layers can tell clients apart. */
 
 	BEGIN_CALL (C_InitToken);
-		IN_ULONG (slot_id);
-		IN_BYTE_ARRAY (pin, pin_len);
-		IN_STRING (label);
+		IN_CALL (gkm_rpc_stub_read_C_InitToken (cs, &slot_id, &pin, &pin_len, &label));
 	PROCESS_CALL ((slot_id, pin, pin_len, label));
 	END_CALL;
 }
@@ -972,7 +1000,7 @@ rpc_C_WaitForSlotEvent (CallState *cs)
 	/* Get slot id from appartment lower layers use. */
 
 	BEGIN_CALL (C_WaitForSlotEvent);
-		IN_ULONG (flags);
+		IN_CALL (gkm_rpc_stub_read_C_WaitForSlotEvent (cs, &flags));
 	PROCESS_CALL ((flags, &slot_id, NULL));
 		OUT_ULONG (slot_id);
 	END_CALL;
@@ -1011,7 +1039,7 @@ rpc_C_CloseSession (CallState *cs)
 	CK_SESSION_HANDLE session;
 
 	BEGIN_CALL (C_CloseSession);
-		IN_ULONG (session);
+		IN_CALL (gkm_rpc_stub_read_C_CloseSession (cs, &session));
 	PROCESS_CALL ((session));
 	END_CALL;
 }
@@ -1036,7 +1064,7 @@ rpc_C_GetFunctionStatus (CallState *cs)
 	CK_SESSION_HANDLE session;
 
 	BEGIN_CALL (C_GetFunctionStatus);
-		IN_ULONG (session);
+		IN_CALL (gkm_rpc_stub_read_C_GetFunctionStatus (cs, &session));
 	PROCESS_CALL ((session));
 	END_CALL;
 }
@@ -1047,7 +1075,7 @@ rpc_C_CancelFunction (CallState *cs)
 	CK_SESSION_HANDLE session;
 
 	BEGIN_CALL (C_CancelFunction);
-		IN_ULONG (session);
+		IN_CALL (gkm_rpc_stub_read_C_CancelFunction (cs, &session));
 	PROCESS_CALL ((session));
 	END_CALL;
 }
@@ -1061,7 +1089,7 @@ rpc_C_GetSessionInfo (CallState *cs)
 	/* Get slot id from appartment lower layers use. */
 
 	BEGIN_CALL (C_GetSessionInfo);
-		IN_ULONG (session);
+		IN_CALL (gkm_rpc_stub_read_C_GetSessionInfo (cs, &session));
 	PROCESS_CALL ((session, &info));
 		OUT_SESSION_INFO (info);
 	END_CALL;
@@ -1075,8 +1103,7 @@ rpc_C_InitPIN (CallState *cs)
 	CK_ULONG pin_len;
 
 	BEGIN_CALL (C_InitPIN);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (pin, pin_len);
+		IN_CALL (gkm_rpc_stub_read_C_InitPIN (cs, &session, &pin, &pin_len));
 	PROCESS_CALL ((session, pin, pin_len));
 	END_CALL;
 }
@@ -1091,9 +1118,8 @@ rpc_C_SetPIN (CallState *cs)
 	CK_ULONG new_len;
 
 	BEGIN_CALL (C_SetPIN);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (old_pin, old_len);
-		IN_BYTE_ARRAY (new_pin, new_len);
+		IN_CALL (gkm_rpc_stub_read_C_SetPIN (cs, &session, &old_pin, &old_len, &new_pin,
+		                                     &new_len));
 	PROCESS_CALL ((session, old_pin, old_len, new_pin, new_len));
 	END_CALL;
 }
@@ -1106,8 +1132,8 @@ rpc_C_GetOperationState (CallState *cs)
 	CK_ULONG operation_state_len;
 
 	BEGIN_CALL (C_GetOperationState);
-		IN_ULONG (session);
-		IN_BYTE_BUFFER (operation_state, operation_state_len);
+		IN_CALL (gkm_rpc_stub_read_C_GetOperationState (cs, &session, &operation_state,
+		                                                &operation_state_len));
 	PROCESS_CALL ((session, operation_state, &operation_state_len));
 		OUT_BYTE_ARRAY (operation_state, operation_state_len);
 	END_CALL;
@@ -1123,10 +1149,10 @@ rpc_C_SetOperationState (CallState *cs)
 	CK_OBJECT_HANDLE authentication_key;
 
 	BEGIN_CALL (C_SetOperationState);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (operation_state, operation_state_len);
-		IN_ULONG (encryption_key);
-		IN_ULONG (authentication_key);
+		IN_CALL (gkm_rpc_stub_read_C_SetOperationState (cs, &session, &operation_state,
+		                                                &operation_state_len,
+		                                                &encryption_key,
+		                                                &authentication_key));
 	PROCESS_CALL ((session, operation_state, operation_state_len, encryption_key, authentication_key));
 	END_CALL;
 }
@@ -1140,9 +1166,7 @@ rpc_C_Login (CallState *cs)
 	CK_ULONG pin_len;
 
 	BEGIN_CALL (C_Login);
-		IN_ULONG (session);
-		IN_ULONG (user_type);
-		IN_BYTE_ARRAY (pin, pin_len);
+		IN_CALL (gkm_rpc_stub_read_C_Login (cs, &session, &user_type, &pin, &pin_len));
 	PROCESS_CALL ((session, user_type, pin, pin_len));
 	END_CALL;
 }
@@ -1153,7 +1177,7 @@ rpc_C_Logout (CallState *cs)
 	CK_SESSION_HANDLE session;
 
 	BEGIN_CALL (C_Logout);
-		IN_ULONG (session);
+		IN_CALL (gkm_rpc_stub_read_C_Logout (cs, &session));
 	PROCESS_CALL ((session));
 	END_CALL;
 }
@@ -1171,8 +1195,7 @@ rpc_C_CreateObject (CallState *cs)
 	CK_OBJECT_HANDLE new_object;
 
 	BEGIN_CALL (C_CreateObject);
-		IN_ULONG (session);
-		IN_ATTRIBUTE_ARRAY (template, count);
+		IN_CALL (gkm_rpc_stub_read_C_CreateObject (cs, &session, &template, &count));
 	PROCESS_CALL ((session, template, count, &new_object));
 		OUT_ULONG (new_object);
 	END_CALL;
@@ -1188,9 +1211,7 @@ rpc_C_CopyObject (CallState *cs)
 	CK_OBJECT_HANDLE new_object;
 
 	BEGIN_CALL (C_CopyObject);
-		IN_ULONG (session);
-		IN_ULONG (object);
-		IN_ATTRIBUTE_ARRAY (template, count);
+		IN_CALL (gkm_rpc_stub_read_C_CopyObject (cs, &session, &object, &template, &count));
 	PROCESS_CALL ((session, object, template, count, &new_object));
 		OUT_ULONG (new_object);
 	END_CALL;
@@ -1203,8 +1224,7 @@ rpc_C_DestroyObject (CallState *cs)
 	CK_OBJECT_HANDLE object;
 
 	BEGIN_CALL (C_DestroyObject);
-		IN_ULONG (session);
-		IN_ULONG (object);
+		IN_CALL (gkm_rpc_stub_read_C_DestroyObject (cs, &session, &object));
 	PROCESS_CALL ((session, object));
 	END_CALL;
 }
@@ -1217,8 +1237,7 @@ rpc_C_GetObjectSize (CallState *cs)
 	CK_ULONG size;
 
 	BEGIN_CALL (C_GetObjectSize);
-		IN_ULONG (session);
-		IN_ULONG (object);
+		IN_CALL (gkm_rpc_stub_read_C_GetObjectSize (cs, &session, &object));
 	PROCESS_CALL ((session, object, &size));
 		OUT_ULONG (size);
 	END_CALL;
@@ -1233,10 +1252,60 @@ rpc_C_GetAttributeValue (CallState *cs)
 	CK_ULONG count;
 
 	BEGIN_CALL (C_GetAttributeValue);
-		IN_ULONG (session);
-		IN_ULONG (object);
-		IN_ATTRIBUTE_BUFFER (template, count);
+		IN_CALL (gkm_rpc_stub_read_C_GetAttributeValue (cs, &session, &object, &template,
+		                                                &count));
+	PROCESS_CALL ((session, object, template, count));
+		OUT_ATTRIBUTE_ARRAY (template, count);
+	END_CALL;
+}
+
+/* Values at most this large are sent along when only sizes are asked for */
+#define FETCH_VALUE_MAX 4096
+
+static CK_RV
+rpc_FetchAttributeValue (CallState *cs)
+{
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE object;
+	CK_ATTRIBUTE_PTR template, fetch;
+	CK_ULONG count, n_fetch, i, j;
+
+	BEGIN_CALL (C_GetAttributeValue);
+		IN_CALL (gkm_rpc_stub_read_C_GetAttributeValue (cs, &session, &object, &template,
+		                                                &count));
 	PROCESS_CALL ((session, object, template, count));
+
+		/* Now that we know the sizes, get the small values */
+		fetch = NULL;
+		n_fetch = 0;
+		if (_ret == CKR_OK || _ret == CKR_ATTRIBUTE_SENSITIVE || _ret == CKR_ATTRIBUTE_TYPE_INVALID)
+			fetch = call_alloc (cs, count * sizeof (CK_ATTRIBUTE));
+
+		/* Never send secrets along, when they weren't asked for */
+		for (i = 0; fetch && i < count; ++i) {
+			if (template[i].pValue != NULL || template[i].ulValueLen == 0 ||
+			    template[i].ulValueLen > FETCH_VALUE_MAX ||
+			    gkm_rpc_attribute_is_secret (template[i].type))
+				continue;
+			fetch[n_fetch].type = template[i].type;
+			fetch[n_fetch].ulValueLen = template[i].ulValueLen;
+			fetch[n_fetch].pValue = call_alloc (cs, template[i].ulValueLen);
+			if (!fetch[n_fetch].pValue)
+				break;
+			++n_fetch;
+		}
+
+		/* If anything goes wrong, the caller only gets the sizes */
+		if (n_fetch > 0 && (_func) (session, object, fetch, n_fetch) == CKR_OK) {
+			for (i = 0, j = 0; i < count && j < n_fetch; ++i) {
+				if (template[i].type != fetch[j].type || template[i].pValue != NULL)
+					continue;
+				template[i].pValue = fetch[j].pValue;
+				template[i].ulValueLen = fetch[j].ulValueLen;
+				++j;
+			}
+		}
+
 		OUT_ATTRIBUTE_ARRAY (template, count);
 	END_CALL;
 }
@@ -1250,9 +1319,8 @@ rpc_C_SetAttributeValue (CallState *cs)
 	CK_ULONG count;
 
 	BEGIN_CALL (C_SetAttributeValue);
-		IN_ULONG (session);
-		IN_ULONG (object);
-		IN_ATTRIBUTE_ARRAY (template, count);
+		IN_CALL (gkm_rpc_stub_read_C_SetAttributeValue (cs, &session, &object, &template,
+		                                                &count));
 	PROCESS_CALL ((session, object, template, count));
 	END_CALL;
 }
@@ -1265,8 +1333,7 @@ rpc_C_FindObjectsInit (CallState *cs)
 	CK_ULONG count;
 
 	BEGIN_CALL (C_FindObjectsInit);
-		IN_ULONG (session);
-		IN_ATTRIBUTE_ARRAY (template, count);
+		IN_CALL (gkm_rpc_stub_read_C_FindObjectsInit (cs, &session, &template, &count));
 	PROCESS_CALL ((session, template, count));
 	END_CALL;
 }
@@ -1275,14 +1342,34 @@ static CK_RV
 rpc_C_FindObjects (CallState *cs)
 {
 	CK_SESSION_HANDLE session;
-	CK_OBJECT_HANDLE_PTR objects;
+	CK_OBJECT_HANDLE_PTR objects, more;
 	CK_ULONG max_object_count;
-	CK_ULONG object_count;
+	CK_ULONG object_count, n_more;
 
 	BEGIN_CALL (C_FindObjects);
-		IN_ULONG (session);
-		IN_ULONG_BUFFER (objects, max_object_count);
+		IN_CALL (gkm_rpc_stub_read_C_FindObjects (cs, &session, &objects,
+		                                          &max_object_count));
 	PROCESS_CALL ((session, objects, max_object_count, &object_count));
+
+		/*
+		 * In a batch the search is usually finished right after, so
+		 * return all of the objects, growing the buffer as needed.
+		 */
+		while (cs->batched && _ret == CKR_OK && object_count > 0 &&
+		       object_count == max_object_count) {
+			more = call_alloc (cs, max_object_count * 2 * sizeof (CK_OBJECT_HANDLE));
+			if (!more) {
+				_ret = CKR_DEVICE_MEMORY;
+				break;
+			}
+			memcpy (more, objects, object_count * sizeof (CK_OBJECT_HANDLE));
+			objects = more;
+			max_object_count *= 2;
+			_ret = (_func) (session, objects + object_count,
+			                max_object_count - object_count, &n_more);
+			object_count += n_more;
+		}
+
 		OUT_ULONG_ARRAY (objects, object_count);
 	END_CALL;
 }
@@ -1293,7 +1380,7 @@ rpc_C_FindObjectsFinal (CallState *cs)
 	CK_SESSION_HANDLE session;
 
 	BEGIN_CALL (C_FindObjectsFinal);
-		IN_ULONG (session);
+		IN_CALL (gkm_rpc_stub_read_C_FindObjectsFinal (cs, &session));
 	PROCESS_CALL ((session));
 	END_CALL;
 }
@@ -1306,9 +1393,7 @@ rpc_C_EncryptInit (CallState *cs)
 	CK_OBJECT_HANDLE key;
 
 	BEGIN_CALL (C_EncryptInit);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (key);
+		IN_CALL (gkm_rpc_stub_read_C_EncryptInit (cs, &session, &mechanism, &key));
 	PROCESS_CALL ((session, &mechanism, key));
 	END_CALL;
 
@@ -1324,9 +1409,8 @@ rpc_C_Encrypt (CallState *cs)
 	CK_ULONG encrypted_data_len;
 
 	BEGIN_CALL (C_Encrypt);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (data, data_len);
-		IN_BYTE_BUFFER (encrypted_data, encrypted_data_len);
+		IN_CALL (gkm_rpc_stub_read_C_Encrypt (cs, &session, &data, &data_len,
+		                                      &encrypted_data, &encrypted_data_len));
 	PROCESS_CALL ((session, data, data_len, encrypted_data, &encrypted_data_len));
 		OUT_BYTE_ARRAY (encrypted_data, encrypted_data_len);
 	END_CALL;
@@ -1342,9 +1426,8 @@ rpc_C_EncryptUpdate (CallState *cs)
 	CK_ULONG encrypted_part_len;
 
 	BEGIN_CALL (C_EncryptUpdate);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (part, part_len);
-		IN_BYTE_BUFFER (encrypted_part, encrypted_part_len);
+		IN_CALL (gkm_rpc_stub_read_C_EncryptUpdate (cs, &session, &part, &part_len,
+		                                            &encrypted_part, &encrypted_part_len));
 	PROCESS_CALL ((session, part, part_len, encrypted_part, &encrypted_part_len));
 		OUT_BYTE_ARRAY (encrypted_part, encrypted_part_len);
 	END_CALL;
@@ -1358,8 +1441,8 @@ rpc_C_EncryptFinal (CallState *cs)
 	CK_ULONG last_encrypted_part_len;
 
 	BEGIN_CALL (C_EncryptFinal);
-		IN_ULONG (session);
-		IN_BYTE_BUFFER (last_encrypted_part, last_encrypted_part_len);
+		IN_CALL (gkm_rpc_stub_read_C_EncryptFinal (cs, &session, &last_encrypted_part,
+		                                           &last_encrypted_part_len));
 	PROCESS_CALL ((session, last_encrypted_part, &last_encrypted_part_len));
 		OUT_BYTE_ARRAY (last_encrypted_part, last_encrypted_part_len);
 	END_CALL;
@@ -1373,9 +1456,7 @@ rpc_C_DecryptInit (CallState *cs)
 	CK_OBJECT_HANDLE key;
 
 	BEGIN_CALL (C_DecryptInit);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (key);
+		IN_CALL (gkm_rpc_stub_read_C_DecryptInit (cs, &session, &mechanism, &key));
 	PROCESS_CALL ((session, &mechanism, key));
 	END_CALL;
 }
@@ -1390,9 +1471,8 @@ rpc_C_Decrypt (CallState *cs)
 	CK_ULONG data_len;
 
 	BEGIN_CALL (C_Decrypt);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (encrypted_data, encrypted_data_len);
-		IN_BYTE_BUFFER (data, data_len);
+		IN_CALL (gkm_rpc_stub_read_C_Decrypt (cs, &session, &encrypted_data,
+		                                      &encrypted_data_len, &data, &data_len));
 	PROCESS_CALL ((session, encrypted_data, encrypted_data_len, data, &data_len));
 		OUT_BYTE_ARRAY (data, data_len);
 	END_CALL;
@@ -1408,9 +1488,8 @@ rpc_C_DecryptUpdate (CallState *cs)
 	CK_ULONG part_len;
 
 	BEGIN_CALL (C_DecryptUpdate);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (encrypted_part, encrypted_part_len);
-		IN_BYTE_BUFFER (part, part_len);
+		IN_CALL (gkm_rpc_stub_read_C_DecryptUpdate (cs, &session, &encrypted_part,
+		                                            &encrypted_part_len, &part, &part_len));
 	PROCESS_CALL ((session, encrypted_part, encrypted_part_len, part, &part_len));
 		OUT_BYTE_ARRAY (part, part_len);
 	END_CALL;
@@ -1424,8 +1503,8 @@ rpc_C_DecryptFinal (CallState *cs)
 	CK_ULONG last_part_len;
 
 	BEGIN_CALL (C_DecryptFinal);
-		IN_ULONG (session);
-		IN_BYTE_BUFFER (last_part, last_part_len);
+		IN_CALL (gkm_rpc_stub_read_C_DecryptFinal (cs, &session, &last_part,
+		                                           &last_part_len));
 	PROCESS_CALL ((session, last_part, &last_part_len));
 		OUT_BYTE_ARRAY (last_part, last_part_len);
 	END_CALL;
@@ -1438,8 +1517,7 @@ rpc_C_DigestInit (CallState *cs)
 	CK_MECHANISM mechanism;
 
 	BEGIN_CALL (C_DigestInit);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
+		IN_CALL (gkm_rpc_stub_read_C_DigestInit (cs, &session, &mechanism));
 	PROCESS_CALL ((session, &mechanism));
 	END_CALL;
 }
@@ -1454,9 +1532,8 @@ rpc_C_Digest (CallState *cs)
 	CK_ULONG digest_len;
 
 	BEGIN_CALL (C_Digest);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (data, data_len);
-		IN_BYTE_BUFFER (digest, digest_len);
+		IN_CALL (gkm_rpc_stub_read_C_Digest (cs, &session, &data, &data_len, &digest,
+		                                     &digest_len));
 	PROCESS_CALL ((session, data, data_len, digest, &digest_len));
 		OUT_BYTE_ARRAY (digest, digest_len);
 	END_CALL;
@@ -1470,8 +1547,7 @@ rpc_C_DigestUpdate (CallState *cs)
 	CK_ULONG part_len;
 
 	BEGIN_CALL (C_DigestUpdate);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (part, part_len);
+		IN_CALL (gkm_rpc_stub_read_C_DigestUpdate (cs, &session, &part, &part_len));
 	PROCESS_CALL ((session, part, part_len));
 	END_CALL;
 }
@@ -1483,8 +1559,7 @@ rpc_C_DigestKey (CallState *cs)
 	CK_OBJECT_HANDLE key;
 
 	BEGIN_CALL (C_DigestKey);
-		IN_ULONG (session);
-		IN_ULONG (key);
+		IN_CALL (gkm_rpc_stub_read_C_DigestKey (cs, &session, &key));
 	PROCESS_CALL ((session, key));
 	END_CALL;
 }
@@ -1497,8 +1572,7 @@ rpc_C_DigestFinal (CallState *cs)
 	CK_ULONG digest_len;
 
 	BEGIN_CALL (C_DigestFinal);
-		IN_ULONG (session);
-		IN_BYTE_BUFFER (digest, digest_len);
+		IN_CALL (gkm_rpc_stub_read_C_DigestFinal (cs, &session, &digest, &digest_len));
 	PROCESS_CALL ((session, digest, &digest_len));
 		OUT_BYTE_ARRAY (digest, digest_len);
 	END_CALL;
@@ -1512,9 +1586,7 @@ rpc_C_SignInit (CallState *cs)
 	CK_OBJECT_HANDLE key;
 
 	BEGIN_CALL (C_SignInit);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (key);
+		IN_CALL (gkm_rpc_stub_read_C_SignInit (cs, &session, &mechanism, &key));
 	PROCESS_CALL ((session, &mechanism, key));
 	END_CALL;
 }
@@ -1529,9 +1601,8 @@ rpc_C_Sign (CallState *cs)
 	CK_ULONG signature_len;
 
 	BEGIN_CALL (C_Sign);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (part, part_len);
-		IN_BYTE_BUFFER (signature, signature_len);
+		IN_CALL (gkm_rpc_stub_read_C_Sign (cs, &session, &part, &part_len, &signature,
+		                                   &signature_len));
 	PROCESS_CALL ((session, part, part_len, signature, &signature_len));
 		OUT_BYTE_ARRAY (signature, signature_len);
 	END_CALL;
@@ -1546,8 +1617,7 @@ rpc_C_SignUpdate (CallState *cs)
 	CK_ULONG part_len;
 
 	BEGIN_CALL (C_SignUpdate);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (part, part_len);
+		IN_CALL (gkm_rpc_stub_read_C_SignUpdate (cs, &session, &part, &part_len));
 	PROCESS_CALL ((session, part, part_len));
 	END_CALL;
 }
@@ -1560,8 +1630,7 @@ rpc_C_SignFinal (CallState *cs)
 	CK_ULONG signature_len;
 
 	BEGIN_CALL (C_SignFinal);
-		IN_ULONG (session);
-		IN_BYTE_BUFFER (signature, signature_len);
+		IN_CALL (gkm_rpc_stub_read_C_SignFinal (cs, &session, &signature, &signature_len));
 	PROCESS_CALL ((session, signature, &signature_len));
 		OUT_BYTE_ARRAY (signature, signature_len);
 	END_CALL;
@@ -1575,9 +1644,7 @@ rpc_C_SignRecoverInit (CallState *cs)
 	CK_OBJECT_HANDLE key;
 
 	BEGIN_CALL (C_SignRecoverInit);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (key);
+		IN_CALL (gkm_rpc_stub_read_C_SignRecoverInit (cs, &session, &mechanism, &key));
 	PROCESS_CALL ((session, &mechanism, key));
 	END_CALL;
 }
@@ -1592,9 +1659,8 @@ rpc_C_SignRecover (CallState *cs)
 	CK_ULONG signature_len;
 
 	BEGIN_CALL (C_SignRecover);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (data, data_len);
-		IN_BYTE_BUFFER (signature, signature_len);
+		IN_CALL (gkm_rpc_stub_read_C_SignRecover (cs, &session, &data, &data_len,
+		                                          &signature, &signature_len));
 	PROCESS_CALL ((session, data, data_len, signature, &signature_len));
 		OUT_BYTE_ARRAY (signature, signature_len);
 	END_CALL;
@@ -1608,9 +1674,7 @@ rpc_C_VerifyInit (CallState *cs)
 	CK_OBJECT_HANDLE key;
 
 	BEGIN_CALL (C_VerifyInit);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (key);
+		IN_CALL (gkm_rpc_stub_read_C_VerifyInit (cs, &session, &mechanism, &key));
 	PROCESS_CALL ((session, &mechanism, key));
 	END_CALL;
 }
@@ -1625,9 +1689,8 @@ rpc_C_Verify (CallState *cs)
 	CK_ULONG signature_len;
 
 	BEGIN_CALL (C_Verify);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (data, data_len);
-		IN_BYTE_ARRAY (signature, signature_len);
+		IN_CALL (gkm_rpc_stub_read_C_Verify (cs, &session, &data, &data_len, &signature,
+		                                     &signature_len));
 	PROCESS_CALL ((session, data, data_len, signature, signature_len));
 	END_CALL;
 }
@@ -1640,8 +1703,7 @@ rpc_C_VerifyUpdate (CallState *cs)
 	CK_ULONG part_len;
 
 	BEGIN_CALL (C_VerifyUpdate);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (part, part_len);
+		IN_CALL (gkm_rpc_stub_read_C_VerifyUpdate (cs, &session, &part, &part_len));
 	PROCESS_CALL ((session, part, part_len));
 	END_CALL;
 }
@@ -1654,8 +1716,8 @@ rpc_C_VerifyFinal (CallState *cs)
 	CK_ULONG signature_len;
 
 	BEGIN_CALL (C_VerifyFinal);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (signature, signature_len);
+		IN_CALL (gkm_rpc_stub_read_C_VerifyFinal (cs, &session, &signature,
+		                                          &signature_len));
 	PROCESS_CALL ((session, signature, signature_len));
 	END_CALL;
 }
@@ -1668,9 +1730,7 @@ rpc_C_VerifyRecoverInit (CallState *cs)
 	CK_OBJECT_HANDLE key;
 
 	BEGIN_CALL (C_VerifyRecoverInit);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (key);
+		IN_CALL (gkm_rpc_stub_read_C_VerifyRecoverInit (cs, &session, &mechanism, &key));
 	PROCESS_CALL ((session, &mechanism, key));
 	END_CALL;
 }
@@ -1685,9 +1745,8 @@ rpc_C_VerifyRecover (CallState *cs)
 	CK_ULONG data_len;
 
 	BEGIN_CALL (C_VerifyRecover);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (signature, signature_len);
-		IN_BYTE_BUFFER (data, data_len);
+		IN_CALL (gkm_rpc_stub_read_C_VerifyRecover (cs, &session, &signature,
+		                                            &signature_len, &data, &data_len));
 	PROCESS_CALL ((session, signature, signature_len, data, &data_len));
 		OUT_BYTE_ARRAY (data, data_len);
 	END_CALL;
@@ -1703,9 +1762,9 @@ rpc_C_DigestEncryptUpdate (CallState *cs)
 	CK_ULONG encrypted_part_len;
 
 	BEGIN_CALL (C_DigestEncryptUpdate);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (part, part_len);
-		IN_BYTE_BUFFER (encrypted_part, encrypted_part_len);
+		IN_CALL (gkm_rpc_stub_read_C_DigestEncryptUpdate (cs, &session, &part, &part_len,
+		                                                  &encrypted_part,
+		                                                  &encrypted_part_len));
 	PROCESS_CALL ((session, part, part_len, encrypted_part, &encrypted_part_len));
 		OUT_BYTE_ARRAY (encrypted_part, encrypted_part_len);
 	END_CALL;
@@ -1721,9 +1780,9 @@ rpc_C_DecryptDigestUpdate (CallState *cs)
 	CK_ULONG part_len;
 
 	BEGIN_CALL (C_DecryptDigestUpdate);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (encrypted_part, encrypted_part_len);
-		IN_BYTE_BUFFER (part, part_len);
+		IN_CALL (gkm_rpc_stub_read_C_DecryptDigestUpdate (cs, &session, &encrypted_part,
+		                                                  &encrypted_part_len, &part,
+		                                                  &part_len));
 	PROCESS_CALL ((session, encrypted_part, encrypted_part_len, part, &part_len));
 		OUT_BYTE_ARRAY (part, part_len);
 	END_CALL;
@@ -1739,9 +1798,9 @@ rpc_C_SignEncryptUpdate (CallState *cs)
 	CK_ULONG encrypted_part_len;
 
 	BEGIN_CALL (C_SignEncryptUpdate);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (part, part_len);
-		IN_BYTE_BUFFER (encrypted_part, encrypted_part_len);
+		IN_CALL (gkm_rpc_stub_read_C_SignEncryptUpdate (cs, &session, &part, &part_len,
+		                                                &encrypted_part,
+		                                                &encrypted_part_len));
 	PROCESS_CALL ((session, part, part_len, encrypted_part, &encrypted_part_len));
 		OUT_BYTE_ARRAY (encrypted_part, encrypted_part_len);
 	END_CALL;
@@ -1757,9 +1816,9 @@ rpc_C_DecryptVerifyUpdate (CallState *cs)
 	CK_ULONG part_len;
 
 	BEGIN_CALL (C_DecryptVerifyUpdate);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (encrypted_part, encrypted_part_len);
-		IN_BYTE_BUFFER (part, part_len);
+		IN_CALL (gkm_rpc_stub_read_C_DecryptVerifyUpdate (cs, &session, &encrypted_part,
+		                                                  &encrypted_part_len, &part,
+		                                                  &part_len));
 	PROCESS_CALL ((session, encrypted_part, encrypted_part_len, part, &part_len));
 		OUT_BYTE_ARRAY (part, part_len);
 	END_CALL;
@@ -1779,9 +1838,8 @@ rpc_C_GenerateKey (CallState *cs)
 	CK_OBJECT_HANDLE key;
 
 	BEGIN_CALL (C_GenerateKey);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ATTRIBUTE_ARRAY (template, count);
+		IN_CALL (gkm_rpc_stub_read_C_GenerateKey (cs, &session, &mechanism, &template,
+		                                          &count));
 	PROCESS_CALL ((session, &mechanism, template, count, &key));
 		OUT_ULONG (key);
 	END_CALL;
@@ -1800,10 +1858,11 @@ rpc_C_GenerateKeyPair (CallState *cs)
 	CK_OBJECT_HANDLE private_key;
 
 	BEGIN_CALL (C_GenerateKeyPair);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ATTRIBUTE_ARRAY (public_key_template, public_key_attribute_count);
-		IN_ATTRIBUTE_ARRAY (private_key_template, private_key_attribute_count);
+		IN_CALL (gkm_rpc_stub_read_C_GenerateKeyPair (cs, &session, &mechanism,
+		                                              &public_key_template,
+		                                              &public_key_attribute_count,
+		                                              &private_key_template,
+		                                              &private_key_attribute_count));
 	PROCESS_CALL ((session, &mechanism, public_key_template, public_key_attribute_count, private_key_template, private_key_attribute_count, &public_key, &private_key));
 		OUT_ULONG (public_key);
 		OUT_ULONG (private_key);
@@ -1822,11 +1881,8 @@ rpc_C_WrapKey (CallState *cs)
 	CK_ULONG wrapped_key_len;
 
 	BEGIN_CALL (C_WrapKey);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (wrapping_key);
-		IN_ULONG (key);
-		IN_BYTE_BUFFER (wrapped_key, wrapped_key_len);
+		IN_CALL (gkm_rpc_stub_read_C_WrapKey (cs, &session, &mechanism, &wrapping_key, &key,
+		                                      &wrapped_key, &wrapped_key_len));
 	PROCESS_CALL ((session, &mechanism, wrapping_key, key, wrapped_key, &wrapped_key_len));
 		OUT_BYTE_ARRAY (wrapped_key, wrapped_key_len);
 	END_CALL;
@@ -1845,11 +1901,9 @@ rpc_C_UnwrapKey (CallState *cs)
 	CK_OBJECT_HANDLE key;
 
 	BEGIN_CALL (C_UnwrapKey);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (unwrapping_key);
-		IN_BYTE_ARRAY (wrapped_key, wrapped_key_len);
-		IN_ATTRIBUTE_ARRAY (template, attribute_count);
+		IN_CALL (gkm_rpc_stub_read_C_UnwrapKey (cs, &session, &mechanism, &unwrapping_key,
+		                                        &wrapped_key, &wrapped_key_len, &template,
+		                                        &attribute_count));
 	PROCESS_CALL ((session, &mechanism, unwrapping_key, wrapped_key, wrapped_key_len, template, attribute_count, &key));
 		OUT_ULONG (key);
 	END_CALL;
@@ -1866,10 +1920,8 @@ rpc_C_DeriveKey (CallState *cs)
 	CK_OBJECT_HANDLE key;
 
 	BEGIN_CALL (C_DeriveKey);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (base_key);
-		IN_ATTRIBUTE_ARRAY (template, attribute_count);
+		IN_CALL (gkm_rpc_stub_read_C_DeriveKey (cs, &session, &mechanism, &base_key,
+		                                        &template, &attribute_count));
 	PROCESS_CALL ((session, &mechanism, base_key, template, attribute_count, &key));
 		OUT_ULONG (key);
 	END_CALL;
@@ -1883,8 +1935,7 @@ rpc_C_SeedRandom (CallState *cs)
 	CK_ULONG seed_len;
 
 	BEGIN_CALL (C_SeedRandom);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (seed, seed_len);
+		IN_CALL (gkm_rpc_stub_read_C_SeedRandom (cs, &session, &seed, &seed_len));
 	PROCESS_CALL ((session, seed, seed_len));
 	END_CALL;
 }
@@ -1897,13 +1948,109 @@ rpc_C_GenerateRandom (CallState *cs)
 	CK_ULONG random_len;
 
 	BEGIN_CALL (C_GenerateRandom);
-		IN_ULONG (session);
-		IN_BYTE_BUFFER (random_data, random_len);
+		IN_CALL (gkm_rpc_stub_read_C_GenerateRandom (cs, &session, &random_data,
+		                                             &random_len));
 	PROCESS_CALL ((session, random_data, random_len));
 		OUT_BYTE_ARRAY (random_data, random_len);
 	END_CALL;
 }
 
+static int dispatch_call (CallState *cs);
+
+static CK_RV
+rpc_Batch (CallState *cs)
+{
+	GkmRpcMessage *req, *resp;
+	GkmRpcMessage *part_req, *part_resp;
+	const unsigned char *part;
+	size_t n_part, offset;
+	EggBuffer parts, results;
+	CK_BYTE_PTR data;
+	CK_ULONG n_data;
+	CK_RV ret;
+
+	debug (("Batch: enter"));
+	assert (cs);
+
+	ret = proto_read_byte_array (cs, &data, &n_data);
+	if (ret != CKR_OK)
+		return ret;
+	if (!data)
+		return PARSE_ERROR;
+
+	req = cs->req;
+	resp = cs->resp;
+
+	part_req = gkm_rpc_message_new ((EggBufferAllocator)realloc);
+	part_resp = gkm_rpc_message_new ((EggBufferAllocator)realloc);
+	if (!part_req || !part_resp) {
+		gkm_rpc_message_free (part_req);
+		gkm_rpc_message_free (part_resp);
+		return CKR_DEVICE_MEMORY;
+	}
+
+	egg_buffer_init_static (&parts, data, n_data);
+	egg_buffer_init_full (&results, 256, (EggBufferAllocator)realloc);
+
+	/* Each part is run exactly as if it had arrived on its own */
+	for (offset = 0; offset < parts.len; ) {
+
+		if (!egg_buffer_get_byte_array (&parts, offset, &offset, &part, &n_part)) {
+			ret = PARSE_ERROR;
+			break;
+		}
+
+		gkm_rpc_message_reset (part_req);
+		if (!egg_buffer_append (&part_req->buffer, part, n_part)) {
+			ret = CKR_DEVICE_MEMORY;
+			break;
+		}
+
+		if (!gkm_rpc_message_parse (part_req, GKM_RPC_REQUEST)) {
+			ret = PARSE_ERROR;
+			break;
+		}
+
+		/* Calls that change the state of the connection can't be batched */
+		switch (part_req->call_id) {
+		case GKM_RPC_CALL_C_Initialize:
+		case GKM_RPC_CALL_C_Finalize:
+		case GKM_RPC_CALL_Batch:
+			gkm_rpc_warn ("call %d is not allowed in a batch", part_req->call_id);
+			ret = PARSE_ERROR;
+			break;
+		}
+		if (ret != CKR_OK)
+			break;
+
+		cs->req = part_req;
+		cs->resp = part_resp;
+		cs->batched = 1;
+		if (!dispatch_call (cs))
+			ret = PREP_ERROR;
+		cs->batched = 0;
+		cs->req = req;
+		cs->resp = resp;
+		if (ret != CKR_OK)
+			break;
+
+		egg_buffer_add_byte_array (&results, part_resp->buffer.buf, part_resp->buffer.len);
+		gkm_rpc_message_reset (part_resp);
+	}
+
+	if (ret == CKR_OK && egg_buffer_has_error (&results))
+		ret = CKR_DEVICE_MEMORY;
+	if (ret == CKR_OK && !gkm_rpc_message_write_byte_array (resp, results.buf, results.len))
+		ret = PREP_ERROR;
+
+	egg_buffer_uninit (&results);
+	gkm_rpc_message_free (part_req);
+	gkm_rpc_message_free (part_resp);
+
+	debug (("ret: %d", ret));
+	return ret;
+}
+
 /* ---------------------------------------------------------------------------
  * DISPATCH THREAD HANDLING
  */
@@ -2002,6 +2149,8 @@ dispatch_call (CallState *cs)
 	CASE_CALL(C_DeriveKey)
 	CASE_CALL(C_SeedRandom)
 	CASE_CALL(C_GenerateRandom)
+	CASE_CALL(Batch)
+	CASE_CALL(FetchAttributeValue)
 	#undef CASE_CALL
 
 	default:
@@ -2054,175 +2203,862 @@ dispatch_call (CallState *cs)
 	return 1;
 }
 
-static int
-read_all (int sock, unsigned char* data, size_t len)
+/*
+ * Sends as much as the socket takes without blocking. Any descriptors are
+ * sent along with the first of the data. Returns the number of bytes sent,
+ * or -1 when the connection should be closed.
+ */
+static ssize_t
+write_some (int sock, unsigned char* data, size_t len, int *fds, int n_fds)
 {
+	size_t sent = 0;
 	int r;
 
 	assert (sock >= 0);
 	assert (data);
-	assert (len > 0);
 
-	while (len > 0) {
+	while (sent < len) {
 
-		r = read (sock, data, len);
+		r = gkm_rpc_send_fds (sock, data + sent, len - sent, fds, n_fds);
 
-		if (r == 0) {
-			/* Connection was closed on client */
-			return 0;
-		} else if (r == -1) {
-			if (errno != EAGAIN && errno != EINTR) {
-				gkm_rpc_warn ("couldn't receive data: %s", strerror (errno));
-				return 0;
+		if (r == -1) {
+			if (errno == EAGAIN) {
+				/* The rest is sent once the socket drains */
+				break;
+			} else if (errno == EINTR) {
+				continue;
+			} else if (errno != EPIPE) {
+				/* EPIPE: Connection closed from client */
+				gkm_rpc_warn ("couldn't send data: %s", strerror (errno));
 			}
-		} else {
-			data += r;
-			len -= r;
+			return -1;
 		}
+
+		sent += r;
+		n_fds = 0;
 	}
 
-	return 1;
+	return sent;
 }
 
-static int
-write_all (int sock, unsigned char* data, size_t len)
+/* ---------------------------------------------------------------------------
+ * CONNECTIONS
+ *
+ * A single loop thread polls all client connections and reads in
+ * complete requests. Each complete request is handed to a bounded
+ * pool of worker threads, which dispatch the call and write back as
+ * much of the response as the socket takes. Workers never wait for a
+ * client to read. Whatever is left is queued on the connection, and
+ * sent by the loop thread once the socket drains.
+ *
+ * A serial connection has at most one request in flight, and is not
+ * polled while busy, so calls on it are processed in order. A client
+ * may negotiate a multiplexed connection in C_Initialize, after which
+ * each request carries an id, several may be in flight at once, and
+ * each response is sent back with the id of its request as soon as
+ * it is ready.
+ */
+
+typedef struct _DispatchConn DispatchConn;
+
+typedef struct _DispatchCall {
+	struct _DispatchCall *next;
+	DispatchConn *conn;
+	uint32_t id;
+	CallState cs;
+} DispatchCall;
+
+/* Response data which the socket didn't take yet */
+typedef struct _DispatchOut {
+	struct _DispatchOut *next;
+	size_t length;
+	size_t n_sent;
+	int fds[GKM_RPC_MAX_FDS];
+	int n_fds;
+	unsigned char data[1];
+} DispatchOut;
+
+struct _DispatchConn {
+	struct _DispatchConn *next;
+	int sock;
+	uint32_t trace_id;
+
+	/* Owned by the loop thread, unless busy and serial */
+	int ready;
+	DispatchCall call;
+	unsigned char header[12];
+	size_t n_read;
+	uint32_t length;
+	uint32_t n_expected;
+	int fds[GKM_RPC_MAX_FDS];
+	int n_fds;
+
+	/* Held while writing, protects the queue of data still to be sent */
+	pthread_mutex_t write_mutex;
+	DispatchOut *out;
+	DispatchOut **out_tail;
+	size_t n_out;
+	int write_failed;
+
+	/* Protected by conns_mutex */
+	int multiplexed;
+	int busy;
+	int closed;
+	DispatchCall *calls;
+};
+
+/* The maximum number of calls dispatched at once */
+#define MAX_WORKERS 16
+
+/* How long a worker waits for the next call on its connection */
+#define LINGER_MSECS 2
+
+/* No more requests are read from a client with this much left to send */
+#define MAX_QUEUED (1024 * 1024)
+
+/* All connections, additions and removals protected by conns_mutex */
+static DispatchConn *pkcs11_conns = NULL;
+static pthread_mutex_t conns_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The loop thread, and the pipe used to wake it up */
+static GThread *loop_thread = NULL;
+static int loop_wakeup[2] = { -1, -1 };
+static int loop_quit = 0;
+
+/* The workers which dispatch the calls */
+static GThreadPool *loop_workers = NULL;
+
+static void
+loop_wake (void)
 {
+	unsigned char ch = 0;
 	int r;
 
-	assert (sock >= 0);
-	assert (data);
-	assert (len > 0);
+	assert (loop_wakeup[1] != -1);
 
-	while (len > 0) {
+	/* If the pipe is full, the loop is going to wake up anyway */
+	do {
+		r = write (loop_wakeup[1], &ch, 1);
+	} while (r < 0 && errno == EINTR);
+}
 
-		r = write (sock, data, len);
+static void
+conn_free_call (DispatchCall *call)
+{
+	call_uninit (&call->cs);
+	free (call);
+}
 
-		if (r == -1) {
-			if (errno == EPIPE) {
-				/* Connection closed from client */
-				return 0;
-			} else if (errno != EAGAIN && errno != EINTR) {
-				gkm_rpc_warn ("couldn't send data: %s", strerror (errno));
-				return 0;
+static void
+conn_free_out (DispatchOut *out)
+{
+	while (out->n_fds > 0)
+		close (out->fds[--out->n_fds]);
+	free (out);
+}
+
+static void
+conn_release (DispatchConn *conn)
+{
+	DispatchCall *call;
+	DispatchOut *out;
+
+	/* Multiplexed calls that were never dispatched */
+	while (conn->calls) {
+		call = conn->calls;
+		conn->calls = call->next;
+		conn_free_call (call);
+	}
+
+	/*
+	 * Close all sessions for the client application
+	 *
+	 * EXTENSION: In our extended application PKCS#11 model
+	 * C_CloseAllSessions accepts an application identifier as well
+	 * as slot ids. Calling with an application identifier closes all
+	 * sessions for just that application identifier.
+	 */
+	if (conn->ready) {
+		pthread_mutex_lock (&clients_mutex);
+
+		if (!--conn->call.cs.client->refcount) {
+			ClientInstance **cl = &clients;
+
+			while (*cl) {
+				if (*cl == conn->call.cs.client) {
+					*cl = conn->call.cs.client->next;
+					break;
+				}
+				cl = &(*cl)->next;
 			}
-		} else {
-			data += r;
-			len -= r;
+			if (conn->call.cs.client->application.applicationId)
+				(pkcs11_module->C_CloseAllSessions) (conn->call.cs.client->application.applicationId);
+			free (conn->call.cs.client);
+			conn->call.cs.client = NULL;
 		}
+
+		pthread_mutex_unlock (&clients_mutex);
+
+		call_uninit (&conn->call.cs);
 	}
 
-	return 1;
+	/* Descriptors for a request that was never completed */
+	while (conn->n_fds > 0)
+		close (conn->fds[--conn->n_fds]);
+
+	/* Responses that were never sent */
+	while (conn->out) {
+		out = conn->out;
+		conn->out = out->next;
+		conn_free_out (out);
+	}
+
+	pthread_mutex_destroy (&conn->write_mutex);
+	close (conn->sock);
+	free (conn);
 }
 
-static void
-run_dispatch_loop (int sock)
+/*
+ * Reads as much of a request as is available without blocking. Returns
+ * 1 when a complete request has been read, 0 when more is needed and -1
+ * when the connection should be closed.
+ */
+static int
+conn_read (DispatchConn *conn)
 {
-	CallState cs;
+	unsigned char *data;
+	size_t want, header;
 	pid_t pid;
 	uid_t uid;
-	unsigned char buf[4];
-	uint32_t len;
+	int r;
 
-	assert (sock != -1);
+	/* The first thing sent is the credentials byte */
+	if (!conn->ready) {
+		if (egg_unix_credentials_read (conn->sock, &pid, &uid) < 0) {
+			gkm_rpc_warn ("couldn't read socket credentials");
+			return -1;
+		}
 
-	if (egg_unix_credentials_read (sock, &pid, &uid) < 0) {
-		gkm_rpc_warn ("couldn't read socket credentials");
-		return;
+		/* Setup our buffers */
+		if (!call_init (&conn->call.cs, uid, pid)) {
+			gkm_rpc_warn ("out of memory");
+			return -1;
+		}
+
+		conn->ready = 1;
 	}
 
-	/* Setup our buffers */
-	if (!call_init (&cs, uid, pid)) {
-		gkm_rpc_warn ("out of memory");
-		return;
+	/* Only changes while a serial connection is busy, so not now */
+	header = conn->multiplexed ? 12 : 4;
+
+	/* Read as much as is available, without blocking */
+	for (;;) {
+
+		/* Read the number of bytes, the request id and descriptors ... */
+		if (conn->n_read < header) {
+			data = conn->header + conn->n_read;
+			want = header - conn->n_read;
+
+		/* ... and then the actual message */
+		} else {
+			data = conn->call.cs.req->buffer.buf + (conn->n_read - header);
+			want = conn->length - (conn->n_read - header);
+		}
+
+		/* Descriptors only come along on multiplexed connections */
+		if (conn->multiplexed)
+			r = gkm_rpc_recv_fds (conn->sock, data, want, conn->fds, &conn->n_fds);
+		else
+			r = read (conn->sock, data, want);
+		if (r == 0) {
+			/* Connection was closed on client */
+			return -1;
+		} else if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			gkm_rpc_warn ("couldn't receive data: %s", strerror (errno));
+			return -1;
+		}
+
+		conn->n_read += r;
+
+		/* Calculate the number of bytes, and allocate memory */
+		if (conn->n_read == header) {
+			conn->length = egg_buffer_decode_uint32 (conn->header);
+			if (conn->length == 0 || conn->length >= 0x0FFFFFFF) {
+				gkm_rpc_warn ("invalid message size from module: %u bytes", conn->length);
+				return -1;
+			}
+
+			if (conn->multiplexed) {
+				conn->call.id = egg_buffer_decode_uint32 (conn->header + 4);
+				conn->n_expected = egg_buffer_decode_uint32 (conn->header + 8);
+			}
+
+			egg_buffer_reserve (&conn->call.cs.req->buffer, conn->call.cs.req->buffer.len + conn->length);
+			if (egg_buffer_has_error (&conn->call.cs.req->buffer)) {
+				gkm_rpc_warn ("error allocating buffer for message");
+				return -1;
+			}
+
+		/* A complete message */
+		} else if (conn->n_read == conn->length + header) {
+			egg_buffer_add_empty (&conn->call.cs.req->buffer, conn->length);
+			conn->n_read = 0;
+			conn->length = 0;
+
+			/* The descriptors arrive with the start of their message */
+			if (conn->n_fds != conn->n_expected) {
+				gkm_rpc_warn ("received %d descriptors from module, expected %u",
+				              conn->n_fds, conn->n_expected);
+				return -1;
+			}
+
+			memcpy (conn->call.cs.req->fds, conn->fds, sizeof (int) * conn->n_fds);
+			conn->call.cs.req->n_fds = conn->n_fds;
+			conn->n_fds = 0;
+			conn->n_expected = 0;
+			return 1;
+		}
 	}
+}
 
-	/* The main thread loop */
-	while (TRUE) {
+/* Moves a request just read on a multiplexed connection into its own call */
+static DispatchCall *
+conn_take_call (DispatchConn *conn)
+{
+	DispatchCall *call;
+	GkmRpcMessage *req;
 
-		call_reset (&cs);
+	assert (conn->multiplexed);
 
-		/* Read the number of bytes ... */
-		if (!read_all (sock, buf, 4))
-			break;
+	call = calloc (1, sizeof (DispatchCall));
+	if (!call)
+		return NULL;
+
+	call->cs.req = gkm_rpc_message_new ((EggBufferAllocator)realloc);
+	call->cs.resp = gkm_rpc_message_new ((EggBufferAllocator)realloc);
+	if (!call->cs.req || !call->cs.resp) {
+		gkm_rpc_message_free (call->cs.req);
+		gkm_rpc_message_free (call->cs.resp);
+		free (call);
+		return NULL;
+	}
+
+	/* The client is owned by the connection, which outlives the call */
+	call->cs.client = conn->call.cs.client;
+	call->conn = conn;
+	call->id = conn->call.id;
 
-		/* Calculate the number of bytes */
-		len = egg_buffer_decode_uint32 (buf);
-		if (len >= 0x0FFFFFFF) {
-			gkm_rpc_warn ("invalid message size from module: %u bytes", len);
+	/* Leave an empty request behind, to read the next one into */
+	req = call->cs.req;
+	call->cs.req = conn->call.cs.req;
+	conn->call.cs.req = req;
+
+	return call;
+}
+
+/* Called while holding write_mutex. Returns 0 when the connection should be closed */
+static int
+conn_flush (DispatchConn *conn)
+{
+	DispatchOut *out;
+	ssize_t r;
+
+	while (conn->out && !conn->write_failed) {
+		out = conn->out;
+
+		r = write_some (conn->sock, out->data + out->n_sent, out->length - out->n_sent,
+		                out->fds, out->n_fds);
+		if (r < 0) {
+			conn->write_failed = 1;
 			break;
 		}
 
-		/* Allocate memory */
-		egg_buffer_reserve (&cs.req->buffer, cs.req->buffer.len + len);
-		if (egg_buffer_has_error (&cs.req->buffer)) {
-			gkm_rpc_warn ("error allocating buffer for message");
-			break;
+		/* The descriptors went along with the first of the data */
+		if (r > 0) {
+			while (out->n_fds > 0)
+				close (out->fds[--out->n_fds]);
 		}
 
-		/* ... and read/parse in the actual message */
-		if (!read_all (sock, cs.req->buffer.buf, len))
+		out->n_sent += r;
+		conn->n_out -= r;
+		if (out->n_sent < out->length)
 			break;
 
-		egg_buffer_add_empty (&cs.req->buffer, len);
+		conn->out = out->next;
+		if (conn->out == NULL)
+			conn->out_tail = &conn->out;
+		conn_free_out (out);
+	}
 
-		if (!gkm_rpc_message_parse (cs.req, GKM_RPC_REQUEST))
-			break;
+	return !conn->write_failed;
+}
 
-		/* ... send for processing ... */
-		if (!dispatch_call (&cs))
-			break;
+/*
+ * Sends a response after its header, and queues whatever the socket
+ * doesn't take for the loop thread to send. Returns 0 when the connection
+ * should be closed.
+ */
+static int
+conn_send (DispatchConn *conn,
+           unsigned char *header,
+           size_t n_header,
+           GkmRpcMessage *resp)
+{
+	DispatchOut *out;
+	ssize_t sent = 0, r;
+	size_t length;
+	int wake = 0;
+	int i, ok;
+
+	length = n_header + resp->buffer.len;
+
+	pthread_mutex_lock (&conn->write_mutex);
+
+	/* Responses go out in order, after anything already queued */
+	if (conn->out == NULL && !conn->write_failed) {
+		sent = write_some (conn->sock, header, n_header, resp->fds, resp->n_fds);
+		if (sent == (ssize_t)n_header) {
+			r = write_some (conn->sock, resp->buffer.buf, resp->buffer.len, NULL, 0);
+			sent = (r < 0) ? -1 : sent + r;
+		}
+		if (sent < 0)
+			conn->write_failed = 1;
+	}
 
-		/* .. send back response length, and then response data */
-		egg_buffer_encode_uint32 (buf, cs.resp->buffer.len);
-		if(!write_all (sock, buf, 4) ||
-		   !write_all (sock, cs.resp->buffer.buf, cs.resp->buffer.len))
-			break;
+	if (!conn->write_failed && (size_t)sent < length) {
+		out = malloc (sizeof (DispatchOut) + length - sent);
+		if (out == NULL) {
+			gkm_rpc_warn ("out of memory");
+			conn->write_failed = 1;
+		}
+	} else {
+		out = NULL;
 	}
 
-	/*
-	 * Close all sessions for the client application
-	 *
-	 * EXTENSION: In our extended application PKCS#11 model
-	 * C_CloseAllSessions accepts an application identifier as well
-	 * as slot ids. Calling with an application identifier closes all
-	 * sessions for just that application identifier.
-	 */
-	pthread_mutex_lock (&clients_mutex);
+	if (out != NULL) {
+		out->next = NULL;
+		out->length = length - sent;
+		out->n_sent = 0;
+		out->n_fds = 0;
 
-	if (!--cs.client->refcount) {
-		ClientInstance **cl = &clients;
+		if ((size_t)sent < n_header) {
+			memcpy (out->data, header + sent, n_header - sent);
+			memcpy (out->data + (n_header - sent), resp->buffer.buf, resp->buffer.len);
+		} else {
+			memcpy (out->data, resp->buffer.buf + (sent - n_header), length - sent);
+		}
 
-		while (*cl) {
-			if (*cl == cs.client) {
-				*cl = cs.client->next;
+		/* The descriptors are closed along with the response, keep copies */
+		for (i = 0; sent == 0 && i < resp->n_fds; i++) {
+			out->fds[i] = dup (resp->fds[i]);
+			if (out->fds[i] < 0) {
+				gkm_rpc_warn ("couldn't copy descriptor: %s", strerror (errno));
+				conn->write_failed = 1;
 				break;
 			}
-			cl = &(*cl)->next;
+			out->n_fds++;
+		}
+
+		if (conn->write_failed) {
+			conn_free_out (out);
+		} else {
+			wake = (conn->out == NULL);
+			*conn->out_tail = out;
+			conn->out_tail = &out->next;
+			conn->n_out += out->length;
 		}
-		if (cs.client->application.applicationId)
-			(pkcs11_module->C_CloseAllSessions) (cs.client->application.applicationId);
-		free (cs.client);
-		cs.client = NULL;
 	}
 
-	pthread_mutex_unlock (&clients_mutex);
+	ok = !conn->write_failed;
+
+	pthread_mutex_unlock (&conn->write_mutex);
 
-	call_uninit (&cs);
+	/* The loop thread needs to wait for the socket to drain */
+	if (wake)
+		loop_wake ();
+
+	return ok;
 }
 
-static void*
-run_dispatch_thread (void *arg)
+/* Whether a client has yet to be sent all of its responses */
+static int
+conn_sending (DispatchConn *conn)
 {
-	int *sock = arg;
-	assert (*sock != -1);
+	int sending;
 
-	run_dispatch_loop (*sock);
+	pthread_mutex_lock (&conn->write_mutex);
+	sending = (conn->out != NULL);
+	pthread_mutex_unlock (&conn->write_mutex);
 
-	/* The thread closes the socket and marks as done */
-	assert (*sock != -1);
-	close (*sock);
-	*sock = -1;
+	return sending;
+}
+
+/*
+ * When asked to, every call is written to a trace file, along with when
+ * it was started and how long it took, so the traffic can be played back
+ * later with gkm-rpc-replay. Anything secret is blanked out first.
+ */
+
+static FILE *trace_file = NULL;
+static gint64 trace_started = 0;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Numbers the connections in the trace, protected by conns_mutex */
+static uint32_t trace_conns = 0;
+
+static int
+trace_add_message (EggBuffer *record, GkmRpcMessage *msg, GkmRpcMessageType type)
+{
+	size_t offset = record->len + 4;
+
+	if (!egg_buffer_add_byte_array (record, msg->buffer.buf, msg->buffer.len))
+		return 0;
+	return gkm_rpc_trace_redact (record->buf + offset, msg->buffer.len, type);
+}
+
+static void
+trace_call (DispatchCall *call, gint64 started, gint64 finished)
+{
+	EggBuffer record;
+	unsigned char len[4];
+	int ok;
+
+	egg_buffer_init_full (&record, 64 + call->cs.req->buffer.len + call->cs.resp->buffer.len,
+	                      (EggBufferAllocator)realloc);
+
+	egg_buffer_add_uint64 (&record, started - trace_started);
+	egg_buffer_add_uint32 (&record, finished - started);
+	egg_buffer_add_uint32 (&record, call->conn->trace_id);
+	egg_buffer_add_byte (&record, call != &call->conn->call);
+	ok = trace_add_message (&record, call->cs.req, GKM_RPC_REQUEST) &&
+	     trace_add_message (&record, call->cs.resp, GKM_RPC_RESPONSE) &&
+	     !egg_buffer_has_error (&record);
+
+	if (ok) {
+		egg_buffer_encode_uint32 (len, record.len);
+		pthread_mutex_lock (&trace_mutex);
+		if (fwrite (len, 1, 4, trace_file) != 4 ||
+		    fwrite (record.buf, 1, record.len, trace_file) != record.len)
+			gkm_rpc_warn ("couldn't write to trace: %s", strerror (errno));
+		pthread_mutex_unlock (&trace_mutex);
+	} else {
+		gkm_rpc_warn ("couldn't trace call: %d", call->cs.req->call_id);
+	}
+
+	egg_buffer_uninit (&record);
+}
+
+static int
+conn_process (DispatchCall *call)
+{
+	DispatchConn *conn = call->conn;
+	CallState *cs = &call->cs;
+	gint64 started = 0, finished = 0;
+	unsigned char buf[12];
+	size_t header;
+	int ok;
 
+	/* Large response data can go in shared memory on multiplexed connections */
+	cs->resp->shared_memory = (call != &conn->call);
+
+	if (trace_file)
+		started = g_get_monotonic_time ();
+
+	/* ... parse and send for processing ... */
+	ok = gkm_rpc_message_parse (cs->req, GKM_RPC_REQUEST) &&
+	     dispatch_call (cs);
+
+	if (trace_file)
+		finished = g_get_monotonic_time ();
+
+	/* .. send back response length, request id, descriptors, and then response data */
+	if (ok) {
+		egg_buffer_encode_uint32 (buf, cs->resp->buffer.len);
+		header = 4;
+
+		if (call != &conn->call) {
+			egg_buffer_encode_uint32 (buf + 4, call->id);
+			egg_buffer_encode_uint32 (buf + 8, cs->resp->n_fds);
+			header = 12;
+		}
+
+		ok = conn_send (conn, buf, header, cs->resp);
+	}
+
+	/* Only once the response is on its way */
+	if (ok && trace_file)
+		trace_call (call, started, finished);
+
+	call_reset (cs);
+	return ok;
+}
+
+/* Called when done with a call. Returns whether to wake the loop thread */
+static int
+conn_finish (DispatchConn *conn,
+             DispatchCall *call,
+             int ok)
+{
+	DispatchCall **here;
+	int serial, wake;
+
+	serial = (call == &conn->call);
+
+	pthread_mutex_lock (&conns_mutex);
+
+	for (here = &conn->calls; *here != NULL; here = &(*here)->next) {
+		if (*here == call) {
+			*here = call->next;
+			break;
+		}
+	}
+
+	assert (conn->busy > 0);
+	conn->busy--;
+	if (!ok)
+		conn->closed = 1;
+	else if (serial && call->cs.multiplex)
+		conn->multiplexed = 1;
+
+	/* The loop needs to poll a serial connection again, or release it */
+	wake = serial || (conn->closed && !conn->busy);
+
+	pthread_mutex_unlock (&conns_mutex);
+
+	if (!serial)
+		conn_free_call (call);
+
+	return wake;
+}
+
+static int
+conn_dispatch (DispatchConn *conn,
+               DispatchCall *call)
+{
+	GError *error = NULL;
+
+	pthread_mutex_lock (&conns_mutex);
+	if (call != &conn->call) {
+		call->next = conn->calls;
+		conn->calls = call;
+	}
+	conn->busy++;
+	pthread_mutex_unlock (&conns_mutex);
+
+	if (!g_thread_pool_push (loop_workers, call, &error)) {
+		gkm_rpc_warn ("couldn't dispatch call: %s", egg_error_message (error));
+		g_clear_error (&error);
+		conn_finish (conn, call, 0);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void
+run_dispatch_worker (gpointer data,
+                     gpointer unused)
+{
+	DispatchCall *call = data;
+	DispatchConn *conn = call->conn;
+	struct pollfd pfd;
+	int ok, r = 0;
+
+	/* Calls on a multiplexed connection are independent of each other */
+	if (call != &conn->call) {
+		ok = conn_process (call);
+		if (conn_finish (conn, call, ok))
+			loop_wake ();
+		return;
+	}
+
+	do {
+		ok = conn_process (call);
+		if (!ok || call->cs.multiplex)
+			break;
+
+		/* The client won't send more until it has the whole response */
+		if (conn_sending (conn))
+			break;
+
+		/*
+		 * A client usually sends its next call right after reading the
+		 * response. Unless other calls are waiting for a worker, keep
+		 * serving this connection for a moment, rather than paying to
+		 * hand it back to the loop thread and out again.
+		 */
+		r = 0;
+		while (r == 0 && g_thread_pool_unprocessed (loop_workers) == 0) {
+			pfd.fd = conn->sock;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll (&pfd, 1, LINGER_MSECS) <= 0)
+				break;
+			r = conn_read (conn);
+		}
+
+		if (r < 0)
+			ok = 0;
+	} while (r > 0);
+
+	/* Hand the connection back to the loop thread */
+	if (conn_finish (conn, call, ok))
+		loop_wake ();
+}
+
+static gpointer
+run_dispatch_loop (gpointer unused)
+{
+	DispatchConn **conns = NULL;
+	struct pollfd *pfds = NULL;
+	DispatchConn *conn, *done, **here;
+	DispatchCall *call;
+	unsigned char buf[64];
+	unsigned int n_alloc = 64;
+	unsigned int n_pfds, i;
+	short events;
+	void *mem;
+	int r;
+
+	pfds = malloc (n_alloc * sizeof (struct pollfd));
+	conns = malloc (n_alloc * sizeof (DispatchConn *));
+	if (!pfds || !conns) {
+		gkm_rpc_warn ("out of memory");
+		free (pfds);
+		free (conns);
+		return NULL;
+	}
+
+	for (;;) {
+		done = NULL;
+
+		pthread_mutex_lock (&conns_mutex);
+
+		if (loop_quit) {
+			pthread_mutex_unlock (&conns_mutex);
+			break;
+		}
+
+		/* Pull out connections the workers are done with */
+		for (here = &pkcs11_conns, conn = *here; conn != NULL; conn = *here) {
+			if (conn->closed && !conn->busy) {
+				*here = conn->next;
+				conn->next = done;
+				done = conn;
+			} else {
+				here = &conn->next;
+			}
+		}
+
+		/* Watch the wakeup pipe, and every connection we can read from or write to */
+		for (n_pfds = 1, conn = pkcs11_conns; conn != NULL; conn = conn->next) {
+			if (conn->closed)
+				continue;
+
+			/* Don't read more requests from a client that isn't reading responses */
+			events = 0;
+			pthread_mutex_lock (&conn->write_mutex);
+			if (!(conn->busy && !conn->multiplexed) && conn->n_out < MAX_QUEUED)
+				events |= POLLIN;
+			if (conn->out != NULL)
+				events |= POLLOUT;
+			pthread_mutex_unlock (&conn->write_mutex);
+
+			if (!events)
+				continue;
+			if (n_pfds == n_alloc) {
+				mem = realloc (pfds, n_alloc * 2 * sizeof (struct pollfd));
+				if (mem)
+					pfds = mem;
+				mem = mem ? realloc (conns, n_alloc * 2 * sizeof (DispatchConn *)) : NULL;
+				if (!mem)
+					break;
+				conns = mem;
+				n_alloc *= 2;
+			}
+			pfds[n_pfds].fd = conn->sock;
+			pfds[n_pfds].events = events;
+			pfds[n_pfds].revents = 0;
+			conns[n_pfds] = conn;
+			n_pfds++;
+		}
+
+		pthread_mutex_unlock (&conns_mutex);
+
+		/* Closing sessions calls into the module, so done outside the lock */
+		for (conn = done; conn != NULL; conn = done) {
+			done = conn->next;
+			conn_release (conn);
+		}
+
+		pfds[0].fd = loop_wakeup[0];
+		pfds[0].events = POLLIN;
+		pfds[0].revents = 0;
+
+		if (poll (pfds, n_pfds, -1) < 0) {
+			if (errno != EINTR && errno != EAGAIN) {
+				gkm_rpc_warn ("couldn't wait on connections: %s", strerror (errno));
+				break;
+			}
+			continue;
+		}
+
+		/* Drain the wakeup pipe */
+		if (pfds[0].revents) {
+			while (read (loop_wakeup[0], buf, sizeof (buf)) > 0);
+		}
+
+		/* Only this thread marks connections busy, so serial ones are still idle */
+		for (i = 1; i < n_pfds; i++) {
+			if (!pfds[i].revents)
+				continue;
+			conn = conns[i];
+			r = 0;
+
+			/* Send more of the responses that are left */
+			if (pfds[i].events & POLLOUT) {
+				pthread_mutex_lock (&conn->write_mutex);
+				if (!conn_flush (conn))
+					r = -1;
+				pthread_mutex_unlock (&conn->write_mutex);
+			}
+
+			/* Each complete request is sent off to a worker */
+			if (r == 0 && (pfds[i].events & POLLIN)) {
+				while ((r = conn_read (conn)) > 0) {
+					if (!conn->multiplexed) {
+						if (!conn_dispatch (conn, &conn->call))
+							r = -1;
+						break;
+					}
+
+					call = conn_take_call (conn);
+					if (!call) {
+						gkm_rpc_warn ("out of memory");
+						r = -1;
+						break;
+					}
+					if (!conn_dispatch (conn, call)) {
+						r = -1;
+						break;
+					}
+				}
+			}
+
+			if (r < 0) {
+				pthread_mutex_lock (&conns_mutex);
+				conn->closed = 1;
+				pthread_mutex_unlock (&conns_mutex);
+			}
+		}
+	}
+
+	free (pfds);
+	free (conns);
 	return NULL;
 }
 
@@ -2230,42 +3066,22 @@ run_dispatch_thread (void *arg)
  * MAIN THREAD
  */
 
-typedef struct _DispatchState {
-	struct _DispatchState *next;
-	GThread *thread;
-	int socket;
-} DispatchState;
-
 /* The main daemon socket that we're listening on */
 static int pkcs11_socket = -1;
 
 /* The unix socket path, that we listen on */
 static char *pkcs11_socket_path = NULL;
 
-/* A linked list of dispatcher threads */
-static DispatchState *pkcs11_dispatchers = NULL;
-
 void
 gkm_rpc_layer_accept (void)
 {
 	struct sockaddr_un addr;
-	DispatchState *ds, **here;
-	GError *error = NULL;
+	DispatchConn *conn;
 	socklen_t addrlen;
 	int new_fd;
 
 	assert (pkcs11_socket != -1);
-
-	/* Cleanup any completed dispatch threads */
-	for (here = &pkcs11_dispatchers, ds = *here; ds != NULL; ds = *here) {
-		if (ds->socket == -1) {
-			g_thread_join (ds->thread);
-			*here = ds->next;
-			free (ds);
-		} else {
-			here = &ds->next;
-		}
-	}
+	assert (loop_thread != NULL);
 
 	addrlen = sizeof (addr);
 	new_fd = accept (pkcs11_socket, (struct sockaddr*) &addr, &addrlen);
@@ -2274,25 +3090,104 @@ gkm_rpc_layer_accept (void)
 		return;
 	}
 
-	ds = calloc (1, sizeof (DispatchState));
-	if (ds == NULL) {
-		gkm_rpc_warn ("out of memory");
+	if (fcntl (new_fd, F_SETFL, fcntl (new_fd, F_GETFL) | O_NONBLOCK) < 0) {
+		gkm_rpc_warn ("couldn't set pkcs11 connection to non-blocking: %s", strerror (errno));
 		close (new_fd);
 		return;
 	}
 
-	ds->socket = new_fd;
-
-	ds->thread = g_thread_new ("dispatch", run_dispatch_thread, &(ds->socket));
-	if (!ds->thread) {
-		gkm_rpc_warn ("couldn't start thread: %s", egg_error_message (error));
+	conn = calloc (1, sizeof (DispatchConn));
+	if (conn == NULL) {
+		gkm_rpc_warn ("out of memory");
 		close (new_fd);
-		free (ds);
 		return;
 	}
 
-	ds->next = pkcs11_dispatchers;
-	pkcs11_dispatchers = ds;
+	conn->sock = new_fd;
+	conn->call.conn = conn;
+	conn->out_tail = &conn->out;
+	pthread_mutex_init (&conn->write_mutex, NULL);
+
+	pthread_mutex_lock (&conns_mutex);
+	conn->trace_id = ++trace_conns;
+	conn->next = pkcs11_conns;
+	pkcs11_conns = conn;
+	pthread_mutex_unlock (&conns_mutex);
+
+	loop_wake ();
+}
+
+static int
+start_dispatch_loop (void)
+{
+	GError *error = NULL;
+	int i;
+
+	assert (loop_thread == NULL);
+
+	if (pipe (loop_wakeup) < 0) {
+		gkm_rpc_warn ("couldn't create wakeup pipe: %s", strerror (errno));
+		return 0;
+	}
+
+	for (i = 0; i < 2; i++) {
+		fcntl (loop_wakeup[i], F_SETFL, fcntl (loop_wakeup[i], F_GETFL) | O_NONBLOCK);
+		fcntl (loop_wakeup[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	loop_workers = g_thread_pool_new (run_dispatch_worker, NULL, MAX_WORKERS, FALSE, &error);
+	if (!loop_workers) {
+		gkm_rpc_warn ("couldn't create worker threads: %s", egg_error_message (error));
+		g_clear_error (&error);
+		return 0;
+	}
+
+	loop_quit = 0;
+	loop_thread = g_thread_new ("dispatch", run_dispatch_loop, NULL);
+	return 1;
+}
+
+static void
+stop_dispatch_loop (void)
+{
+	DispatchConn *conn, *next;
+
+	/* Stop the loop thread, so no more calls are sent to workers */
+	if (loop_thread) {
+		pthread_mutex_lock (&conns_mutex);
+		loop_quit = 1;
+		pthread_mutex_unlock (&conns_mutex);
+		loop_wake ();
+		g_thread_join (loop_thread);
+		loop_thread = NULL;
+	}
+
+	/* Forcibly shutdown the connections, and wait for workers */
+	if (loop_workers) {
+		pthread_mutex_lock (&conns_mutex);
+		for (conn = pkcs11_conns; conn != NULL; conn = conn->next)
+			shutdown (conn->sock, SHUT_RDWR);
+		pthread_mutex_unlock (&conns_mutex);
+
+		g_thread_pool_free (loop_workers, TRUE, TRUE);
+		loop_workers = NULL;
+	}
+
+	pthread_mutex_lock (&conns_mutex);
+	conn = pkcs11_conns;
+	pkcs11_conns = NULL;
+	pthread_mutex_unlock (&conns_mutex);
+
+	for (; conn != NULL; conn = next) {
+		next = conn->next;
+		conn_release (conn);
+	}
+
+	if (loop_wakeup[0] != -1)
+		close (loop_wakeup[0]);
+	if (loop_wakeup[1] != -1)
+		close (loop_wakeup[1]);
+	loop_wakeup[0] = loop_wakeup[1] = -1;
 }
 
 int
@@ -2309,41 +3204,38 @@ gkm_rpc_layer_initialize (CK_FUNCTION_LIST_PTR module)
 void
 gkm_rpc_layer_uninitialize (void)
 {
-	DispatchState *ds, *next;
-
 	if (!pkcs11_module)
 		return;
 
-	/* Close our main listening socket */
-	if (pkcs11_socket != -1)
-		close (pkcs11_socket);
-	pkcs11_socket = -1;
+	gkm_rpc_layer_shutdown ();
 
-	/* Delete our unix socket */
-	if(pkcs11_socket_path) {
-		unlink (pkcs11_socket_path);
-		free (pkcs11_socket_path);
-		pkcs11_socket_path = NULL;
-	}
+	pkcs11_module = NULL;
+}
 
-	ds = pkcs11_dispatchers;
-	pkcs11_dispatchers = NULL;
+int
+gkm_rpc_layer_trace (const char *filename)
+{
+	assert (filename);
 
-	/* Stop all of the dispatch threads */
-	for (; ds; ds = next) {
-		next = ds->next;
+	/* cannot be called once started */
+	assert (pkcs11_socket == -1);
+	assert (trace_file == NULL);
 
-		/* Forcibly shutdown the connection */
-		if (ds->socket)
-			shutdown (ds->socket, SHUT_RDWR);
-		g_thread_join (ds->thread);
+	trace_file = fopen (filename, "wb");
+	if (trace_file == NULL) {
+		gkm_rpc_warn ("couldn't open trace file: %s: %s", filename, strerror (errno));
+		return 0;
+	}
 
-		/* This is always closed by dispatch thread */
-		assert (ds->socket == -1);
-		free (ds);
+	if (fwrite (GKM_RPC_TRACE_MAGIC, 1, GKM_RPC_TRACE_MAGIC_LEN, trace_file) != GKM_RPC_TRACE_MAGIC_LEN) {
+		gkm_rpc_warn ("couldn't write to trace file: %s: %s", filename, strerror (errno));
+		fclose (trace_file);
+		trace_file = NULL;
+		return 0;
 	}
 
-	pkcs11_module = NULL;
+	trace_started = g_get_monotonic_time ();
+	return 1;
 }
 
 int
@@ -2360,7 +3252,7 @@ gkm_rpc_layer_startup (const char *prefix)
 
 	/* cannot be called more than once */
 	assert (pkcs11_socket == -1);
-	assert (pkcs11_dispatchers == NULL);
+	assert (pkcs11_conns == NULL);
 
 	free (pkcs11_socket_path);
 	pkcs11_socket_path = malloc (strlen (prefix) + strlen ("/pkcs11") + 1);
@@ -2392,8 +3284,13 @@ gkm_rpc_layer_startup (const char *prefix)
 		return -1;
 	}
 
+	if (!start_dispatch_loop ()) {
+		stop_dispatch_loop ();
+		close (sock);
+		return -1;
+	}
+
 	pkcs11_socket = sock;
-	pkcs11_dispatchers = NULL;
 
 	return sock;
 }
@@ -2401,8 +3298,6 @@ gkm_rpc_layer_startup (const char *prefix)
 void
 gkm_rpc_layer_shutdown (void)
 {
-	DispatchState *ds, *next;
-
 	/* Close our main listening socket */
 	if (pkcs11_socket != -1)
 		close (pkcs11_socket);
@@ -2415,20 +3310,13 @@ gkm_rpc_layer_shutdown (void)
 		pkcs11_socket_path = NULL;
 	}
 
-	ds = pkcs11_dispatchers;
-	pkcs11_dispatchers = NULL;
-
-	/* Stop all of the dispatch threads */
-	for (; ds; ds = next) {
-		next = ds->next;
-
-		/* Forcibly shutdown the connection */
-		if (ds->socket)
-			shutdown (ds->socket, SHUT_RDWR);
-		g_thread_join (ds->thread);
+	/* Stop the loop, the workers and all the connections */
+	stop_dispatch_loop ();
 
-		/* This is always closed by dispatch thread */
-		assert (ds->socket == -1);
-		free (ds);
+	/* Nothing more is written to the trace */
+	if (trace_file) {
+		if (fclose (trace_file) != 0)
+			gkm_rpc_warn ("couldn't write to trace file: %s", strerror (errno));
+		trace_file = NULL;
 	}
 }
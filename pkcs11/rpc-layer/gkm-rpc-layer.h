@@ -13,6 +13,9 @@ int                gkm_rpc_layer_initialize             (CK_FUNCTION_LIST_PTR fu
 /* Should be called to cleanup dispatcher */
 void               gkm_rpc_layer_uninitialize           (void);
 
+/* Call to record a redacted trace of all calls, before starting up */
+int                gkm_rpc_layer_trace                  (const char *filename);
+
 /* Call to start listening, returns socket or -1 */
 int                gkm_rpc_layer_startup                (const char *prefix);
 
@@ -24,8 +24,18 @@
 
 #include "gkm-rpc-layer.h"
 #include "gkm-rpc-private.h"
+#include "gkm-rpc-calls.h"
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
 
 #ifdef G_DISABLE_ASSERT
 #define assert(x)
@@ -61,6 +71,8 @@ gkm_rpc_message_free (GkmRpcMessage *msg)
 	EggBufferAllocator allocator;
 
 	if (msg) {
+		gkm_rpc_message_close_fds (msg);
+
 		assert (msg->buffer.allocator);
 		allocator = msg->buffer.allocator;
 		egg_buffer_uninit (&msg->buffer);
@@ -78,17 +90,144 @@ gkm_rpc_message_reset (GkmRpcMessage *msg)
 	msg->call_id = 0;
 	msg->call_type = 0;
 	msg->signature = NULL;
+	msg->signature_len = 0;
 	msg->sigverify = NULL;
 	msg->parsed = 0;
 
+	gkm_rpc_message_close_fds (msg);
 	egg_buffer_reset (&msg->buffer);
 }
 
+void
+gkm_rpc_message_close_fds (GkmRpcMessage *msg)
+{
+	int i;
+
+	assert (msg);
+
+	for (i = 0; i < msg->n_fds; ++i) {
+#ifdef HAVE_MEMFD_CREATE
+		if (msg->maps[i])
+			munmap (msg->maps[i], msg->map_lengths[i]);
+#endif
+		msg->maps[i] = NULL;
+		msg->map_lengths[i] = 0;
+		close (msg->fds[i]);
+	}
+
+	msg->n_fds = 0;
+}
+
+#ifdef HAVE_MEMFD_CREATE
+#define SHARED_MEMORY_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+#endif
+
+/*
+ * Puts a large byte array in sealed shared memory, and writes the
+ * length and the index of the descriptor. Returns zero when the data
+ * should be written inline instead.
+ */
+static int
+message_write_shared (GkmRpcMessage *msg, CK_BYTE_PTR arr, CK_ULONG num)
+{
+#ifdef HAVE_MEMFD_CREATE
+	size_t len;
+	ssize_t r;
+	int fd;
+
+	if (!msg->shared_memory || !arr || num < GKM_RPC_SHARED_MEMORY_THRESHOLD ||
+	    num >= 0x7FFFFFFF || msg->n_fds >= GKM_RPC_MAX_FDS)
+		return 0;
+
+	fd = memfd_create ("gkm-rpc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return 0;
+
+	for (len = 0; len < num; ) {
+		r = write (fd, arr + len, num - len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			close (fd);
+			return 0;
+		}
+		len += r;
+	}
+
+	if (fcntl (fd, F_ADD_SEALS, SHARED_MEMORY_SEALS) < 0) {
+		close (fd);
+		return 0;
+	}
+
+	egg_buffer_add_byte (&msg->buffer, 2);
+	egg_buffer_add_uint32 (&msg->buffer, num);
+	egg_buffer_add_uint32 (&msg->buffer, msg->n_fds);
+	msg->fds[msg->n_fds++] = fd;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Reads the index of a descriptor sent with the message, and maps the
+ * shared memory it refers to. The memory must be sealed, so the sender
+ * can't change it after the fact.
+ */
 int
-gkm_rpc_message_prep (GkmRpcMessage *msg, int call_id, GkmRpcMessageType type)
+gkm_rpc_message_read_shared (GkmRpcMessage *msg, size_t length, const unsigned char **data)
 {
-	int len;
+#ifdef HAVE_MEMFD_CREATE
+	struct stat sb;
+	uint32_t index;
+	void *map;
+	int seals;
+
+	assert (msg);
+	assert (data);
 
+	if (!egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &index))
+		return 0;
+
+	if (index >= msg->n_fds || length == 0) {
+		gkm_rpc_warn ("invalid shared memory in message");
+		return 0;
+	}
+
+	if (msg->maps[index]) {
+		if (length > msg->map_lengths[index])
+			return 0;
+		*data = msg->maps[index];
+		return 1;
+	}
+
+	seals = fcntl (msg->fds[index], F_GET_SEALS);
+	if (seals < 0 || (seals & SHARED_MEMORY_SEALS) != SHARED_MEMORY_SEALS ||
+	    fstat (msg->fds[index], &sb) < 0 || sb.st_size < 0 || (size_t)sb.st_size < length) {
+		gkm_rpc_warn ("shared memory in message is not sealed, or too short");
+		return 0;
+	}
+
+	/* A private mapping, any changes made by the receiver stay with it */
+	map = mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, msg->fds[index], 0);
+	if (map == MAP_FAILED) {
+		gkm_rpc_warn ("couldn't map shared memory: %s", strerror (errno));
+		return 0;
+	}
+
+	msg->maps[index] = map;
+	msg->map_lengths[index] = length;
+	*data = map;
+	return 1;
+#else
+	gkm_rpc_warn ("shared memory is not supported");
+	return 0;
+#endif
+}
+
+int
+gkm_rpc_message_prep (GkmRpcMessage *msg, int call_id, GkmRpcMessageType type)
+{
 	assert (type);
 	assert (call_id >= GKM_RPC_CALL_ERROR);
 	assert (call_id < GKM_RPC_CALL_MAX);
@@ -98,14 +237,18 @@ gkm_rpc_message_prep (GkmRpcMessage *msg, int call_id, GkmRpcMessageType type)
 	if (call_id != GKM_RPC_CALL_ERROR) {
 
 		/* The call id and signature */
-		if (type == GKM_RPC_REQUEST)
+		if (type == GKM_RPC_REQUEST) {
 			msg->signature = gkm_rpc_calls[call_id].request;
-		else if (type == GKM_RPC_RESPONSE)
+			msg->signature_len = gkm_rpc_call_parts[call_id].request_len;
+			msg->sigverify = gkm_rpc_call_parts[call_id].request;
+		} else if (type == GKM_RPC_RESPONSE) {
 			msg->signature = gkm_rpc_calls[call_id].response;
-		else
+			msg->signature_len = gkm_rpc_call_parts[call_id].response_len;
+			msg->sigverify = gkm_rpc_call_parts[call_id].response;
+		} else {
 			assert (0 && "invalid message type");
+		}
 		assert (msg->signature);
-		msg->sigverify = msg->signature;
 	}
 
 	msg->call_id = call_id;
@@ -113,10 +256,9 @@ gkm_rpc_message_prep (GkmRpcMessage *msg, int call_id, GkmRpcMessageType type)
 
 	/* Encode the two of them */
 	egg_buffer_add_uint32 (&msg->buffer, call_id);
-	if (msg->signature) {
-		len = strlen (msg->signature);
-		egg_buffer_add_byte_array (&msg->buffer, (unsigned char*)msg->signature, len);
-	}
+	if (msg->signature)
+		egg_buffer_add_byte_array (&msg->buffer, (unsigned char*)msg->signature,
+		                           msg->signature_len);
 
 	msg->parsed = 0;
 	return !egg_buffer_has_error (&msg->buffer);
@@ -137,7 +279,9 @@ gkm_rpc_message_parse (GkmRpcMessage *msg, GkmRpcMessageType type)
 		return 0;
 	}
 
-	msg->signature = msg->sigverify = NULL;
+	msg->signature = NULL;
+	msg->signature_len = 0;
+	msg->sigverify = NULL;
 
 	/* If it's an error code then no more processing */
 	if (call_id == GKM_RPC_CALL_ERROR) {
@@ -154,15 +298,19 @@ gkm_rpc_message_parse (GkmRpcMessage *msg, GkmRpcMessageType type)
 		gkm_rpc_warn ("invalid message: bad call id: %d", call_id);
 		return 0;
 	}
-	if (type == GKM_RPC_REQUEST)
+	if (type == GKM_RPC_REQUEST) {
 		msg->signature = gkm_rpc_calls[call_id].request;
-	else if (type == GKM_RPC_RESPONSE)
+		msg->signature_len = gkm_rpc_call_parts[call_id].request_len;
+		msg->sigverify = gkm_rpc_call_parts[call_id].request;
+	} else if (type == GKM_RPC_RESPONSE) {
 		msg->signature = gkm_rpc_calls[call_id].response;
-	else
+		msg->signature_len = gkm_rpc_call_parts[call_id].response_len;
+		msg->sigverify = gkm_rpc_call_parts[call_id].response;
+	} else {
 		assert (0 && "invalid message type");
+	}
 	msg->call_id = call_id;
 	msg->call_type = type;
-	msg->sigverify = msg->signature;
 
 	/* Verify the incoming signature */
 	if (!egg_buffer_get_byte_array (&msg->buffer, msg->parsed, &(msg->parsed), &val, &len)) {
@@ -170,7 +318,7 @@ gkm_rpc_message_parse (GkmRpcMessage *msg, GkmRpcMessageType type)
 		return 0;
 	}
 
-	if ((strlen (msg->signature) != len) || (memcmp (val, msg->signature, len) != 0)) {
+	if ((msg->signature_len != len) || (memcmp (val, msg->signature, len) != 0)) {
 		gkm_rpc_warn ("invalid message: signature doesn't match");
 		return 0;
 	}
@@ -193,10 +341,7 @@ gkm_rpc_message_equals (GkmRpcMessage *m1, GkmRpcMessage *m2)
 		return 0;
 	if (m1->call_type != m2->call_type)
 		return 0;
-	if (m1->signature && m2->signature) {
-		if (strcmp (m1->signature, m2->signature) != 0)
-			return 0;
-	} else if (m1->signature != m2->signature) {
+	if (m1->signature != m2->signature) {
 		return 0;
 	}
 
@@ -205,18 +350,16 @@ gkm_rpc_message_equals (GkmRpcMessage *m1, GkmRpcMessage *m2)
 }
 
 int
-gkm_rpc_message_verify_part (GkmRpcMessage *msg, const char* part)
+gkm_rpc_message_verify_part (GkmRpcMessage *msg, int part)
 {
-	int len, ok;
-
 	if (!msg->sigverify)
 		return 1;
 
-	len = strlen (part);
-	ok = (strncmp (msg->sigverify, part, len) == 0);
-	if (ok)
-		msg->sigverify += len;
-	return ok;
+	if (*msg->sigverify != part)
+		return 0;
+
+	msg->sigverify++;
+	return 1;
 }
 
 int
@@ -230,7 +373,7 @@ gkm_rpc_message_write_attribute_buffer (GkmRpcMessage *msg, CK_ATTRIBUTE_PTR arr
 	assert (msg);
 
 	/* Make sure this is in the rigth order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "fA"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_ATTRIBUTE_BUFFER));
 
 	/* Write the number of items */
 	egg_buffer_add_uint32 (&msg->buffer, num);
@@ -254,13 +397,12 @@ gkm_rpc_message_write_attribute_array (GkmRpcMessage *msg,
 {
 	CK_ULONG i;
 	CK_ATTRIBUTE_PTR attr;
-	unsigned char validity;
 
 	assert (!num || arr);
 	assert (msg);
 
 	/* Make sure this is in the rigth order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "aA"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_ATTRIBUTE_ARRAY));
 
 	/* Write the number of items */
 	egg_buffer_add_uint32 (&msg->buffer, num);
@@ -271,12 +413,11 @@ gkm_rpc_message_write_attribute_array (GkmRpcMessage *msg,
 		/* The attribute type */
 		egg_buffer_add_uint32 (&msg->buffer, attr->type);
 
-		/* Write out the attribute validity */
-		validity = (((CK_LONG)attr->ulValueLen) == -1) ? 0 : 1;
-		egg_buffer_add_byte (&msg->buffer, validity);
-
-		/* The attribute length and value */
-		if (validity) {
+		/* The attribute validity, length and value, large values may be shared */
+		if (((CK_LONG)attr->ulValueLen) == -1) {
+			egg_buffer_add_byte (&msg->buffer, 0);
+		} else if (!message_write_shared (msg, attr->pValue, attr->ulValueLen)) {
+			egg_buffer_add_byte (&msg->buffer, 1);
 			egg_buffer_add_uint32 (&msg->buffer, attr->ulValueLen);
 			egg_buffer_add_byte_array (&msg->buffer, attr->pValue, attr->ulValueLen);
 		}
@@ -291,7 +432,7 @@ gkm_rpc_message_read_byte (GkmRpcMessage *msg, CK_BYTE *val)
 	assert (msg);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "y"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_BYTE));
 	return egg_buffer_get_byte (&msg->buffer, msg->parsed, &msg->parsed, val);
 }
 
@@ -301,7 +442,7 @@ gkm_rpc_message_write_byte (GkmRpcMessage *msg, CK_BYTE val)
 	assert (msg);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "y"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_BYTE));
 	return egg_buffer_add_byte (&msg->buffer, val);
 }
 
@@ -312,7 +453,7 @@ gkm_rpc_message_read_ulong (GkmRpcMessage *msg, CK_ULONG *val)
 	assert (msg);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "u"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_ULONG));
 
 	if (!egg_buffer_get_uint64 (&msg->buffer, msg->parsed, &msg->parsed, &v))
 		return 0;
@@ -327,7 +468,7 @@ gkm_rpc_message_write_ulong (GkmRpcMessage *msg, CK_ULONG val)
 	assert (msg);
 
 	/* Make sure this is in the rigth order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "u"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_ULONG));
 	return egg_buffer_add_uint64 (&msg->buffer, val);
 }
 
@@ -337,7 +478,7 @@ gkm_rpc_message_write_byte_buffer (GkmRpcMessage *msg, CK_ULONG count)
 	assert (msg);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "fy"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_BYTE_BUFFER));
 	return egg_buffer_add_uint32 (&msg->buffer, count);
 }
 
@@ -347,13 +488,13 @@ gkm_rpc_message_write_byte_array (GkmRpcMessage *msg, CK_BYTE_PTR arr, CK_ULONG
 	assert (msg);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "ay"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_BYTE_ARRAY));
 
 	/* No array, no data, just length */
 	if (!arr) {
 		egg_buffer_add_byte (&msg->buffer, 0);
 		egg_buffer_add_uint32 (&msg->buffer, num);
-	} else {
+	} else if (!message_write_shared (msg, arr, num)) {
 		egg_buffer_add_byte (&msg->buffer, 1);
 		egg_buffer_add_byte_array (&msg->buffer, arr, num);
 	}
@@ -367,7 +508,7 @@ gkm_rpc_message_write_ulong_buffer (GkmRpcMessage *msg, CK_ULONG count)
 	assert (msg);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "fu"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_ULONG_BUFFER));
 	return egg_buffer_add_uint32 (&msg->buffer, count);
 }
 
@@ -379,7 +520,7 @@ gkm_rpc_message_write_ulong_array (GkmRpcMessage *msg, CK_ULONG_PTR array, CK_UL
 	assert (msg);
 
 	/* Check that we're supposed to have this at this point */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "au"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_ULONG_ARRAY));
 
 	/* We send a byte which determines whether there's actual data present or not */
 	egg_buffer_add_byte (&msg->buffer, array ? 1 : 0);
@@ -401,7 +542,7 @@ gkm_rpc_message_read_version (GkmRpcMessage *msg, CK_VERSION* version)
 	assert (version);
 
 	/* Check that we're supposed to have this at this point */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "v"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_VERSION));
 
 	return egg_buffer_get_byte (&msg->buffer, msg->parsed, &msg->parsed, &version->major) &&
 	       egg_buffer_get_byte (&msg->buffer, msg->parsed, &msg->parsed, &version->minor);
@@ -414,7 +555,7 @@ gkm_rpc_message_write_version (GkmRpcMessage *msg, CK_VERSION* version)
 	assert (version);
 
 	/* Check that we're supposed to have this at this point */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "v"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_VERSION));
 
 	egg_buffer_add_byte (&msg->buffer, version->major);
 	egg_buffer_add_byte (&msg->buffer, version->minor);
@@ -432,7 +573,7 @@ gkm_rpc_message_read_space_string (GkmRpcMessage *msg, CK_UTF8CHAR* buffer, CK_U
 	assert (buffer);
 	assert (length);
 
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "s"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_SPACE_STRING));
 
 	if (!egg_buffer_get_byte_array (&msg->buffer, msg->parsed, &msg->parsed, &data, &n_data))
 		return 0;
@@ -453,7 +594,7 @@ gkm_rpc_message_write_space_string (GkmRpcMessage *msg, CK_UTF8CHAR* buffer, CK_
 	assert (buffer);
 	assert (length);
 
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "s"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_SPACE_STRING));
 
 	return egg_buffer_add_byte_array (&msg->buffer, buffer, length);
 }
@@ -464,7 +605,7 @@ gkm_rpc_message_write_zero_string (GkmRpcMessage *msg, CK_UTF8CHAR* string)
 	assert (msg);
 	assert (string);
 
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "z"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_ZERO_STRING));
 
 	return egg_buffer_add_string (&msg->buffer, (const char*)string);
 }
@@ -189,12 +189,35 @@ enum CallStatus {
 	CALL_PARSE
 };
 
+struct _CallState;
+
+typedef struct _CallConn {
+	int socket;                  /* The shared connection */
+	pid_t pid;                   /* The process that opened it */
+	pthread_mutex_t write_mutex; /* Held while writing a request */
+	pthread_mutex_t mutex;       /* Protects the fields below */
+	pthread_cond_t cond;         /* Signalled when responses arrive */
+	int refs;
+	int broken;
+	int reading;                 /* A thread is reading responses */
+	uint32_t last_id;
+	struct _CallState *pending;  /* Calls waiting for a response */
+} CallConn;
+
 typedef struct _CallState {
 	int socket;                  /* The connection we're sending on */
+	CallConn *conn;              /* Or the multiplexed one */
 	GkmRpcMessage *req;          /* The current request */
 	GkmRpcMessage *resp;         /* The current response */
 	int call_status;
 	struct _CallState *next;     /* For pooling of completed sockets */
+
+	/* While waiting on a multiplexed connection */
+	uint32_t request_id;
+	GkmRpcMessage *answer;
+	CK_RV answer_ret;
+	int answered;
+	struct _CallState *next_pending;
 } CallState;
 
 /* Maximum number of idle calls */
@@ -204,7 +227,11 @@ typedef struct _CallState {
 static CallState *call_state_pool = NULL;
 static unsigned int n_call_state_pool = 0;
 
-/* Mutex to protect above call state list */
+/* Whether the daemon multiplexes calls, and the connection shared by them */
+static int call_multiplexed = 0;
+static CallConn *call_shared_conn = NULL;
+
+/* Mutex to protect above call state list, and shared connection */
 static pthread_mutex_t call_state_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* Allocator for call session buffers */
@@ -284,6 +311,298 @@ call_disconnect (CallState *cs)
 	}
 }
 
+/* -----------------------------------------------------------------------------
+ * MULTIPLEXED CONNECTION
+ *
+ * When the daemon supports it, calls from all threads share a single
+ * connection. Each request carries an id, and responses can come back
+ * in any order. There's no thread dedicated to reading responses;
+ * instead one of the waiting threads reads them, and hands each one
+ * to the call it belongs to.
+ */
+
+static CallConn*
+conn_new (int sock)
+{
+	CallConn *conn;
+
+	conn = calloc (1, sizeof (CallConn));
+	if (conn == NULL)
+		return NULL;
+
+	conn->socket = sock;
+	conn->pid = getpid ();
+	conn->refs = 1;
+	pthread_mutex_init (&conn->write_mutex, NULL);
+	pthread_mutex_init (&conn->mutex, NULL);
+	pthread_cond_init (&conn->cond, NULL);
+
+	return conn;
+}
+
+static void
+conn_unref (CallConn *conn)
+{
+	int last;
+
+	assert (conn);
+
+	pthread_mutex_lock (&conn->mutex);
+	last = (--conn->refs == 0);
+	pthread_mutex_unlock (&conn->mutex);
+
+	if (!last)
+		return;
+
+	assert (conn->pending == NULL);
+	debug (("disconnected shared socket"));
+	close (conn->socket);
+	pthread_mutex_destroy (&conn->write_mutex);
+	pthread_mutex_destroy (&conn->mutex);
+	pthread_cond_destroy (&conn->cond);
+	free (conn);
+}
+
+/* Called with conn->mutex held, fails all the calls waiting */
+static void
+conn_break (CallConn *conn)
+{
+	CallState *cs;
+
+	if (!conn->broken) {
+		conn->broken = 1;
+
+		/* Wake up anyone blocked on the socket */
+		shutdown (conn->socket, SHUT_RDWR);
+	}
+
+	/* A reader may be filling in a response, it'll fail the calls itself */
+	if (conn->reading)
+		return;
+
+	while (conn->pending) {
+		cs = conn->pending;
+		conn->pending = cs->next_pending;
+		cs->next_pending = NULL;
+		cs->answer_ret = CKR_DEVICE_ERROR;
+		cs->answered = 1;
+	}
+
+	pthread_cond_broadcast (&conn->cond);
+}
+
+static CK_RV
+conn_write (CallConn *conn, unsigned char* data, size_t len)
+{
+	int r;
+
+	while (len > 0) {
+		r = write (conn->socket, data, len);
+		if (r == -1) {
+			if (errno == EPIPE) {
+				warning (("couldn't send data: daemon closed connection"));
+				return CKR_DEVICE_ERROR;
+			} else if (errno != EAGAIN && errno != EINTR) {
+				warning (("couldn't send data: %s", strerror (errno)));
+				return CKR_DEVICE_ERROR;
+			}
+		} else {
+			data += r;
+			len -= r;
+		}
+	}
+
+	return CKR_OK;
+}
+
+/* Any descriptors that come along are added to fds, when not NULL */
+static CK_RV
+conn_read (CallConn *conn, unsigned char* data, size_t len, int *fds, int *n_fds)
+{
+	int r;
+
+	while (len > 0) {
+		if (fds)
+			r = gkm_rpc_recv_fds (conn->socket, data, len, fds, n_fds);
+		else
+			r = read (conn->socket, data, len);
+		if (r == 0) {
+			warning (("couldn't receive data: daemon closed connection"));
+			return CKR_DEVICE_ERROR;
+		} else if (r == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
+				warning (("couldn't receive data: %s", strerror (errno)));
+				return CKR_DEVICE_ERROR;
+			}
+		} else {
+			data += r;
+			len -= r;
+		}
+	}
+
+	return CKR_OK;
+}
+
+/* Reads one response, and hands it to its call. Only one thread at a time */
+static CK_RV
+conn_receive (CallConn *conn)
+{
+	unsigned char buf[12];
+	GkmRpcMessage *resp;
+	CallState *cs, **here;
+	uint32_t len, id, n_expected;
+	int fds[GKM_RPC_MAX_FDS];
+	int n_fds = 0;
+	CK_RV ret;
+
+	/* The descriptors arrive with the start of the response */
+	ret = conn_read (conn, buf, 12, fds, &n_fds);
+	if (ret == CKR_OK) {
+		len = egg_buffer_decode_uint32 (buf);
+		id = egg_buffer_decode_uint32 (buf + 4);
+		n_expected = egg_buffer_decode_uint32 (buf + 8);
+
+		if (n_expected != n_fds) {
+			warning (("received %d descriptors from gnome-keyring-daemon, expected %u",
+			          n_fds, n_expected));
+			ret = CKR_DEVICE_ERROR;
+		}
+	}
+
+	if (ret != CKR_OK) {
+		while (n_fds > 0)
+			close (fds[--n_fds]);
+		return ret;
+	}
+
+	/* The call stays pending, so nobody else touches it */
+	pthread_mutex_lock (&conn->mutex);
+	for (cs = conn->pending; cs != NULL; cs = cs->next_pending) {
+		if (cs->request_id == id)
+			break;
+	}
+	pthread_mutex_unlock (&conn->mutex);
+
+	if (cs == NULL) {
+		warning (("invalid response from gnome-keyring-daemon: unknown request: %u", id));
+		while (n_fds > 0)
+			close (fds[--n_fds]);
+		return CKR_DEVICE_ERROR;
+	}
+
+	/* The response owns the descriptors from now on */
+	resp = cs->answer;
+	memcpy (resp->fds, fds, sizeof (int) * n_fds);
+	resp->n_fds = n_fds;
+
+	if (!egg_buffer_reserve (&resp->buffer, len + resp->buffer.len)) {
+		warning (("couldn't allocate %u byte response area: out of memory", len));
+		return CKR_HOST_MEMORY;
+	}
+	ret = conn_read (conn, resp->buffer.buf, len, NULL, NULL);
+	if (ret != CKR_OK)
+		return ret;
+
+	egg_buffer_add_empty (&resp->buffer, len);
+
+	pthread_mutex_lock (&conn->mutex);
+	for (here = &conn->pending; *here != NULL; here = &(*here)->next_pending) {
+		if (*here == cs) {
+			*here = cs->next_pending;
+			break;
+		}
+	}
+	cs->next_pending = NULL;
+	cs->answer_ret = gkm_rpc_message_parse (resp, GKM_RPC_RESPONSE) ? CKR_OK : CKR_DEVICE_ERROR;
+	cs->answered = 1;
+	pthread_mutex_unlock (&conn->mutex);
+
+	debug (("received response for request: %u", id));
+	return CKR_OK;
+}
+
+static CK_RV
+conn_send_recv (CallConn *conn, CallState *cs, GkmRpcMessage *req, GkmRpcMessage *resp)
+{
+	unsigned char buf[12];
+	int r;
+	CK_RV ret;
+
+	/* Register for the response before sending, it might be quick */
+	pthread_mutex_lock (&conn->mutex);
+
+		if (conn->broken) {
+			pthread_mutex_unlock (&conn->mutex);
+			return CKR_DEVICE_ERROR;
+		}
+
+		cs->request_id = ++conn->last_id;
+		cs->answer = resp;
+		cs->answered = 0;
+		cs->next_pending = conn->pending;
+		conn->pending = cs;
+
+	pthread_mutex_unlock (&conn->mutex);
+
+	/* Send the number of bytes, the request id, descriptors, and then the data */
+	egg_buffer_encode_uint32 (buf, req->buffer.len);
+	egg_buffer_encode_uint32 (buf + 4, cs->request_id);
+	egg_buffer_encode_uint32 (buf + 8, req->n_fds);
+
+	pthread_mutex_lock (&conn->write_mutex);
+
+		/* The descriptors go along with the first bytes */
+		do {
+			r = gkm_rpc_send_fds (conn->socket, buf, 12, req->fds, req->n_fds);
+		} while (r < 0 && errno == EINTR);
+
+		if (r < 0) {
+			warning (("couldn't send data: %s", strerror (errno)));
+			ret = CKR_DEVICE_ERROR;
+		} else {
+			ret = conn_write (conn, buf + r, 12 - r);
+		}
+
+		if (ret == CKR_OK)
+			ret = conn_write (conn, req->buffer.buf, req->buffer.len);
+
+	pthread_mutex_unlock (&conn->write_mutex);
+
+	/* The daemon has its own copies of the descriptors now */
+	gkm_rpc_message_close_fds (req);
+
+	pthread_mutex_lock (&conn->mutex);
+
+		if (ret != CKR_OK)
+			conn_break (conn);
+
+		/* Read responses until ours comes in, unless someone else is */
+		while (!cs->answered) {
+			if (conn->reading) {
+				pthread_cond_wait (&conn->cond, &conn->mutex);
+				continue;
+			}
+
+			conn->reading = 1;
+			pthread_mutex_unlock (&conn->mutex);
+
+			ret = conn_receive (conn);
+
+			pthread_mutex_lock (&conn->mutex);
+			conn->reading = 0;
+			if (ret != CKR_OK)
+				conn_break (conn);
+			pthread_cond_broadcast (&conn->cond);
+		}
+
+		ret = cs->answer_ret;
+		cs->answer = NULL;
+
+	pthread_mutex_unlock (&conn->mutex);
+
+	return ret;
+}
+
 static void
 call_destroy (void *value)
 {
@@ -293,6 +612,9 @@ call_destroy (void *value)
 		call_disconnect (cs);
 		assert (cs->socket == -1);
 
+		if (cs->conn)
+			conn_unref (cs->conn);
+
 		gkm_rpc_message_free (cs->req);
 		gkm_rpc_message_free (cs->resp);
 
@@ -302,16 +624,21 @@ call_destroy (void *value)
 	}
 }
 
+static CK_RV call_attach (CallState *cs);
+
 static CK_RV
 call_lookup (CallState **ret)
 {
 	CallState *cs = NULL;
+	int multiplexed;
 	CK_RV rv;
 
 	assert (ret);
 
 	pthread_mutex_lock (&call_state_mutex);
 
+		multiplexed = call_multiplexed;
+
 		/* Pop one from the pool if possible */
 		if (call_state_pool != NULL) {
 			cs = call_state_pool;
@@ -328,18 +655,20 @@ call_lookup (CallState **ret)
 		if (cs == NULL)
 			return CKR_HOST_MEMORY;
 		cs->socket = -1;
-		cs->call_status = CALL_INVALID;
+	}
 
-		/* Try to connect the call */
-		rv = call_connect (cs);
+	/* Share the multiplexed connection, or try to connect the call */
+	if (cs->socket == -1) {
+		cs->call_status = CALL_INVALID;
+		rv = multiplexed ? call_attach (cs) : call_connect (cs);
 		if (rv != CKR_OK) {
-			free (cs);
+			call_destroy (cs);
 			return rv;
 		}
 	}
 
 	assert (cs->call_status == CALL_READY);
-	assert (cs->socket != -1);
+	assert (cs->socket != -1 || cs->conn != NULL);
 	assert (cs->next == NULL);
 	*ret = cs;
 	return CKR_OK;
@@ -361,6 +690,9 @@ call_prepare (CallState *cs, int call_id)
 		}
 	}
 
+	/* Large data can go in shared memory on a multiplexed connection */
+	cs->req->shared_memory = (cs->conn != NULL);
+
 	/* Put in the Call ID and signature */
 	gkm_rpc_message_reset (cs->req);
 	if (!gkm_rpc_message_prep (cs->req, call_id, GKM_RPC_REQUEST))
@@ -489,6 +821,11 @@ call_send_recv (CallState *cs)
 	resp = cs->resp;
 	cs->req = cs->resp = NULL;
 
+	if (cs->conn) {
+		ret = conn_send_recv (cs->conn, cs, req, resp);
+		goto cleanup;
+	}
+
 	/* Send the number of bytes, and then the data */
 	egg_buffer_encode_uint32 (buf, req->buffer.len);
 	ret = call_write (cs, buf, 4);
@@ -542,7 +879,7 @@ call_run (CallState *cs)
 	assert (cs);
 	assert (cs->req);
 	assert (cs->call_status == CALL_PREP);
-	assert (cs->socket != -1);
+	assert (cs->socket != -1 || cs->conn != NULL);
 
 	/* Did building the call fail? */
 	if (gkm_rpc_message_buffer_error (cs->req)) {
@@ -593,6 +930,8 @@ call_run (CallState *cs)
 static CK_RV
 call_done (CallState *cs, CK_RV ret)
 {
+	int shared;
+
 	assert (cs);
 	assert (cs->call_status > CALL_INVALID);
 
@@ -611,8 +950,19 @@ call_done (CallState *cs, CK_RV ret)
 		}
 	}
 
+	/* Don't keep shared memory around in pooled calls */
+	if (cs->resp)
+		gkm_rpc_message_close_fds (cs->resp);
+
+	/* Calls only hold on to a multiplexed connection while in use */
+	shared = (cs->conn != NULL);
+	if (shared) {
+		conn_unref (cs->conn);
+		cs->conn = NULL;
+	}
+
 	/* Certain error codes cause us to discard the conenction */
-	if (ret != CKR_DEVICE_ERROR && ret != CKR_DEVICE_REMOVED && cs->socket != -1) {
+	if (ret != CKR_DEVICE_ERROR && ret != CKR_DEVICE_REMOVED && (shared || cs->socket != -1)) {
 
 		/* Try and stash it away for later use */
 		pthread_mutex_lock (&call_state_mutex);
@@ -635,6 +985,93 @@ call_done (CallState *cs, CK_RV ret)
 	return ret;
 }
 
+static CK_RV
+call_handshake (CallState *cs, unsigned char *handshake)
+{
+	CK_RV ret;
+
+	assert (cs->call_status == CALL_READY);
+
+	ret = call_prepare (cs, GKM_RPC_CALL_C_Initialize);
+	if (ret == CKR_OK)
+		if (!gkm_rpc_message_write_byte_array (cs->req, handshake, strlen ((char *)handshake)))
+			ret = CKR_HOST_MEMORY;
+	if (ret == CKR_OK)
+		ret = call_run (cs);
+
+	cs->call_status = CALL_READY;
+	return ret;
+}
+
+static CK_RV
+call_attach (CallState *cs)
+{
+	CallConn *conn, *stale = NULL;
+	CK_RV ret;
+
+	assert (cs->socket == -1);
+	assert (cs->conn == NULL);
+
+	pthread_mutex_lock (&call_state_mutex);
+
+		/* Don't use a broken connection, or one from before a fork */
+		conn = call_shared_conn;
+		if (conn != NULL) {
+			pthread_mutex_lock (&conn->mutex);
+			if (conn->broken || conn->pid != getpid ())
+				stale = conn;
+			else
+				conn->refs++;
+			pthread_mutex_unlock (&conn->mutex);
+
+			if (stale != NULL)
+				conn = call_shared_conn = NULL;
+		}
+
+	pthread_mutex_unlock (&call_state_mutex);
+
+	if (stale != NULL)
+		conn_unref (stale);
+
+	if (conn != NULL) {
+		cs->conn = conn;
+		cs->call_status = CALL_READY;
+		return CKR_OK;
+	}
+
+	/* Open a new connection, and ask the daemon to multiplex calls on it */
+	ret = call_connect (cs);
+	if (ret == CKR_OK)
+		ret = call_handshake (cs, GKM_RPC_HANDSHAKE_MULTIPLEX);
+
+	if (ret == CKR_OK) {
+		conn = conn_new (cs->socket);
+		if (conn == NULL)
+			return CKR_HOST_MEMORY;
+		cs->socket = -1;
+		cs->conn = conn;
+
+		pthread_mutex_lock (&call_state_mutex);
+		if (call_shared_conn == NULL) {
+			conn->refs++;
+			call_shared_conn = conn;
+		}
+		pthread_mutex_unlock (&call_state_mutex);
+
+	/* An older daemon, use a connection per call instead */
+	} else if (ret == CKR_GENERAL_ERROR && cs->socket != -1) {
+		debug (("daemon doesn't multiplex calls"));
+
+		pthread_mutex_lock (&call_state_mutex);
+		call_multiplexed = 0;
+		pthread_mutex_unlock (&call_state_mutex);
+
+		ret = call_handshake (cs, GKM_RPC_HANDSHAKE);
+	}
+
+	return ret;
+}
+
 /* -----------------------------------------------------------------------------
  * MODULE SPECIFIC PROTOCOL CODE
  */
@@ -653,7 +1090,7 @@ proto_read_attribute_array (GkmRpcMessage *msg, CK_ATTRIBUTE_PTR arr, CK_ULONG l
 	assert (msg);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "aA"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_ATTRIBUTE_ARRAY));
 
 	/* Get the number of items. We need this value to be correct */
 	if (!egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &num))
@@ -685,8 +1122,13 @@ proto_read_attribute_array (GkmRpcMessage *msg, CK_ATTRIBUTE_PTR arr, CK_ULONG l
 		egg_buffer_get_byte (&msg->buffer, msg->parsed,
 		                     &msg->parsed, &validity);
 
-		/* And the data itself */
-		if (validity) {
+		/* And the data itself, large values may be in shared memory */
+		if (validity == 2) {
+			if (!egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &value) ||
+			    !gkm_rpc_message_read_shared (msg, value, &attrval))
+				return PARSE_ERROR;
+			attrlen = value;
+		} else if (validity) {
 			if (egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &value) &&
 			    egg_buffer_get_byte_array (&msg->buffer, msg->parsed, &msg->parsed, &attrval, &attrlen)) {
 				if (attrval && value != attrlen) {
@@ -759,7 +1201,7 @@ proto_read_byte_array (GkmRpcMessage *msg, CK_BYTE_PTR arr,
 	assert (msg);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "ay"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_BYTE_ARRAY));
 
 	/* A single byte which determines whether valid or not */
 	if (!egg_buffer_get_byte (&msg->buffer, msg->parsed, &msg->parsed, &valid))
@@ -778,9 +1220,15 @@ proto_read_byte_array (GkmRpcMessage *msg, CK_BYTE_PTR arr,
 			return CKR_OK;
 	}
 
-	/* Get the actual bytes */
-	if (!egg_buffer_get_byte_array (&msg->buffer, msg->parsed, &msg->parsed, &val, &vlen))
+	/* Get the actual bytes, large data may be in shared memory */
+	if (valid == 2) {
+		if (!egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &length) ||
+		    !gkm_rpc_message_read_shared (msg, length, &val))
+			return PARSE_ERROR;
+		vlen = length;
+	} else if (!egg_buffer_get_byte_array (&msg->buffer, msg->parsed, &msg->parsed, &val, &vlen)) {
 		return PARSE_ERROR;
+	}
 
 	*len = vlen;
 
@@ -808,7 +1256,7 @@ proto_read_ulong_array (GkmRpcMessage *msg, CK_ULONG_PTR arr,
 	assert (msg);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "au"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_ULONG_ARRAY));
 
 	/* A single byte which determines whether valid or not */
 	if (!egg_buffer_get_byte (&msg->buffer, msg->parsed, &msg->parsed, &valid))
@@ -841,6 +1289,48 @@ proto_read_ulong_array (GkmRpcMessage *msg, CK_ULONG_PTR arr,
 	return egg_buffer_has_error (&msg->buffer) ? PARSE_ERROR : CKR_OK;
 }
 
+/* Reads a ulong array of any length into newly allocated memory */
+static CK_RV
+proto_read_ulong_array_full (GkmRpcMessage *msg, CK_ULONG_PTR *arr,
+                             CK_ULONG_PTR len)
+{
+	uint32_t i, num;
+	uint64_t val;
+	unsigned char valid;
+
+	assert (msg);
+	assert (arr);
+	assert (len);
+
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_ULONG_ARRAY));
+
+	if (!egg_buffer_get_byte (&msg->buffer, msg->parsed, &msg->parsed, &valid) ||
+	    !egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &num))
+		return PARSE_ERROR;
+
+	if (!valid || num > (msg->buffer.len - msg->parsed) / 8)
+		return PARSE_ERROR;
+
+	*arr = calloc (num ? num : 1, sizeof (CK_ULONG));
+	if (!*arr)
+		return CKR_HOST_MEMORY;
+
+	for (i = 0; i < num; ++i) {
+		egg_buffer_get_uint64 (&msg->buffer, msg->parsed, &msg->parsed, &val);
+		(*arr)[i] = (CK_ULONG)val;
+	}
+
+	*len = num;
+
+	if (egg_buffer_has_error (&msg->buffer)) {
+		free (*arr);
+		*arr = NULL;
+		return PARSE_ERROR;
+	}
+
+	return CKR_OK;
+}
+
 static CK_RV
 proto_write_mechanism (GkmRpcMessage *msg, CK_MECHANISM_PTR mech)
 {
@@ -848,7 +1338,7 @@ proto_write_mechanism (GkmRpcMessage *msg, CK_MECHANISM_PTR mech)
 	assert (mech);
 
 	/* Make sure this is in the right order */
-	assert (!msg->signature || gkm_rpc_message_verify_part (msg, "M"));
+	assert (!msg->signature || gkm_rpc_message_verify_part (msg, GKM_RPC_PART_MECHANISM));
 
 	/* The mechanism type */
 	egg_buffer_add_uint32 (&msg->buffer, mech->mechanism);
@@ -967,20 +1457,871 @@ proto_read_sesssion_info (GkmRpcMessage *msg, CK_SESSION_INFO_PTR info)
 }
 
 /* -------------------------------------------------------------------
- * CALL MACROS
+ * BATCHED CALLS
  */
 
-#define BEGIN_CALL_OR(call_id, if_no_daemon) \
-	debug ((#call_id ": enter")); \
-	return_val_if_fail (pkcs11_initialized, CKR_CRYPTOKI_NOT_INITIALIZED); \
-	{  \
-		CallState *_cs; \
-		CK_RV _ret = CKR_OK; \
-		_ret = call_lookup (&_cs); \
-		if (_ret == CKR_DEVICE_REMOVED) return (if_no_daemon); \
-		if (_ret != CKR_OK) return _ret; \
-		_ret = call_prepare (_cs, GKM_RPC_CALL_##call_id); \
-		if (_ret != CKR_OK) goto _cleanup;
+/*
+ * Sends the prepared request in each part to the daemon in one round trip.
+ * On return each part holds the matching response, and its result is in
+ * rets. Only daemons that multiplex calls support this.
+ */
+static CK_RV
+call_batch (GkmRpcMessage **parts, CK_RV *rets, int n_parts)
+{
+	const unsigned char *data, *part;
+	size_t n_data, n_part, offset;
+	unsigned char valid;
+	CallState *cs;
+	EggBuffer buf;
+	CK_ULONG ckerr;
+	int call_id, i;
+	CK_RV ret;
+
+	assert (parts);
+	assert (rets);
+
+	ret = call_lookup (&cs);
+	if (ret != CKR_OK)
+		return ret;
+
+	ret = call_prepare (cs, GKM_RPC_CALL_Batch);
+	if (ret == CKR_OK) {
+		egg_buffer_init_full (&buf, 256, call_allocator);
+		for (i = 0; i < n_parts; ++i) {
+			assert (gkm_rpc_message_is_verified (parts[i]));
+			egg_buffer_add_byte_array (&buf, parts[i]->buffer.buf, parts[i]->buffer.len);
+		}
+		if (egg_buffer_has_error (&buf) ||
+		    !gkm_rpc_message_write_byte_array (cs->req, buf.buf, buf.len))
+			ret = CKR_HOST_MEMORY;
+		egg_buffer_uninit (&buf);
+	}
+
+	if (ret == CKR_OK)
+		ret = call_run (cs);
+
+	if (ret == CKR_OK) {
+		if (!gkm_rpc_message_verify_part (cs->resp, GKM_RPC_PART_BYTE_ARRAY) ||
+		    !egg_buffer_get_byte (&cs->resp->buffer, cs->resp->parsed, &cs->resp->parsed, &valid) ||
+		    !valid || !egg_buffer_get_byte_array (&cs->resp->buffer, cs->resp->parsed,
+		                                          &cs->resp->parsed, &data, &n_data))
+			ret = PARSE_ERROR;
+	}
+
+	/* Pull out each of the responses, in the same order */
+	if (ret == CKR_OK) {
+		egg_buffer_init_static (&buf, data, n_data);
+		offset = 0;
+
+		for (i = 0; ret == CKR_OK && i < n_parts; ++i) {
+			call_id = parts[i]->call_id;
+			gkm_rpc_message_reset (parts[i]);
+
+			if (!egg_buffer_get_byte_array (&buf, offset, &offset, &part, &n_part) ||
+			    !egg_buffer_append (&parts[i]->buffer, part, n_part) ||
+			    !gkm_rpc_message_parse (parts[i], GKM_RPC_RESPONSE)) {
+				warning (("invalid batch response from gnome-keyring-daemon"));
+				ret = PARSE_ERROR;
+
+			} else if (parts[i]->call_id == GKM_RPC_CALL_ERROR) {
+				if (!gkm_rpc_message_read_ulong (parts[i], &ckerr) || ckerr <= CKR_OK) {
+					warning (("invalid error response from gnome-keyring-daemon"));
+					ret = PARSE_ERROR;
+				} else {
+					rets[i] = (CK_RV)ckerr;
+				}
+
+			} else if (parts[i]->call_id != call_id) {
+				warning (("invalid response from gnome-keyring-daemon: call mismatch"));
+				ret = PARSE_ERROR;
+
+			} else {
+				rets[i] = CKR_OK;
+			}
+		}
+	}
+
+	return call_done (cs, ret);
+}
+
+/*
+ * A search run with one batch, the whole of which is read ahead. The
+ * daemon has already finished the search, and we hand out the objects.
+ * Once the search is finished, the objects handed out are kept until
+ * their attributes are read, see attr_fetch_found().
+ */
+typedef struct _FindState {
+	struct _FindState *next;
+	CK_SESSION_HANDLE session;
+	CK_SLOT_ID slot;
+	CK_OBJECT_HANDLE_PTR objects;
+	CK_ULONG n_objects;
+	CK_ULONG n_read;
+} FindState;
+
+/* The buffer for a batched search, the daemon grows it for larger ones */
+#define FIND_READ_AHEAD 256
+
+static FindState *find_states = NULL;
+static FindState *found_states = NULL;
+static pthread_mutex_t find_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+find_state_free (FindState *fs)
+{
+	if (fs) {
+		free (fs->objects);
+		free (fs);
+	}
+}
+
+/* Call with find_mutex held */
+static FindState**
+find_state_lookup (FindState **list, CK_SESSION_HANDLE session)
+{
+	FindState **at;
+
+	for (at = list; *at; at = &(*at)->next) {
+		if ((*at)->session == session)
+			break;
+	}
+
+	return at;
+}
+
+/* Call with find_mutex held */
+static void
+find_state_discard_in (FindState **list, int all_sessions,
+                       CK_SESSION_HANDLE session, CK_SLOT_ID slot)
+{
+	FindState **at, *fs;
+
+	at = list;
+	while (*at) {
+		fs = *at;
+		if (all_sessions ? fs->slot == slot : fs->session == session) {
+			*at = fs->next;
+			find_state_free (fs);
+		} else {
+			at = &fs->next;
+		}
+	}
+}
+
+static void
+find_state_discard (int all_sessions, CK_SESSION_HANDLE session, CK_SLOT_ID slot)
+{
+	pthread_mutex_lock (&find_mutex);
+
+		find_state_discard_in (&find_states, all_sessions, session, slot);
+		find_state_discard_in (&found_states, all_sessions, session, slot);
+
+	pthread_mutex_unlock (&find_mutex);
+}
+
+static void
+find_state_clear (void)
+{
+	FindState *fs;
+
+	pthread_mutex_lock (&find_mutex);
+
+		while (find_states) {
+			fs = find_states;
+			find_states = fs->next;
+			find_state_free (fs);
+		}
+
+		while (found_states) {
+			fs = found_states;
+			found_states = fs->next;
+			find_state_free (fs);
+		}
+
+	pthread_mutex_unlock (&find_mutex);
+}
+
+/* Keeps the objects handed out by a finished search, call with find_mutex held */
+static void
+find_state_finished (FindState *fs)
+{
+	find_state_discard_in (&found_states, 0, fs->session, 0);
+
+	if (fs->n_read < 2) {
+		find_state_free (fs);
+	} else {
+		fs->n_objects = fs->n_read;
+		fs->n_read = 0;
+		fs->next = found_states;
+		found_states = fs;
+	}
+}
+
+/*
+ * Run FindObjectsInit, FindObjects and FindObjectsFinal in one batch. Returns
+ * CKR_FUNCTION_NOT_SUPPORTED when the search should go through the daemon.
+ */
+static CK_RV
+find_objects_batched (CK_SESSION_HANDLE session, CK_ATTRIBUTE_PTR template,
+                      CK_ULONG count)
+{
+	GkmRpcMessage *parts[4] = { NULL, NULL, NULL, NULL };
+	CK_RV rets[4];
+	CK_SESSION_INFO info;
+	FindState *fs = NULL;
+	int multiplexed, i;
+	CK_RV ret = CKR_OK;
+
+	pthread_mutex_lock (&call_state_mutex);
+	multiplexed = call_multiplexed;
+	pthread_mutex_unlock (&call_state_mutex);
+
+	if (!multiplexed)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	for (i = 0; i < 4; ++i) {
+		parts[i] = gkm_rpc_message_new (call_allocator);
+		if (!parts[i])
+			ret = CKR_HOST_MEMORY;
+	}
+
+	/* The session info tells us which slot the search belongs to */
+	if (ret == CKR_OK &&
+	    (!gkm_rpc_message_prep (parts[0], GKM_RPC_CALL_C_FindObjectsInit, GKM_RPC_REQUEST) ||
+	     !gkm_rpc_message_write_ulong (parts[0], session) ||
+	     !gkm_rpc_message_write_attribute_array (parts[0], template, count) ||
+	     !gkm_rpc_message_prep (parts[1], GKM_RPC_CALL_C_FindObjects, GKM_RPC_REQUEST) ||
+	     !gkm_rpc_message_write_ulong (parts[1], session) ||
+	     !gkm_rpc_message_write_ulong_buffer (parts[1], FIND_READ_AHEAD) ||
+	     !gkm_rpc_message_prep (parts[2], GKM_RPC_CALL_C_FindObjectsFinal, GKM_RPC_REQUEST) ||
+	     !gkm_rpc_message_write_ulong (parts[2], session) ||
+	     !gkm_rpc_message_prep (parts[3], GKM_RPC_CALL_C_GetSessionInfo, GKM_RPC_REQUEST) ||
+	     !gkm_rpc_message_write_ulong (parts[3], session)))
+		ret = CKR_HOST_MEMORY;
+
+	if (ret == CKR_OK)
+		ret = call_batch (parts, rets, 4);
+
+	if (ret == CKR_DEVICE_REMOVED)
+		ret = CKR_SESSION_HANDLE_INVALID;
+
+	/* The search couldn't be started, there's nothing to clean up */
+	if (ret == CKR_OK && rets[0] != CKR_OK)
+		ret = rets[0];
+
+	/* Otherwise search through the daemon if anything else went wrong */
+	else if (ret == CKR_OK && (rets[1] != CKR_OK || rets[3] != CKR_OK))
+		ret = CKR_FUNCTION_NOT_SUPPORTED;
+
+	if (ret == CKR_OK) {
+		fs = calloc (1, sizeof (FindState));
+		if (!fs)
+			ret = CKR_HOST_MEMORY;
+	}
+
+	/* In a batch the daemon returns all the objects, however many */
+	if (ret == CKR_OK) {
+		ret = proto_read_ulong_array_full (parts[1], &fs->objects, &fs->n_objects);
+		if (ret == CKR_OK)
+			ret = proto_read_sesssion_info (parts[3], &info);
+	}
+
+	if (ret == CKR_OK) {
+		fs->session = session;
+		fs->slot = info.slotID;
+
+		pthread_mutex_lock (&find_mutex);
+		if (*find_state_lookup (&find_states, session) != NULL) {
+			ret = CKR_OPERATION_ACTIVE;
+		} else {
+			fs->next = find_states;
+			find_states = fs;
+			fs = NULL;
+		}
+		pthread_mutex_unlock (&find_mutex);
+	}
+
+	find_state_free (fs);
+	for (i = 0; i < 4; ++i)
+		gkm_rpc_message_free (parts[i]);
+
+	return ret;
+}
+
+/* -------------------------------------------------------------------
+ * ATTRIBUTE CACHE
+ *
+ * Callers usually ask for the sizes of attributes, and then for their
+ * values. When only sizes are asked for, the daemon sends small values
+ * along, and they're kept here for the second call. Values that can't
+ * change are kept until the object is destroyed or the session closes.
+ *
+ * After a search, callers usually read the same attributes of each of
+ * the objects found. Those are fetched for several objects at once, and
+ * kept until each object is first read.
+ */
+
+typedef struct _CachedAttr {
+	struct _CachedAttr *next;
+	CK_ATTRIBUTE_TYPE type;
+	CK_BYTE_PTR value;
+	CK_ULONG length;
+} CachedAttr;
+
+typedef struct _AttrCache {
+	struct _AttrCache *next;
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE object;
+	CachedAttr *attrs;
+	int found;
+} AttrCache;
+
+/* The most objects that have cached attributes */
+#define MAX_ATTR_CACHE 64
+
+/* The most found objects whose attributes are fetched at once */
+#define MAX_ATTR_BATCH 16
+
+enum {
+	DISCARD_ALL,
+	DISCARD_SESSION,
+	DISCARD_OBJECT
+};
+
+enum {
+	STORE_FIXED,            /* Only the values that can't change */
+	STORE_NEXT_CALL,        /* Values for the next call on the session */
+	STORE_FOUND             /* Values until the object is first read */
+};
+
+static AttrCache *attr_caches = NULL;
+static unsigned int n_attr_caches = 0;
+static pthread_mutex_t attr_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+cached_attr_free (CachedAttr *ca)
+{
+	if (ca) {
+		if (ca->value)
+			memset (ca->value, 0, ca->length);
+		free (ca->value);
+		free (ca);
+	}
+}
+
+static void
+attr_cache_free (AttrCache *ac)
+{
+	CachedAttr *ca;
+
+	if (ac) {
+		while (ac->attrs) {
+			ca = ac->attrs;
+			ac->attrs = ca->next;
+			cached_attr_free (ca);
+		}
+		free (ac);
+	}
+}
+
+static CachedAttr*
+attr_cache_get (AttrCache *ac, CK_ATTRIBUTE_TYPE type)
+{
+	CachedAttr *ca;
+
+	for (ca = ac->attrs; ca; ca = ca->next) {
+		if (ca->type == type)
+			return ca;
+	}
+
+	return NULL;
+}
+
+/* Attributes which can't be changed once an object exists */
+static int
+attr_cache_is_fixed (AttrCache *ac, CK_ATTRIBUTE_TYPE type)
+{
+	CachedAttr *ca;
+	CK_OBJECT_CLASS klass;
+
+	switch (type) {
+	case CKA_CLASS:
+	case CKA_TOKEN:
+	case CKA_KEY_TYPE:
+	case CKA_CERTIFICATE_TYPE:
+	case CKA_MODULUS:
+	case CKA_MODULUS_BITS:
+	case CKA_PUBLIC_EXPONENT:
+	case CKA_EC_PARAMS:
+	case CKA_EC_POINT:
+		return 1;
+
+	/* The value of a certificate can't change */
+	case CKA_VALUE:
+		ca = attr_cache_get (ac, CKA_CLASS);
+		if (!ca || ca->length != sizeof (klass))
+			return 0;
+		memcpy (&klass, ca->value, sizeof (klass));
+		return klass == CKO_CERTIFICATE;
+
+	default:
+		return 0;
+	}
+}
+
+/* Drops the values that were only kept for the next call */
+static void
+attr_cache_prune (AttrCache *ac)
+{
+	CachedAttr **at, *ca;
+
+	at = &ac->attrs;
+	while (*at) {
+		ca = *at;
+		if (attr_cache_is_fixed (ac, ca->type)) {
+			at = &ca->next;
+		} else {
+			*at = ca->next;
+			cached_attr_free (ca);
+		}
+	}
+}
+
+/* Call with attr_cache_mutex held */
+static AttrCache**
+attr_cache_lookup (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object)
+{
+	AttrCache **at;
+
+	for (at = &attr_caches; *at; at = &(*at)->next) {
+		if ((*at)->session == session && (*at)->object == object)
+			break;
+	}
+
+	return at;
+}
+
+static void
+attr_cache_put (AttrCache *ac, CK_ATTRIBUTE_PTR attr, int fixed_only)
+{
+	CachedAttr *ca;
+	CK_BYTE_PTR value;
+
+	if (!attr->pValue || attr->ulValueLen == (CK_ULONG)-1)
+		return;
+	if (fixed_only && !attr_cache_is_fixed (ac, attr->type))
+		return;
+
+	value = malloc (attr->ulValueLen ? attr->ulValueLen : 1);
+	if (!value)
+		return;
+	memcpy (value, attr->pValue, attr->ulValueLen);
+
+	ca = attr_cache_get (ac, attr->type);
+	if (ca) {
+		memset (ca->value, 0, ca->length);
+		free (ca->value);
+	} else {
+		ca = calloc (1, sizeof (CachedAttr));
+		if (!ca) {
+			free (value);
+			return;
+		}
+		ca->type = attr->type;
+		ca->next = ac->attrs;
+		ac->attrs = ca;
+	}
+
+	ca->value = value;
+	ca->length = attr->ulValueLen;
+}
+
+/* Keeps the values in the template, how long depends on the store mode */
+static void
+attr_cache_store (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
+                  CK_ATTRIBUTE_PTR template, CK_ULONG count, int store)
+{
+	AttrCache **at, *ac;
+	CK_ULONG i;
+
+	pthread_mutex_lock (&attr_cache_mutex);
+
+		/* Most recently used at the front */
+		at = attr_cache_lookup (session, object);
+		ac = *at;
+		if (ac) {
+			*at = ac->next;
+		} else {
+			ac = calloc (1, sizeof (AttrCache));
+			if (ac) {
+				ac->session = session;
+				ac->object = object;
+				++n_attr_caches;
+			}
+		}
+
+		if (ac) {
+			/* The class decides whether other attributes can change */
+			for (i = 0; i < count; ++i) {
+				if (template[i].type == CKA_CLASS)
+					attr_cache_put (ac, &template[i], store == STORE_FIXED);
+			}
+			for (i = 0; i < count; ++i) {
+				if (template[i].type != CKA_CLASS)
+					attr_cache_put (ac, &template[i], store == STORE_FIXED);
+			}
+			if (store == STORE_FOUND)
+				ac->found = 1;
+
+			if (ac->attrs) {
+				ac->next = attr_caches;
+				attr_caches = ac;
+			} else {
+				attr_cache_free (ac);
+				--n_attr_caches;
+			}
+		}
+
+		/* Forget the least recently used */
+		if (n_attr_caches > MAX_ATTR_CACHE) {
+			for (at = &attr_caches; (*at)->next; at = &(*at)->next);
+			attr_cache_free (*at);
+			*at = NULL;
+			--n_attr_caches;
+		}
+
+	pthread_mutex_unlock (&attr_cache_mutex);
+}
+
+/*
+ * Answers C_GetAttributeValue if all the attributes are in the cache.
+ * Values fetched along with sizes are only used once, by the next call
+ * on the same session. Values fetched for found objects are kept until
+ * that object is read.
+ */
+static int
+attr_cache_answer (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
+                   CK_ATTRIBUTE_PTR template, CK_ULONG count, CK_RV *ret)
+{
+	AttrCache **at, *ac, *found = NULL;
+	CachedAttr *ca;
+	int delivered = 0;
+	CK_ULONG i;
+
+	if (count == 0)
+		return 0;
+
+	pthread_mutex_lock (&attr_cache_mutex);
+
+		at = &attr_caches;
+		while (*at) {
+			ac = *at;
+			if (ac->session == session && ac->object == object)
+				found = ac;
+			else if (ac->session == session && !ac->found)
+				attr_cache_prune (ac);
+
+			if (ac->attrs) {
+				at = &ac->next;
+			} else {
+				*at = ac->next;
+				attr_cache_free (ac);
+				--n_attr_caches;
+			}
+		}
+
+		for (i = 0; found && i < count; ++i) {
+			if (!attr_cache_get (found, template[i].type))
+				found = NULL;
+		}
+
+		if (found) {
+			*ret = CKR_OK;
+			for (i = 0; i < count; ++i) {
+				ca = attr_cache_get (found, template[i].type);
+
+				/* Just requesting the attribute size */
+				if (!template[i].pValue) {
+					template[i].ulValueLen = ca->length;
+
+				/* Wants attribute data, but too small */
+				} else if (template[i].ulValueLen < ca->length) {
+					template[i].ulValueLen = ca->length;
+					*ret = CKR_BUFFER_TOO_SMALL;
+
+				/* Wants attribute data, enough space */
+				} else {
+					memcpy (template[i].pValue, ca->value, ca->length);
+					template[i].ulValueLen = ca->length;
+					delivered = 1;
+				}
+			}
+
+			/* From now on, like values for the next call */
+			found->found = 0;
+			if (delivered && *ret == CKR_OK)
+				attr_cache_prune (found);
+		}
+
+	pthread_mutex_unlock (&attr_cache_mutex);
+
+	return found != NULL;
+}
+
+static void
+attr_cache_discard (int what, CK_ULONG handle)
+{
+	AttrCache **at, *ac;
+
+	pthread_mutex_lock (&attr_cache_mutex);
+
+		at = &attr_caches;
+		while (*at) {
+			ac = *at;
+			if (what == DISCARD_ALL ||
+			    (what == DISCARD_SESSION && ac->session == handle) ||
+			    (what == DISCARD_OBJECT && ac->object == handle)) {
+				*at = ac->next;
+				attr_cache_free (ac);
+				--n_attr_caches;
+			} else {
+				at = &ac->next;
+			}
+		}
+
+	pthread_mutex_unlock (&attr_cache_mutex);
+}
+
+/*
+ * Reads the response to FetchAttributeValue. The sizes go into the
+ * template, and the values into the cache.
+ */
+static CK_RV
+proto_read_fetched (GkmRpcMessage *msg, CK_SESSION_HANDLE session,
+                    CK_OBJECT_HANDLE object, CK_ATTRIBUTE_PTR template,
+                    CK_ULONG count, int store)
+{
+	const unsigned char *data;
+	CK_ATTRIBUTE_PTR values;
+	unsigned char validity;
+	uint32_t num, type, value;
+	size_t n_data;
+	CK_ULONG i, rv;
+	CK_RV ret = CKR_OK;
+
+	values = calloc (count ? count : 1, sizeof (CK_ATTRIBUTE));
+	if (!values)
+		return CKR_HOST_MEMORY;
+
+	if (!gkm_rpc_message_verify_part (msg, GKM_RPC_PART_ATTRIBUTE_ARRAY) ||
+	    !egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &num) ||
+	    num != count) {
+		warning (("received an attribute array with wrong number of attributes"));
+		ret = PARSE_ERROR;
+	}
+
+	for (i = 0; ret == CKR_OK && i < count; ++i) {
+		data = NULL;
+
+		if (!egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &type) ||
+		    !egg_buffer_get_byte (&msg->buffer, msg->parsed, &msg->parsed, &validity) ||
+		    type != template[i].type) {
+			ret = PARSE_ERROR;
+			break;
+		}
+
+		values[i].type = type;
+		values[i].pValue = NULL;
+		values[i].ulValueLen = (CK_ULONG)-1;
+
+		if (!validity) {
+			template[i].ulValueLen = (CK_ULONG)-1;
+			continue;
+		}
+
+		if (!egg_buffer_get_uint32 (&msg->buffer, msg->parsed, &msg->parsed, &value)) {
+			ret = PARSE_ERROR;
+		} else if (validity == 2) {
+			if (!gkm_rpc_message_read_shared (msg, value, &data))
+				ret = PARSE_ERROR;
+		} else if (!egg_buffer_get_byte_array (&msg->buffer, msg->parsed, &msg->parsed, &data, &n_data) ||
+		           (data && n_data != value)) {
+			ret = PARSE_ERROR;
+		}
+
+		/* Secrets are never cached, even if a daemon sends them */
+		if (ret == CKR_OK) {
+			template[i].ulValueLen = value;
+			if (data && !gkm_rpc_attribute_is_secret (type)) {
+				values[i].pValue = (CK_VOID_PTR)data;
+				values[i].ulValueLen = value;
+			}
+		}
+	}
+
+	/* Along with the code that goes with these attributes */
+	if (ret == CKR_OK) {
+		if (!gkm_rpc_message_read_ulong (msg, &rv))
+			ret = PARSE_ERROR;
+		else
+			ret = rv;
+	}
+
+	if (ret == CKR_OK || ret == CKR_ATTRIBUTE_SENSITIVE || ret == CKR_ATTRIBUTE_TYPE_INVALID)
+		attr_cache_store (session, object, values, count, store);
+
+	free (values);
+	return ret;
+}
+
+/*
+ * Asks for the sizes of attributes, along with those values that are
+ * small enough. Returns CKR_FUNCTION_NOT_SUPPORTED when the daemon
+ * can't do this.
+ */
+static CK_RV
+attr_fetch (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
+            CK_ATTRIBUTE_PTR template, CK_ULONG count)
+{
+	CallState *cs;
+	int multiplexed;
+	CK_RV ret;
+
+	pthread_mutex_lock (&call_state_mutex);
+	multiplexed = call_multiplexed;
+	pthread_mutex_unlock (&call_state_mutex);
+
+	if (!multiplexed)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	ret = call_lookup (&cs);
+	if (ret != CKR_OK)
+		return ret == CKR_DEVICE_REMOVED ? CKR_SESSION_HANDLE_INVALID : ret;
+
+	ret = call_prepare (cs, GKM_RPC_CALL_FetchAttributeValue);
+	if (ret == CKR_OK &&
+	    (!gkm_rpc_message_write_ulong (cs->req, session) ||
+	     !gkm_rpc_message_write_ulong (cs->req, object) ||
+	     !gkm_rpc_message_write_attribute_buffer (cs->req, template, count)))
+		ret = CKR_HOST_MEMORY;
+
+	if (ret == CKR_OK)
+		ret = call_run (cs);
+
+	if (ret == CKR_OK)
+		ret = proto_read_fetched (cs->resp, session, object, template, count,
+		                          STORE_NEXT_CALL);
+
+	return call_done (cs, ret);
+}
+
+/*
+ * When the object was found by the last search on the session, fetches
+ * the attributes in the template for it and the objects found after it,
+ * in one batch. Returns CKR_OK if they were fetched into the cache.
+ */
+static CK_RV
+attr_fetch_found (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
+                  CK_ATTRIBUTE_PTR template, CK_ULONG count)
+{
+	GkmRpcMessage *parts[MAX_ATTR_BATCH];
+	CK_OBJECT_HANDLE objects[MAX_ATTR_BATCH];
+	CK_ATTRIBUTE_PTR sizes;
+	CK_RV rets[MAX_ATTR_BATCH];
+	FindState **at, *fs;
+	int n_parts = 0;
+	int multiplexed;
+	CK_ULONG i;
+	CK_RV ret = CKR_OK;
+	int j;
+
+	pthread_mutex_lock (&call_state_mutex);
+	multiplexed = call_multiplexed;
+	pthread_mutex_unlock (&call_state_mutex);
+
+	if (!multiplexed)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	/* Take this object, and the ones after it that haven't been read */
+	pthread_mutex_lock (&find_mutex);
+
+		at = find_state_lookup (&found_states, session);
+		fs = *at;
+		for (i = 0; fs && i < fs->n_objects; ++i) {
+			if (fs->objects[i] == object)
+				break;
+		}
+
+		for (; fs && i < fs->n_objects && n_parts < MAX_ATTR_BATCH; ++i) {
+			if (fs->objects[i] != 0) {
+				objects[n_parts++] = fs->objects[i];
+				fs->objects[i] = 0;
+			}
+		}
+
+		if (fs && n_parts == 0) {
+			*at = fs->next;
+			find_state_free (fs);
+		}
+
+	pthread_mutex_unlock (&find_mutex);
+
+	/* Not worth a batch for just the one object */
+	if (n_parts < 2)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	/* Only the sizes are asked for, and small values come along */
+	sizes = calloc (count, sizeof (CK_ATTRIBUTE));
+	if (!sizes)
+		return CKR_HOST_MEMORY;
+	for (i = 0; i < count; ++i)
+		sizes[i].type = template[i].type;
+
+	for (j = 0; j < n_parts; ++j) {
+		parts[j] = gkm_rpc_message_new (call_allocator);
+		if (!parts[j] ||
+		    !gkm_rpc_message_prep (parts[j], GKM_RPC_CALL_FetchAttributeValue, GKM_RPC_REQUEST) ||
+		    !gkm_rpc_message_write_ulong (parts[j], session) ||
+		    !gkm_rpc_message_write_ulong (parts[j], objects[j]) ||
+		    !gkm_rpc_message_write_attribute_buffer (parts[j], sizes, count))
+			ret = CKR_HOST_MEMORY;
+	}
+
+	if (ret == CKR_OK)
+		ret = call_batch (parts, rets, n_parts);
+
+	for (j = 0; ret == CKR_OK && j < n_parts; ++j) {
+		if (rets[j] == CKR_OK)
+			proto_read_fetched (parts[j], session, objects[j], sizes, count,
+			                    objects[j] == object ? STORE_NEXT_CALL : STORE_FOUND);
+	}
+
+	for (j = 0; j < n_parts; ++j)
+		gkm_rpc_message_free (parts[j]);
+	free (sizes);
+
+	return ret;
+}
+
+/* -------------------------------------------------------------------
+ * CALL MACROS
+ */
+
+/* Typed request stubs, generated from the call signatures */
+#define GKM_RPC_STUBS_MODULE
+#include "gkm-rpc-stubs.h"
+
+#define BEGIN_CALL_OR(call_id, if_no_daemon) \
+	debug ((#call_id ": enter")); \
+	return_val_if_fail (pkcs11_initialized, CKR_CRYPTOKI_NOT_INITIALIZED); \
+	{  \
+		CallState *_cs; \
+		CK_RV _ret = CKR_OK; \
+		_ret = call_lookup (&_cs); \
+		if (_ret == CKR_DEVICE_REMOVED) return (if_no_daemon); \
+		if (_ret != CKR_OK) return _ret; \
+		_ret = call_prepare (_cs, GKM_RPC_CALL_##call_id); \
+		if (_ret != CKR_OK) goto _cleanup;
 
 #define PROCESS_CALL \
 		_ret = call_run (_cs); \
@@ -997,6 +2338,10 @@ proto_read_sesssion_info (GkmRpcMessage *msg, CK_SESSION_INFO_PTR info)
 		return _ret; \
 	}
 
+#define IN_CALL(stub) \
+	_ret = stub; \
+	if (_ret != CKR_OK) goto _cleanup;
+
 #define IN_BYTE(val) \
 	if (!gkm_rpc_message_write_byte (_cs->req, val)) \
 		{ _ret = CKR_HOST_MEMORY; goto _cleanup; }
@@ -1214,14 +2559,14 @@ rpc_C_Initialize (CK_VOID_PTR init_args)
 
 		/* Call through and initialize the daemon if available */
 		if (pkcs11_socket_path != NULL) {
+
+			/* Try multiplexing, the handshake happens when connecting */
+			pthread_mutex_lock (&call_state_mutex);
+			call_multiplexed = 1;
+			pthread_mutex_unlock (&call_state_mutex);
+
 			ret = call_lookup (&cs);
 			if (ret == CKR_OK) {
-				ret = call_prepare (cs, GKM_RPC_CALL_C_Initialize);
-				if (ret == CKR_OK)
-					if (!gkm_rpc_message_write_byte_array (cs->req, GKM_RPC_HANDSHAKE, GKM_RPC_HANDSHAKE_LEN))
-						ret = CKR_HOST_MEMORY;
-				if (ret == CKR_OK)
-					ret = call_run (cs);
 				call_done (cs, ret);
 
 			/* No daemon available */
@@ -1285,6 +2630,16 @@ rpc_C_Finalize (CK_VOID_PTR reserved)
 			call_destroy (cs);
 		}
 
+		/* And the multiplexed connection */
+		if (call_shared_conn)
+			conn_unref (call_shared_conn);
+		call_shared_conn = NULL;
+		call_multiplexed = 0;
+
+		/* Searches read ahead from the daemon, and cached attributes */
+		find_state_clear ();
+		attr_cache_discard (DISCARD_ALL, 0);
+
 		/* This should stop all other calls in */
 		pkcs11_initialized = 0;
 		pkcs11_initialized_pid = 0;
@@ -1336,8 +2691,8 @@ rpc_C_GetSlotList (CK_BBOOL token_present, CK_SLOT_ID_PTR slot_list, CK_ULONG_PT
 	return_val_if_fail (count, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_GetSlotList, (*count = 0, CKR_OK));
-		IN_BYTE (token_present);
-		IN_ULONG_BUFFER (slot_list, count);
+		IN_CALL (gkm_rpc_stub_write_C_GetSlotList (_cs->req, token_present, slot_list,
+		                                           count));
 	PROCESS_CALL;
 		OUT_ULONG_ARRAY (slot_list, count);
 	END_CALL;
@@ -1349,7 +2704,7 @@ rpc_C_GetSlotInfo (CK_SLOT_ID id, CK_SLOT_INFO_PTR info)
 	return_val_if_fail (info, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_GetSlotInfo, CKR_SLOT_ID_INVALID);
-		IN_ULONG (id);
+		IN_CALL (gkm_rpc_stub_write_C_GetSlotInfo (_cs->req, id));
 	PROCESS_CALL;
 		OUT_SLOT_INFO (info);
 	END_CALL;
@@ -1361,7 +2716,7 @@ rpc_C_GetTokenInfo (CK_SLOT_ID id, CK_TOKEN_INFO_PTR info)
 	return_val_if_fail (info, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_GetTokenInfo, CKR_SLOT_ID_INVALID);
-		IN_ULONG (id);
+		IN_CALL (gkm_rpc_stub_write_C_GetTokenInfo (_cs->req, id));
 	PROCESS_CALL;
 		OUT_TOKEN_INFO (info);
 	END_CALL;
@@ -1374,8 +2729,8 @@ rpc_C_GetMechanismList (CK_SLOT_ID id, CK_MECHANISM_TYPE_PTR mechanism_list,
 	return_val_if_fail (count, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_GetMechanismList, CKR_SLOT_ID_INVALID);
-		IN_ULONG (id);
-		IN_ULONG_BUFFER (mechanism_list, count);
+		IN_CALL (gkm_rpc_stub_write_C_GetMechanismList (_cs->req, id, mechanism_list,
+		                                                count));
 	PROCESS_CALL;
 		OUT_MECHANISM_TYPE_ARRAY (mechanism_list, count);
 	END_CALL;
@@ -1401,9 +2756,7 @@ rpc_C_InitToken (CK_SLOT_ID id, CK_UTF8CHAR_PTR pin, CK_ULONG pin_len,
                  CK_UTF8CHAR_PTR label)
 {
 	BEGIN_CALL_OR (C_InitToken, CKR_SLOT_ID_INVALID);
-		IN_ULONG (id);
-		IN_BYTE_ARRAY (pin, pin_len);
-		IN_STRING (label);
+		IN_CALL (gkm_rpc_stub_write_C_InitToken (_cs->req, id, pin, pin_len, label));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1414,7 +2767,7 @@ rpc_C_WaitForSlotEvent (CK_FLAGS flags, CK_SLOT_ID_PTR slot, CK_VOID_PTR reserve
 	return_val_if_fail (slot, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_WaitForSlotEvent, CKR_DEVICE_REMOVED);
-		IN_ULONG (flags);
+		IN_CALL (gkm_rpc_stub_write_C_WaitForSlotEvent (_cs->req, flags));
 	PROCESS_CALL;
 		OUT_ULONG (slot);
 	END_CALL;
@@ -1427,8 +2780,7 @@ rpc_C_OpenSession (CK_SLOT_ID id, CK_FLAGS flags, CK_VOID_PTR user_data,
 	return_val_if_fail (session, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_OpenSession, CKR_SLOT_ID_INVALID);
-		IN_ULONG (id);
-		IN_ULONG (flags);
+		IN_CALL (gkm_rpc_stub_write_C_OpenSession (_cs->req, id, flags));
 	PROCESS_CALL;
 		OUT_ULONG (session);
 	END_CALL;
@@ -1437,8 +2789,11 @@ rpc_C_OpenSession (CK_SLOT_ID id, CK_FLAGS flags, CK_VOID_PTR user_data,
 static CK_RV
 rpc_C_CloseSession (CK_SESSION_HANDLE session)
 {
+	find_state_discard (0, session, 0);
+	attr_cache_discard (DISCARD_SESSION, session);
+
 	BEGIN_CALL_OR (C_CloseSession, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
+		IN_CALL (gkm_rpc_stub_write_C_CloseSession (_cs->req, session));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1446,8 +2801,11 @@ rpc_C_CloseSession (CK_SESSION_HANDLE session)
 static CK_RV
 rpc_C_CloseAllSessions (CK_SLOT_ID id)
 {
+	find_state_discard (1, 0, id);
+	attr_cache_discard (DISCARD_ALL, 0);
+
 	BEGIN_CALL_OR (C_CloseAllSessions, CKR_SLOT_ID_INVALID);
-		IN_ULONG (id);
+		IN_CALL (gkm_rpc_stub_write_C_CloseAllSessions (_cs->req, id));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1456,7 +2814,7 @@ static CK_RV
 rpc_C_GetFunctionStatus (CK_SESSION_HANDLE session)
 {
 	BEGIN_CALL_OR (C_GetFunctionStatus, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
+		IN_CALL (gkm_rpc_stub_write_C_GetFunctionStatus (_cs->req, session));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1465,7 +2823,7 @@ static CK_RV
 rpc_C_CancelFunction (CK_SESSION_HANDLE session)
 {
 	BEGIN_CALL_OR (C_CancelFunction, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
+		IN_CALL (gkm_rpc_stub_write_C_CancelFunction (_cs->req, session));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1476,7 +2834,7 @@ rpc_C_GetSessionInfo(CK_SESSION_HANDLE session, CK_SESSION_INFO_PTR info)
 	return_val_if_fail (info, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_GetSessionInfo, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
+		IN_CALL (gkm_rpc_stub_write_C_GetSessionInfo (_cs->req, session));
 	PROCESS_CALL;
 		OUT_SESSION_INFO (info);
 	END_CALL;
@@ -1487,8 +2845,7 @@ rpc_C_InitPIN (CK_SESSION_HANDLE session, CK_UTF8CHAR_PTR pin,
                CK_ULONG pin_len)
 {
 	BEGIN_CALL_OR (C_InitPIN, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (pin, pin_len);
+		IN_CALL (gkm_rpc_stub_write_C_InitPIN (_cs->req, session, pin, pin_len));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1498,9 +2855,8 @@ rpc_C_SetPIN (CK_SESSION_HANDLE session, CK_UTF8CHAR_PTR old_pin,
               CK_ULONG old_pin_len, CK_UTF8CHAR_PTR new_pin, CK_ULONG new_pin_len)
 {
 	BEGIN_CALL_OR (C_SetPIN, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (old_pin, old_pin_len);
-		IN_BYTE_ARRAY (new_pin, old_pin_len);
+		IN_CALL (gkm_rpc_stub_write_C_SetPIN (_cs->req, session, old_pin, old_pin_len,
+		                                      new_pin, old_pin_len));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1512,8 +2868,8 @@ rpc_C_GetOperationState (CK_SESSION_HANDLE session, CK_BYTE_PTR operation_state,
 	return_val_if_fail (operation_state_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_GetOperationState, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_BUFFER (operation_state, operation_state_len);
+		IN_CALL (gkm_rpc_stub_write_C_GetOperationState (_cs->req, session, operation_state,
+		                                                 operation_state_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (operation_state, operation_state_len);
 	END_CALL;
@@ -1525,10 +2881,10 @@ rpc_C_SetOperationState (CK_SESSION_HANDLE session, CK_BYTE_PTR operation_state,
                          CK_OBJECT_HANDLE authentication_key)
 {
 	BEGIN_CALL_OR (C_SetOperationState, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (operation_state, operation_state_len);
-		IN_ULONG (encryption_key);
-		IN_ULONG (authentication_key);
+		IN_CALL (gkm_rpc_stub_write_C_SetOperationState (_cs->req, session, operation_state,
+		                                                 operation_state_len,
+		                                                 encryption_key,
+		                                                 authentication_key));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1537,10 +2893,11 @@ static CK_RV
 rpc_C_Login (CK_SESSION_HANDLE session, CK_USER_TYPE user_type,
              CK_UTF8CHAR_PTR pin, CK_ULONG pin_len)
 {
+	/* Private objects come and go */
+	attr_cache_discard (DISCARD_ALL, 0);
+
 	BEGIN_CALL_OR (C_Login, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_ULONG (user_type);
-		IN_BYTE_ARRAY (pin, pin_len);
+		IN_CALL (gkm_rpc_stub_write_C_Login (_cs->req, session, user_type, pin, pin_len));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1548,8 +2905,11 @@ rpc_C_Login (CK_SESSION_HANDLE session, CK_USER_TYPE user_type,
 static CK_RV
 rpc_C_Logout (CK_SESSION_HANDLE session)
 {
+	/* Private objects come and go */
+	attr_cache_discard (DISCARD_ALL, 0);
+
 	BEGIN_CALL_OR (C_Logout, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
+		IN_CALL (gkm_rpc_stub_write_C_Logout (_cs->req, session));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1561,8 +2921,7 @@ rpc_C_CreateObject (CK_SESSION_HANDLE session, CK_ATTRIBUTE_PTR template,
 	return_val_if_fail (new_object, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_CreateObject, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_ATTRIBUTE_ARRAY (template, count);
+		IN_CALL (gkm_rpc_stub_write_C_CreateObject (_cs->req, session, template, count));
 	PROCESS_CALL;
 		OUT_ULONG (new_object);
 	END_CALL;
@@ -1576,9 +2935,8 @@ rpc_C_CopyObject (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
 	return_val_if_fail (new_object, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_CopyObject, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_ULONG (object);
-		IN_ATTRIBUTE_ARRAY (template, count);
+		IN_CALL (gkm_rpc_stub_write_C_CopyObject (_cs->req, session, object, template,
+		                                          count));
 	PROCESS_CALL;
 		OUT_ULONG (new_object);
 	END_CALL;
@@ -1588,9 +2946,10 @@ rpc_C_CopyObject (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
 static CK_RV
 rpc_C_DestroyObject (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object)
 {
+	attr_cache_discard (DISCARD_OBJECT, object);
+
 	BEGIN_CALL_OR (C_DestroyObject, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_ULONG (object);
+		IN_CALL (gkm_rpc_stub_write_C_DestroyObject (_cs->req, session, object));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1602,34 +2961,72 @@ rpc_C_GetObjectSize (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
 	return_val_if_fail (size, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_GetObjectSize, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_ULONG (object);
+		IN_CALL (gkm_rpc_stub_write_C_GetObjectSize (_cs->req, session, object));
 	PROCESS_CALL;
 		OUT_ULONG (size);
 	END_CALL;
 }
 
 static CK_RV
-rpc_C_GetAttributeValue (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
-                         CK_ATTRIBUTE_PTR template, CK_ULONG count)
+call_get_attribute_value (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
+                          CK_ATTRIBUTE_PTR template, CK_ULONG count)
 {
 	BEGIN_CALL_OR (C_GetAttributeValue, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_ULONG (object);
-		IN_ATTRIBUTE_BUFFER (template, count);
+		IN_CALL (gkm_rpc_stub_write_C_GetAttributeValue (_cs->req, session, object,
+		                                                 template, count));
 	PROCESS_CALL;
 		OUT_ATTRIBUTE_ARRAY (template, count);
 	END_CALL;
 }
 
+static CK_RV
+rpc_C_GetAttributeValue (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
+                         CK_ATTRIBUTE_PTR template, CK_ULONG count)
+{
+	CK_ULONG i;
+	CK_RV ret;
+
+	return_val_if_fail (pkcs11_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
+	return_val_if_fail (count == 0 || template, CKR_ARGUMENTS_BAD);
+
+	/* Values we have from before, or from asking for the sizes */
+	if (attr_cache_answer (session, object, template, count, &ret))
+		return ret;
+
+	/* Read the same attributes of the next few objects found by a search */
+	if (count > 0 && attr_fetch_found (session, object, template, count) == CKR_OK &&
+	    attr_cache_answer (session, object, template, count, &ret))
+		return ret;
+
+	/* When only asking for the sizes, small values come along */
+	for (i = 0; i < count; ++i) {
+		if (template[i].pValue)
+			break;
+	}
+	if (count > 0 && i == count) {
+		ret = attr_fetch (session, object, template, count);
+		if (ret != CKR_FUNCTION_NOT_SUPPORTED)
+			return ret;
+	}
+
+	ret = call_get_attribute_value (session, object, template, count);
+
+	/* Keep the values that can't change */
+	if (ret == CKR_OK)
+		attr_cache_store (session, object, template, count, STORE_FIXED);
+
+	return ret;
+}
+
 static CK_RV
 rpc_C_SetAttributeValue (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
                          CK_ATTRIBUTE_PTR template, CK_ULONG count)
 {
+	attr_cache_discard (DISCARD_OBJECT, object);
+
 	BEGIN_CALL_OR (C_SetAttributeValue, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_ULONG (object);
-		IN_ATTRIBUTE_ARRAY (template, count);
+		IN_CALL (gkm_rpc_stub_write_C_SetAttributeValue (_cs->req, session, object,
+		                                                 template, count));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1638,9 +3035,26 @@ static CK_RV
 rpc_C_FindObjectsInit (CK_SESSION_HANDLE session, CK_ATTRIBUTE_PTR template,
                        CK_ULONG count)
 {
+	FindState *fs;
+	CK_RV ret;
+
+	return_val_if_fail (pkcs11_initialized, CKR_CRYPTOKI_NOT_INITIALIZED);
+	return_val_if_fail (count == 0 || template, CKR_ARGUMENTS_BAD);
+
+	pthread_mutex_lock (&find_mutex);
+	fs = *find_state_lookup (&find_states, session);
+	pthread_mutex_unlock (&find_mutex);
+
+	if (fs != NULL)
+		return CKR_OPERATION_ACTIVE;
+
+	/* Read the whole search in one round trip */
+	ret = find_objects_batched (session, template, count);
+	if (ret != CKR_FUNCTION_NOT_SUPPORTED)
+		return ret;
+
 	BEGIN_CALL_OR (C_FindObjectsInit, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_ATTRIBUTE_ARRAY (template, count);
+		IN_CALL (gkm_rpc_stub_write_C_FindObjectsInit (_cs->req, session, template, count));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1652,11 +3066,35 @@ rpc_C_FindObjects (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR objects,
 	/* HACK: To fix a stupid gcc warning */
 	CK_ULONG_PTR address_of_max_count = &max_count;
 
+	FindState *fs;
+	CK_ULONG n;
+
 	return_val_if_fail (count, CKR_ARGUMENTS_BAD);
 
+	pthread_mutex_lock (&find_mutex);
+
+		fs = *find_state_lookup (&find_states, session);
+		if (fs != NULL) {
+			n = fs->n_objects - fs->n_read;
+			if (n > max_count)
+				n = max_count;
+			if (n > 0 && objects == NULL) {
+				pthread_mutex_unlock (&find_mutex);
+				return CKR_ARGUMENTS_BAD;
+			}
+			memcpy (objects, fs->objects + fs->n_read, n * sizeof (CK_OBJECT_HANDLE));
+			fs->n_read += n;
+			*count = n;
+		}
+
+	pthread_mutex_unlock (&find_mutex);
+
+	if (fs != NULL)
+		return CKR_OK;
+
 	BEGIN_CALL_OR (C_FindObjects, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_ULONG_BUFFER (objects, address_of_max_count);
+		IN_CALL (gkm_rpc_stub_write_C_FindObjects (_cs->req, session, objects,
+		                                           address_of_max_count));
 	PROCESS_CALL;
 		*count = max_count;
 		OUT_ULONG_ARRAY (objects, count);
@@ -1666,8 +3104,24 @@ rpc_C_FindObjects (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR objects,
 static CK_RV
 rpc_C_FindObjectsFinal (CK_SESSION_HANDLE session)
 {
+	FindState **at, *fs;
+
+	pthread_mutex_lock (&find_mutex);
+
+		at = find_state_lookup (&find_states, session);
+		fs = *at;
+		if (fs != NULL) {
+			*at = fs->next;
+			find_state_finished (fs);
+		}
+
+	pthread_mutex_unlock (&find_mutex);
+
+	if (fs != NULL)
+		return CKR_OK;
+
 	BEGIN_CALL_OR (C_FindObjectsFinal, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
+		IN_CALL (gkm_rpc_stub_write_C_FindObjectsFinal (_cs->req, session));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1677,9 +3131,7 @@ rpc_C_EncryptInit (CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
                    CK_OBJECT_HANDLE key)
 {
 	BEGIN_CALL_OR (C_EncryptInit, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (key);
+		IN_CALL (gkm_rpc_stub_write_C_EncryptInit (_cs->req, session, mechanism, key));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1691,9 +3143,8 @@ rpc_C_Encrypt (CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_len,
 	return_val_if_fail (encrypted_data_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_Encrypt, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (data, data_len);
-		IN_BYTE_BUFFER (encrypted_data, encrypted_data_len);
+		IN_CALL (gkm_rpc_stub_write_C_Encrypt (_cs->req, session, data, data_len,
+		                                       encrypted_data, encrypted_data_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (encrypted_data, encrypted_data_len);
 	END_CALL;
@@ -1707,9 +3158,8 @@ rpc_C_EncryptUpdate (CK_SESSION_HANDLE session, CK_BYTE_PTR part,
 	return_val_if_fail (encrypted_part_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_EncryptUpdate, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (part, part_len);
-		IN_BYTE_BUFFER (encrypted_part, encrypted_part_len);
+		IN_CALL (gkm_rpc_stub_write_C_EncryptUpdate (_cs->req, session, part, part_len,
+		                                             encrypted_part, encrypted_part_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (encrypted_part, encrypted_part_len);
 	END_CALL;
@@ -1722,8 +3172,8 @@ rpc_C_EncryptFinal (CK_SESSION_HANDLE session, CK_BYTE_PTR last_part,
 	return_val_if_fail (last_part_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_EncryptFinal, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_BUFFER (last_part, last_part_len);
+		IN_CALL (gkm_rpc_stub_write_C_EncryptFinal (_cs->req, session, last_part,
+		                                            last_part_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (last_part, last_part_len);
 	END_CALL;
@@ -1734,9 +3184,7 @@ rpc_C_DecryptInit (CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
                    CK_OBJECT_HANDLE key)
 {
 	BEGIN_CALL_OR (C_DecryptInit, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (key);
+		IN_CALL (gkm_rpc_stub_write_C_DecryptInit (_cs->req, session, mechanism, key));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1748,9 +3196,8 @@ rpc_C_Decrypt (CK_SESSION_HANDLE session, CK_BYTE_PTR enc_data,
 	return_val_if_fail (data_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_Decrypt, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (enc_data, enc_data_len);
-		IN_BYTE_BUFFER (data, data_len);
+		IN_CALL (gkm_rpc_stub_write_C_Decrypt (_cs->req, session, enc_data, enc_data_len,
+		                                       data, data_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (data, data_len);
 	END_CALL;
@@ -1763,9 +3210,8 @@ rpc_C_DecryptUpdate (CK_SESSION_HANDLE session, CK_BYTE_PTR enc_part,
 	return_val_if_fail (part_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_DecryptUpdate, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (enc_part, enc_part_len);
-		IN_BYTE_BUFFER (part, part_len);
+		IN_CALL (gkm_rpc_stub_write_C_DecryptUpdate (_cs->req, session, enc_part,
+		                                             enc_part_len, part, part_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (part, part_len);
 	END_CALL;
@@ -1778,8 +3224,8 @@ rpc_C_DecryptFinal (CK_SESSION_HANDLE session, CK_BYTE_PTR last_part,
 	return_val_if_fail (last_part_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_DecryptFinal, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_BUFFER (last_part, last_part_len);
+		IN_CALL (gkm_rpc_stub_write_C_DecryptFinal (_cs->req, session, last_part,
+		                                            last_part_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (last_part, last_part_len);
 	END_CALL;
@@ -1789,8 +3235,7 @@ static CK_RV
 rpc_C_DigestInit (CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism)
 {
 	BEGIN_CALL_OR (C_DigestInit, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
+		IN_CALL (gkm_rpc_stub_write_C_DigestInit (_cs->req, session, mechanism));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1802,9 +3247,8 @@ rpc_C_Digest (CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_len,
 	return_val_if_fail (digest_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_Digest, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (data, data_len);
-		IN_BYTE_BUFFER (digest, digest_len);
+		IN_CALL (gkm_rpc_stub_write_C_Digest (_cs->req, session, data, data_len, digest,
+		                                      digest_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (digest, digest_len);
 	END_CALL;
@@ -1814,8 +3258,7 @@ static CK_RV
 rpc_C_DigestUpdate (CK_SESSION_HANDLE session, CK_BYTE_PTR part, CK_ULONG part_len)
 {
 	BEGIN_CALL_OR (C_DigestUpdate, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (part, part_len);
+		IN_CALL (gkm_rpc_stub_write_C_DigestUpdate (_cs->req, session, part, part_len));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1824,8 +3267,7 @@ static CK_RV
 rpc_C_DigestKey (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key)
 {
 	BEGIN_CALL_OR (C_DigestKey, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_ULONG (key);
+		IN_CALL (gkm_rpc_stub_write_C_DigestKey (_cs->req, session, key));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1837,8 +3279,7 @@ rpc_C_DigestFinal (CK_SESSION_HANDLE session, CK_BYTE_PTR digest,
 	return_val_if_fail (digest_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_DigestFinal, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_BUFFER (digest, digest_len);
+		IN_CALL (gkm_rpc_stub_write_C_DigestFinal (_cs->req, session, digest, digest_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (digest, digest_len);
 	END_CALL;
@@ -1849,9 +3290,7 @@ rpc_C_SignInit (CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
                 CK_OBJECT_HANDLE key)
 {
 	BEGIN_CALL_OR (C_SignInit, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (key);
+		IN_CALL (gkm_rpc_stub_write_C_SignInit (_cs->req, session, mechanism, key));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1863,9 +3302,8 @@ rpc_C_Sign (CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_len,
 	return_val_if_fail (signature_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_Sign, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (data, data_len);
-		IN_BYTE_BUFFER (signature, signature_len);
+		IN_CALL (gkm_rpc_stub_write_C_Sign (_cs->req, session, data, data_len, signature,
+		                                    signature_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (signature, signature_len);
 	END_CALL;
@@ -1877,8 +3315,7 @@ rpc_C_SignUpdate (CK_SESSION_HANDLE session, CK_BYTE_PTR part, CK_ULONG part_len
 	return_val_if_fail (part_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_SignUpdate, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (part, part_len);
+		IN_CALL (gkm_rpc_stub_write_C_SignUpdate (_cs->req, session, part, part_len));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1890,8 +3327,8 @@ rpc_C_SignFinal (CK_SESSION_HANDLE session, CK_BYTE_PTR signature,
 	return_val_if_fail (signature_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_SignFinal, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_BUFFER (signature, signature_len);
+		IN_CALL (gkm_rpc_stub_write_C_SignFinal (_cs->req, session, signature,
+		                                         signature_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (signature, signature_len);
 	END_CALL;
@@ -1902,9 +3339,7 @@ rpc_C_SignRecoverInit (CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
                        CK_OBJECT_HANDLE key)
 {
 	BEGIN_CALL_OR (C_SignRecoverInit, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (key);
+		IN_CALL (gkm_rpc_stub_write_C_SignRecoverInit (_cs->req, session, mechanism, key));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1916,9 +3351,8 @@ rpc_C_SignRecover (CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_le
 	return_val_if_fail (signature_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_SignRecover, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (data, data_len);
-		IN_BYTE_BUFFER (signature, signature_len);
+		IN_CALL (gkm_rpc_stub_write_C_SignRecover (_cs->req, session, data, data_len,
+		                                           signature, signature_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (signature, signature_len);
 	END_CALL;
@@ -1929,9 +3363,7 @@ rpc_C_VerifyInit (CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
                   CK_OBJECT_HANDLE key)
 {
 	BEGIN_CALL_OR (C_VerifyInit, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (key);
+		IN_CALL (gkm_rpc_stub_write_C_VerifyInit (_cs->req, session, mechanism, key));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1941,9 +3373,8 @@ rpc_C_Verify (CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_len,
               CK_BYTE_PTR signature, CK_ULONG signature_len)
 {
 	BEGIN_CALL_OR (C_Verify, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (data, data_len);
-		IN_BYTE_ARRAY (signature, signature_len);
+		IN_CALL (gkm_rpc_stub_write_C_Verify (_cs->req, session, data, data_len, signature,
+		                                      signature_len));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1952,8 +3383,7 @@ static CK_RV
 rpc_C_VerifyUpdate (CK_SESSION_HANDLE session, CK_BYTE_PTR part, CK_ULONG part_len)
 {
 	BEGIN_CALL_OR (C_VerifyUpdate, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (part, part_len);
+		IN_CALL (gkm_rpc_stub_write_C_VerifyUpdate (_cs->req, session, part, part_len));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1963,8 +3393,8 @@ rpc_C_VerifyFinal (CK_SESSION_HANDLE session, CK_BYTE_PTR signature,
                    CK_ULONG signature_len)
 {
 	BEGIN_CALL_OR (C_VerifyFinal, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (signature, signature_len);
+		IN_CALL (gkm_rpc_stub_write_C_VerifyFinal (_cs->req, session, signature,
+		                                           signature_len));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1974,9 +3404,8 @@ rpc_C_VerifyRecoverInit (CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
                          CK_OBJECT_HANDLE key)
 {
 	BEGIN_CALL_OR (C_VerifyRecoverInit, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (key);
+		IN_CALL (gkm_rpc_stub_write_C_VerifyRecoverInit (_cs->req, session, mechanism,
+		                                                 key));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -1988,9 +3417,8 @@ rpc_C_VerifyRecover (CK_SESSION_HANDLE session, CK_BYTE_PTR signature,
 	return_val_if_fail (data_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_VerifyRecover, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (signature, signature_len);
-		IN_BYTE_BUFFER (data, data_len);
+		IN_CALL (gkm_rpc_stub_write_C_VerifyRecover (_cs->req, session, signature,
+		                                             signature_len, data, data_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (data, data_len);
 	END_CALL;
@@ -2004,9 +3432,9 @@ rpc_C_DigestEncryptUpdate (CK_SESSION_HANDLE session, CK_BYTE_PTR part,
 	return_val_if_fail (enc_part_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_DigestEncryptUpdate, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (part, part_len);
-		IN_BYTE_BUFFER (enc_part, enc_part_len);
+		IN_CALL (gkm_rpc_stub_write_C_DigestEncryptUpdate (_cs->req, session, part,
+		                                                   part_len, enc_part,
+		                                                   enc_part_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (enc_part, enc_part_len);
 	END_CALL;
@@ -2020,9 +3448,8 @@ rpc_C_DecryptDigestUpdate (CK_SESSION_HANDLE session, CK_BYTE_PTR enc_part,
 	return_val_if_fail (part_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_DecryptDigestUpdate, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (enc_part, enc_part_len);
-		IN_BYTE_BUFFER (part, part_len);
+		IN_CALL (gkm_rpc_stub_write_C_DecryptDigestUpdate (_cs->req, session, enc_part,
+		                                                   enc_part_len, part, part_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (part, part_len);
 	END_CALL;
@@ -2036,9 +3463,8 @@ rpc_C_SignEncryptUpdate (CK_SESSION_HANDLE session, CK_BYTE_PTR part,
 	return_val_if_fail (enc_part_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_SignEncryptUpdate, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (part, part_len);
-		IN_BYTE_BUFFER (enc_part, enc_part_len);
+		IN_CALL (gkm_rpc_stub_write_C_SignEncryptUpdate (_cs->req, session, part, part_len,
+		                                                 enc_part, enc_part_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (enc_part, enc_part_len);
 	END_CALL;
@@ -2052,9 +3478,8 @@ rpc_C_DecryptVerifyUpdate (CK_SESSION_HANDLE session, CK_BYTE_PTR enc_part,
 	return_val_if_fail (part_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_DecryptVerifyUpdate, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (enc_part, enc_part_len);
-		IN_BYTE_BUFFER (part, part_len);
+		IN_CALL (gkm_rpc_stub_write_C_DecryptVerifyUpdate (_cs->req, session, enc_part,
+		                                                   enc_part_len, part, part_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (part, part_len);
 	END_CALL;
@@ -2066,9 +3491,8 @@ rpc_C_GenerateKey (CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
                    CK_OBJECT_HANDLE_PTR key)
 {
 	BEGIN_CALL_OR (C_GenerateKey, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ATTRIBUTE_ARRAY (template, count);
+		IN_CALL (gkm_rpc_stub_write_C_GenerateKey (_cs->req, session, mechanism, template,
+		                                           count));
 	PROCESS_CALL;
 		OUT_ULONG (key);
 	END_CALL;
@@ -2081,10 +3505,9 @@ rpc_C_GenerateKeyPair (CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
                        CK_OBJECT_HANDLE_PTR pub_key, CK_OBJECT_HANDLE_PTR priv_key)
 {
 	BEGIN_CALL_OR (C_GenerateKeyPair, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ATTRIBUTE_ARRAY (pub_template, pub_count);
-		IN_ATTRIBUTE_ARRAY (priv_template, priv_count);
+		IN_CALL (gkm_rpc_stub_write_C_GenerateKeyPair (_cs->req, session, mechanism,
+		                                               pub_template, pub_count,
+		                                               priv_template, priv_count));
 	PROCESS_CALL;
 		OUT_ULONG (pub_key);
 		OUT_ULONG (priv_key);
@@ -2099,11 +3522,8 @@ rpc_C_WrapKey (CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
 	return_val_if_fail (wrapped_key_len, CKR_ARGUMENTS_BAD);
 
 	BEGIN_CALL_OR (C_WrapKey, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (wrapping_key);
-		IN_ULONG (key);
-		IN_BYTE_BUFFER (wrapped_key, wrapped_key_len);
+		IN_CALL (gkm_rpc_stub_write_C_WrapKey (_cs->req, session, mechanism, wrapping_key,
+		                                       key, wrapped_key, wrapped_key_len));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (wrapped_key, wrapped_key_len);
 	END_CALL;
@@ -2116,11 +3536,9 @@ rpc_C_UnwrapKey (CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
                  CK_ULONG count, CK_OBJECT_HANDLE_PTR key)
 {
 	BEGIN_CALL_OR (C_UnwrapKey, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (unwrapping_key);
-		IN_BYTE_ARRAY (wrapped_key, wrapped_key_len);
-		IN_ATTRIBUTE_ARRAY (template, count);
+		IN_CALL (gkm_rpc_stub_write_C_UnwrapKey (_cs->req, session, mechanism,
+		                                         unwrapping_key, wrapped_key,
+		                                         wrapped_key_len, template, count));
 	PROCESS_CALL;
 		OUT_ULONG (key);
 	END_CALL;
@@ -2132,10 +3550,8 @@ rpc_C_DeriveKey (CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
                  CK_ULONG count, CK_OBJECT_HANDLE_PTR key)
 {
 	BEGIN_CALL_OR (C_DeriveKey, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_MECHANISM (mechanism);
-		IN_ULONG (base_key);
-		IN_ATTRIBUTE_ARRAY (template, count);
+		IN_CALL (gkm_rpc_stub_write_C_DeriveKey (_cs->req, session, mechanism, base_key,
+		                                         template, count));
 	PROCESS_CALL;
 		OUT_ULONG (key);
 	END_CALL;
@@ -2145,8 +3561,7 @@ static CK_RV
 rpc_C_SeedRandom (CK_SESSION_HANDLE session, CK_BYTE_PTR seed, CK_ULONG seed_len)
 {
 	BEGIN_CALL_OR (C_SeedRandom, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_ARRAY (seed, seed_len);
+		IN_CALL (gkm_rpc_stub_write_C_SeedRandom (_cs->req, session, seed, seed_len));
 	PROCESS_CALL;
 	END_CALL;
 }
@@ -2157,8 +3572,8 @@ rpc_C_GenerateRandom (CK_SESSION_HANDLE session, CK_BYTE_PTR random_data,
 {
 	CK_ULONG_PTR address = &random_len;
 	BEGIN_CALL_OR (C_GenerateRandom, CKR_SESSION_HANDLE_INVALID);
-		IN_ULONG (session);
-		IN_BYTE_BUFFER (random_data, address);
+		IN_CALL (gkm_rpc_stub_write_C_GenerateRandom (_cs->req, session, random_data,
+		                                              address));
 	PROCESS_CALL;
 		OUT_BYTE_ARRAY (random_data, address);
 	END_CALL;
@@ -110,6 +110,9 @@ enum {
 	GKM_RPC_CALL_C_SeedRandom,
 	GKM_RPC_CALL_C_GenerateRandom,
 
+	GKM_RPC_CALL_Batch,
+	GKM_RPC_CALL_FetchAttributeValue,
+
 	GKM_RPC_CALL_MAX
 };
 
@@ -120,6 +123,17 @@ typedef struct _GkmRpcCall {
 	const char* response;
 } GkmRpcCall;
 
+/*
+ * A Batch carries several complete request messages, each as a byte
+ * array, one after another. The daemon runs them in order and responds
+ * with the response messages, in the same way. Only daemons that accept
+ * GKM_RPC_HANDSHAKE_MULTIPLEX understand batches.
+ *
+ * FetchAttributeValue is C_GetAttributeValue asking only for sizes. Along
+ * with the sizes, the daemon sends the values that are small enough, to
+ * save the caller a second round trip. Also only for those daemons.
+ */
+
 /*
  *  a_ = prefix denotes array of _
  *  A  = CK_ATTRIBUTE
@@ -201,8 +215,38 @@ static const GkmRpcCall gkm_rpc_calls[] = {
 	{ GKM_RPC_CALL_C_DeriveKey,            "C_DeriveKey",            "uMuaA",   "u"                    },
 	{ GKM_RPC_CALL_C_SeedRandom,           "C_SeedRandom",           "uay",     ""                     },
 	{ GKM_RPC_CALL_C_GenerateRandom,       "C_GenerateRandom",       "ufy",     "ay"                   },
+	{ GKM_RPC_CALL_Batch,                  "Batch",                  "ay",      "ay"                   },
+	{ GKM_RPC_CALL_FetchAttributeValue,    "FetchAttributeValue",    "uufA",    "aAu"                  },
 };
 
+/*
+ * The parts of each signature above, as split by gkm-rpc-calls.awk at
+ * build time. Messages are checked against these while being read and
+ * written, one part at a time.
+ */
+typedef enum _GkmRpcPart {
+	GKM_RPC_PART_END = 0,
+	GKM_RPC_PART_BYTE,              /* y */
+	GKM_RPC_PART_ULONG,             /* u */
+	GKM_RPC_PART_VERSION,           /* v */
+	GKM_RPC_PART_SPACE_STRING,      /* s */
+	GKM_RPC_PART_ZERO_STRING,       /* z */
+	GKM_RPC_PART_MECHANISM,         /* M */
+	GKM_RPC_PART_BYTE_ARRAY,        /* ay */
+	GKM_RPC_PART_ULONG_ARRAY,       /* au */
+	GKM_RPC_PART_ATTRIBUTE_ARRAY,   /* aA */
+	GKM_RPC_PART_BYTE_BUFFER,       /* fy */
+	GKM_RPC_PART_ULONG_BUFFER,      /* fu */
+	GKM_RPC_PART_ATTRIBUTE_BUFFER   /* fA */
+} GkmRpcPart;
+
+typedef struct _GkmRpcCallParts {
+	const unsigned char *request;
+	const unsigned char *response;
+	size_t request_len;
+	size_t response_len;
+} GkmRpcCallParts;
+
 #ifdef _DEBUG
 #define GKM_RPC_CHECK_CALLS() \
 	{ int i; for (i = 0; i < GKM_RPC_CALL_MAX; ++i) assert (gkm_rpc_calls[i].call_id == i); }
@@ -213,6 +257,18 @@ static const GkmRpcCall gkm_rpc_calls[] = {
 #define GKM_RPC_HANDSHAKE_LEN \
 	(strlen ((char *)GKM_RPC_HANDSHAKE))
 
+/*
+ * A client sending this handshake in C_Initialize asks for calls to be
+ * multiplexed on that connection. From then on the length of each
+ * message is followed by a request id and the number of descriptors
+ * sent along with the message. Responses are sent back with the id of
+ * their request, in any order.
+ */
+#define GKM_RPC_HANDSHAKE_MULTIPLEX \
+	((unsigned char*)"PRIVATE-GNOME-KEYRING-PKCS11-PROTOCOL-V-2")
+#define GKM_RPC_HANDSHAKE_MULTIPLEX_LEN \
+	(strlen ((char *)GKM_RPC_HANDSHAKE_MULTIPLEX))
+
 #define GKM_RPC_SOCKET_EXT 	"pkcs11"
 
 typedef enum _GkmRpcMessageType {
@@ -220,14 +276,31 @@ typedef enum _GkmRpcMessageType {
 	GKM_RPC_RESPONSE
 } GkmRpcMessageType;
 
+/*
+ * On multiplexed connections byte arrays at least this large are put in
+ * sealed shared memory, and only the descriptor is sent with the message.
+ */
+#define GKM_RPC_SHARED_MEMORY_THRESHOLD (64 * 1024)
+
+/* The most descriptors sent along with one message */
+#define GKM_RPC_MAX_FDS 8
+
 typedef struct _GkmRpcMessage {
 	int call_id;
 	GkmRpcMessageType call_type;
 	const char *signature;
+	size_t signature_len;
 	EggBuffer buffer;
 
 	size_t parsed;
-	const char *sigverify;
+	const unsigned char *sigverify;
+
+	/* Shared memory sent along with the message */
+	int shared_memory;
+	int fds[GKM_RPC_MAX_FDS];
+	int n_fds;
+	void *maps[GKM_RPC_MAX_FDS];
+	size_t map_lengths[GKM_RPC_MAX_FDS];
 } GkmRpcMessage;
 
 GkmRpcMessage*           gkm_rpc_message_new                     (EggBufferAllocator allocator);
@@ -251,7 +324,7 @@ int                      gkm_rpc_message_parse                   (GkmRpcMessage
                                                                   GkmRpcMessageType type);
 
 int                      gkm_rpc_message_verify_part             (GkmRpcMessage *msg,
-                                                                  const char* part);
+                                                                  int part);
 
 int                      gkm_rpc_message_write_byte              (GkmRpcMessage *msg,
                                                                   CK_BYTE val);
@@ -305,6 +378,12 @@ int                      gkm_rpc_message_read_space_string       (GkmRpcMessage
 int                      gkm_rpc_message_read_version            (GkmRpcMessage *msg,
                                                                   CK_VERSION* version);
 
+int                      gkm_rpc_message_read_shared             (GkmRpcMessage *msg,
+                                                                  size_t length,
+                                                                  const unsigned char **data);
+
+void                     gkm_rpc_message_close_fds               (GkmRpcMessage *msg);
+
 
 
 void                     gkm_rpc_log                             (const char *line);
@@ -313,6 +392,54 @@ void                     gkm_rpc_warn                            (const char* ms
 
 void                     gkm_rpc_debug                           (const char* msg, ...);
 
+int                      gkm_rpc_send_fds                        (int sock,
+                                                                  unsigned char *data,
+                                                                  size_t len,
+                                                                  int *fds,
+                                                                  int n_fds);
+
+int                      gkm_rpc_recv_fds                        (int sock,
+                                                                  unsigned char *data,
+                                                                  size_t len,
+                                                                  int *fds,
+                                                                  int *n_fds);
+
+/*
+ * A trace of calls, as written by the dispatcher when asked to, and played
+ * back by gkm-rpc-replay. It starts with GKM_RPC_TRACE_MAGIC, followed by
+ * a byte array for each call, holding:
+ *
+ *   uint64  microseconds since the trace started, when the call was started
+ *   uint32  microseconds the daemon spent on the call
+ *   uint32  the connection the call arrived on, numbered from 1
+ *   byte    whether the connection was multiplexed
+ *   ay      the request, redacted
+ *   ay      the response, redacted
+ */
+#define GKM_RPC_TRACE_MAGIC     "GKM-RPC-TRACE-1\n"
+#define GKM_RPC_TRACE_MAGIC_LEN 16
+
+typedef enum _GkmRpcTraceValue {
+	GKM_RPC_TRACE_SESSION = 1,
+	GKM_RPC_TRACE_OBJECT,
+	GKM_RPC_TRACE_SHARED
+} GkmRpcTraceValue;
+
+typedef void (*GkmRpcTraceFunc) (GkmRpcTraceValue what,
+                                 unsigned char *data,
+                                 size_t n_data,
+                                 void *user_data);
+
+int                      gkm_rpc_trace_redact                    (unsigned char *data,
+                                                                  size_t n_data,
+                                                                  GkmRpcMessageType type);
+
+int                      gkm_rpc_trace_visit                     (unsigned char *data,
+                                                                  size_t n_data,
+                                                                  GkmRpcMessageType type,
+                                                                  GkmRpcTraceFunc func,
+                                                                  void *user_data);
+
 #ifdef G_DISABLE_ASSERT
 #define assert(x)
 #else
@@ -336,4 +463,11 @@ void   gkm_rpc_mechanism_list_purge          (CK_MECHANISM_TYPE_PTR mechs, CK_UL
 int    gkm_rpc_mechanism_has_sane_parameters (CK_MECHANISM_TYPE type);
 int    gkm_rpc_mechanism_has_no_parameters   (CK_MECHANISM_TYPE mech);
 
+/*
+ * Attributes which may hold secret key material. These are never sent
+ * along speculatively, and are redacted from traces.
+ */
+
+int    gkm_rpc_attribute_is_secret           (CK_ATTRIBUTE_TYPE type);
+
 #endif /* GKM_RPC_CALLS_H */
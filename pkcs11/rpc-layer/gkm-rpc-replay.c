@@ -0,0 +1,790 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* gkm-rpc-replay.c - plays back a trace of calls against a daemon
+
+   The Gnome Keyring Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Keyring Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include "gkm-rpc-layer.h"
+#include "gkm-rpc-private.h"
+
+#include "egg/egg-unix-credentials.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+/*
+ * Each connection in the trace is played back on its own connection,
+ * with each call sent at the same time after the start as it was
+ * recorded, or scaled by the speed. A call isn't sent before the calls
+ * on its connection that had finished by the time it was recorded,
+ * since it may depend on them.
+ *
+ * The daemon hands out its own session and object handles, so those
+ * in the responses are matched up with the recorded ones, and changed
+ * in the requests that follow.
+ *
+ * The trace doesn't contain any secrets, so calls that depend on them,
+ * like logging in, don't behave as they did when recorded.
+ */
+
+#define SOCKET_PATH "/tmp/gkm-rpc-daemon.sock"
+
+typedef struct _Record {
+	gint64 started;
+	guint32 duration;
+	guint32 conn;
+	gboolean multiplexed;
+	int call_id;
+	unsigned char *request;
+	size_t n_request;
+	unsigned char *response;
+	size_t n_response;
+
+	/* While playing back */
+	gint64 sent;
+	gboolean answered;
+} Record;
+
+typedef struct _Conn {
+	guint32 id;
+	GPtrArray *records;
+	int sock;
+
+	/* Protected by mutex */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	guint n_sent;
+	guint n_answered;
+	guint first_unanswered;
+	gboolean failed;
+} Conn;
+
+static double replay_speed = 1.0;
+static gint64 replay_started = 0;
+
+/* Recorded handles to the ones the daemon handed out this time */
+static pthread_mutex_t handles_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *sessions = NULL;
+static GHashTable *objects = NULL;
+
+/* Latencies of each call */
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GArray *latencies[GKM_RPC_CALL_MAX];
+static guint failures[GKM_RPC_CALL_MAX];
+
+void
+gkm_rpc_log (const char *line)
+{
+	fprintf (stderr, "%s\n", line);
+}
+
+static int
+usage (void)
+{
+	fprintf (stderr, "usage: gkm-rpc-replay [-d socket-directory] [-s speed] trace-file\n");
+	exit (2);
+}
+
+static guint64
+decode_handle (const unsigned char *data)
+{
+	return ((guint64)egg_buffer_decode_uint32 ((unsigned char *)data)) << 32 |
+	       egg_buffer_decode_uint32 ((unsigned char *)data + 4);
+}
+
+static void
+encode_handle (unsigned char *data, guint64 handle)
+{
+	egg_buffer_encode_uint32 (data, handle >> 32);
+	egg_buffer_encode_uint32 (data + 4, handle & 0xffffffff);
+}
+
+/* -----------------------------------------------------------------------------
+ * LOADING
+ */
+
+static gint
+compare_records (gconstpointer a,
+                 gconstpointer b)
+{
+	const Record *ra = *((Record **)a);
+	const Record *rb = *((Record **)b);
+
+	if (ra->started == rb->started)
+		return 0;
+	return ra->started < rb->started ? -1 : 1;
+}
+
+static GPtrArray *
+load_trace (const char *filename,
+            unsigned char **contents)
+{
+	GError *error = NULL;
+	const unsigned char *data, *request, *response;
+	GHashTable *by_id;
+	GPtrArray *records, *conns;
+	EggBuffer trace, buffer;
+	size_t offset, at, n_data;
+	uint64_t started;
+	unsigned char multiplexed;
+	Record *rec;
+	Conn *conn;
+	gsize length;
+	guint i;
+
+	if (!g_file_get_contents (filename, (gchar **)contents, &length, &error)) {
+		fprintf (stderr, "couldn't read trace: %s\n", error->message);
+		exit (1);
+	}
+
+	if (length < GKM_RPC_TRACE_MAGIC_LEN ||
+	    memcmp (*contents, GKM_RPC_TRACE_MAGIC, GKM_RPC_TRACE_MAGIC_LEN) != 0) {
+		fprintf (stderr, "not a trace file: %s\n", filename);
+		exit (1);
+	}
+
+	records = g_ptr_array_new ();
+	egg_buffer_init_static (&trace, *contents, length);
+
+	for (offset = GKM_RPC_TRACE_MAGIC_LEN; offset < trace.len; ) {
+		if (!egg_buffer_get_byte_array (&trace, offset, &offset, &data, &n_data) || !data) {
+			fprintf (stderr, "truncated trace: %s\n", filename);
+			break;
+		}
+
+		rec = g_new0 (Record, 1);
+		egg_buffer_init_static (&buffer, data, n_data);
+		if (!egg_buffer_get_uint64 (&buffer, 0, &at, &started) ||
+		    !egg_buffer_get_uint32 (&buffer, at, &at, &rec->duration) ||
+		    !egg_buffer_get_uint32 (&buffer, at, &at, &rec->conn) ||
+		    !egg_buffer_get_byte (&buffer, at, &at, &multiplexed) ||
+		    !egg_buffer_get_byte_array (&buffer, at, &at, &request, &rec->n_request) ||
+		    !egg_buffer_get_byte_array (&buffer, at, &at, &response, &rec->n_response) ||
+		    !request || rec->n_request < 4 || !response || rec->n_response < 4) {
+			fprintf (stderr, "invalid record in trace: %s\n", filename);
+			g_free (rec);
+			continue;
+		}
+
+		rec->call_id = egg_buffer_decode_uint32 ((unsigned char *)request);
+		if (rec->call_id <= GKM_RPC_CALL_ERROR || rec->call_id >= GKM_RPC_CALL_MAX) {
+			fprintf (stderr, "invalid call in trace: %d\n", rec->call_id);
+			g_free (rec);
+			continue;
+		}
+
+		rec->request = (unsigned char *)request;
+		rec->response = (unsigned char *)response;
+		rec->started = started;
+		rec->multiplexed = multiplexed;
+		g_ptr_array_add (records, rec);
+	}
+
+	/* Records are written as calls finish, play them back as they started */
+	g_ptr_array_sort (records, compare_records);
+
+	conns = g_ptr_array_new ();
+	by_id = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	for (i = 0; i < records->len; ++i) {
+		rec = records->pdata[i];
+		conn = g_hash_table_lookup (by_id, GUINT_TO_POINTER (rec->conn));
+		if (conn == NULL) {
+			conn = g_new0 (Conn, 1);
+			conn->id = rec->conn;
+			conn->records = g_ptr_array_new ();
+			conn->sock = -1;
+			pthread_mutex_init (&conn->mutex, NULL);
+			pthread_cond_init (&conn->cond, NULL);
+			g_hash_table_insert (by_id, GUINT_TO_POINTER (rec->conn), conn);
+			g_ptr_array_add (conns, conn);
+		}
+		g_ptr_array_add (conn->records, rec);
+	}
+
+	/* The records are now owned by the connections */
+	g_hash_table_destroy (by_id);
+	g_ptr_array_free (records, TRUE);
+	return conns;
+}
+
+/* -----------------------------------------------------------------------------
+ * HANDLES
+ */
+
+typedef struct _Request {
+	int fds[GKM_RPC_MAX_FDS];
+	int n_fds;
+	gboolean failed;
+} Request;
+
+static int
+create_shared (size_t length)
+{
+#ifdef HAVE_MEMFD_CREATE
+	int fd;
+
+	fd = memfd_create ("gkm-rpc-replay", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate (fd, length) < 0 ||
+	    fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		close (fd);
+		return -1;
+	}
+
+	return fd;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void
+prepare_value (GkmRpcTraceValue what,
+               unsigned char *data,
+               size_t n_data,
+               void *user_data)
+{
+	Request *req = user_data;
+	GHashTable *handles;
+	guint64 handle;
+	gpointer live;
+	int fd;
+
+	/* Shared memory is recorded as its length, so send as many zeros */
+	if (what == GKM_RPC_TRACE_SHARED) {
+		fd = req->n_fds < GKM_RPC_MAX_FDS ? create_shared (n_data) : -1;
+		if (fd < 0)
+			req->failed = TRUE;
+		else
+			req->fds[req->n_fds++] = fd;
+		return;
+	}
+
+	handles = (what == GKM_RPC_TRACE_SESSION) ? sessions : objects;
+	handle = decode_handle (data);
+
+	pthread_mutex_lock (&handles_mutex);
+	live = g_hash_table_lookup (handles, &handle);
+	pthread_mutex_unlock (&handles_mutex);
+
+	if (live != NULL)
+		encode_handle (data, *((guint64 *)live));
+}
+
+typedef struct _Handles {
+	GkmRpcTraceValue what[256];
+	guint64 handles[256];
+	guint n_handles;
+} Handles;
+
+static void
+collect_handle (GkmRpcTraceValue what,
+                unsigned char *data,
+                size_t n_data,
+                void *user_data)
+{
+	Handles *handles = user_data;
+
+	if (what == GKM_RPC_TRACE_SHARED)
+		return;
+	if (handles->n_handles < G_N_ELEMENTS (handles->handles)) {
+		handles->what[handles->n_handles] = what;
+		handles->handles[handles->n_handles++] = decode_handle (data);
+	}
+}
+
+/* Matches up the handles in a live response with those in the recorded one */
+static void
+learn_handles (Record *rec,
+               unsigned char *response,
+               size_t n_response)
+{
+	Handles *recorded, *live;
+	GHashTable *handles;
+	guint i;
+
+	recorded = g_new0 (Handles, 1);
+	live = g_new0 (Handles, 1);
+
+	if (gkm_rpc_trace_visit (rec->response, rec->n_response, GKM_RPC_RESPONSE,
+	                         collect_handle, recorded) &&
+	    gkm_rpc_trace_visit (response, n_response, GKM_RPC_RESPONSE,
+	                         collect_handle, live)) {
+
+		pthread_mutex_lock (&handles_mutex);
+		for (i = 0; i < recorded->n_handles && i < live->n_handles; ++i) {
+			if (recorded->what[i] != live->what[i])
+				break;
+			handles = (recorded->what[i] == GKM_RPC_TRACE_SESSION) ? sessions : objects;
+			g_hash_table_insert (handles, g_memdup (&recorded->handles[i], sizeof (guint64)),
+			                     g_memdup (&live->handles[i], sizeof (guint64)));
+		}
+		pthread_mutex_unlock (&handles_mutex);
+	}
+
+	g_free (recorded);
+	g_free (live);
+}
+
+/* -----------------------------------------------------------------------------
+ * PLAYBACK
+ */
+
+static gboolean
+write_all (int sock,
+           unsigned char *data,
+           size_t len,
+           int *fds,
+           int n_fds)
+{
+	int r;
+
+	while (len > 0) {
+		r = gkm_rpc_send_fds (sock, data, len, fds, n_fds);
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			fprintf (stderr, "couldn't send data: %s\n", g_strerror (errno));
+			return FALSE;
+		}
+		data += r;
+		len -= r;
+		n_fds = 0;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+read_all (int sock,
+          unsigned char *data,
+          size_t len,
+          int *fds,
+          int *n_fds)
+{
+	int r;
+
+	while (len > 0) {
+		r = gkm_rpc_recv_fds (sock, data, len, fds, n_fds);
+		if (r == 0) {
+			fprintf (stderr, "daemon closed connection\n");
+			return FALSE;
+		} else if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			fprintf (stderr, "couldn't receive data: %s\n", g_strerror (errno));
+			return FALSE;
+		}
+		data += r;
+		len -= r;
+	}
+
+	return TRUE;
+}
+
+static void
+record_latency (Record *rec,
+                gint64 latency,
+                gboolean failed)
+{
+	pthread_mutex_lock (&stats_mutex);
+	if (!latencies[rec->call_id])
+		latencies[rec->call_id] = g_array_new (FALSE, FALSE, sizeof (gint64));
+	g_array_append_val (latencies[rec->call_id], latency);
+	if (failed)
+		failures[rec->call_id]++;
+	pthread_mutex_unlock (&stats_mutex);
+}
+
+static void *
+run_reader (void *data)
+{
+	Conn *conn = data;
+	unsigned char header[12];
+	unsigned char *response = NULL;
+	int fds[GKM_RPC_MAX_FDS];
+	int n_fds;
+	uint32_t length, id;
+	gboolean ok = TRUE;
+	Record *rec = NULL;
+	gint64 now;
+	guint i;
+
+	while (ok) {
+
+		/* Wait for something to come back */
+		pthread_mutex_lock (&conn->mutex);
+		while (conn->n_answered == conn->n_sent && !conn->failed)
+			pthread_cond_wait (&conn->cond, &conn->mutex);
+		for (i = conn->first_unanswered; i < conn->records->len; ++i) {
+			rec = conn->records->pdata[i];
+			if (!rec->answered)
+				break;
+		}
+		ok = !conn->failed;
+		pthread_mutex_unlock (&conn->mutex);
+
+		if (!ok)
+			break;
+
+		/* Responses on serial connections come back in order, others have their id */
+		n_fds = 0;
+		ok = read_all (conn->sock, header, rec->multiplexed ? 12 : 4, fds, &n_fds);
+		if (ok) {
+			length = egg_buffer_decode_uint32 (header);
+			if (rec->multiplexed) {
+				id = egg_buffer_decode_uint32 (header + 4);
+				if (id == 0 || id > conn->records->len) {
+					fprintf (stderr, "unexpected response from daemon: %u\n", id);
+					ok = FALSE;
+				} else {
+					rec = conn->records->pdata[id - 1];
+				}
+			}
+		}
+
+		if (ok) {
+			response = g_realloc (response, length);
+			ok = read_all (conn->sock, response, length, fds, &n_fds);
+		}
+
+		now = g_get_monotonic_time ();
+
+		/* Shared memory in responses isn't needed */
+		while (n_fds > 0)
+			close (fds[--n_fds]);
+
+		/* Count the calls that fail now, but didn't when recorded */
+		if (ok) {
+			record_latency (rec, now - rec->sent,
+			                length >= 4 && egg_buffer_decode_uint32 (response) == GKM_RPC_CALL_ERROR &&
+			                egg_buffer_decode_uint32 (rec->response) != GKM_RPC_CALL_ERROR);
+			learn_handles (rec, response, length);
+		}
+
+		pthread_mutex_lock (&conn->mutex);
+		if (ok) {
+			rec->answered = TRUE;
+			conn->n_answered++;
+			while (conn->first_unanswered < conn->records->len &&
+			       ((Record *)conn->records->pdata[conn->first_unanswered])->answered)
+				conn->first_unanswered++;
+			if (conn->first_unanswered == conn->records->len)
+				ok = FALSE;
+		} else {
+			conn->failed = TRUE;
+		}
+		pthread_cond_broadcast (&conn->cond);
+		pthread_mutex_unlock (&conn->mutex);
+	}
+
+	g_free (response);
+	return NULL;
+}
+
+/* Waits for the calls that this one may depend on, returns FALSE on failure */
+static gboolean
+wait_for_calls (Conn *conn,
+                Record *rec,
+                guint index)
+{
+	Record *other;
+	gboolean waiting;
+	guint i;
+
+	pthread_mutex_lock (&conn->mutex);
+	for (;;) {
+		waiting = FALSE;
+		for (i = conn->first_unanswered; i < index; ++i) {
+			other = conn->records->pdata[i];
+			if (!other->answered && other->started + other->duration <= rec->started) {
+				waiting = TRUE;
+				break;
+			}
+		}
+		if (!waiting || conn->failed)
+			break;
+		pthread_cond_wait (&conn->cond, &conn->mutex);
+	}
+	waiting = conn->failed;
+	pthread_mutex_unlock (&conn->mutex);
+
+	return !waiting;
+}
+
+static gboolean
+send_call (Conn *conn,
+           Record *rec,
+           guint index)
+{
+	unsigned char header[12];
+	unsigned char *request;
+	Request req = { { 0, }, 0, FALSE };
+	gboolean ok;
+	gint64 when;
+
+	/* Keep to the recorded timing */
+	if (replay_speed > 0) {
+		when = replay_started + (gint64)(rec->started / replay_speed);
+		while (g_get_monotonic_time () < when)
+			g_usleep (when - g_get_monotonic_time ());
+	}
+
+	request = g_memdup (rec->request, rec->n_request);
+	if (!gkm_rpc_trace_visit (request, rec->n_request, GKM_RPC_REQUEST,
+	                          prepare_value, &req) || req.failed) {
+		fprintf (stderr, "couldn't prepare call: %s\n", gkm_rpc_calls[rec->call_id].name);
+		while (req.n_fds > 0)
+			close (req.fds[--req.n_fds]);
+		g_free (request);
+		return FALSE;
+	}
+
+	egg_buffer_encode_uint32 (header, rec->n_request);
+	egg_buffer_encode_uint32 (header + 4, index + 1);
+	egg_buffer_encode_uint32 (header + 8, req.n_fds);
+
+	pthread_mutex_lock (&conn->mutex);
+	rec->sent = g_get_monotonic_time ();
+	conn->n_sent++;
+	pthread_cond_broadcast (&conn->cond);
+	pthread_mutex_unlock (&conn->mutex);
+
+	ok = write_all (conn->sock, header, rec->multiplexed ? 12 : 4, req.fds, req.n_fds) &&
+	     write_all (conn->sock, request, rec->n_request, NULL, 0);
+
+	while (req.n_fds > 0)
+		close (req.fds[--req.n_fds]);
+	g_free (request);
+	return ok;
+}
+
+static void *
+run_conn (void *data)
+{
+	Conn *conn = data;
+	pthread_t reader;
+	Record *rec;
+	gboolean ok = TRUE;
+	guint i;
+
+	if (egg_unix_credentials_write (conn->sock) < 0) {
+		fprintf (stderr, "couldn't send credentials: %s\n", g_strerror (errno));
+		return NULL;
+	}
+
+	if (pthread_create (&reader, NULL, run_reader, conn) != 0) {
+		fprintf (stderr, "couldn't create thread\n");
+		return NULL;
+	}
+
+	for (i = 0; ok && i < conn->records->len; ++i) {
+		rec = conn->records->pdata[i];
+		ok = wait_for_calls (conn, rec, i) &&
+		     send_call (conn, rec, i);
+	}
+
+	if (!ok) {
+		pthread_mutex_lock (&conn->mutex);
+		conn->failed = TRUE;
+		pthread_cond_broadcast (&conn->cond);
+		pthread_mutex_unlock (&conn->mutex);
+		shutdown (conn->sock, SHUT_RDWR);
+	}
+
+	pthread_join (reader, NULL);
+	return NULL;
+}
+
+static int
+connect_daemon (const char *directory)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	snprintf (addr.sun_path, sizeof (addr.sun_path), "%s/pkcs11", directory);
+
+	sock = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		fprintf (stderr, "couldn't create socket: %s\n", g_strerror (errno));
+		return -1;
+	}
+
+	if (connect (sock, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+		fprintf (stderr, "couldn't connect to: %s: %s\n", addr.sun_path, g_strerror (errno));
+		close (sock);
+		return -1;
+	}
+
+	fcntl (sock, F_SETFD, FD_CLOEXEC);
+	return sock;
+}
+
+/* -----------------------------------------------------------------------------
+ * REPORT
+ */
+
+static gint
+compare_latencies (gconstpointer a,
+                   gconstpointer b)
+{
+	gint64 la = *((gint64 *)a);
+	gint64 lb = *((gint64 *)b);
+
+	if (la == lb)
+		return 0;
+	return la < lb ? -1 : 1;
+}
+
+static gint64
+percentile (GArray *sorted,
+            guint percent)
+{
+	guint index;
+
+	index = (sorted->len * percent + 99) / 100;
+	if (index > 0)
+		index--;
+	return g_array_index (sorted, gint64, index);
+}
+
+static void
+report (gint64 elapsed)
+{
+	GArray *array;
+	guint total = 0;
+	int i;
+
+	printf ("%-24s %8s %8s %10s %10s %10s %10s\n", "call", "count", "failed",
+	        "p50 usec", "p90 usec", "p99 usec", "max usec");
+
+	for (i = 0; i < GKM_RPC_CALL_MAX; ++i) {
+		array = latencies[i];
+		if (!array)
+			continue;
+
+		g_array_sort (array, compare_latencies);
+		printf ("%-24s %8u %8u %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT
+		        " %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT "\n",
+		        gkm_rpc_calls[i].name, array->len, failures[i],
+		        percentile (array, 50), percentile (array, 90),
+		        percentile (array, 99), g_array_index (array, gint64, array->len - 1));
+		total += array->len;
+		g_array_free (array, TRUE);
+		latencies[i] = NULL;
+	}
+
+	printf ("%u calls in %" G_GINT64_FORMAT " msec\n", total, elapsed / 1000);
+}
+
+int
+main (int argc, char *argv[])
+{
+	const char *directory;
+	unsigned char *contents;
+	GPtrArray *conns;
+	pthread_t *threads;
+	gboolean failed = FALSE;
+	Conn *conn;
+	guint i;
+	int opt;
+
+	directory = g_getenv ("GNOME_KEYRING_CONTROL");
+	if (!directory)
+		directory = SOCKET_PATH;
+
+	while ((opt = getopt (argc, argv, "d:s:")) != -1) {
+		switch (opt) {
+		case 'd':
+			directory = optarg;
+			break;
+		case 's':
+			replay_speed = g_ascii_strtod (optarg, NULL);
+			if (replay_speed < 0)
+				usage ();
+			break;
+		default:
+			usage ();
+		}
+	}
+
+	if (optind != argc - 1)
+		usage ();
+
+	conns = load_trace (argv[optind], &contents);
+	sessions = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, g_free);
+	objects = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, g_free);
+
+	for (i = 0; i < conns->len; ++i) {
+		conn = conns->pdata[i];
+		conn->sock = connect_daemon (directory);
+		if (conn->sock < 0)
+			exit (1);
+	}
+
+	threads = g_new0 (pthread_t, conns->len);
+	replay_started = g_get_monotonic_time ();
+
+	for (i = 0; i < conns->len; ++i) {
+		if (pthread_create (&threads[i], NULL, run_conn, conns->pdata[i]) != 0) {
+			fprintf (stderr, "couldn't create thread\n");
+			exit (1);
+		}
+	}
+
+	for (i = 0; i < conns->len; ++i) {
+		pthread_join (threads[i], NULL);
+		conn = conns->pdata[i];
+		if (conn->failed)
+			failed = TRUE;
+		close (conn->sock);
+		g_ptr_array_foreach (conn->records, (GFunc)g_free, NULL);
+		g_ptr_array_free (conn->records, TRUE);
+		pthread_mutex_destroy (&conn->mutex);
+		pthread_cond_destroy (&conn->cond);
+		g_free (conn);
+	}
+
+	report (g_get_monotonic_time () - replay_started);
+
+	g_free (threads);
+	g_ptr_array_free (conns, TRUE);
+	g_hash_table_destroy (sessions);
+	g_hash_table_destroy (objects);
+	g_free (contents);
+
+	return failed ? 1 : 0;
+}
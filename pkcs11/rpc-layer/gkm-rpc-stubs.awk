@@ -0,0 +1,143 @@
+# gkm-rpc-stubs.awk - generates gkm-rpc-stubs.h from gkm-rpc-private.h
+#
+# For each call in the gkm_rpc_calls table this writes a typed function
+# which encodes the request (used by the module) and one which decodes
+# it (used by the dispatcher). The parts are handled in signature order
+# by construction, so the stubs turn off the per part check for the
+# message they work on. The C types each part maps to are listed below;
+# a request part without a mapping fails the build.
+#
+# The including file defines GKM_RPC_STUBS_MODULE or GKM_RPC_STUBS_DISPATCH
+# and provides the proto_xxx () functions and PARSE_ERROR used here.
+
+function stub(name, sig,    part, wparams, rparams, wbody, rbody, i, a)
+{
+	wparams = ""
+	rparams = ""
+	wbody = ""
+	rbody = ""
+	i = 0
+
+	while (length(sig) > 0) {
+		part = substr(sig, 1, 1)
+		if (part == "a" || part == "f")
+			part = substr(sig, 1, 2)
+		if (!(part in wtype)) {
+			printf("gkm-rpc-stubs.awk: no stub for part '%s' in request of %s\n", part, name) > "/dev/stderr"
+			failed = 1
+			exit 1
+		}
+		sig = substr(sig, length(part) + 1)
+		a = "a" i
+		i++
+
+		if (part == "y" || part == "u") {
+			wparams = wparams ", " wtype[part] " " a
+			rparams = rparams ", " wtype[part] " *" a
+			wbody = wbody "\tif (!gkm_rpc_message_write_" fname[part] " (msg, " a "))\n\t\treturn CKR_HOST_MEMORY;\n"
+			rbody = rbody "\tif (!gkm_rpc_message_read_" fname[part] " (cs->req, " a "))\n\t\treturn PARSE_ERROR;\n"
+
+		} else if (part == "z") {
+			wparams = wparams ", CK_UTF8CHAR_PTR " a
+			rparams = rparams ", CK_UTF8CHAR_PTR *" a
+			wbody = wbody "\tif (" a " == NULL)\n\t\treturn CKR_ARGUMENTS_BAD;\n"
+			wbody = wbody "\tif (!gkm_rpc_message_write_zero_string (msg, " a "))\n\t\treturn CKR_HOST_MEMORY;\n"
+			rbody = rbody "\tret = proto_read_null_string (cs, " a ");\n\tif (ret != CKR_OK)\n\t\treturn ret;\n"
+
+		} else if (part == "M") {
+			wparams = wparams ", CK_MECHANISM_PTR " a
+			rparams = rparams ", CK_MECHANISM_PTR " a
+			wbody = wbody "\tif (" a " == NULL)\n\t\treturn CKR_ARGUMENTS_BAD;\n"
+			wbody = wbody "\tret = proto_write_mechanism (msg, " a ");\n\tif (ret != CKR_OK)\n\t\treturn ret;\n"
+			rbody = rbody "\tret = proto_read_mechanism (cs, " a ");\n\tif (ret != CKR_OK)\n\t\treturn ret;\n"
+
+		} else if (substr(part, 1, 1) == "a" || part == "fA") {
+			# Arrays, and attribute buffers which describe the caller's template
+			wparams = wparams ", " wtype[part] " " a ", CK_ULONG n_" a
+			rparams = rparams ", " wtype[part] " *" a ", CK_ULONG *n_" a
+			wbody = wbody "\tif (n_" a " != 0 && " a " == NULL)\n\t\treturn CKR_ARGUMENTS_BAD;\n"
+			wbody = wbody "\tif (!gkm_rpc_message_write_" fname[part] " (msg, " a ", n_" a "))\n\t\treturn CKR_HOST_MEMORY;\n"
+			rbody = rbody "\tret = proto_read_" fname[part] " (cs, " a ", n_" a ");\n\tif (ret != CKR_OK)\n\t\treturn ret;\n"
+
+		} else {
+			# Other buffers only send how much room the caller has
+			wparams = wparams ", " wtype[part] " " a ", CK_ULONG_PTR n_" a
+			rparams = rparams ", " wtype[part] " *" a ", CK_ULONG *n_" a
+			wbody = wbody "\tif (n_" a " == NULL)\n\t\treturn CKR_ARGUMENTS_BAD;\n"
+			wbody = wbody "\tif (!gkm_rpc_message_write_" fname[part] " (msg, " a " ? *n_" a " : 0))\n\t\treturn CKR_HOST_MEMORY;\n"
+			rbody = rbody "\tret = proto_read_" fname[part] " (cs, " a ", n_" a ");\n\tif (ret != CKR_OK)\n\t\treturn ret;\n"
+		}
+	}
+
+	wout = wout "\nstatic inline CK_RV\ngkm_rpc_stub_write_" name " (GkmRpcMessage *msg" wparams ")\n{\n"
+	if (wbody ~ /ret = /)
+		wout = wout "\tCK_RV ret;\n\n"
+	wout = wout "\tassert (msg->call_id == GKM_RPC_CALL_" name ");\n\tmsg->sigverify = NULL;\n\n" wbody "\treturn CKR_OK;\n}\n"
+
+	rout = rout "\nstatic inline CK_RV\ngkm_rpc_stub_read_" name " (CallState *cs" rparams ")\n{\n"
+	if (rbody ~ /ret = /)
+		rout = rout "\tCK_RV ret;\n\n"
+	rout = rout "\tassert (cs->req->call_id == GKM_RPC_CALL_" name ");\n\tcs->req->sigverify = NULL;\n\n" rbody "\treturn CKR_OK;\n}\n"
+}
+
+BEGIN {
+	wtype["y"] = "CK_BYTE"
+	wtype["u"] = "CK_ULONG"
+	wtype["z"] = "CK_UTF8CHAR_PTR"
+	wtype["M"] = "CK_MECHANISM_PTR"
+	wtype["ay"] = "CK_BYTE_PTR"
+	wtype["aA"] = "CK_ATTRIBUTE_PTR"
+	wtype["fy"] = "CK_BYTE_PTR"
+	wtype["fu"] = "CK_ULONG_PTR"
+	wtype["fA"] = "CK_ATTRIBUTE_PTR"
+
+	fname["y"] = "byte"
+	fname["u"] = "ulong"
+	fname["ay"] = "byte_array"
+	fname["aA"] = "attribute_array"
+	fname["fy"] = "byte_buffer"
+	fname["fu"] = "ulong_buffer"
+	fname["fA"] = "attribute_buffer"
+
+	wout = ""
+	rout = ""
+	n = 0
+}
+
+/^[ \t]*\{ GKM_RPC_CALL_/ {
+	line = $0
+	gsub(/[{},]/, " ", line)
+	split(line, field, " ")
+
+	if (field[1] == "GKM_RPC_CALL_ERROR")
+		next
+
+	name = field[1]
+	sub(/^GKM_RPC_CALL_/, "", name)
+	request = field[3]
+	gsub(/"/, "", request)
+
+	stub(name, request)
+	n++
+}
+
+END {
+	if (failed)
+		exit 1
+	if (n == 0) {
+		print "gkm-rpc-stubs.awk: no calls found" > "/dev/stderr"
+		exit 1
+	}
+
+	print "/* Generated from gkm-rpc-private.h by gkm-rpc-stubs.awk, do not edit */"
+	print ""
+	print "#ifdef GKM_RPC_STUBS_MODULE"
+	printf("%s", wout)
+	print ""
+	print "#endif /* GKM_RPC_STUBS_MODULE */"
+	print ""
+	print "#ifdef GKM_RPC_STUBS_DISPATCH"
+	printf("%s", rout)
+	print ""
+	print "#endif /* GKM_RPC_STUBS_DISPATCH */"
+}
@@ -0,0 +1,389 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* gkm-rpc-trace.c - walking recorded messages, for capture and replay
+
+   The Gnome Keyring Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Keyring Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include "gkm-rpc-layer.h"
+#include "gkm-rpc-private.h"
+
+#include <string.h>
+
+/*
+ * Called for each value of interest in a message. The data points into
+ * the message, and is NULL for values sent in shared memory.
+ */
+typedef void (*TraceFunc) (GkmRpcMessage *msg, int part, int index,
+                           CK_ATTRIBUTE_TYPE type, unsigned char *data,
+                           size_t n_data, void *user_data);
+
+static int
+trace_skip (GkmRpcMessage *msg, size_t length)
+{
+	if (msg->buffer.len - msg->parsed < length)
+		return 0;
+	msg->parsed += length;
+	return 1;
+}
+
+/*
+ * Reads a message in place, without any assumptions about it apart
+ * from its signature, so that it doesn't matter which side wrote it.
+ */
+static int
+trace_parse (GkmRpcMessage *msg, unsigned char *data, size_t n_data,
+             GkmRpcMessageType type)
+{
+	memset (msg, 0, sizeof (GkmRpcMessage));
+	egg_buffer_init_static (&msg->buffer, data, n_data);
+	return gkm_rpc_message_parse (msg, type);
+}
+
+static int
+trace_walk (GkmRpcMessage *msg, TraceFunc func, void *user_data)
+{
+	EggBuffer *buffer = &msg->buffer;
+	const unsigned char *data;
+	uint32_t count, type, length, i;
+	unsigned char valid;
+	size_t n_data, at;
+	int index, part;
+
+	/* Error responses don't carry anything */
+	if (!msg->sigverify)
+		return 1;
+
+	for (index = 0; (part = *msg->sigverify) != GKM_RPC_PART_END; ++index, ++msg->sigverify) {
+		switch (part) {
+		case GKM_RPC_PART_BYTE:
+			if (!trace_skip (msg, 1))
+				return 0;
+			break;
+
+		case GKM_RPC_PART_ULONG:
+			at = msg->parsed;
+			if (!trace_skip (msg, 8))
+				return 0;
+			(func) (msg, part, index, 0, buffer->buf + at, 8, user_data);
+			break;
+
+		case GKM_RPC_PART_VERSION:
+			if (!trace_skip (msg, 2))
+				return 0;
+			break;
+
+		case GKM_RPC_PART_SPACE_STRING:
+			if (!egg_buffer_get_byte_array (buffer, msg->parsed, &msg->parsed, &data, &n_data))
+				return 0;
+			break;
+
+		case GKM_RPC_PART_ZERO_STRING:
+			if (!egg_buffer_get_uint32 (buffer, msg->parsed, &msg->parsed, &length))
+				return 0;
+			if (length != 0xffffffff && !trace_skip (msg, length))
+				return 0;
+			break;
+
+		case GKM_RPC_PART_MECHANISM:
+			if (!egg_buffer_get_uint32 (buffer, msg->parsed, &msg->parsed, &type) ||
+			    !egg_buffer_get_byte_array (buffer, msg->parsed, &msg->parsed, &data, &n_data))
+				return 0;
+			break;
+
+		case GKM_RPC_PART_BYTE_ARRAY:
+			if (!egg_buffer_get_byte (buffer, msg->parsed, &msg->parsed, &valid))
+				return 0;
+			if (valid == 0) {
+				if (!trace_skip (msg, 4))
+					return 0;
+			} else if (valid == 2) {
+				if (!egg_buffer_get_uint32 (buffer, msg->parsed, &msg->parsed, &length) ||
+				    !trace_skip (msg, 4))
+					return 0;
+				(func) (msg, part, index, 0, NULL, length, user_data);
+			} else {
+				if (!egg_buffer_get_byte_array (buffer, msg->parsed, &msg->parsed, &data, &n_data))
+					return 0;
+				if (data)
+					(func) (msg, part, index, 0, (unsigned char *)data, n_data, user_data);
+			}
+			break;
+
+		case GKM_RPC_PART_ULONG_ARRAY:
+			if (!egg_buffer_get_byte (buffer, msg->parsed, &msg->parsed, &valid) ||
+			    !egg_buffer_get_uint32 (buffer, msg->parsed, &msg->parsed, &count))
+				return 0;
+			if (valid) {
+				at = msg->parsed;
+				if (count > buffer->len / 8 || !trace_skip (msg, count * 8))
+					return 0;
+				(func) (msg, part, index, 0, buffer->buf + at, count * 8, user_data);
+			}
+			break;
+
+		case GKM_RPC_PART_ATTRIBUTE_ARRAY:
+			if (!egg_buffer_get_uint32 (buffer, msg->parsed, &msg->parsed, &count))
+				return 0;
+			for (i = 0; i < count; ++i) {
+				if (!egg_buffer_get_uint32 (buffer, msg->parsed, &msg->parsed, &type) ||
+				    !egg_buffer_get_byte (buffer, msg->parsed, &msg->parsed, &valid))
+					return 0;
+				if (!valid)
+					continue;
+				if (!egg_buffer_get_uint32 (buffer, msg->parsed, &msg->parsed, &length))
+					return 0;
+				if (valid == 2) {
+					if (!trace_skip (msg, 4))
+						return 0;
+					(func) (msg, part, index, type, NULL, length, user_data);
+				} else {
+					if (!egg_buffer_get_byte_array (buffer, msg->parsed, &msg->parsed, &data, &n_data))
+						return 0;
+					if (data)
+						(func) (msg, part, index, type, (unsigned char *)data, n_data, user_data);
+				}
+			}
+			break;
+
+		case GKM_RPC_PART_BYTE_BUFFER:
+		case GKM_RPC_PART_ULONG_BUFFER:
+			if (!trace_skip (msg, 4))
+				return 0;
+			break;
+
+		case GKM_RPC_PART_ATTRIBUTE_BUFFER:
+			if (!egg_buffer_get_uint32 (buffer, msg->parsed, &msg->parsed, &count))
+				return 0;
+			if (count > buffer->len / 8 || !trace_skip (msg, count * 8))
+				return 0;
+			break;
+
+		default:
+			return 0;
+		}
+	}
+
+	return msg->parsed == buffer->len;
+}
+
+/* Walks each of the messages carried in a batch */
+static int
+trace_walk_batch (unsigned char *data, size_t n_data, GkmRpcMessageType type,
+                  int (*walk) (unsigned char *, size_t, GkmRpcMessageType, void *),
+                  void *user_data)
+{
+	const unsigned char *part;
+	EggBuffer parts;
+	size_t n_part, offset;
+
+	egg_buffer_init_static (&parts, data, n_data);
+	for (offset = 0; offset < parts.len; ) {
+		if (!egg_buffer_get_byte_array (&parts, offset, &offset, &part, &n_part) || !part)
+			return 0;
+		if (!(walk) ((unsigned char *)part, n_part, type, user_data))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* -----------------------------------------------------------------------------
+ * REDACTION
+ */
+
+typedef struct _RedactState {
+	unsigned char *batch;
+	size_t n_batch;
+} RedactState;
+
+static void
+redact_value (GkmRpcMessage *msg, int part, int index, CK_ATTRIBUTE_TYPE type,
+              unsigned char *data, size_t n_data, void *user_data)
+{
+	RedactState *state = user_data;
+
+	if (!data)
+		return;
+
+	switch (part) {
+	case GKM_RPC_PART_BYTE_ARRAY:
+		/* The handshake isn't secret, and batches are redacted part by part */
+		if (msg->call_id == GKM_RPC_CALL_C_Initialize)
+			return;
+		if (msg->call_id == GKM_RPC_CALL_Batch) {
+			state->batch = data;
+			state->n_batch = n_data;
+			return;
+		}
+		memset (data, 0, n_data);
+		break;
+
+	case GKM_RPC_PART_ATTRIBUTE_ARRAY:
+		if (gkm_rpc_attribute_is_secret (type))
+			memset (data, 0, n_data);
+		break;
+	}
+}
+
+static int
+redact_message (unsigned char *data, size_t n_data, GkmRpcMessageType type,
+                void *unused)
+{
+	RedactState state = { NULL, 0 };
+	GkmRpcMessage msg;
+
+	if (!trace_parse (&msg, data, n_data, type) ||
+	    !trace_walk (&msg, redact_value, &state))
+		return 0;
+
+	if (state.batch)
+		return trace_walk_batch (state.batch, state.n_batch, type, redact_message, NULL);
+
+	return 1;
+}
+
+/*
+ * Blanks out everything secret in a message, in place, leaving the
+ * lengths alone. That's the contents of all byte arrays except the
+ * handshake, and the values of private key and secret attributes.
+ * Fails for messages that can't be parsed, which shouldn't be kept.
+ */
+int
+gkm_rpc_trace_redact (unsigned char *data, size_t n_data, GkmRpcMessageType type)
+{
+	return redact_message (data, n_data, type, NULL);
+}
+
+/* -----------------------------------------------------------------------------
+ * HANDLES AND SHARED MEMORY
+ */
+
+typedef struct _VisitState {
+	GkmRpcTraceFunc func;
+	void *user_data;
+	unsigned char *batch;
+	size_t n_batch;
+} VisitState;
+
+/* Requests to these calls carry a session handle first */
+static int
+visit_has_session (int call_id)
+{
+	switch (call_id) {
+	case GKM_RPC_CALL_C_CloseAllSessions:
+	case GKM_RPC_CALL_Batch:
+		return 0;
+	default:
+		return call_id >= GKM_RPC_CALL_C_CloseSession;
+	}
+}
+
+/* Responses to these calls carry only new object handles */
+static int
+visit_has_objects (int call_id)
+{
+	switch (call_id) {
+	case GKM_RPC_CALL_C_CreateObject:
+	case GKM_RPC_CALL_C_CopyObject:
+	case GKM_RPC_CALL_C_FindObjects:
+	case GKM_RPC_CALL_C_GenerateKey:
+	case GKM_RPC_CALL_C_GenerateKeyPair:
+	case GKM_RPC_CALL_C_UnwrapKey:
+	case GKM_RPC_CALL_C_DeriveKey:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void
+visit_value (GkmRpcMessage *msg, int part, int index, CK_ATTRIBUTE_TYPE type,
+             unsigned char *data, size_t n_data, void *user_data)
+{
+	VisitState *state = user_data;
+	size_t i;
+
+	/* Large values in shared memory, sent as descriptors */
+	if (!data) {
+		(state->func) (GKM_RPC_TRACE_SHARED, NULL, n_data, state->user_data);
+		return;
+	}
+
+	if (part == GKM_RPC_PART_BYTE_ARRAY && msg->call_id == GKM_RPC_CALL_Batch) {
+		state->batch = data;
+		state->n_batch = n_data;
+		return;
+	}
+
+	if (msg->call_type == GKM_RPC_REQUEST) {
+		if (part != GKM_RPC_PART_ULONG || !visit_has_session (msg->call_id))
+			return;
+
+		/* Every other number in a session call is an object, except the user type */
+		if (index == 0)
+			(state->func) (GKM_RPC_TRACE_SESSION, data, 8, state->user_data);
+		else if (msg->call_id != GKM_RPC_CALL_C_Login)
+			(state->func) (GKM_RPC_TRACE_OBJECT, data, 8, state->user_data);
+
+	} else {
+		if (msg->call_id == GKM_RPC_CALL_C_OpenSession && part == GKM_RPC_PART_ULONG) {
+			(state->func) (GKM_RPC_TRACE_SESSION, data, 8, state->user_data);
+		} else if (visit_has_objects (msg->call_id) &&
+		           (part == GKM_RPC_PART_ULONG || part == GKM_RPC_PART_ULONG_ARRAY)) {
+			for (i = 0; i + 8 <= n_data; i += 8)
+				(state->func) (GKM_RPC_TRACE_OBJECT, data + i, 8, state->user_data);
+		}
+	}
+}
+
+static int
+visit_message (unsigned char *data, size_t n_data, GkmRpcMessageType type,
+               void *user_data)
+{
+	VisitState *state = user_data;
+	VisitState inner;
+	GkmRpcMessage msg;
+
+	inner.func = state->func;
+	inner.user_data = state->user_data;
+	inner.batch = NULL;
+	inner.n_batch = 0;
+
+	if (!trace_parse (&msg, data, n_data, type) ||
+	    !trace_walk (&msg, visit_value, &inner))
+		return 0;
+
+	if (inner.batch)
+		return trace_walk_batch (inner.batch, inner.n_batch, type, visit_message, state);
+
+	return 1;
+}
+
+/*
+ * Calls func, in order, for the session and object handles in a message,
+ * and for each value that was sent in shared memory. Handles are passed
+ * as they're encoded, so they can be changed in place.
+ */
+int
+gkm_rpc_trace_visit (unsigned char *data, size_t n_data, GkmRpcMessageType type,
+                     GkmRpcTraceFunc func, void *user_data)
+{
+	VisitState state = { func, user_data, NULL, 0 };
+
+	assert (func);
+	return visit_message (data, n_data, type, &state);
+}
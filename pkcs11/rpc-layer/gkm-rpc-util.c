@@ -25,9 +25,22 @@
 #include "gkm-rpc-layer.h"
 #include "gkm-rpc-private.h"
 
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <errno.h>
 #include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
 static void
 do_log (const char *pref, const char *msg, va_list va)
@@ -105,6 +118,23 @@ gkm_rpc_mechanism_has_sane_parameters (CK_MECHANISM_TYPE type)
 	}
 }
 
+int
+gkm_rpc_attribute_is_secret (CK_ATTRIBUTE_TYPE type)
+{
+	switch (type) {
+	case CKA_VALUE:
+	case CKA_PRIVATE_EXPONENT:
+	case CKA_PRIME_1:
+	case CKA_PRIME_2:
+	case CKA_EXPONENT_1:
+	case CKA_EXPONENT_2:
+	case CKA_COEFFICIENT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 int
 gkm_rpc_mechanism_has_no_parameters (CK_MECHANISM_TYPE mech)
 {
@@ -205,3 +235,98 @@ gkm_rpc_mechanism_has_no_parameters (CK_MECHANISM_TYPE mech)
 		return 0;
 	};
 }
+
+/*
+ * Sends data like write(), the descriptors go along with the first byte.
+ */
+int
+gkm_rpc_send_fds (int sock, unsigned char *data, size_t len, int *fds, int n_fds)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE (sizeof (int) * GKM_RPC_MAX_FDS)];
+	} control;
+
+	assert (n_fds >= 0 && n_fds <= GKM_RPC_MAX_FDS);
+
+	if (n_fds == 0)
+		return write (sock, data, len);
+
+	memset (&msg, 0, sizeof (msg));
+	iov.iov_base = data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE (sizeof (int) * n_fds);
+
+	cmsg = CMSG_FIRSTHDR (&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN (sizeof (int) * n_fds);
+	memcpy (CMSG_DATA (cmsg), fds, sizeof (int) * n_fds);
+
+	return sendmsg (sock, &msg, MSG_NOSIGNAL);
+}
+
+/*
+ * Reads data like read(), and adds any descriptors that came along to
+ * fds. Fails with EMSGSIZE if more than GKM_RPC_MAX_FDS are received.
+ */
+int
+gkm_rpc_recv_fds (int sock, unsigned char *data, size_t len, int *fds, int *n_fds)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int overflow = 0;
+	int i, num, r;
+	int *received;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE (sizeof (int) * GKM_RPC_MAX_FDS)];
+	} control;
+
+	assert (n_fds);
+
+	memset (&msg, 0, sizeof (msg));
+	iov.iov_base = data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof (control.buf);
+
+	r = recvmsg (sock, &msg, MSG_CMSG_CLOEXEC);
+	if (r < 0)
+		return r;
+
+	if (msg.msg_flags & MSG_CTRUNC)
+		overflow = 1;
+
+	for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		received = (int*)CMSG_DATA (cmsg);
+		num = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+		for (i = 0; i < num; ++i) {
+			if (*n_fds < GKM_RPC_MAX_FDS) {
+				fds[(*n_fds)++] = received[i];
+			} else {
+				close (received[i]);
+				overflow = 1;
+			}
+		}
+	}
+
+	if (overflow) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	return r;
+}
@@ -376,6 +376,46 @@ encrypt_buffer (EggBuffer *buffer, GkmSecret *master,
 	return TRUE;
 }
 
+/*
+ * Deriving the key is the slow part of unlocking a keyring, so it can be done
+ * beforehand without the module lock, see gkm_secret_binary_prepare(). The
+ * key is left for the thread which then does the unlock, and is used here if
+ * it was derived from the same password, salt and iterations.
+ */
+
+typedef struct {
+	GkmPrepared prepared;
+	gchar *filename;
+	GkmSecret *master;
+	guchar salt[8];
+	guint32 iterations;
+	guchar *key;
+	guchar *iv;
+} PreparedKey;
+
+static GPrivate prepared_key = G_PRIVATE_INIT (NULL);
+
+static gboolean
+take_prepared_key (GkmSecret *master, guchar salt[8], int iterations,
+                   guchar **key, guchar **iv)
+{
+	PreparedKey *prepared;
+
+	prepared = g_private_get (&prepared_key);
+	if (prepared == NULL || prepared->key == NULL || master == NULL)
+		return FALSE;
+	if (prepared->iterations != (guint32)iterations ||
+	    memcmp (prepared->salt, salt, 8) != 0 ||
+	    !gkm_secret_equal (prepared->master, master))
+		return FALSE;
+
+	*key = prepared->key;
+	*iv = prepared->iv;
+	prepared->key = NULL;
+	prepared->iv = NULL;
+	return TRUE;
+}
+
 static gboolean
 decrypt_buffer (EggBuffer *buffer, GkmSecret *master,
 		guchar salt[8], int iterations)
@@ -399,7 +439,8 @@ decrypt_buffer (EggBuffer *buffer, GkmSecret *master,
 		password = gkm_secret_get_password (master, &n_password);
 	}
 
-	if (!egg_symkey_generate_simple (GCRY_CIPHER_AES128, GCRY_MD_SHA256,
+	if (!take_prepared_key (master, salt, iterations, &key, &iv) &&
+	    !egg_symkey_generate_simple (GCRY_CIPHER_AES128, GCRY_MD_SHA256,
 	                                 password, n_password, salt, 8, iterations, &key, &iv))
 		return FALSE;
 
@@ -846,12 +887,99 @@ free_item_info (ItemInfo *info)
 	gkm_secret_compat_acl_free (info->acl);
 }
 
+static gboolean
+read_header (EggBuffer *buffer, gsize *offset)
+{
+	guchar major, minor, crypto, hash;
+
+	if (buffer->len < KEYRING_FILE_HEADER_LEN + 4 ||
+	    memcmp (buffer->buf, KEYRING_FILE_HEADER, KEYRING_FILE_HEADER_LEN) != 0)
+		return FALSE;
+
+	*offset = KEYRING_FILE_HEADER_LEN;
+	major = buffer->buf[(*offset)++];
+	minor = buffer->buf[(*offset)++];
+	crypto = buffer->buf[(*offset)++];
+	hash = buffer->buf[(*offset)++];
+
+	return major == 0 && minor == 0 && crypto == 0 && hash == 0;
+}
+
+static void
+prepared_key_run (GkmPrepared *base)
+{
+	PreparedKey *prepared = (PreparedKey *)base;
+	const gchar *password;
+	gsize n_password;
+	EggBuffer buffer;
+	gchar *display_name = NULL;
+	guint32 flags, lock_timeout;
+	time_t ctime, mtime;
+	gsize offset;
+	guchar *data;
+	gsize n_data;
+
+	if (!g_file_get_contents (prepared->filename, (gchar **)&data, &n_data, NULL))
+		return;
+
+	/* Only as far as the salt and iterations, the rest is read on unlock */
+	egg_buffer_init_static (&buffer, data, n_data);
+	if (read_header (&buffer, &offset) &&
+	    buffer_get_utf8_string (&buffer, offset, &offset, &display_name) &&
+	    buffer_get_time (&buffer, offset, &offset, &ctime) &&
+	    buffer_get_time (&buffer, offset, &offset, &mtime) &&
+	    egg_buffer_get_uint32 (&buffer, offset, &offset, &flags) &&
+	    egg_buffer_get_uint32 (&buffer, offset, &offset, &lock_timeout) &&
+	    egg_buffer_get_uint32 (&buffer, offset, &offset, &prepared->iterations) &&
+	    buffer_get_bytes (&buffer, offset, &offset, prepared->salt, 8)) {
+		password = gkm_secret_get_password (prepared->master, &n_password);
+		if (egg_symkey_generate_simple (GCRY_CIPHER_AES128, GCRY_MD_SHA256,
+		                                password, n_password, prepared->salt, 8,
+		                                prepared->iterations, &prepared->key, &prepared->iv))
+			g_private_set (&prepared_key, prepared);
+	}
+
+	egg_buffer_uninit (&buffer);
+	g_free (display_name);
+	g_free (data);
+}
+
+static void
+prepared_key_free (GkmPrepared *base)
+{
+	PreparedKey *prepared = (PreparedKey *)base;
+
+	if (g_private_get (&prepared_key) == prepared)
+		g_private_set (&prepared_key, NULL);
+
+	egg_secure_free (prepared->key);
+	g_free (prepared->iv);
+	g_object_unref (prepared->master);
+	g_free (prepared->filename);
+	g_slice_free (PreparedKey, prepared);
+}
+
+GkmPrepared*
+gkm_secret_binary_prepare (const gchar *filename, GkmSecret *master)
+{
+	PreparedKey *prepared;
+
+	g_return_val_if_fail (filename, NULL);
+	g_return_val_if_fail (GKM_IS_SECRET (master), NULL);
+
+	prepared = g_slice_new0 (PreparedKey);
+	prepared->prepared.run = prepared_key_run;
+	prepared->prepared.free = prepared_key_free;
+	prepared->filename = g_strdup (filename);
+	prepared->master = g_object_ref (master);
+	return &prepared->prepared;
+}
+
 GkmDataResult
 gkm_secret_binary_read (GkmSecretCollection *collection, GkmSecretData *sdata,
                         gconstpointer data, gsize n_data)
 {
 	gsize offset;
-	guchar major, minor, crypto, hash;
 	guint32 flags;
 	guint32 lock_timeout;
 	time_t mtime, ctime;
@@ -879,19 +1007,7 @@ gkm_secret_binary_read (GkmSecretCollection *collection, GkmSecretData *sdata,
 	/* The buffer we read from */
 	egg_buffer_init_static (&buffer, data, n_data);
 
-	if (buffer.len < KEYRING_FILE_HEADER_LEN ||
-	    memcmp (buffer.buf, KEYRING_FILE_HEADER, KEYRING_FILE_HEADER_LEN) != 0) {
-		egg_buffer_uninit (&buffer);
-		return GKM_DATA_UNRECOGNIZED;
-	}
-
-	offset = KEYRING_FILE_HEADER_LEN;
-	major = buffer.buf[offset++];
-	minor = buffer.buf[offset++];
-	crypto = buffer.buf[offset++];
-	hash = buffer.buf[offset++];
-
-	if (major != 0 || minor != 0 || crypto != 0 || hash != 0) {
+	if (!read_header (&buffer, &offset)) {
 		egg_buffer_uninit (&buffer);
 		return GKM_DATA_UNRECOGNIZED;
 	}
@@ -31,6 +31,9 @@ GkmDataResult          gkm_secret_binary_read        (GkmSecretCollection *colle
                                                       gconstpointer data,
                                                       gsize n_data);
 
+GkmPrepared*           gkm_secret_binary_prepare     (const gchar *filename,
+                                                      GkmSecret *master);
+
 GkmDataResult          gkm_secret_binary_write       (GkmSecretCollection *collection,
                                                       GkmSecretData *sdata,
                                                       gpointer *data,
@@ -528,6 +528,25 @@ gkm_secret_collection_real_unlock (GkmObject *obj, GkmCredential *cred)
 	return rv;
 }
 
+static GkmPrepared*
+gkm_secret_collection_prepare_unlock (GkmObject *obj, CK_UTF8CHAR_PTR pin, CK_ULONG n_pin)
+{
+	GkmSecretCollection *self = GKM_SECRET_COLLECTION (obj);
+	GkmPrepared *prepared;
+	GkmSecret *master;
+
+	/* Already unlocked, or nothing to decrypt */
+	if (self->sdata || !self->filename)
+		return NULL;
+
+	/* The key for the keyring is derived without the module lock */
+	master = gkm_secret_new_from_login (pin, n_pin);
+	prepared = gkm_secret_binary_prepare (self->filename, master);
+	g_object_unref (master);
+
+	return prepared;
+}
+
 static void
 gkm_secret_collection_expose (GkmObject *base, gboolean expose)
 {
@@ -638,6 +657,7 @@ gkm_secret_collection_class_init (GkmSecretCollectionClass *klass)
 	gkm_class->get_attribute = gkm_secret_collection_get_attribute;
 	gkm_class->set_attribute = gkm_secret_collection_set_attribute;
 	gkm_class->unlock = gkm_secret_collection_real_unlock;
+	gkm_class->prepare_unlock = gkm_secret_collection_prepare_unlock;
 	gkm_class->expose_object = gkm_secret_collection_expose;
 
 	secret_class->is_locked = gkm_secret_collection_real_is_locked;
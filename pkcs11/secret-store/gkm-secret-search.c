@@ -284,8 +284,15 @@ on_matched_sort_modified (gconstpointer a,
 	return 0;
 }
 
+/*
+ * Sets the matched handles, most recently modified first. When filtering
+ * only the items that are locked, or not locked, to the session are set.
+ */
 static CK_RV
 attribute_set_handles (GHashTable *objects,
+                       GkmSession *session,
+                       gboolean filter,
+                       gboolean locked,
                        CK_ATTRIBUTE_PTR attr)
 {
 	GList *list, *l;
@@ -297,7 +304,7 @@ attribute_set_handles (GHashTable *objects,
 	g_assert (attr);
 
 	/* Want the length */
-	if (!attr->pValue) {
+	if (!attr->pValue && !filter) {
 		attr->ulValueLen = sizeof (CK_OBJECT_HANDLE) * g_hash_table_size (objects);
 		return CKR_OK;
 	}
@@ -307,11 +314,19 @@ attribute_set_handles (GHashTable *objects,
 	array = g_array_new (FALSE, TRUE, sizeof (CK_OBJECT_HANDLE));
 
 	for (l = list; l != NULL; l = g_list_next (l)) {
+		if (filter && gkm_secret_object_is_locked (GKM_SECRET_OBJECT (l->data), session) != locked)
+			continue;
 		handle = gkm_object_get_handle (l->data);
 		g_array_append_val (array, handle);
 	}
 
-	rv = gkm_attribute_set_data (attr, array->data, array->len * sizeof (CK_OBJECT_HANDLE));
+	if (!attr->pValue) {
+		attr->ulValueLen = array->len * sizeof (CK_OBJECT_HANDLE);
+		rv = CKR_OK;
+	} else {
+		rv = gkm_attribute_set_data (attr, array->data, array->len * sizeof (CK_OBJECT_HANDLE));
+	}
+
 	g_array_free (array, TRUE);
 	g_list_free (list);
 
@@ -339,7 +354,11 @@ gkm_secret_search_get_attribute (GkmObject *base, GkmSession *session, CK_ATTRIB
 	case CKA_G_FIELDS:
 		return gkm_secret_fields_serialize (attr, self->fields, self->schema_name);
 	case CKA_G_MATCHED:
-		return attribute_set_handles (self->objects, attr);
+		return attribute_set_handles (self->objects, session, FALSE, FALSE, attr);
+	case CKA_G_MATCHED_UNLOCKED:
+		return attribute_set_handles (self->objects, session, TRUE, FALSE, attr);
+	case CKA_G_MATCHED_LOCKED:
+		return attribute_set_handles (self->objects, session, TRUE, TRUE, attr);
 	}
 
 	return GKM_OBJECT_CLASS (gkm_secret_search_parent_class)->get_attribute (base, session, attr);
@@ -128,6 +128,42 @@ test_read_wrong_master (Test *test, gconstpointer unused)
 	g_assert (res == GKM_DATA_LOCKED);
 }
 
+static void
+test_read_prepared (Test *test, gconstpointer unused)
+{
+	GkmPrepared *prepared;
+	GkmDataResult res;
+
+	prepared = gkm_secret_binary_prepare (SRCDIR "/pkcs11/secret-store/fixtures/encrypted.keyring",
+	                                      gkm_secret_data_get_master (test->sdata));
+	gkm_prepared_run (prepared);
+
+	res = check_read_keyring_file (test, SRCDIR "/pkcs11/secret-store/fixtures/encrypted.keyring");
+	g_assert (res == GKM_DATA_SUCCESS);
+	gkm_prepared_free (prepared);
+
+	test_secret_collection_validate (test->collection, test->sdata);
+}
+
+static void
+test_read_prepared_other_master (Test *test, gconstpointer unused)
+{
+	GkmPrepared *prepared;
+	GkmDataResult res;
+	GkmSecret *master;
+
+	/* A key prepared for another password isn't used */
+	master = gkm_secret_new_from_password ("wrong");
+	prepared = gkm_secret_binary_prepare (SRCDIR "/pkcs11/secret-store/fixtures/encrypted.keyring",
+	                                      master);
+	g_object_unref (master);
+	gkm_prepared_run (prepared);
+
+	res = check_read_keyring_file (test, SRCDIR "/pkcs11/secret-store/fixtures/encrypted.keyring");
+	g_assert (res == GKM_DATA_SUCCESS);
+	gkm_prepared_free (prepared);
+}
+
 static void
 test_read_sdata_but_no_master (Test *test, gconstpointer unused)
 {
@@ -256,6 +292,8 @@ main (int argc, char **argv)
 	g_test_add ("/secret-store/binary/read_encrypted", Test, NULL, setup, test_read_encrypted, teardown);
 	g_test_add ("/secret-store/binary/read_wrong_format", Test, NULL, setup, test_read_wrong_format, teardown);
 	g_test_add ("/secret-store/binary/read_wrong_master", Test, NULL, setup, test_read_wrong_master, teardown);
+	g_test_add ("/secret-store/binary/read_prepared", Test, NULL, setup, test_read_prepared, teardown);
+	g_test_add ("/secret-store/binary/read_prepared_other_master", Test, NULL, setup, test_read_prepared_other_master, teardown);
 	g_test_add ("/secret-store/binary/read_sdata_but_no_master", Test, NULL, setup, test_read_sdata_but_no_master, teardown);
 	g_test_add ("/secret-store/binary/write", Test, NULL, setup, test_write, teardown);
 	g_test_add ("/secret-store/binary/remove_unavailable", Test, NULL, setup, test_remove_unavailable, teardown);
@@ -318,6 +318,36 @@ test_for_collection (Test *test, gconstpointer unused)
 	g_object_unref (object);
 }
 
+static void
+test_matched_locked (Test *test, gconstpointer unused)
+{
+	CK_ATTRIBUTE attrs[] = {
+	        { CKA_G_FIELDS, "name1\0value1", 13 },
+	};
+
+	GkmObject *object = NULL;
+	gpointer vdata;
+	gsize vsize;
+
+	object = gkm_session_create_object_for_factory (test->session, test->factory, NULL, attrs, 1);
+	g_assert (object != NULL);
+	g_assert (GKM_IS_SECRET_SEARCH (object));
+
+	/* The collection is not unlocked, so the item matches as locked */
+	vdata = gkm_object_get_attribute_data (object, test->session, CKA_G_MATCHED_LOCKED, &vsize);
+	g_assert (vdata);
+	g_assert (vsize == sizeof (CK_OBJECT_HANDLE));
+	g_assert (*((CK_OBJECT_HANDLE_PTR)vdata) == gkm_object_get_handle (GKM_OBJECT (test->item)));
+	g_free (vdata);
+
+	vdata = gkm_object_get_attribute_data (object, test->session, CKA_G_MATCHED_UNLOCKED, &vsize);
+	g_assert (vdata);
+	g_assert (vsize == 0);
+	g_free (vdata);
+
+	g_object_unref (object);
+}
+
 static void
 test_for_collection_no_match (Test *test, gconstpointer unused)
 {
@@ -448,6 +478,7 @@ main (int argc, char **argv)
 	g_test_add ("/secret-store/search/for_bad_collection", Test, NULL, setup, test_for_bad_collection, teardown);
 	g_test_add ("/secret-store/search/for_collection", Test, NULL, setup, test_for_collection, teardown);
 	g_test_add ("/secret-store/search/for_collection_no_match", Test, NULL, setup, test_for_collection_no_match, teardown);
+	g_test_add ("/secret-store/search/matched_locked", Test, NULL, setup, test_matched_locked, teardown);
 	g_test_add ("/secret-store/search/order", Test, NULL, setup, test_order, teardown);
 
 	return g_test_run ();
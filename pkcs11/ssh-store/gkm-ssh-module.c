@@ -266,6 +266,21 @@ gkm_ssh_store_get_functions (void)
 	return gkm_ssh_module_function_list;
 }
 
+char*
+gkm_ssh_store_get_directory (void)
+{
+	char *directory = NULL;
+
+	g_mutex_lock (&pkcs11_module_mutex);
+
+		if (pkcs11_module)
+			directory = g_strdup (GKM_SSH_MODULE (pkcs11_module)->directory);
+
+	g_mutex_unlock (&pkcs11_module_mutex);
+
+	return directory;
+}
+
 GkmModule*
 _gkm_ssh_store_get_module_for_testing (void)
 {
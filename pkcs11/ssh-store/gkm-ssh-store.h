@@ -25,4 +25,7 @@
 
 CK_FUNCTION_LIST_PTR  gkm_ssh_store_get_functions  (void);
 
+/* The directory keys are loaded from, once initialized. Free with g_free() */
+char*                 gkm_ssh_store_get_directory  (void);
+
 #endif /* __GKM_SSH_STORE_H__ */
@@ -37,4 +37,6 @@ void                    gkm_wrap_layer_mark_login_unlock_success   (void);
 
 void                    gkm_wrap_layer_mark_login_unlock_failure   (const gchar *failed_password);
 
+gchar*                  gkm_wrap_layer_auto_unlock_location        (const gchar *identifier);
+
 #endif /* __GKM_WRAP_LAYER_H__ */
@@ -66,6 +66,18 @@ gkm_wrap_layer_mark_login_unlock_failure (const gchar *failed_password)
 		egg_secure_strfree (newval);
 }
 
+/*
+ * COMPAT: The location a keyring's password is stored under in the login
+ * keyring. This is done this way for compatibility with old gnome-keyring
+ * releases. In the future this may change.
+ */
+gchar*
+gkm_wrap_layer_auto_unlock_location (const gchar *identifier)
+{
+	g_return_val_if_fail (identifier, NULL);
+	return g_strdup_printf ("LOCAL:/keyrings/%s.keyring", identifier);
+}
+
 gboolean
 gkm_wrap_login_did_unlock_fail (void)
 {
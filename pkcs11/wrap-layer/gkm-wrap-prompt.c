@@ -20,6 +20,7 @@
 
 #include "config.h"
 
+#include "gkm-wrap-layer.h"
 #include "gkm-wrap-login.h"
 #include "gkm-wrap-prompt.h"
 
@@ -122,12 +123,7 @@ auto_unlock_keyring_location (CK_ATTRIBUTE_PTR attrs, CK_ULONG n_attrs)
 	if (attr == NULL)
 		return NULL;
 
-	/*
-	 * COMPAT: Format it into a string. This is done this way for compatibility
-	 * with old gnome-keyring releases. In the future this may change.
-	 */
-
-	return g_strdup_printf ("LOCAL:/keyrings/%s.keyring", (gchar*)attr->pValue);
+	return gkm_wrap_layer_auto_unlock_location ((gchar*)attr->pValue);
 }
 
 static gchar*